@@ -22,10 +22,10 @@ struct vec3
 	vec3 operator*(float rhs);
 	vec3 operator*(vec3 rhs);
 	vec3 operator/(float rhs);
-	vec3 vec3::operator*=(f32 rhs);
-	vec3 vec3::operator/=(f32 rhs);
-	bool vec3::operator==(vec3 rhs);
-	bool vec3::operator!=(vec3 rhs);
+	vec3 operator*=(f32 rhs);
+	vec3 operator/=(f32 rhs);
+	bool operator==(vec3 rhs);
+	bool operator!=(vec3 rhs);
 };
 
 
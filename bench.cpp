@@ -0,0 +1,540 @@
+//Headless entry point for the benchmark_ and verify_ functions in the mesh and culling headers. Includes them in
+//the same order as dx_window.cpp but without a window or device, see build_bench.bat. Elsewhere:
+//    g++ -std=c++17 -O2 -pthread -Wno-write-strings bench.cpp -o bench
+//Usage: bench [--threads count] [--remap-corners count] [mesh.obj]
+//       bench --depth depth_recording.bin
+//The mesh defaults to Apollo_Statue.obj and the threads to every hardware thread. Forcing more threads than cores runs
+//the partitioned paths on small machines, their times are then not speedups. The vertex remap benchmark runs on a
+//generated stream of 50M corners by default, about 1.2GB of vertices. --depth only analyzes a recording dx_window.cpp
+//wrote on F12.
+#include <stdint.h>
+
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t  s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef float f32;
+typedef double f64;
+
+#include "SargentMath.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define VC_EXTRALEAN
+#define NOMINMAX
+#include <Windows.h>
+#include <D3d12.h>
+#else
+//Same layout as the D3D12 struct, DrawCallInfo only carries it through the culling headers.
+struct D3D12_INDEX_BUFFER_VIEW
+{
+	u64 BufferLocation;
+	u32 SizeInBytes;
+	u32 Format;
+};
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+
+#include "utils.h"
+#include "jobs.h"
+
+#define FAST_OBJ_IMPLEMENTATION
+#include "include/fast_obj.h"
+
+#include "draw_layout.h"
+
+#include "include/meshoptimizer.h"
+#include "include/vfetchoptimizer.cpp"
+#include "include/vcacheoptimizer.cpp"
+#include "include/indexgenerator.cpp"
+#include "include/simplifier.cpp"
+#include "include/spatialorder.cpp"
+#include "include/clusterizer.cpp"
+#include "include/vcacheanalyzer.cpp"
+#include "include/vfetchanalyzer.cpp"
+#include "include/overdrawanalyzer.cpp"
+#include "include/overdrawoptimizer.cpp"
+#include "include/stripifier.cpp"
+
+#include "mesh_simplify.h"
+#include "cluster_lod.h"
+#include "mesh_build.h"
+#include "mesh_weld.h"
+#include "mesh_overdraw.h"
+#include "mesh_tune.h"
+
+#include "cull_layout.h"
+#include "culling.h"
+#include "instance_store.h"
+#include "instance_bvh.h"
+#include "occlusion.h"
+#include "hiz.h"
+#include "multiview_cull.h"
+#include "instance_lod.h"
+#include "compaction.h"
+#include "instance_buckets.h"
+#include "draw_sort.h"
+#include "triangle_cull.h"
+#include "static_batch.h"
+#include "mesh_split.h"
+#include "bounds.h"
+#include "mesh_depth.h"
+#include "instance_transform.h"
+
+
+static u32 bench_width = 1920;
+static u32 bench_height = 1080;
+static u32 bench_instance_count = 4096;
+
+
+struct BenchMesh
+{
+	Vertex* vertices;
+	u32 vertex_count;
+	u32* indices;
+	u32 index_count;
+};
+
+
+//Same steps as load_obj and the remap in load_mesh, without the optional build stages.
+bool load_bench_mesh(char* filename, BenchMesh* mesh)
+{
+	fastObjMesh* obj_mesh = fast_obj_read(filename);
+	if (!obj_mesh) {
+		printf("Could not read %s\n", filename);
+		return false;
+	}
+
+	size_t index_count = 0;
+	for (u32 i = 0; i < obj_mesh->face_count; ++i)
+		index_count += 3 * (obj_mesh->face_vertices[i] - 2);
+
+	Vertex* soup = new Vertex[index_count];
+	size_t vertex_offset = 0;
+	size_t index_offset = 0;
+	for (u32 i = 0; i < obj_mesh->face_count; ++i)
+	{
+		for (u32 j = 0; j < obj_mesh->face_vertices[i]; ++j)
+		{
+			fastObjIndex index = obj_mesh->indices[index_offset + j];
+
+			if (j >= 3)
+			{
+				soup[vertex_offset + 0] = soup[vertex_offset - 3];
+				soup[vertex_offset + 1] = soup[vertex_offset - 1];
+				vertex_offset += 2;
+			}
+
+			Vertex& v = soup[vertex_offset++];
+			v.position[0] = obj_mesh->positions[index.p * 3 + 0];
+			v.position[1] = obj_mesh->positions[index.p * 3 + 1];
+			v.position[2] = obj_mesh->positions[index.p * 3 + 2];
+			v.normal[0] = obj_mesh->normals[index.n * 3 + 0];
+			v.normal[1] = obj_mesh->normals[index.n * 3 + 1];
+			v.normal[2] = obj_mesh->normals[index.n * 3 + 2];
+		}
+		index_offset += obj_mesh->face_vertices[i];
+	}
+	fast_obj_destroy(obj_mesh);
+
+	u32* remap = new u32[index_count];
+	size_t vertex_count = meshopt_generateVertexRemap(remap, 0, index_count, soup, index_count, sizeof(Vertex));
+
+	mesh->vertices = new Vertex[vertex_count];
+	mesh->vertex_count = (u32)vertex_count;
+	mesh->indices = new u32[index_count];
+	mesh->index_count = (u32)index_count;
+	meshopt_remapVertexBuffer(mesh->vertices, soup, index_count, sizeof(Vertex), remap);
+	meshopt_remapIndexBuffer(mesh->indices, 0, index_count, remap);
+	meshopt_optimizeVertexCache(mesh->indices, mesh->indices, index_count, vertex_count);
+
+	delete[] remap;
+	delete[] soup;
+	return true;
+}
+
+
+struct PositionMesh
+{
+	f32* positions;
+	u32 vertex_count;
+	u32* indices;
+	u32 index_count;
+};
+
+
+//The mesh welded on position alone for the simplifiers. Flat normals split every corner into its own vertex, which
+//meshopt_simplify sees as attribute seams and locks.
+void build_position_mesh(const BenchMesh* mesh, PositionMesh* result)
+{
+	f32* positions = new f32[mesh->vertex_count * 3];
+	for (u32 i = 0; i < mesh->vertex_count; ++i)
+		memcpy(&positions[i * 3], mesh->vertices[i].position, sizeof(f32) * 3);
+
+	u32* remap = new u32[mesh->vertex_count];
+	size_t vertex_count = meshopt_generateVertexRemap(remap, mesh->indices, mesh->index_count, positions, mesh->vertex_count, sizeof(f32) * 3);
+
+	result->positions = new f32[vertex_count * 3];
+	result->vertex_count = (u32)vertex_count;
+	result->indices = new u32[mesh->index_count];
+	result->index_count = mesh->index_count;
+	meshopt_remapVertexBuffer(result->positions, positions, mesh->vertex_count, sizeof(f32) * 3, remap);
+	meshopt_remapIndexBuffer(result->indices, mesh->indices, mesh->index_count, remap);
+
+	delete[] remap;
+	delete[] positions;
+}
+
+
+//A wavy height field of quads_per_side^2 quads, big enough to split into the partitions the parallel mesh builds want.
+void build_bench_grid(PositionMesh* result, u32 quads_per_side)
+{
+	u32 side = quads_per_side + 1;
+	result->vertex_count = side * side;
+	result->positions = new f32[result->vertex_count * 3];
+	result->index_count = quads_per_side * quads_per_side * 6;
+	result->indices = new u32[result->index_count];
+
+	for (u32 z = 0; z < side; ++z)
+	{
+		for (u32 x = 0; x < side; ++x)
+		{
+			f32* p = &result->positions[(z * side + x) * 3];
+			p[0] = (f32)x / quads_per_side;
+			p[1] = 0.05f * sinf(p[0] * 40.0f) * cosf((f32)z / quads_per_side * 30.0f);
+			p[2] = (f32)z / quads_per_side;
+		}
+	}
+
+	u32* out = result->indices;
+	for (u32 z = 0; z < quads_per_side; ++z)
+	{
+		for (u32 x = 0; x < quads_per_side; ++x)
+		{
+			u32 v = z * side + x;
+			*out++ = v; *out++ = v + side; *out++ = v + 1;
+			*out++ = v + 1; *out++ = v + side; *out++ = v + side + 1;
+		}
+	}
+}
+
+
+//Unindexed corners of a smooth grid, like a big OBJ before the remap: every vertex is repeated by the up to 6
+//triangles around it. corner_count is rounded down to whole triangles.
+Vertex* build_bench_corner_stream(u32 corner_count)
+{
+	u32 triangle_count = corner_count / 3;
+	u32 quads_per_side = (u32)ceilf(sqrtf(triangle_count / 2.0f));
+	Vertex* corners = new Vertex[triangle_count * 3];
+
+	auto grid_vertex = [&](u32 x, u32 z) -> Vertex
+	{
+		Vertex v = {};
+		v.position[0] = (f32)x / quads_per_side;
+		v.position[2] = (f32)z / quads_per_side;
+		v.position[1] = 0.05f * sinf(v.position[0] * 40.0f);
+		v.normal[1] = 1.0f;
+		return v;
+	};
+
+	for (u32 t = 0; t < triangle_count; ++t)
+	{
+		u32 quad = t / 2;
+		u32 x = quad % quads_per_side;
+		u32 z = quad / quads_per_side;
+		Vertex* out = &corners[t * 3];
+		if (t & 1)
+		{
+			out[0] = grid_vertex(x + 1, z); out[1] = grid_vertex(x, z + 1); out[2] = grid_vertex(x + 1, z + 1);
+		}
+		else
+		{
+			out[0] = grid_vertex(x, z); out[1] = grid_vertex(x, z + 1); out[2] = grid_vertex(x + 1, z);
+		}
+	}
+	return corners;
+}
+
+
+//The scene draw() builds: instances of random meshes at random positions and rotations, with the rotation independent
+//sphere around the mesh origin.
+void build_bench_scene(DrawCallInfo* infos, u32 count, const BenchMesh* meshes, const MeshBounds* bounds, u32 mesh_count, vec3 world_min, vec3 world_max)
+{
+	u32 random = 101;
+	for (u32 i = 0; i < count; ++i)
+	{
+		u32 mesh_index = (u32)rand_f32_in_range(0.0f, (f32)mesh_count, &random);
+		mesh_index = MIN(mesh_index, mesh_count - 1);
+
+		DrawCallInfo info = {};
+		info.triangle_count = meshes[mesh_index].index_count / 3;
+		info.draw_info.position = {rand_f32_in_range(world_min.x, world_max.x, &random), rand_f32_in_range(world_min.y, world_max.y, &random), rand_f32_in_range(world_min.z, world_max.z, &random)};
+		info.draw_info.quat = {rand_f32_in_range(-1.0f, 1.0f, &random), rand_f32_in_range(-1.0f, 1.0f, &random), rand_f32_in_range(-1.0f, 1.0f, &random), rand_f32_in_range(-1.0f, 1.0f, &random)};
+		info.draw_info.quat = normalize(info.draw_info.quat);
+		info.draw_info.vertex_buffer_index = mesh_index;
+		info.bounding_radius = bounds[mesh_index].origin_radius;
+		infos[i] = info;
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	char* mesh_name = (char*)"Apollo_Statue.obj";
+	u32 remap_corner_count = 50000000;
+	char* depth_recording_path = 0;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) job_thread_count = (u32)atoi(argv[++i]);
+		else if (strcmp(argv[i], "--remap-corners") == 0 && i + 1 < argc) remap_corner_count = (u32)atoi(argv[++i]);
+		else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) depth_recording_path = argv[++i];
+		else mesh_name = argv[i];
+	}
+
+	if (depth_recording_path)
+	{
+		DepthRecording recording;
+		if (!load_depth_recording(depth_recording_path, &recording))
+			return 1;
+		bool conservative = analyze_depth_recording(&recording);
+		free_depth_recording(&recording);
+		return conservative ? 0 : 1;
+	}
+
+	BenchMesh mesh = {};
+	if (!load_bench_mesh(mesh_name, &mesh))
+		return 1;
+	printf("%s: %u vertices, %u triangles\n\n", mesh_name, mesh.vertex_count, mesh.index_count / 3);
+
+	//The small meshes draw() loads next to the bench mesh, for the benchmarks that compare mesh sizes.
+	BenchMesh small_meshes[2] = {};
+	char* small_mesh_names[2] = {(char*)"cube.obj", (char*)"icosphere.obj"};
+	bool small_meshes_loaded = load_bench_mesh(small_mesh_names[0], &small_meshes[0]) && load_bench_mesh(small_mesh_names[1], &small_meshes[1]);
+
+	//The camera draw() starts with.
+	ShaderGlobals globals = {};
+	globals.projection = perspective_infinite_reversed_z(70.0, 0.01f, (f32)bench_width, (f32)bench_height);
+	globals.view = look_at(Vec3(0.0f, 0.0f, 10.0f), Vec3(0.0f), Vec3(0.0f, 1.0f, 0.0f));
+
+	PositionMesh position_mesh = {};
+	build_position_mesh(&mesh, &position_mesh);
+
+	//The meshes draw() instances, small ones first, with their position welds and bounds.
+	u32 scene_mesh_count = small_meshes_loaded ? 3 : 1;
+	BenchMesh scene_meshes[3] = {};
+	PositionMesh scene_position_meshes[3] = {};
+	MeshBounds scene_bounds[3] = {};
+	char* scene_mesh_names[3] = {};
+	for (u32 m = 0; m < scene_mesh_count; ++m)
+	{
+		bool small = m + 1 < scene_mesh_count;
+		scene_meshes[m] = small ? small_meshes[m] : mesh;
+		scene_mesh_names[m] = small ? small_mesh_names[m] : mesh_name;
+		if (small) build_position_mesh(&scene_meshes[m], &scene_position_meshes[m]);
+		else scene_position_meshes[m] = position_mesh;
+		compute_mesh_bounds(&scene_bounds[m], scene_position_meshes[m].positions, scene_position_meshes[m].vertex_count, sizeof(f32) * 3);
+	}
+	u32 grid_sizes[] = {16, 64, 128};
+	bool out_of_core_passed = verify_out_of_core_simplify("bench.soup", position_mesh.indices, position_mesh.index_count, position_mesh.positions, position_mesh.vertex_count, sizeof(f32) * 3,
+	                                                      grid_sizes, sizeof(grid_sizes) / sizeof(grid_sizes[0]));
+	printf("Out of core simplify %s\n\n", out_of_core_passed ? "matches meshopt_simplifySloppy" : "FAILED");
+
+	benchmark_parallel_simplify(mesh_name, position_mesh.indices, position_mesh.index_count, position_mesh.positions, position_mesh.vertex_count, sizeof(f32) * 3,
+	                            position_mesh.index_count / 4 / 3 * 3, 0.02f);
+
+	ClusterLodDag dag = {};
+	build_cluster_lod_dag(&dag, position_mesh.indices, position_mesh.index_count, position_mesh.positions, position_mesh.vertex_count, sizeof(f32) * 3);
+	benchmark_cluster_lod(mesh_name, &dag, contribution_projection_scale(&globals.projection, bench_width, bench_height), 1.0f);
+	free_cluster_lod_dag(&dag);
+
+	PositionMesh grid = {};
+	build_bench_grid(&grid, 512);
+	benchmark_parallel_meshlets(mesh_name, position_mesh.indices, position_mesh.index_count, position_mesh.positions, position_mesh.vertex_count, sizeof(f32) * 3, 64, 124, 0.25f);
+	benchmark_parallel_meshlets("grid", grid.indices, grid.index_count, grid.positions, grid.vertex_count, sizeof(f32) * 3, 64, 124, 0.25f);
+	benchmark_parallel_vertex_cache(mesh_name, position_mesh.indices, position_mesh.index_count, position_mesh.positions, position_mesh.vertex_count, sizeof(f32) * 3);
+	benchmark_parallel_vertex_cache("grid", grid.indices, grid.index_count, grid.positions, grid.vertex_count, sizeof(f32) * 3);
+
+	//meshopt_optimizeOverdraw expects vertex cache ordered input, the position weld undid the order load_bench_mesh made
+	u32* cache_ordered = new u32[position_mesh.index_count];
+	meshopt_optimizeVertexCache(cache_ordered, position_mesh.indices, position_mesh.index_count, position_mesh.vertex_count);
+	benchmark_parallel_overdraw(mesh_name, cache_ordered, position_mesh.index_count, position_mesh.positions, position_mesh.vertex_count, sizeof(f32) * 3, 1.05f);
+	delete[] cache_ordered;
+
+	//Same call load_mesh makes, over every mesh draw() loads. The bench mesh has flat normals and so no shared vertices,
+	//its position weld is tuned too to show what the orders do with reuse.
+	print_tune_report_header();
+	for (u32 m = 0; m < 4; ++m)
+	{
+		if (m < 2 && !small_meshes_loaded) continue;
+		char* tune_name = m < 2 ? small_mesh_names[m] : m == 2 ? mesh_name : (char*)"positions only";
+		const u32* tune_indices = m < 2 ? small_meshes[m].indices : m == 2 ? mesh.indices : position_mesh.indices;
+		u32 tune_index_count = m < 2 ? small_meshes[m].index_count : m == 2 ? mesh.index_count : position_mesh.index_count;
+		const f32* tune_positions = m < 2 ? &small_meshes[m].vertices[0].position[0] : m == 2 ? &mesh.vertices[0].position[0] : position_mesh.positions;
+		u32 tune_vertex_count = m < 2 ? small_meshes[m].vertex_count : m == 2 ? mesh.vertex_count : position_mesh.vertex_count;
+		size_t tune_stride = m < 3 ? sizeof(Vertex) : sizeof(f32) * 3;
+
+		u32* tuned_indices = new u32[tune_index_count];
+		TuneReport report = {};
+		tune_index_order(tuned_indices, tune_indices, tune_index_count, tune_positions, tune_vertex_count, tune_stride, 0.25f, &report);
+		print_tune_report(tune_name, &report);
+		delete[] tuned_indices;
+	}
+	printf("\n");
+
+	if (remap_corner_count >= 3) {
+		Vertex* corners = build_bench_corner_stream(remap_corner_count);
+		benchmark_parallel_vertex_remap("grid corners", corners, remap_corner_count / 3 * 3, sizeof(Vertex));
+		delete[] corners;
+	}
+
+	{
+		//Same scene as the cull benchmarks.
+		f32 scale = sqrtf(bench_instance_count / 1250.0f);
+		vec3 world_max = Vec3(100.0f * scale, 25.0f, 100.0f * scale);
+		vec3 world_min = -world_max;
+
+		DrawCallInfo* infos = new DrawCallInfo[bench_instance_count];
+		u32 random = 101;
+		for (u32 i = 0; i < bench_instance_count; ++i)
+		{
+			infos[i] = {};
+			infos[i].draw_info.position = {rand_f32_in_range(world_min.x, world_max.x, &random), rand_f32_in_range(world_min.y, world_max.y, &random), rand_f32_in_range(world_min.z, world_max.z, &random)};
+			infos[i].bounding_radius = rand_f32_in_range(0.5f, 3.0f, &random);
+		}
+
+		u32 move_counts[] = {1, 16, bench_instance_count / INSTANCE_FULL_SORT_DIVISOR};
+		for (u32 m = 0; m < sizeof(move_counts) / sizeof(move_counts[0]); ++m)
+			printf("Instance order merge, %u moved: %s\n", move_counts[m], verify_instance_order(infos, bench_instance_count, world_min, world_max, move_counts[m]) ? "matches the full sort" : "FAILED");
+		benchmark_instance_order(infos, bench_instance_count, &globals, world_min, world_max);
+		printf("\n");
+
+		delete[] infos;
+	}
+
+	{
+		//draw()'s 1250 instances in a 1280x720 window, whose occlusion buffer is a quarter of that in each direction.
+		u32 instance_count = 1250;
+		DrawCallInfo* infos = new DrawCallInfo[instance_count];
+		build_bench_scene(infos, instance_count, scene_meshes, scene_bounds, scene_mesh_count, Vec3(-100.0f, -25.0f, -100.0f), Vec3(100.0f, 25.0f, 100.0f));
+
+		ShaderGlobals window_globals = globals;
+		window_globals.projection = perspective_infinite_reversed_z(70.0, 0.01f, 1280.0f, 720.0f);
+
+		OccluderMesh full_meshes[3] = {};
+		for (u32 m = 0; m < scene_mesh_count; ++m)
+			full_meshes[m] = {scene_position_meshes[m].positions, scene_position_meshes[m].vertex_count, scene_position_meshes[m].indices, scene_position_meshes[m].index_count};
+
+		f64 frame_seconds = benchmark_occlusion_culling(full_meshes, scene_mesh_count, infos, instance_count, &window_globals, 1280 / 4, 720 / 4);
+		printf("  %.3fms a frame on one core: %s the %.1fms budget\n\n", frame_seconds * 1000.0, frame_seconds < OCCLUSION_FRAME_BUDGET_SECONDS ? "within" : "FAILED, over", OCCLUSION_FRAME_BUDGET_SECONDS * 1000.0);
+		assert(frame_seconds < OCCLUSION_FRAME_BUDGET_SECONDS);
+
+		delete[] infos;
+	}
+
+	{
+		//Round trips through the file format --depth reads.
+		DepthRecording synthetic;
+		build_synthetic_depth_recording(&synthetic, &globals, bench_width, bench_height, 24, bench_instance_count);
+		DepthRecording recording;
+		if (save_depth_recording("bench_depth.bin", &globals, synthetic.depth, bench_width, bench_height, bench_width * sizeof(f32), synthetic.instances, bench_instance_count) &&
+		    load_depth_recording("bench_depth.bin", &recording))
+		{
+			bool conservative = analyze_depth_recording(&recording);
+			printf("Synthetic depth: hi-z %s\n\n", conservative ? "is conservative" : "FAILED");
+			free_depth_recording(&recording);
+		}
+		remove("bench_depth.bin");
+		free_depth_recording(&synthetic);
+	}
+
+	{
+		//LODs of the position welds: with flat normals every edge of the loaded meshes is an attribute seam that
+		//meshopt_simplify keeps.
+		MeshLods lods[3] = {};
+		for (u32 m = 0; m < scene_mesh_count; ++m)
+		{
+			const PositionMesh* lod_mesh = &scene_position_meshes[m];
+			u32* lod_indices = new u32[lod_mesh->index_count * 2];
+			build_mesh_lods(&lods[m], lod_indices, lod_mesh->indices, lod_mesh->index_count, lod_mesh->positions, lod_mesh->vertex_count, sizeof(f32) * 3);
+			delete[] lod_indices;
+		}
+
+		u32 instance_count = 1250;
+		DrawCallInfo* infos = new DrawCallInfo[instance_count];
+		build_bench_scene(infos, instance_count, scene_meshes, scene_bounds, scene_mesh_count, Vec3(-100.0f, -25.0f, -100.0f), Vec3(100.0f, 25.0f, 100.0f));
+
+		CullFrustum frustum = make_cull_frustum(&globals);
+		for (u32 i = 0; i < instance_count; ++i) infos[i].bounding_radius *= frustum.bounds_scale;
+
+		benchmark_contribution_culling(lods, scene_mesh_count, infos, instance_count, &globals, bench_width, bench_height);
+		printf("\n");
+
+		delete[] infos;
+	}
+
+	benchmark_instance_bvh(bench_instance_count, &globals);
+	benchmark_multi_view_cull(bench_instance_count, &globals);
+	benchmark_cull_layouts(bench_instance_count, &globals);
+	benchmark_cull_compaction(bench_instance_count);//Runs verify_cull_compaction over its edge cases first
+	bool buckets_passed = benchmark_instance_buckets(bench_instance_count, MAX_INSTANCE_BUCKETS / MAX_MESH_LODS);//Runs verify_instance_buckets over its edge cases first
+	assert(buckets_passed);
+	benchmark_draw_sort(1250, 2);//draw()'s instances over the two meshes it loads
+	benchmark_draw_sort(DRAW_SORT_PARALLEL_MIN_COUNT * 4, 2);//Big enough for the parallel sort
+	benchmark_mesh_split(mesh_name, mesh.indices, mesh.index_count, &mesh.vertices[0].position[0], mesh.vertex_count, sizeof(Vertex), MESH_CHUNK_TARGET_TRIANGLES);//As load_mesh splits it
+	{
+		//load_mesh's order: split LOD 0 into chunks, optimize vertex fetch, append the LODs, then the depth stream.
+		u32* split_indices = new u32[mesh.index_count];
+		memcpy(split_indices, mesh.indices, sizeof(u32) * mesh.index_count);
+		MeshChunk* chunks = new MeshChunk[max_mesh_chunks(mesh.index_count / 3, MESH_CHUNK_TARGET_TRIANGLES)];
+		u32 chunk_count = mesh.index_count / 3 > MESH_SPLIT_MIN_TRIANGLES ?
+		                  split_mesh_chunks(chunks, split_indices, mesh.index_count, &mesh.vertices[0].position[0], mesh.vertex_count, sizeof(Vertex), MESH_CHUNK_TARGET_TRIANGLES) : 0;
+
+		Vertex* vertices = new Vertex[mesh.vertex_count];
+		u32 vertex_count = (u32)meshopt_optimizeVertexFetch(vertices, split_indices, mesh.index_count, mesh.vertices, mesh.vertex_count, sizeof(Vertex));
+
+		MeshLods lods;
+		u32* lod_indices = new u32[mesh.index_count * 2];
+		u32 lod_index_count = build_mesh_lods(&lods, lod_indices, split_indices, mesh.index_count, &vertices[0].position[0], vertex_count, sizeof(Vertex));
+
+		DepthMesh depth_mesh;
+		build_depth_mesh(&depth_mesh, lod_indices, lod_index_count, &lods, chunks, chunk_count, &vertices[0].position[0], vertex_count, sizeof(Vertex));
+		print_depth_mesh_stats(mesh_name, &depth_mesh, lod_indices, lods.index_count[0], vertex_count, sizeof(Vertex));
+		printf("\n");
+
+		free_depth_mesh(&depth_mesh);
+		delete[] vertices;
+		delete[] lod_indices;
+		delete[] chunks;
+		delete[] split_indices;
+	}
+
+	benchmark_triangle_culling(mesh_name, mesh.indices, mesh.index_count, &mesh.vertices[0].position[0], mesh.vertex_count, sizeof(Vertex), bench_width, bench_height);
+
+	//Small meshes get baked, the bench mesh keeps its own draws when it is over BATCH_MAX_MESH_TRIANGLES.
+	if (small_meshes_loaded) {
+		BatchSourceMesh batch_meshes[3] = {};
+		batch_meshes[0] = {small_meshes[0].vertices, small_meshes[0].vertex_count, small_meshes[0].indices, small_meshes[0].index_count};
+		batch_meshes[1] = {small_meshes[1].vertices, small_meshes[1].vertex_count, small_meshes[1].indices, small_meshes[1].index_count};
+		batch_meshes[2] = {mesh.vertices, mesh.vertex_count, mesh.indices, mesh.index_count};
+		f32 cell_sizes[] = {8.0f, 16.0f, 32.0f};
+		benchmark_static_batching(batch_meshes, 3, bench_instance_count, Vec3(-100.0f, -25.0f, -100.0f), Vec3(100.0f, 25.0f, 100.0f),
+		                          cell_sizes, sizeof(cell_sizes) / sizeof(cell_sizes[0]), &globals);//Runs verify_static_batch after every bake
+	}
+
+	for (u32 m = 0; m < scene_mesh_count; ++m)
+		benchmark_mesh_bounds(scene_mesh_names[m], scene_position_meshes[m].positions, scene_position_meshes[m].vertex_count, sizeof(f32) * 3);
+	printf("\n");
+
+	benchmark_instance_transforms(bench_instance_count);
+
+	return 0;
+}
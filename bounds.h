@@ -0,0 +1,713 @@
+#pragma once
+
+// Tight bounding volumes of a mesh's vertices, in mesh space: a near minimal sphere, the AABB and an oriented box
+// along the vertices' principal axes, plus the radius around the mesh origin.
+//
+// The sphere is Ritter's: the two ends of a furthest vertex chase seed it, and it grows towards the furthest vertex
+// outside it until none is left. Ritter ends up a few percent too big, so the centre then takes shrinking steps
+// towards the furthest vertex (Badoiu and Clarkson's iteration), keeping the smallest sphere seen. Every pass is a
+// furthest vertex search, four vertices per SSE iteration; the box extents are the same kind of pass.
+//
+// The oriented box takes its axes from the eigenvectors of the vertex covariance.
+//
+// Instances spin around their origin (instance_rotation), so the only sphere that holds for every rotation is the one
+// around the origin, origin_radius. The tight sphere's centre has to turn with the instance, which draw() does every
+// frame in the instance store, so the CPU culling and cull_compute test the same sphere.
+//
+// Needs culling.h and occlusion.h in the same translation unit.
+
+#include <emmintrin.h>
+
+
+constexpr u32 BOUNDS_SPHERE_GROW_ITERATIONS = 256;
+constexpr u32 BOUNDS_SPHERE_REFINE_ITERATIONS = 64;
+
+enum BoundsVolume
+{
+	BOUNDS_SPHERE,
+	BOUNDS_AABB,
+	BOUNDS_OBB,
+};
+
+struct MeshBounds
+{
+	//Mesh space
+	vec3 aabb_min;
+	vec3 aabb_max;
+
+	vec3 sphere_centre;
+	f32 sphere_radius;
+
+	f32 origin_radius;//Around the mesh origin
+
+	vec3 obb_centre;
+	vec3 obb_axes[3];//Orthonormal, right handed
+	vec3 obb_half_extents;
+
+	BoundsVolume tightest;//Smallest of the three by volume
+};
+
+inline vec3 bounds_vertex(const f32* positions, size_t stride_in_floats, u32 i)
+{
+	const f32* p = positions + i * stride_in_floats;
+	return Vec3(p[0], p[1], p[2]);
+}
+
+// x, y and z of vertices i to i + 3, one vertex per lane.
+inline void load_bounds_vertices_sse(const f32* positions, size_t stride_in_floats, u32 i, __m128* x, __m128* y, __m128* z)
+{
+	const f32* p0 = positions + (i + 0) * stride_in_floats;
+	const f32* p1 = positions + (i + 1) * stride_in_floats;
+	const f32* p2 = positions + (i + 2) * stride_in_floats;
+	const f32* p3 = positions + (i + 3) * stride_in_floats;
+	*x = _mm_set_ps(p3[0], p2[0], p1[0], p0[0]);
+	*y = _mm_set_ps(p3[1], p2[1], p1[1], p0[1]);
+	*z = _mm_set_ps(p3[2], p2[2], p1[2], p0[2]);
+}
+
+inline f32 horizontal_min_sse(__m128 v)
+{
+	v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+	v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+	return _mm_cvtss_f32(v);
+}
+
+inline f32 horizontal_max_sse(__m128 v)
+{
+	v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+	v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+	return _mm_cvtss_f32(v);
+}
+
+// Smallest and largest dot product of the vertices with each of the three axes. With the unit axes this is the AABB.
+void bounds_extent_sse(vec3* extent_min, vec3* extent_max, const vec3 axes[3], const f32* positions, u32 vertex_count, size_t positions_stride)
+{
+	size_t stride_in_floats = positions_stride / sizeof(f32);
+
+	__m128 axis_x[3], axis_y[3], axis_z[3], lower[3], upper[3];
+	for (u32 a = 0; a < 3; ++a)
+	{
+		axis_x[a] = _mm_set1_ps(axes[a].x);
+		axis_y[a] = _mm_set1_ps(axes[a].y);
+		axis_z[a] = _mm_set1_ps(axes[a].z);
+		lower[a] = _mm_set1_ps(FLT_MAX);
+		upper[a] = _mm_set1_ps(-FLT_MAX);
+	}
+
+	u32 i = 0;
+	for (; i + 4 <= vertex_count; i += 4)
+	{
+		__m128 x, y, z;
+		load_bounds_vertices_sse(positions, stride_in_floats, i, &x, &y, &z);
+
+		for (u32 a = 0; a < 3; ++a)
+		{
+			__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, axis_x[a]), _mm_mul_ps(y, axis_y[a])), _mm_mul_ps(z, axis_z[a]));
+			lower[a] = _mm_min_ps(lower[a], d);
+			upper[a] = _mm_max_ps(upper[a], d);
+		}
+	}
+
+	f32 lowest[3], highest[3];
+	for (u32 a = 0; a < 3; ++a)
+	{
+		lowest[a] = horizontal_min_sse(lower[a]);
+		highest[a] = horizontal_max_sse(upper[a]);
+	}
+
+	for (; i < vertex_count; ++i)
+	{
+		vec3 p = bounds_vertex(positions, stride_in_floats, i);
+		for (u32 a = 0; a < 3; ++a)
+		{
+			f32 d = p.x * axes[a].x + p.y * axes[a].y + p.z * axes[a].z;
+			lowest[a] = MIN(lowest[a], d);
+			highest[a] = MAX(highest[a], d);
+		}
+	}
+
+	*extent_min = Vec3(lowest[0], lowest[1], lowest[2]);
+	*extent_max = Vec3(highest[0], highest[1], highest[2]);
+}
+
+// Squared distance from centre to the vertex furthest from it, and that vertex. Ties go to the lowest index.
+f32 furthest_bounds_vertex_sse(vec3 centre, const f32* positions, u32 vertex_count, size_t positions_stride, u32* furthest)
+{
+	size_t stride_in_floats = positions_stride / sizeof(f32);
+
+	__m128 cx = _mm_set1_ps(centre.x);
+	__m128 cy = _mm_set1_ps(centre.y);
+	__m128 cz = _mm_set1_ps(centre.z);
+	__m128 best = _mm_set1_ps(-1.0f);
+	__m128i best_index = _mm_setzero_si128();
+	__m128i index = _mm_setr_epi32(0, 1, 2, 3);
+	__m128i four = _mm_set1_epi32(4);
+
+	u32 i = 0;
+	for (; i + 4 <= vertex_count; i += 4)
+	{
+		__m128 x, y, z;
+		load_bounds_vertices_sse(positions, stride_in_floats, i, &x, &y, &z);
+
+		__m128 dx = _mm_sub_ps(x, cx);
+		__m128 dy = _mm_sub_ps(y, cy);
+		__m128 dz = _mm_sub_ps(z, cz);
+		__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+		__m128i further = _mm_castps_si128(_mm_cmpgt_ps(d, best));
+		best = _mm_max_ps(best, d);
+		best_index = _mm_or_si128(_mm_and_si128(further, index), _mm_andnot_si128(further, best_index));
+		index = _mm_add_epi32(index, four);
+	}
+
+	f32 lane_distance[4];
+	u32 lane_index[4];
+	_mm_storeu_ps(lane_distance, best);
+	_mm_storeu_si128((__m128i*)lane_index, best_index);
+
+	f32 result = -1.0f;
+	u32 result_index = 0;
+	for (u32 l = 0; l < 4; ++l)
+	{
+		if (lane_distance[l] > result || (lane_distance[l] == result && lane_index[l] < result_index))
+		{
+			result = lane_distance[l];
+			result_index = lane_index[l];
+		}
+	}
+
+	for (; i < vertex_count; ++i)
+	{
+		vec3 d = bounds_vertex(positions, stride_in_floats, i) - centre;
+		f32 distance = dot(d, d);
+		if (distance > result)
+		{
+			result = distance;
+			result_index = i;
+		}
+	}
+
+	*furthest = result_index;
+	return result;
+}
+
+// Ritter's sphere, then refined. The radius is always the exact distance to the furthest vertex from the centre.
+void compute_bounds_sphere(vec3* centre, f32* radius, const f32* positions, u32 vertex_count, size_t positions_stride)
+{
+	size_t stride_in_floats = positions_stride / sizeof(f32);
+
+	u32 a = 0, b = 0;
+	furthest_bounds_vertex_sse(bounds_vertex(positions, stride_in_floats, 0), positions, vertex_count, positions_stride, &a);
+	furthest_bounds_vertex_sse(bounds_vertex(positions, stride_in_floats, a), positions, vertex_count, positions_stride, &b);
+
+	vec3 pa = bounds_vertex(positions, stride_in_floats, a);
+	vec3 pb = bounds_vertex(positions, stride_in_floats, b);
+	vec3 c = (pa + pb) * 0.5f;
+	f32 r = length(pb - pa) * 0.5f;
+
+	//Grow just enough to take in the furthest vertex, keeping the far side of the sphere where it is.
+	for (u32 it = 0; it < BOUNDS_SPHERE_GROW_ITERATIONS; ++it)
+	{
+		u32 f;
+		f32 d = sqrtf(furthest_bounds_vertex_sse(c, positions, vertex_count, positions_stride, &f));
+		if (d <= r) break;
+
+		f32 grown = (r + d) * 0.5f;
+		c = c + (bounds_vertex(positions, stride_in_floats, f) - c) * ((grown - r) / d);
+		r = grown;
+	}
+
+	u32 f;
+	r = sqrtf(furthest_bounds_vertex_sse(c, positions, vertex_count, positions_stride, &f));
+
+	//The minimal sphere's centre is where the furthest vertex is nearest; step towards the furthest vertex with
+	//steps that shrink with the iteration, starting well below Badoiu and Clarkson's 1/2 since Ritter is close already.
+	vec3 best_centre = c;
+	f32 best_radius = r;
+	for (u32 it = 0; it < BOUNDS_SPHERE_REFINE_ITERATIONS; ++it)
+	{
+		c = c + (bounds_vertex(positions, stride_in_floats, f) - c) * (1.0f / (it + 16));
+
+		r = sqrtf(furthest_bounds_vertex_sse(c, positions, vertex_count, positions_stride, &f));
+		if (r < best_radius)
+		{
+			best_centre = c;
+			best_radius = r;
+		}
+	}
+
+	*centre = best_centre;
+	*radius = best_radius;
+}
+
+// Eigenvectors of a symmetric 3x3 matrix as the columns of vectors, by cyclic Jacobi rotations.
+void symmetric_eigenvectors_3x3(f64 a[3][3], f64 vectors[3][3])
+{
+	for (u32 r = 0; r < 3; ++r)
+		for (u32 c = 0; c < 3; ++c) vectors[r][c] = r == c ? 1.0 : 0.0;
+
+	for (u32 sweep = 0; sweep < 32; ++sweep)
+	{
+		f64 off_diagonal = fabs(a[0][1]) + fabs(a[0][2]) + fabs(a[1][2]);
+		if (off_diagonal < 1e-15 * (fabs(a[0][0]) + fabs(a[1][1]) + fabs(a[2][2]))) break;
+
+		for (u32 p = 0; p < 2; ++p)
+		{
+			for (u32 q = p + 1; q < 3; ++q)
+			{
+				if (a[p][q] == 0.0) continue;
+
+				//Rotation in the p, q plane that zeroes a[p][q].
+				f64 theta = (a[q][q] - a[p][p]) / (2.0 * a[p][q]);
+				f64 t = (theta >= 0.0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1.0));
+				f64 cs = 1.0 / sqrt(t * t + 1.0);
+				f64 sn = t * cs;
+
+				for (u32 k = 0; k < 3; ++k)
+				{
+					f64 akp = a[k][p], akq = a[k][q];
+					a[k][p] = cs * akp - sn * akq;
+					a[k][q] = sn * akp + cs * akq;
+				}
+				for (u32 k = 0; k < 3; ++k)
+				{
+					f64 apk = a[p][k], aqk = a[q][k];
+					a[p][k] = cs * apk - sn * aqk;
+					a[q][k] = sn * apk + cs * aqk;
+				}
+				for (u32 k = 0; k < 3; ++k)
+				{
+					f64 vkp = vectors[k][p], vkq = vectors[k][q];
+					vectors[k][p] = cs * vkp - sn * vkq;
+					vectors[k][q] = sn * vkp + cs * vkq;
+				}
+			}
+		}
+	}
+}
+
+// Axes of the vertices' covariance, orthonormal and right handed.
+void principal_bounds_axes(vec3 axes[3], const f32* positions, u32 vertex_count, size_t positions_stride)
+{
+	size_t stride_in_floats = positions_stride / sizeof(f32);
+
+	f64 mean[3] = {};
+	for (u32 i = 0; i < vertex_count; ++i)
+	{
+		const f32* p = positions + i * stride_in_floats;
+		for (u32 k = 0; k < 3; ++k) mean[k] += p[k];
+	}
+	for (u32 k = 0; k < 3; ++k) mean[k] /= MAX(vertex_count, 1u);
+
+	f64 covariance[3][3] = {};
+	for (u32 i = 0; i < vertex_count; ++i)
+	{
+		const f32* p = positions + i * stride_in_floats;
+		f64 d[3] = {p[0] - mean[0], p[1] - mean[1], p[2] - mean[2]};
+		for (u32 r = 0; r < 3; ++r)
+			for (u32 c = r; c < 3; ++c) covariance[r][c] += d[r] * d[c];
+	}
+	for (u32 r = 0; r < 3; ++r)
+		for (u32 c = 0; c < r; ++c) covariance[r][c] = covariance[c][r];
+
+	f64 vectors[3][3];
+	symmetric_eigenvectors_3x3(covariance, vectors);
+
+	axes[0] = normalize(Vec3((f32)vectors[0][0], (f32)vectors[1][0], (f32)vectors[2][0]));
+	vec3 second = Vec3((f32)vectors[0][1], (f32)vectors[1][1], (f32)vectors[2][1]);
+	axes[1] = normalize(second - axes[0] * dot(second, axes[0]));
+	axes[2] = cross(axes[0], axes[1]);
+}
+
+f32 bounds_box_volume(vec3 half_extents)
+{
+	return 8.0f * half_extents.x * half_extents.y * half_extents.z;
+}
+
+f32 bounds_sphere_volume(f32 radius)
+{
+	return 4.0f / 3.0f * 3.14159265f * radius * radius * radius;
+}
+
+void compute_mesh_bounds(MeshBounds* bounds, const f32* positions, u32 vertex_count, size_t positions_stride)
+{
+	*bounds = {};
+	if (vertex_count == 0) return;
+
+	vec3 unit_axes[3] = {Vec3(1.0f, 0.0f, 0.0f), Vec3(0.0f, 1.0f, 0.0f), Vec3(0.0f, 0.0f, 1.0f)};
+	bounds_extent_sse(&bounds->aabb_min, &bounds->aabb_max, unit_axes, positions, vertex_count, positions_stride);
+
+	compute_bounds_sphere(&bounds->sphere_centre, &bounds->sphere_radius, positions, vertex_count, positions_stride);
+
+	u32 furthest;
+	bounds->origin_radius = sqrtf(furthest_bounds_vertex_sse(Vec3(0.0f), positions, vertex_count, positions_stride, &furthest));
+
+	vec3 extent_min, extent_max;
+	principal_bounds_axes(bounds->obb_axes, positions, vertex_count, positions_stride);
+	bounds_extent_sse(&extent_min, &extent_max, bounds->obb_axes, positions, vertex_count, positions_stride);
+
+	vec3 middle = (extent_min + extent_max) * 0.5f;
+	bounds->obb_centre = bounds->obb_axes[0] * middle.x + bounds->obb_axes[1] * middle.y + bounds->obb_axes[2] * middle.z;
+	bounds->obb_half_extents = (extent_max - extent_min) * 0.5f;
+
+	f32 sphere_volume = bounds_sphere_volume(bounds->sphere_radius);
+	f32 aabb_volume = bounds_box_volume((bounds->aabb_max - bounds->aabb_min) * 0.5f);
+	f32 obb_volume = bounds_box_volume(bounds->obb_half_extents);
+
+	bounds->tightest = BOUNDS_SPHERE;
+	if (aabb_volume < sphere_volume) bounds->tightest = BOUNDS_AABB;
+	if (obb_volume < MIN(sphere_volume, aabb_volume)) bounds->tightest = BOUNDS_OBB;
+}
+
+// Outside as soon as the whole box is behind one plane. half_axes are the box axes scaled by its half extents, in
+// world space. The planes are the unnormalized ones the sphere test uses; the box's reach is measured with the same
+// plane vector, so it needs no bounds_scale.
+bool box_in_frustum(const CullFrustum* frustum, vec3 centre, const vec3 half_axes[3])
+{
+	for (u32 i = 0; i < 5; ++i)
+	{
+		const vec4& plane = frustum->planes[i];
+		vec3 normal = Vec3(plane.x, plane.y, plane.z);
+		f32 reach = fabsf(dot(normal, half_axes[0])) + fabsf(dot(normal, half_axes[1])) + fabsf(dot(normal, half_axes[2]));
+		if (dot(normal, centre) + plane.w < -reach) return false;
+	}
+	return true;
+}
+
+// One instance of the mesh against the frustum with the given volume, turned the way vertex_shader.hlsl turns the
+// instance at time.
+bool mesh_bounds_in_frustum(const CullFrustum* frustum, const MeshBounds* bounds, BoundsVolume volume, const DrawInfo* draw_info, f32 time)
+{
+	vec4 quat = instance_rotation(draw_info->quat, time);
+
+	if (volume == BOUNDS_SPHERE)
+	{
+		vec3 centre = rotate_vec_by_quat(bounds->sphere_centre, quat) + draw_info->position;
+		return sphere_in_frustum(frustum, centre, bounds->sphere_radius * frustum->bounds_scale);
+	}
+
+	vec3 centre, half_axes[3];
+	if (volume == BOUNDS_AABB)
+	{
+		vec3 aabb_min = bounds->aabb_min, aabb_max = bounds->aabb_max;
+		vec3 half_extents = (aabb_max - aabb_min) * 0.5f;
+		centre = (aabb_min + aabb_max) * 0.5f;
+		half_axes[0] = rotate_vec_by_quat(Vec3(half_extents.x, 0.0f, 0.0f), quat);
+		half_axes[1] = rotate_vec_by_quat(Vec3(0.0f, half_extents.y, 0.0f), quat);
+		half_axes[2] = rotate_vec_by_quat(Vec3(0.0f, 0.0f, half_extents.z), quat);
+	}
+	else
+	{
+		centre = bounds->obb_centre;
+		for (u32 a = 0; a < 3; ++a)
+		{
+			vec3 axis = bounds->obb_axes[a];
+			half_axes[a] = rotate_vec_by_quat(axis * bounds->obb_half_extents.data[a], quat);
+		}
+	}
+
+	return box_in_frustum(frustum, rotate_vec_by_quat(centre, quat) + draw_info->position, half_axes);
+}
+
+
+// Exact minimal sphere for the benchmark: Welzl's algorithm unrolled into its four nested loops (a sphere is fixed by
+// at most four boundary points), in doubles, over the vertices in a shuffled order so it runs in expected linear time.
+struct ReferenceSphere
+{
+	f64 centre[3];
+	f64 radius_squared;
+};
+
+inline f64 reference_distance_squared(const f64* a, const f64* b)
+{
+	f64 d[3] = {a[0] - b[0], a[1] - b[1], a[2] - b[2]};
+	return d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+}
+
+inline bool outside_reference_sphere(const ReferenceSphere* sphere, const f64* p)
+{
+	return reference_distance_squared(sphere->centre, p) > sphere->radius_squared * (1.0 + 1e-12) + 1e-18;
+}
+
+ReferenceSphere reference_sphere_2(const f64* a, const f64* b)
+{
+	ReferenceSphere result;
+	for (u32 k = 0; k < 3; ++k) result.centre[k] = (a[k] + b[k]) * 0.5;
+	result.radius_squared = reference_distance_squared(a, b) * 0.25;
+	return result;
+}
+
+// Circumcircle of the triangle; the widest pair's sphere when the points are on a line.
+ReferenceSphere reference_sphere_3(const f64* a, const f64* b, const f64* c)
+{
+	f64 u[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+	f64 v[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+	f64 n[3] = {u[1] * v[2] - u[2] * v[1], u[2] * v[0] - u[0] * v[2], u[0] * v[1] - u[1] * v[0]};
+	f64 n2 = n[0] * n[0] + n[1] * n[1] + n[2] * n[2];
+	f64 u2 = u[0] * u[0] + u[1] * u[1] + u[2] * u[2];
+	f64 v2 = v[0] * v[0] + v[1] * v[1] + v[2] * v[2];
+
+	if (n2 <= 1e-24 * u2 * v2)
+	{
+		ReferenceSphere ab = reference_sphere_2(a, b), ac = reference_sphere_2(a, c), bc = reference_sphere_2(b, c);
+		ReferenceSphere result = ab.radius_squared > ac.radius_squared ? ab : ac;
+		return bc.radius_squared > result.radius_squared ? bc : result;
+	}
+
+	//centre - a = (|u|^2 (v x n) + |v|^2 (n x u)) / (2 |n|^2)
+	f64 vn[3] = {v[1] * n[2] - v[2] * n[1], v[2] * n[0] - v[0] * n[2], v[0] * n[1] - v[1] * n[0]};
+	f64 nu[3] = {n[1] * u[2] - n[2] * u[1], n[2] * u[0] - n[0] * u[2], n[0] * u[1] - n[1] * u[0]};
+
+	ReferenceSphere result;
+	f64 offset[3];
+	for (u32 k = 0; k < 3; ++k)
+	{
+		offset[k] = (u2 * vn[k] + v2 * nu[k]) / (2.0 * n2);
+		result.centre[k] = a[k] + offset[k];
+	}
+	result.radius_squared = offset[0] * offset[0] + offset[1] * offset[1] + offset[2] * offset[2];
+	return result;
+}
+
+// Circumsphere of the tetrahedron; the circumcircle of its widest face when the points are on a plane.
+ReferenceSphere reference_sphere_4(const f64* a, const f64* b, const f64* c, const f64* d)
+{
+	f64 u[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+	f64 v[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+	f64 w[3] = {d[0] - a[0], d[1] - a[1], d[2] - a[2]};
+	f64 vw[3] = {v[1] * w[2] - v[2] * w[1], v[2] * w[0] - v[0] * w[2], v[0] * w[1] - v[1] * w[0]};
+	f64 wu[3] = {w[1] * u[2] - w[2] * u[1], w[2] * u[0] - w[0] * u[2], w[0] * u[1] - w[1] * u[0]};
+	f64 uv[3] = {u[1] * v[2] - u[2] * v[1], u[2] * v[0] - u[0] * v[2], u[0] * v[1] - u[1] * v[0]};
+	f64 determinant = u[0] * vw[0] + u[1] * vw[1] + u[2] * vw[2];
+
+	f64 u2 = u[0] * u[0] + u[1] * u[1] + u[2] * u[2];
+	f64 v2 = v[0] * v[0] + v[1] * v[1] + v[2] * v[2];
+	f64 w2 = w[0] * w[0] + w[1] * w[1] + w[2] * w[2];
+
+	if (fabs(determinant) <= 1e-12 * sqrt(u2 * v2 * w2))
+	{
+		ReferenceSphere faces[4] = {reference_sphere_3(a, b, c), reference_sphere_3(a, b, d), reference_sphere_3(a, c, d), reference_sphere_3(b, c, d)};
+		ReferenceSphere result = faces[0];
+		for (u32 i = 1; i < 4; ++i)
+			if (faces[i].radius_squared > result.radius_squared) result = faces[i];
+		return result;
+	}
+
+	ReferenceSphere result;
+	f64 offset[3];
+	for (u32 k = 0; k < 3; ++k)
+	{
+		offset[k] = (u2 * vw[k] + v2 * wu[k] + w2 * uv[k]) / (2.0 * determinant);
+		result.centre[k] = a[k] + offset[k];
+	}
+	result.radius_squared = offset[0] * offset[0] + offset[1] * offset[1] + offset[2] * offset[2];
+	return result;
+}
+
+f32 minimal_sphere_radius_reference(const f32* positions, u32 vertex_count, size_t positions_stride)
+{
+	size_t stride_in_floats = positions_stride / sizeof(f32);
+
+	f64* points = new f64[vertex_count * 3];
+	for (u32 i = 0; i < vertex_count; ++i)
+		for (u32 k = 0; k < 3; ++k) points[i * 3 + k] = positions[i * stride_in_floats + k];
+
+	u32 random = 7;
+	for (u32 i = vertex_count; i > 1; --i)
+	{
+		u32 j = (u32)rand_f32_in_range(0.0f, (f32)i, &random);
+		j = MIN(j, i - 1);
+		for (u32 k = 0; k < 3; ++k)
+		{
+			f64 t = points[(i - 1) * 3 + k];
+			points[(i - 1) * 3 + k] = points[j * 3 + k];
+			points[j * 3 + k] = t;
+		}
+	}
+
+	ReferenceSphere sphere = {{points[0], points[1], points[2]}, 0.0};
+	for (u32 i = 1; i < vertex_count; ++i)
+	{
+		const f64* pi = &points[i * 3];
+		if (!outside_reference_sphere(&sphere, pi)) continue;
+
+		sphere = {{pi[0], pi[1], pi[2]}, 0.0};
+		for (u32 j = 0; j < i; ++j)
+		{
+			const f64* pj = &points[j * 3];
+			if (!outside_reference_sphere(&sphere, pj)) continue;
+
+			sphere = reference_sphere_2(pi, pj);
+			for (u32 k = 0; k < j; ++k)
+			{
+				const f64* pk = &points[k * 3];
+				if (!outside_reference_sphere(&sphere, pk)) continue;
+
+				sphere = reference_sphere_3(pi, pj, pk);
+				for (u32 l = 0; l < k; ++l)
+				{
+					const f64* pl = &points[l * 3];
+					if (outside_reference_sphere(&sphere, pl)) sphere = reference_sphere_4(pi, pj, pk, pl);
+				}
+			}
+		}
+	}
+
+	delete[] points;
+	return (f32)sqrt(sphere.radius_squared);
+}
+
+// Smallest box volume over a grid of rotations, then finer grids around the best one; the principal axes are tried
+// too, so the result is never worse than the PCA box. A sampled minimum, not an exact one.
+f32 minimal_box_volume_reference(const f32* positions, u32 vertex_count, size_t positions_stride, const vec3 principal_axes[3])
+{
+	const u32 steps = 16;
+	const f32 quarter_turn = 3.14159265f * 0.5f;
+
+	auto box_volume = [&](const vec3 axes[3]) -> f32
+	{
+		vec3 extent_min, extent_max;
+		bounds_extent_sse(&extent_min, &extent_max, axes, positions, vertex_count, positions_stride);
+		return bounds_box_volume((extent_max - extent_min) * 0.5f);
+	};
+
+	auto rotated_axes = [](f32 yaw, f32 pitch, f32 roll, vec3 axes[3])
+	{
+		vec4 q = quat_mul(quat_mul(normalize(vec4{0.0f, sinf(yaw * 0.5f), 0.0f, cosf(yaw * 0.5f)}), normalize(vec4{sinf(pitch * 0.5f), 0.0f, 0.0f, cosf(pitch * 0.5f)})),
+		                  normalize(vec4{0.0f, 0.0f, sinf(roll * 0.5f), cosf(roll * 0.5f)}));
+		axes[0] = rotate_vec_by_quat(Vec3(1.0f, 0.0f, 0.0f), q);
+		axes[1] = rotate_vec_by_quat(Vec3(0.0f, 1.0f, 0.0f), q);
+		axes[2] = rotate_vec_by_quat(Vec3(0.0f, 0.0f, 1.0f), q);
+	};
+
+	f32 best = box_volume(principal_axes);
+	f32 best_angles[3] = {};
+	for (u32 a = 0; a < steps; ++a)
+		for (u32 b = 0; b < steps; ++b)
+			for (u32 c = 0; c < steps; ++c)
+			{
+				f32 angles[3] = {a * quarter_turn / steps, b * quarter_turn / steps, c * quarter_turn / steps};
+				vec3 axes[3];
+				rotated_axes(angles[0], angles[1], angles[2], axes);
+				f32 volume = box_volume(axes);
+				if (volume < best)
+				{
+					best = volume;
+					memcpy(best_angles, angles, sizeof(angles));
+				}
+			}
+
+	f32 step = quarter_turn / steps;
+	for (u32 round = 0; round < 4; ++round)
+	{
+		f32 centre_angles[3];
+		memcpy(centre_angles, best_angles, sizeof(centre_angles));
+		for (int a = -2; a <= 2; ++a)
+			for (int b = -2; b <= 2; ++b)
+				for (int c = -2; c <= 2; ++c)
+				{
+					f32 angles[3] = {centre_angles[0] + a * step * 0.5f, centre_angles[1] + b * step * 0.5f, centre_angles[2] + c * step * 0.5f};
+					vec3 axes[3];
+					rotated_axes(angles[0], angles[1], angles[2], axes);
+					f32 volume = box_volume(axes);
+					if (volume < best)
+					{
+						best = volume;
+						memcpy(best_angles, angles, sizeof(angles));
+					}
+				}
+		step *= 0.5f;
+	}
+
+	return best;
+}
+
+// Computes the bounds, checks every volume holds every vertex, then prints how each volume compares with the brute
+// force minima (Welzl's exact sphere, a rotation search for the box) and how many instances of the mesh each volume
+// keeps in a few frustums, against the sphere around the origin that load_mesh used to cull with.
+void benchmark_mesh_bounds(char* name, const f32* positions, u32 vertex_count, size_t positions_stride)
+{
+	size_t stride_in_floats = positions_stride / sizeof(f32);
+
+	MeshBounds bounds;
+	const u32 iterations = 10;
+	f64 start = time_in_seconds();
+	for (u32 it = 0; it < iterations; ++it) compute_mesh_bounds(&bounds, positions, vertex_count, positions_stride);
+	f64 bounds_seconds = (time_in_seconds() - start) / iterations;
+
+	//Vertex average centre, radius from the origin: what load_mesh had before.
+	vec3 average = Vec3(0.0f);
+	for (u32 i = 0; i < vertex_count; ++i) average = average + bounds_vertex(positions, stride_in_floats, i) * (1.0f / vertex_count);
+
+	bool passed = true;
+	f32 average_radius = 0.0f;
+	for (u32 i = 0; i < vertex_count; ++i)
+	{
+		vec3 p = bounds_vertex(positions, stride_in_floats, i);
+		average_radius = MAX(average_radius, length(p - average));
+
+		f32 slack = 1e-4f * bounds.origin_radius;
+		passed = passed && length(p - bounds.sphere_centre) <= bounds.sphere_radius + slack;
+		passed = passed && length(p) <= bounds.origin_radius + slack;
+		passed = passed && p.x >= bounds.aabb_min.x && p.y >= bounds.aabb_min.y && p.z >= bounds.aabb_min.z;
+		passed = passed && p.x <= bounds.aabb_max.x && p.y <= bounds.aabb_max.y && p.z <= bounds.aabb_max.z;
+
+		vec3 local = p - bounds.obb_centre;
+		for (u32 a = 0; a < 3; ++a) passed = passed && fabsf(dot(local, bounds.obb_axes[a])) <= bounds.obb_half_extents.data[a] + slack;
+	}
+
+	start = time_in_seconds();
+	f32 minimal_radius = minimal_sphere_radius_reference(positions, vertex_count, positions_stride);
+	f64 welzl_seconds = time_in_seconds() - start;
+	f32 minimal_box_volume = minimal_box_volume_reference(positions, vertex_count, positions_stride, bounds.obb_axes);
+
+	f32 minimal_sphere_volume = bounds_sphere_volume(minimal_radius);
+	f32 aabb_volume = bounds_box_volume((bounds.aabb_max - bounds.aabb_min) * 0.5f);
+	f32 obb_volume = bounds_box_volume(bounds.obb_half_extents);
+	const char* volume_names[3] = {"sphere", "AABB", "OBB"};
+
+	printf("Mesh bounds %s, %u vertices, %.3fms (Welzl %.1fms)%s\n", name, vertex_count, bounds_seconds * 1000.0, welzl_seconds * 1000.0,
+	       passed ? ", every vertex inside every volume" : " (VERTEX OUTSIDE)");
+	printf("  sphere radius: around the origin %.4f, around the vertex average %.4f, Ritter refined %.4f, minimal %.4f\n",
+	       bounds.origin_radius, average_radius, bounds.sphere_radius, minimal_radius);
+	printf("  volume against the minimal sphere: origin %.2fx, refined %.4fx; AABB %.2fx; OBB %.2fx (%.3fx the rotation search's box); tightest %s\n",
+	       bounds_sphere_volume(bounds.origin_radius) / minimal_sphere_volume, bounds_sphere_volume(bounds.sphere_radius) / minimal_sphere_volume,
+	       aabb_volume / minimal_sphere_volume, obb_volume / minimal_sphere_volume, obb_volume / minimal_box_volume, volume_names[bounds.tightest]);
+
+	//Instances scattered the way draw() places them, seen from a few cameras, at a few times so they spin.
+	const u32 instance_count = 4096;
+	u32 random = 31;
+	DrawInfo* instances = new DrawInfo[instance_count];
+	f32 extent = 8.0f * bounds.origin_radius;
+	for (u32 i = 0; i < instance_count; ++i)
+	{
+		instances[i] = {};
+		instances[i].position = Vec3(rand_f32_in_range(-extent, extent, &random), rand_f32_in_range(-extent * 0.25f, extent * 0.25f, &random), rand_f32_in_range(-extent, extent, &random));
+		instances[i].quat = normalize(vec4{rand_f32_in_range(-1.0f, 1.0f, &random), rand_f32_in_range(-1.0f, 1.0f, &random), rand_f32_in_range(-1.0f, 1.0f, &random), rand_f32_in_range(-1.0f, 1.0f, &random)});
+	}
+
+	u32 kept[5] = {};
+	u32 tests = 0;
+	for (u32 view = 0; view < 8; ++view)
+	{
+		f32 angle = view * 0.785f;
+		ShaderGlobals globals = {};
+		globals.time = view * 0.37f;
+		globals.projection = perspective_infinite_reversed_z(70.0, 0.01f, 1280.0f, 720.0f);
+		globals.view = look_at(Vec3(sinf(angle), 0.2f, cosf(angle)) * extent * 0.5f, Vec3(-sinf(angle), 0.0f, -cosf(angle)) * extent, Vec3(0.0f, 1.0f, 0.0f));
+		CullFrustum frustum = make_cull_frustum(&globals);
+
+		for (u32 i = 0; i < instance_count; ++i)
+		{
+			kept[0] += sphere_in_frustum(&frustum, instances[i].position, bounds.origin_radius * frustum.bounds_scale);
+			for (u32 v = 0; v < 3; ++v) kept[1 + v] += mesh_bounds_in_frustum(&frustum, &bounds, (BoundsVolume)v, &instances[i], globals.time);
+			kept[4] += mesh_bounds_in_frustum(&frustum, &bounds, bounds.tightest, &instances[i], globals.time);
+		}
+		tests += instance_count;
+	}
+
+	printf("  instances kept by the frustum: origin sphere %.1f%%, sphere %.1f%%, AABB %.1f%%, OBB %.1f%%, tightest %.1f%%\n",
+	       100.0 * kept[0] / tests, 100.0 * kept[1] / tests, 100.0 * kept[2] / tests, 100.0 * kept[3] / tests, 100.0 * kept[4] / tests);
+
+	delete[] instances;
+}
@@ -0,0 +1,4 @@
+@echo off
+
+REM Headless benchmarks and checks for the mesh and culling headers, see bench.cpp.
+cl.exe -nologo bench.cpp -O2 -Z7 -EHsc -FeBench.exe
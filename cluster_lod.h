@@ -0,0 +1,616 @@
+#pragma once
+
+// Continuous LOD built as a DAG of clusters, in the style of Nanite.
+//
+// The source mesh is split into meshlets (level 0). Each level after that groups neighbouring clusters, simplifies
+// every group to half its triangles with meshopt_SimplifyLockBorder and splits the result back into clusters.
+// Locking the group border means the edges a group shares with its neighbours never move, so any mix of levels
+// across group boundaries stays watertight.
+//
+// Every cluster stores the error and bounds of the group simplification that produced it, and the error and bounds of
+// the group simplification that consumed it (its parents). Errors and bounds only grow going up the DAG, so with
+// a view-dependent error test, exactly one cut through the DAG satisfies
+//     test(cluster) && !test(parent)
+// for every cluster, and all clusters of a group make the same decision since they share both values.
+//
+// Needs include/clusterizer.cpp, include/simplifier.cpp and include/spatialorder.cpp in the same translation unit.
+
+#include "jobs.h"
+#include "mesh_partition.h"
+
+
+constexpr u32 CLUSTER_MAX_VERTICES = 64;
+constexpr u32 CLUSTER_MAX_TRIANGLES = 124;
+constexpr u32 CLUSTER_GROUP_SIZE = 4;
+
+// A group that can't lose at least this fraction of its triangles is mostly locked border, its clusters become roots.
+constexpr f32 CLUSTER_MIN_REDUCTION = 0.15f;
+
+
+struct LodSphere
+{
+	f32 centre[3];
+	f32 radius;
+};
+
+struct LodCluster
+{
+	u32 index_offset;//Into ClusterLodDag::indices, which index the source vertex buffer
+	u32 index_count;
+	u32 level;
+
+	LodSphere bounds;//Bounds of the group simplification that made this cluster (the cluster's own bounds at level 0)
+	f32 error;//Absolute error in mesh units, 0 at level 0
+
+	LodSphere parent_bounds;
+	f32 parent_error;//FLT_MAX for roots
+};
+
+struct ClusterLodDag
+{
+	LodCluster* clusters;
+	u32 cluster_count;
+
+	u32* indices;
+	u32 index_count;
+
+	u32 level_count;
+	f64 build_seconds;
+};
+
+void free_cluster_lod_dag(ClusterLodDag* dag)
+{
+	delete[] dag->clusters;
+	delete[] dag->indices;
+	*dag = {};
+}
+
+
+// Growable arrays for the clusters a single group produces, so groups can be processed on any thread and appended
+// in group order afterwards.
+struct ClusterOutput
+{
+	LodCluster* clusters;
+	u32 cluster_count;
+	u32 cluster_capacity;
+
+	u32* indices;
+	u32 index_count;
+	u32 index_capacity;
+};
+
+void free_cluster_output(ClusterOutput* output)
+{
+	delete[] output->clusters;
+	delete[] output->indices;
+	*output = {};
+}
+
+void reserve_cluster_output(ClusterOutput* output, u32 cluster_count, u32 index_count)
+{
+	if (output->cluster_count + cluster_count > output->cluster_capacity)
+	{
+		u32 capacity = MAX(output->cluster_capacity * 2, output->cluster_count + cluster_count);
+		LodCluster* clusters = new LodCluster[capacity];
+		if (output->cluster_count) memcpy(clusters, output->clusters, sizeof(LodCluster) * output->cluster_count);
+		delete[] output->clusters;
+		output->clusters = clusters;
+		output->cluster_capacity = capacity;
+	}
+
+	if (output->index_count + index_count > output->index_capacity)
+	{
+		u32 capacity = MAX(output->index_capacity * 2, output->index_count + index_count);
+		u32* indices = new u32[capacity];
+		if (output->index_count) memcpy(indices, output->indices, sizeof(u32) * output->index_count);
+		delete[] output->indices;
+		output->indices = indices;
+		output->index_capacity = capacity;
+	}
+}
+
+// Splits a partition into meshlets and appends them to output with source vertex indices.
+// Bounds and errors are left for the caller.
+void append_clusters(ClusterOutput* output, const MeshPartition* partition, const u32* indices, u32 index_count, u32 level)
+{
+	size_t max_meshlets = meshopt_buildMeshletsBound(index_count, CLUSTER_MAX_VERTICES, CLUSTER_MAX_TRIANGLES);
+
+	meshopt_Meshlet* meshlets = new meshopt_Meshlet[max_meshlets];
+	u32* meshlet_vertices = new u32[max_meshlets * CLUSTER_MAX_VERTICES];
+	u8* meshlet_triangles = new u8[max_meshlets * CLUSTER_MAX_TRIANGLES * 3];
+
+	u32 meshlet_count = (u32)meshopt_buildMeshlets(meshlets, meshlet_vertices, meshlet_triangles, indices, index_count,
+	                                               partition->positions, partition->vertex_count, sizeof(f32) * 3,
+	                                               CLUSTER_MAX_VERTICES, CLUSTER_MAX_TRIANGLES, 0.0f);
+
+	reserve_cluster_output(output, meshlet_count, index_count);
+
+	for (u32 m = 0; m < meshlet_count; ++m)
+	{
+		const meshopt_Meshlet& meshlet = meshlets[m];
+
+		LodCluster& cluster = output->clusters[output->cluster_count++];
+		cluster = {};
+		cluster.index_offset = output->index_count;
+		cluster.index_count = meshlet.triangle_count * 3;
+		cluster.level = level;
+
+		for (u32 i = 0; i < meshlet.triangle_count * 3; ++i)
+		{
+			u32 local_vertex = meshlet_vertices[meshlet.vertex_offset + meshlet_triangles[meshlet.triangle_offset + i]];
+			output->indices[output->index_count++] = partition->vertices[local_vertex];
+		}
+	}
+
+	delete[] meshlets;
+	delete[] meshlet_vertices;
+	delete[] meshlet_triangles;
+}
+
+// Conservative sphere around a set of spheres: centred on their radius weighted average, grown to contain all of them.
+LodSphere merge_spheres(const LodSphere* spheres, u32 count)
+{
+	LodSphere result = {};
+
+	f32 weight = 0.0f;
+	for (u32 i = 0; i < count; ++i)
+	{
+		const LodSphere& s = spheres[i];
+		f32 w = MAX(s.radius, 1e-6f);
+		for (u32 j = 0; j < 3; ++j) result.centre[j] += s.centre[j] * w;
+		weight += w;
+	}
+	for (u32 j = 0; j < 3; ++j) result.centre[j] /= weight;
+
+	for (u32 i = 0; i < count; ++i)
+	{
+		const LodSphere& s = spheres[i];
+		f32 dx = s.centre[0] - result.centre[0];
+		f32 dy = s.centre[1] - result.centre[1];
+		f32 dz = s.centre[2] - result.centre[2];
+		result.radius = MAX(result.radius, sqrtf(dx * dx + dy * dy + dz * dz) + s.radius);
+	}
+
+	return result;
+}
+
+
+struct ClusterPair
+{
+	u32 key;
+	u32 cluster;
+};
+
+int compare_cluster_pairs(const void* a, const void* b)
+{
+	const ClusterPair* lhs = (const ClusterPair*)a;
+	const ClusterPair* rhs = (const ClusterPair*)b;
+	if (lhs->key != rhs->key) return lhs->key < rhs->key ? -1 : 1;
+	return lhs->cluster < rhs->cluster ? -1 : lhs->cluster > rhs->cluster ? 1 : 0;
+}
+
+// Groups the clusters in active[0..active_count) into groups of up to CLUSTER_GROUP_SIZE clusters that share
+// as many vertices as possible. Writes the clusters of group g to group_clusters[group_offsets[g] .. group_offsets[g + 1])
+// and returns the group count. group_offsets needs active_count + 1 entries.
+u32 group_clusters(u32* group_clusters, u32* group_offsets, const u32* active, u32 active_count, const ClusterLodDag* dag)
+{
+	// (vertex, cluster) pairs sorted by vertex give every vertex's cluster list
+	u32 pair_count = 0;
+	for (u32 i = 0; i < active_count; ++i) pair_count += dag->clusters[active[i]].index_count;
+
+	ClusterPair* pairs = new ClusterPair[pair_count];
+	pair_count = 0;
+	for (u32 i = 0; i < active_count; ++i)
+	{
+		const LodCluster& cluster = dag->clusters[active[i]];
+		for (u32 j = 0; j < cluster.index_count; ++j)
+			pairs[pair_count++] = { dag->indices[cluster.index_offset + j], i };
+	}
+	qsort(pairs, pair_count, sizeof(ClusterPair), compare_cluster_pairs);
+
+	// every pair of clusters meeting at a vertex is an edge of the cluster adjacency graph, weighted by the number of shared vertices
+	u32 edge_count = 0;
+	ClusterPair* edges = 0;
+	for (u32 pass = 0; pass < 2; ++pass)
+	{
+		u32 written = 0;
+		for (u32 begin = 0; begin < pair_count; )
+		{
+			u32 end = begin + 1;
+			while (end < pair_count && pairs[end].key == pairs[begin].key) ++end;
+
+			for (u32 a = begin; a < end; ++a)
+			{
+				if (a > begin && pairs[a].cluster == pairs[a - 1].cluster) continue;//same vertex used twice by one cluster
+
+				for (u32 b = begin; b < end; ++b)
+				{
+					if (pairs[b].cluster == pairs[a].cluster || (b > begin && pairs[b].cluster == pairs[b - 1].cluster)) continue;
+					if (edges) edges[written] = { pairs[a].cluster, pairs[b].cluster };
+					++written;
+				}
+			}
+			begin = end;
+		}
+
+		if (!edges)
+		{
+			edge_count = written;
+			edges = new ClusterPair[MAX(edge_count, 1u)];
+		}
+	}
+	delete[] pairs;
+
+	qsort(edges, edge_count, sizeof(ClusterPair), compare_cluster_pairs);
+
+	// compress into per cluster neighbour lists with weights
+	u32* neighbour_offsets = new u32[active_count + 1];
+	u32* neighbours = new u32[MAX(edge_count, 1u)];
+	u32* weights = new u32[MAX(edge_count, 1u)];
+	u32 neighbour_count = 0;
+
+	memset(neighbour_offsets, 0, sizeof(u32) * (active_count + 1));
+	for (u32 i = 0; i < edge_count; ++i)
+	{
+		if (i > 0 && edges[i].key == edges[i - 1].key && edges[i].cluster == edges[i - 1].cluster)
+		{
+			++weights[neighbour_count - 1];
+			continue;
+		}
+
+		neighbours[neighbour_count] = edges[i].cluster;
+		weights[neighbour_count] = 1;
+		++neighbour_count;
+		++neighbour_offsets[edges[i].key + 1];
+	}
+	for (u32 i = 0; i < active_count; ++i) neighbour_offsets[i + 1] += neighbour_offsets[i];
+	delete[] edges;
+
+	// seed groups in spatial order so groups come out compact and neighbouring groups are close in memory
+	f32* centres = new f32[active_count * 3];
+	for (u32 i = 0; i < active_count; ++i)
+		memcpy(&centres[i * 3], dag->clusters[active[i]].bounds.centre, sizeof(f32) * 3);
+
+	u32* order = new u32[active_count];
+	meshopt_spatialSortRemap(order, centres, active_count, sizeof(f32) * 3);
+	u32* seeds = new u32[active_count];
+	for (u32 i = 0; i < active_count; ++i) seeds[order[i]] = i;
+	delete[] order;
+	delete[] centres;
+
+	bool* grouped = new bool[active_count];
+	memset(grouped, 0, sizeof(bool) * active_count);
+
+	u32 group_count = 0;
+	u32 written = 0;
+
+	for (u32 s = 0; s < active_count; ++s)
+	{
+		u32 seed = seeds[s];
+		if (grouped[seed]) continue;
+
+		group_offsets[group_count++] = written;
+
+		group_clusters[written++] = active[seed];
+		grouped[seed] = true;
+
+		u32 members[CLUSTER_GROUP_SIZE] = { seed };
+		u32 member_count = 1;
+
+		// greedily add the ungrouped neighbour sharing the most vertices with the group so far
+		while (member_count < CLUSTER_GROUP_SIZE)
+		{
+			u32 best = ~0u;
+			u32 best_weight = 0;
+
+			for (u32 m = 0; m < member_count; ++m)
+			{
+				for (u32 n = neighbour_offsets[members[m]]; n < neighbour_offsets[members[m] + 1]; ++n)
+				{
+					u32 candidate = neighbours[n];
+					if (grouped[candidate]) continue;
+
+					u32 weight = 0;
+					for (u32 k = 0; k < member_count; ++k)
+					{
+						for (u32 e = neighbour_offsets[members[k]]; e < neighbour_offsets[members[k] + 1]; ++e)
+							if (neighbours[e] == candidate) weight += weights[e];
+					}
+
+					if (weight > best_weight || (weight == best_weight && candidate < best))
+					{
+						best = candidate;
+						best_weight = weight;
+					}
+				}
+			}
+
+			if (best == ~0u) break;
+
+			grouped[best] = true;
+			members[member_count++] = best;
+			group_clusters[written++] = active[best];
+		}
+	}
+	group_offsets[group_count] = written;
+
+	delete[] grouped;
+	delete[] seeds;
+	delete[] neighbour_offsets;
+	delete[] neighbours;
+	delete[] weights;
+
+	return group_count;
+}
+
+
+void build_cluster_lod_dag(ClusterLodDag* dag, const u32* indices, u32 index_count, const f32* vertex_positions, u32 vertex_count, size_t vertex_positions_stride, u32 thread_count = 0)
+{
+	f64 start = time_in_seconds();
+	*dag = {};
+
+	if (thread_count == 0) thread_count = get_job_thread_count();
+
+	u32** vertex_scratch = new u32*[thread_count];
+	for (u32 i = 0; i < thread_count; ++i)
+	{
+		vertex_scratch[i] = new u32[vertex_count];
+		memset(vertex_scratch[i], 0xff, sizeof(u32) * vertex_count);
+	}
+
+	ClusterOutput all = {};
+
+	// level 0: the source mesh split into meshlets
+	{
+		MeshPartition source = {};
+		extract_mesh_partition(&source, vertex_scratch[0], indices, index_count, vertex_positions, vertex_positions_stride);
+		append_clusters(&all, &source, source.indices, source.index_count, 0);
+		free_mesh_partition(&source);
+
+		for (u32 i = 0; i < all.cluster_count; ++i)
+		{
+			LodCluster& cluster = all.clusters[i];
+			meshopt_Bounds bounds = meshopt_computeClusterBounds(&all.indices[cluster.index_offset], cluster.index_count, vertex_positions, vertex_count, vertex_positions_stride);
+			memcpy(cluster.bounds.centre, bounds.center, sizeof(f32) * 3);
+			cluster.bounds.radius = bounds.radius;
+			cluster.error = 0.0f;
+		}
+	}
+
+	u32 level_begin = 0;
+	u32 level = 0;
+
+	while (all.cluster_count - level_begin > 1)
+	{
+		u32 active_count = all.cluster_count - level_begin;
+		u32* active = new u32[active_count];
+		for (u32 i = 0; i < active_count; ++i) active[i] = level_begin + i;
+
+		u32* grouped = new u32[active_count];
+		u32* group_offsets = new u32[active_count + 1];
+
+		dag->clusters = all.clusters;
+		dag->cluster_count = all.cluster_count;
+		dag->indices = all.indices;
+		u32 group_count = group_clusters(grouped, group_offsets, active, active_count, dag);
+		*dag = {};
+
+		ClusterOutput* group_outputs = new ClusterOutput[group_count];
+		memset(group_outputs, 0, sizeof(ClusterOutput) * group_count);
+
+		parallel_for(group_count, thread_count, [&](u32 g, u32 thread_index)
+		{
+			u32 first = group_offsets[g];
+			u32 count = group_offsets[g + 1] - first;
+
+			u32 group_index_count = 0;
+			for (u32 i = 0; i < count; ++i) group_index_count += all.clusters[grouped[first + i]].index_count;
+
+			u32* group_indices = new u32[group_index_count];
+			group_index_count = 0;
+			f32 children_error = 0.0f;
+
+			for (u32 i = 0; i < count; ++i)
+			{
+				const LodCluster& child = all.clusters[grouped[first + i]];
+				memcpy(group_indices + group_index_count, &all.indices[child.index_offset], sizeof(u32) * child.index_count);
+				group_index_count += child.index_count;
+				children_error = MAX(children_error, child.error);
+			}
+
+			MeshPartition group = {};
+			extract_mesh_partition(&group, vertex_scratch[thread_index], group_indices, group_index_count, vertex_positions, vertex_positions_stride);
+			delete[] group_indices;
+
+			u32 target = group.index_count / 2 / 3 * 3;
+			f32 simplify_error = 0.0f;
+			u32 simplified_count = (u32)meshopt_simplify(group.indices, group.indices, group.index_count, group.positions, group.vertex_count, sizeof(f32) * 3,
+			                                             target, 1.0f, meshopt_SimplifyLockBorder, &simplify_error);
+
+			ClusterOutput* output = &group_outputs[g];
+
+			if (simplified_count > (u32)(group.index_count * (1.0f - CLUSTER_MIN_REDUCTION)))
+			{
+				free_mesh_partition(&group);
+				return;//leave output empty, the children stay roots
+			}
+
+			append_clusters(output, &group, group.indices, simplified_count, level + 1);
+
+			// errors accumulate so they stay monotonic up the DAG, the group sphere contains every child sphere
+			assert(count <= CLUSTER_GROUP_SIZE);
+			LodSphere child_bounds[CLUSTER_GROUP_SIZE] = {};
+			for (u32 i = 0; i < count; ++i) child_bounds[i] = all.clusters[grouped[first + i]].bounds;
+			LodSphere group_bounds = merge_spheres(child_bounds, count);
+
+			f32 group_error = children_error + simplify_error * meshopt_simplifyScale(group.positions, group.vertex_count, sizeof(f32) * 3);
+
+			for (u32 i = 0; i < output->cluster_count; ++i)
+			{
+				output->clusters[i].bounds = group_bounds;
+				output->clusters[i].error = group_error;
+			}
+
+			// every child of the group gets the same parent values, which is what keeps the cut consistent within a group
+			for (u32 i = 0; i < count; ++i)
+			{
+				LodCluster& child = all.clusters[grouped[first + i]];
+				child.parent_bounds = group_bounds;
+				child.parent_error = group_error;
+			}
+
+			free_mesh_partition(&group);
+		});
+
+		// children of groups that didn't simplify become roots
+		for (u32 g = 0; g < group_count; ++g)
+		{
+			if (group_outputs[g].cluster_count) continue;
+
+			for (u32 i = group_offsets[g]; i < group_offsets[g + 1]; ++i)
+			{
+				LodCluster& child = all.clusters[grouped[i]];
+				child.parent_bounds = child.bounds;
+				child.parent_error = FLT_MAX;
+			}
+		}
+
+		u32 next_level_begin = all.cluster_count;
+
+		for (u32 g = 0; g < group_count; ++g)
+		{
+			ClusterOutput* output = &group_outputs[g];
+			reserve_cluster_output(&all, output->cluster_count, output->index_count);
+
+			for (u32 i = 0; i < output->cluster_count; ++i)
+			{
+				LodCluster cluster = output->clusters[i];
+				cluster.index_offset += all.index_count;
+				all.clusters[all.cluster_count++] = cluster;
+			}
+			if (output->index_count) memcpy(all.indices + all.index_count, output->indices, sizeof(u32) * output->index_count);//Groups that produced nothing have no buffer
+			all.index_count += output->index_count;
+
+			free_cluster_output(output);
+		}
+
+		delete[] group_outputs;
+		delete[] group_offsets;
+		delete[] grouped;
+		delete[] active;
+
+		level_begin = next_level_begin;
+		++level;
+
+		if (all.cluster_count == next_level_begin) break;//nothing simplified this level
+	}
+
+	// whatever is left at the top has nothing above it
+	for (u32 i = level_begin; i < all.cluster_count; ++i)
+	{
+		all.clusters[i].parent_bounds = all.clusters[i].bounds;
+		all.clusters[i].parent_error = FLT_MAX;
+	}
+
+	for (u32 i = 0; i < thread_count; ++i) delete[] vertex_scratch[i];
+	delete[] vertex_scratch;
+
+	dag->clusters = all.clusters;
+	dag->cluster_count = all.cluster_count;
+	dag->indices = all.indices;
+	dag->index_count = all.index_count;
+	dag->level_count = level + 1;
+	dag->build_seconds = time_in_seconds() - start;
+}
+
+
+// ---------------------------------------------------------------------------------------------------------------------
+// Cut selection
+// ---------------------------------------------------------------------------------------------------------------------
+
+struct LodCamera
+{
+	f32 position[3];//In mesh space
+	f32 projection_scale;//projection.d[1][1] * viewport_height / 2, converts error / distance to pixels
+	f32 near_plane;
+	f32 pixel_error;//Largest error allowed on screen
+};
+
+// Spheres containing the camera are treated as being at the near plane, so the test stays monotonic.
+inline bool lod_error_is_acceptable(const LodCamera* camera, const LodSphere& bounds, f32 error)
+{
+	if (error == FLT_MAX) return false;
+
+	f32 dx = bounds.centre[0] - camera->position[0];
+	f32 dy = bounds.centre[1] - camera->position[1];
+	f32 dz = bounds.centre[2] - camera->position[2];
+	f32 distance = MAX(sqrtf(dx * dx + dy * dy + dz * dz) - bounds.radius, camera->near_plane);
+
+	return error / distance * camera->projection_scale <= camera->pixel_error;
+}
+
+// Writes the clusters on the cut for this camera to selected and returns how many there are.
+// Every cluster is tested independently, so the loop can be split over threads or moved to a compute shader as is.
+u32 select_lod_cut(u32* selected, u32* selected_triangle_count, const ClusterLodDag* dag, const LodCamera* camera)
+{
+	u32 count = 0;
+	u32 triangles = 0;
+
+	for (u32 i = 0; i < dag->cluster_count; ++i)
+	{
+		const LodCluster& cluster = dag->clusters[i];
+
+		if (lod_error_is_acceptable(camera, cluster.bounds, cluster.error) && !lod_error_is_acceptable(camera, cluster.parent_bounds, cluster.parent_error))
+		{
+			selected[count++] = i;
+			triangles += cluster.index_count / 3;
+		}
+	}
+
+	if (selected_triangle_count) *selected_triangle_count = triangles;
+	return count;
+}
+
+
+// Prints the DAG's shape and how the cut behaves as the camera backs away from the mesh.
+void benchmark_cluster_lod(char* name, const ClusterLodDag* dag, f32 projection_scale, f32 pixel_error)
+{
+	u32 leaf_triangles = 0;
+	u32 root_count = 0;
+	f32 mesh_radius = 0.0f;
+
+	for (u32 i = 0; i < dag->cluster_count; ++i)
+	{
+		const LodCluster& cluster = dag->clusters[i];
+		if (cluster.level == 0) leaf_triangles += cluster.index_count / 3;
+		if (cluster.parent_error == FLT_MAX) ++root_count;
+		mesh_radius = MAX(mesh_radius, cluster.parent_bounds.radius);
+	}
+
+	printf("Cluster LOD %s: %u clusters over %u levels, %u roots, %u source triangles, built in %.1fms\n",
+	       name, dag->cluster_count, dag->level_count, root_count, leaf_triangles, dag->build_seconds * 1000.0);
+
+	u32* selected = new u32[dag->cluster_count];
+
+	for (f32 distance = 0.5f; distance <= 64.0f; distance *= 2.0f)
+	{
+		LodCamera camera = {};
+		camera.position[2] = mesh_radius * distance;
+		camera.projection_scale = projection_scale;
+		camera.near_plane = 0.01f;
+		camera.pixel_error = pixel_error;
+
+		constexpr u32 repeat_count = 16;
+		u32 triangles = 0;
+		u32 count = 0;
+
+		f64 start = time_in_seconds();
+		for (u32 r = 0; r < repeat_count; ++r)
+			count = select_lod_cut(selected, &triangles, dag, &camera);
+		f64 seconds = (time_in_seconds() - start) / repeat_count;
+
+		printf("  camera at %5.1fx radius: %5u clusters, %8u triangles, cut in %.3fms\n", distance, count, triangles, seconds * 1000.0);
+	}
+
+	delete[] selected;
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+// CPU reference for the survivor compaction in cull_compute.hlsl. The shader used to Append survivors, so their order
+// depended on which groups finished first and changed from frame to frame. Now the cull pass (main) stores a result
+// per instance and a survivor count per group, and the compaction pass (compact) gives every survivor the slot
+// (survivors in earlier groups) + (survivors before it in its group), so survivors come out in input order and the
+// argument buffer's counter ends up at the exact number of draws.
+//
+// Results are 0 for culled instances and LOD + 1 otherwise, like instance_results in the shader. Both passes are
+// mirrored one group at a time, with the same Hillis-Steele scan the shader runs in groupshared memory.
+//
+// Needs cull_layout.h for CULL_GROUP_SIZE and instance_lod.h in the same translation unit.
+
+
+// main: the survivors of every group. Returns the group count.
+u32 count_cull_group_survivors(const u32* results, u32 count, u32* group_counts)
+{
+	u32 group_count = (count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE;
+
+	for (u32 group = 0; group < group_count; ++group)
+	{
+		u32 survivors = 0;
+		for (u32 thread = 0; thread < CULL_GROUP_SIZE; ++thread)
+		{
+			u32 input_index = group * CULL_GROUP_SIZE + thread;
+			if (input_index < count && results[input_index] != 0) survivors++;
+		}
+		group_counts[group] = survivors;
+	}
+
+	return group_count;
+}
+
+// compact: writes the input index of every survivor to its slot in output, which needs room for count indices.
+// Returns the number written, which is what the counter holds after the shader runs.
+u32 compact_cull_survivors(const u32* results, u32 count, const u32* group_counts, u32* output)
+{
+	u32 group_count = (count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE;
+	u32 written = 0;
+
+	for (u32 group = 0; group < group_count; ++group)
+	{
+		u32 group_offset = 0;
+		for (u32 previous = 0; previous < group; ++previous) group_offset += group_counts[previous];
+
+		//Both halves of the shader's groupshared array; every step reads one and writes the other.
+		u32 scan[CULL_GROUP_SIZE * 2];
+		for (u32 thread = 0; thread < CULL_GROUP_SIZE; ++thread)
+		{
+			u32 input_index = group * CULL_GROUP_SIZE + thread;
+			scan[thread] = input_index < count && results[input_index] != 0;
+		}
+
+		u32 read = 0;
+		for (u32 step = 1; step < CULL_GROUP_SIZE; step <<= 1)
+		{
+			u32 write = CULL_GROUP_SIZE - read;
+			for (u32 thread = 0; thread < CULL_GROUP_SIZE; ++thread)
+			{
+				u32 value = scan[read + thread];
+				if (thread >= step) value += scan[read + thread - step];
+				scan[write + thread] = value;
+			}
+			read = write;
+		}
+
+		for (u32 thread = 0; thread < CULL_GROUP_SIZE; ++thread)
+		{
+			u32 input_index = group * CULL_GROUP_SIZE + thread;
+			if (input_index >= count || results[input_index] == 0) continue;
+
+			output[group_offset + scan[read + thread] - 1] = input_index;
+			written++;
+		}
+	}
+
+	return written;
+}
+
+// Runs both passes over results and checks them against a plain loop: the count has to be exact and the output has
+// to hold every survivor once, in increasing input order. Returns false and prints the first mismatch otherwise.
+bool verify_cull_compaction(const u32* results, u32 count, u32* group_counts, u32* output)
+{
+	count_cull_group_survivors(results, count, group_counts);
+	u32 written = compact_cull_survivors(results, count, group_counts, output);
+
+	u32 expected = 0;
+	for (u32 i = 0; i < count; ++i)
+	{
+		if (results[i] == 0) continue;
+
+		if (expected >= written || output[expected] != i)
+		{
+			printf("Cull compaction of %u instances: slot %u should be instance %u\n", count, expected, i);
+			return false;
+		}
+		expected++;
+	}
+
+	if (written != expected)
+	{
+		printf("Cull compaction of %u instances: wrote %u survivors, expected %u\n", count, written, expected);
+		return false;
+	}
+
+	return true;
+}
+
+// Checks the compaction for counts that do and do not fill the last group, with nothing, everything, every other
+// instance, single survivors at group edges and random survivors visible, then times the CPU reference.
+void benchmark_cull_compaction(u32 max_count)
+{
+	u32* results = new u32[max_count];
+	u32* group_counts = new u32[(max_count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE];
+	u32* output = new u32[max_count];
+
+	u32 counts[] = { 0, 1, CULL_GROUP_SIZE - 1, CULL_GROUP_SIZE, CULL_GROUP_SIZE + 1, 1250, max_count };
+	u32 random = 101;
+	u32 checked = 0;
+	bool all_passed = true;
+
+	for (u32 c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c)
+	{
+		u32 count = MIN(counts[c], max_count);
+
+		for (u32 pattern = 0; pattern < 5; ++pattern)
+		{
+			for (u32 i = 0; i < count; ++i)
+			{
+				u32 lane = i % CULL_GROUP_SIZE;
+				switch (pattern)
+				{
+					case 0: results[i] = 0; break;
+					case 1: results[i] = 1 + i % MAX_MESH_LODS; break;
+					case 2: results[i] = i & 1; break;
+					case 3: results[i] = lane == 0 || lane == CULL_GROUP_SIZE - 1; break;
+					default: results[i] = rand_f32_normal(&random) < 0.3f ? 1 + i % MAX_MESH_LODS : 0; break;
+				}
+			}
+
+			all_passed = verify_cull_compaction(results, count, group_counts, output) && all_passed;
+			checked++;
+		}
+	}
+
+	const u32 iterations = 1000;
+	u32 written = 0;
+	f64 start = time_in_seconds();
+	for (u32 it = 0; it < iterations; ++it)
+	{
+		count_cull_group_survivors(results, max_count, group_counts);
+		written = compact_cull_survivors(results, max_count, group_counts, output);
+	}
+	f64 seconds = (time_in_seconds() - start) / iterations;
+
+	printf("Cull compaction: %u cases %s, %u instances -> %u survivors in %.3fms\n",
+	       checked, all_passed ? "in order with exact counts" : "FAILED", max_count, written, seconds * 1000.0);
+
+	delete[] results;
+	delete[] group_counts;
+	delete[] output;
+}
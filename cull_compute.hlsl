@@ -14,8 +14,7 @@ struct DrawInfo {
 };
 
 
-//@Speed: Most likely, seperating the vertex buffer and index buffer stuff from
-//         the cull info stuff will lead to a speed up by reducing memory pressure?
+//Only read for instances that pass every test, the tests themselves read CullInstance.
 struct DrawCallInfo {
 	DrawInfo draw_info;
 	D3D12_INDEX_BUFFER_VIEW index_buffer_view;
@@ -43,9 +42,22 @@ struct DrawArguments {
 	int packing_b;
 };
 
+//One draw per instance bucket, same size as DrawArguments. The vertex shader reads instance_count ids starting at
+//first_instance and loads each instance's DrawInfo itself.
+struct InstancedDrawArguments {
+	D3D12_INDEX_BUFFER_VIEW index_buffer_view;
+	uint first_instance;
+	uint instanced;
+	D3D12_DRAW_INDEXED_ARGUMENTS indexed;
+	uint packing[9];
+};
+
+#include "cull_layout.h"
+
 #define BUFFER_SPACE space0
 StructuredBuffer<DrawCallInfo> input_draw_calls : register(t0, BUFFER_SPACE);
-AppendStructuredBuffer<DrawArguments> output_argument_buffer : register(u0, BUFFER_SPACE);
+StructuredBuffer<CullInstance> cull_instances : register(t3, BUFFER_SPACE);
+RWStructuredBuffer<DrawArguments> output_argument_buffer : register(u0, BUFFER_SPACE);//The counter is the draw count
 
 struct Globals
 {
@@ -59,22 +71,160 @@ cbuffer GlobalBindings : register(b2, space0)
 };
 
 
+//Two phase occlusion culling. The early phase draws what was visible last frame, the late phase tests everything
+//against the Hi-Z pyramid built from the early phase's depth, draws what was missed and updates the visibility bits.
+//CULL_PHASE_ALL is the plain frustum cull. hiz.h has the CPU reference for the late phase test.
+#define CULL_PHASE_ALL 0
+#define CULL_PHASE_EARLY 1
+#define CULL_PHASE_LATE 2
 
+RWStructuredBuffer<uint> instance_visibility : register(u1, BUFFER_SPACE);//One bit per instance, kept between frames
+RWStructuredBuffer<DrawArguments> late_argument_buffer : register(u2, BUFFER_SPACE);
+Texture2D<float> hiz : register(t1, BUFFER_SPACE);//Level 0 is half the depth buffer size
 
-[numthreads(64, 1, 1)]
-void main (uint3 dispatch_thread_id : SV_DispatchThreadID)
+struct CullParameters
 {
-	uint input_index = dispatch_thread_id.x;
+	uint phase;
+	uint hiz_level_count;
+	uint screen_width;
+	uint screen_height;
+	float min_screen_radius;//Pixels, smaller instances are dropped
+	float lod_pixel_error;//Negative always draws LOD 0
+	uint instance_count;//The buffers are sized for MAX_NUM_DRAW_CALLS, only this many are live
+	uint bucket_count;//0 draws every instance on its own, otherwise mesh count * MAX_MESH_LODS
+};
+cbuffer CullBindings : register(b3, space0)
+{
+	CullParameters cull;
+};
 
-	uint num_draw_calls;
-	uint draw_call_stride;
 
-	input_draw_calls.GetDimensions(num_draw_calls, draw_call_stride);
+//Discrete LODs in the mesh's index buffer, one entry per mesh. instance_lod.h has the CPU reference.
+#define MAX_MESH_LODS 4
+#define INSTANCE_TOO_SMALL 0xffffffff
 
-    if (input_index >= num_draw_calls)
-        return;
+struct MeshLods
+{
+	uint first_index[MAX_MESH_LODS];
+	uint index_count[MAX_MESH_LODS];
+	float error[MAX_MESH_LODS];
+	uint lod_count;
+	uint3 packing;
+};
+StructuredBuffer<MeshLods> mesh_lods : register(t2, BUFFER_SPACE);
 
-	DrawCallInfo draw_call_info = input_draw_calls[input_index];
+//Same as select_instance_lod.
+uint select_instance_lod(MeshLods lods, float view_depth, float radius, float near_plane, float projection_scale)
+{
+	float distance = max(view_depth - radius, near_plane);
+	float pixels_per_unit = projection_scale / distance;
+
+	if (radius * pixels_per_unit < cull.min_screen_radius)
+		return INSTANCE_TOO_SMALL;
+
+	for (uint lod = lods.lod_count - 1; lod > 0; --lod) {
+		if (lods.error[lod] * pixels_per_unit <= cull.lod_pixel_error)
+			return lod;
+	}
+
+	return 0;
+}
+
+
+uint ceil_log2(uint value)
+{
+	return value <= 1 ? 0 : firstbithigh(value - 1) + 1;
+}
+
+//Same operations in the same order as project_sphere_rect and sphere_occluded_hiz on the CPU.
+bool sphere_occluded_hiz(float3 centre, float radius)
+{
+	float4 v = mul(globals.view, float4(centre, 1.0));
+	float3 c = float3(v.x, v.y, -v.z);
+
+	float nearest = c.z - radius;
+	if (nearest <= 0)
+		return false;
+
+	float4x4 p = globals.projection;
+	float sphere_depth = (p[2][3] - p[2][2] * nearest) / (p[3][3] - p[3][2] * nearest);
+	if (sphere_depth >= 1.0)
+		return false;
+
+	float czr2 = c.z * c.z - radius * radius;
+	float vx = sqrt(c.x * c.x + czr2);
+	float vy = sqrt(c.y * c.y + czr2);
+
+	float min_x = (vx * c.x - radius * c.z) / (vx * c.z + radius * c.x) * p[0][0];
+	float max_x = (vx * c.x + radius * c.z) / (vx * c.z - radius * c.x) * p[0][0];
+	float min_y = (vy * c.y - radius * c.z) / (vy * c.z + radius * c.y) * p[1][1];
+	float max_y = (vy * c.y + radius * c.z) / (vy * c.z - radius * c.y) * p[1][1];
+
+	float width = (float)cull.screen_width;
+	float height = (float)cull.screen_height;
+
+	float x0 = (min_x + 1.0) * 0.5 * width;
+	float x1 = (max_x + 1.0) * 0.5 * width;
+	float y0 = (1.0 - max_y) * 0.5 * height;
+	float y1 = (1.0 - min_y) * 0.5 * height;
+
+	if (x1 <= 0 || y1 <= 0 || x0 >= width || y0 >= height)
+		return false;
+
+	int px0 = max((int)floor(x0), 0);
+	int px1 = min((int)ceil(x1), (int)cull.screen_width);
+	int py0 = max((int)floor(y0), 0);
+	int py1 = min((int)ceil(y1), (int)cull.screen_height);
+
+	if (px0 >= px1 || py0 >= py1)
+		return false;
+
+	//Level i halves the depth buffer i + 1 times; a rectangle up to 2^(i + 1) pixels wide touches at most two texels.
+	uint extent = (uint)max(px1 - px0, py1 - py0);
+	uint level = min(max(ceil_log2(extent), 1) - 1, cull.hiz_level_count - 1);
+	uint shift = level + 1;
+
+	uint tx0 = (uint)px0 >> shift;
+	uint ty0 = (uint)py0 >> shift;
+	uint tx1 = (uint)(px1 - 1) >> shift;
+	uint ty1 = (uint)(py1 - 1) >> shift;
+
+	float a = min(hiz.Load(int3(tx0, ty0, level)), hiz.Load(int3(tx1, ty0, level)));
+	float b = min(hiz.Load(int3(tx0, ty1, level)), hiz.Load(int3(tx1, ty1, level)));
+
+	return min(a, b) > sphere_depth;
+}
+
+
+
+
+//Survivors are written in input order instead of appended, so the draw order is the same every frame. main culls
+//and counts the survivors of each group, compact scans the group counts and the survivors within each group to find
+//every survivor's slot. compaction.h has the CPU reference.
+RWStructuredBuffer<uint> instance_results : register(u3, BUFFER_SPACE);//0 when culled, otherwise LOD + 1
+RWStructuredBuffer<uint> group_counts : register(u4, BUFFER_SPACE);//Survivors per group
+
+groupshared uint group_survivors;
+groupshared uint group_offset;
+groupshared uint scan[CULL_GROUP_SIZE * 2];//Two halves, read from one and written to the other every step
+
+//Instancing: main also counts the survivors of every bucket per group, bucket_offsets turns those counts into each
+//group's offset within the bucket and lays the buckets out one after the other, bucket_scatter writes the ids.
+//Instances keep their input order within a bucket. instance_buckets.h has the CPU reference.
+RWStructuredBuffer<uint> group_bucket_counts : register(u5, BUFFER_SPACE);//[group * MAX_INSTANCE_BUCKETS + bucket]
+RWStructuredBuffer<BucketRange> bucket_ranges : register(u6, BUFFER_SPACE);
+RWStructuredBuffer<uint> instance_ids : register(u7, BUFFER_SPACE);//Read by vertex_shader.hlsl
+RWStructuredBuffer<InstancedDrawArguments> instanced_argument_buffer : register(u8, BUFFER_SPACE);//Same resource and counter as u0
+RWStructuredBuffer<InstancedDrawArguments> late_instanced_argument_buffer : register(u9, BUFFER_SPACE);//Same resource and counter as u2
+
+groupshared uint bucket_histogram[MAX_INSTANCE_BUCKETS];
+groupshared uint lane_buckets[CULL_GROUP_SIZE];
+
+
+//Returns 0 when culled, otherwise the LOD to draw + 1.
+uint cull_instance(uint input_index)
+{
+	CullInstance instance = cull_instances[input_index];
 
 	float4x4 mat = globals.projection;
 
@@ -91,9 +241,7 @@ void main (uint3 dispatch_thread_id : SV_DispatchThreadID)
 	frustum_planes[4] = row_4;
 	frustum_planes[5] = row_4+row_3;
 
-	float4 p = float4(draw_call_info.draw_info.position.x, draw_call_info.draw_info.position.y, draw_call_info.draw_info.position.z, 1.0);
-
-	// p += draw_call_info.bounding_centre; TODO(ANDREW) USE THIS
+	float4 p = float4(instance.centre.x, instance.centre.y, instance.centre.z, 1.0);//Already offset by bounding_centre
 
 	p = mul(globals.view,p);
 
@@ -101,34 +249,242 @@ void main (uint3 dispatch_thread_id : SV_DispatchThreadID)
 
 	bool inside = true;
 	for(int i = 0; i < 5; ++i) {
-		if (dot(p, frustum_planes[i]) < -draw_call_info.bounding_radius) {
+		if (dot(p, frustum_planes[i]) < -instance.radius) {
 			inside = false;
 			break;
 		}
 	}
 	is_visible = is_visible && inside;
 
-	if(!is_visible) {
+	//The radius is pre-scaled for the plane tests above, the size and Hi-Z tests need it in world units.
+	float bounds_scale = max(max(length(row_1), length(row_2)), length(row_3));
+	float world_radius = instance.radius / bounds_scale;
+
+	uint lod = 0;
+	if (is_visible) {
+		MeshLods lods = mesh_lods[cull_instance_mesh_index(instance)];
+		float projection_scale = max(mat[0][0] * cull.screen_width, mat[1][1] * cull.screen_height) * 0.5;
+		lod = select_instance_lod(lods, -p.z, world_radius, mat[2][3], projection_scale);
+		is_visible = lod != INSTANCE_TOO_SMALL;
+	}
+
+	//Keyed by the instance, not the upload slot, which changes whenever sort_draws_front_to_back reorders the uploads.
+	uint visibility_index = cull_instance_visibility_index(instance);
+	uint visibility_word = visibility_index >> 5;
+	uint visibility_bit = 1u << (visibility_index & 31);
+	bool was_visible = (instance_visibility[visibility_word] & visibility_bit) != 0;
+
+	if (cull.phase == CULL_PHASE_EARLY) {
+		is_visible = is_visible && was_visible;
+	}
+	else if (cull.phase == CULL_PHASE_LATE) {
+		is_visible = is_visible && !sphere_occluded_hiz(instance.centre, world_radius);
+
+		if (is_visible)
+			InterlockedOr(instance_visibility[visibility_word], visibility_bit);
+		else
+			InterlockedAnd(instance_visibility[visibility_word], ~visibility_bit);
+
+		//Drawn in the early phase already.
+		is_visible = is_visible && !was_visible;
+	}
+
+	return is_visible ? lod + 1 : 0;
+}
+
+
+[numthreads(CULL_GROUP_SIZE, 1, 1)]
+void main (uint3 dispatch_thread_id : SV_DispatchThreadID, uint3 group_id : SV_GroupID, uint group_index : SV_GroupIndex)
+{
+	uint input_index = dispatch_thread_id.x;
+
+	if (group_index == 0)
+		group_survivors = 0;
+	for (uint bucket = group_index; bucket < MAX_INSTANCE_BUCKETS; bucket += CULL_GROUP_SIZE)
+		bucket_histogram[bucket] = 0;
+	GroupMemoryBarrierWithGroupSync();
+
+	//No early out, every thread has to reach the barriers.
+	if (input_index < cull.instance_count) {
+		uint result = cull_instance(input_index);
+		instance_results[input_index] = result;
+
+		if (result != 0) {
+			InterlockedAdd(group_survivors, 1);
+
+			if (cull.bucket_count != 0)
+				InterlockedAdd(bucket_histogram[cull_instance_mesh_index(cull_instances[input_index]) * MAX_MESH_LODS + result - 1], 1);
+		}
+	}
+	GroupMemoryBarrierWithGroupSync();
+
+	if (group_index == 0)
+		group_counts[group_id.x] = group_survivors;
+
+	for (uint b = group_index; b < cull.bucket_count; b += CULL_GROUP_SIZE)
+		group_bucket_counts[group_id.x * MAX_INSTANCE_BUCKETS + b] = bucket_histogram[b];
+}
+
+
+[numthreads(CULL_GROUP_SIZE, 1, 1)]
+void compact (uint3 dispatch_thread_id : SV_DispatchThreadID, uint3 group_id : SV_GroupID, uint group_index : SV_GroupIndex)
+{
+	uint input_index = dispatch_thread_id.x;
+
+	//Every group before this one. MAX_NUM_DRAW_CALLS / CULL_GROUP_SIZE is small enough for one thread to add up.
+	if (group_index == 0) {
+		uint offset = 0;
+		for (uint group = 0; group < group_id.x; ++group)
+			offset += group_counts[group];
+		group_offset = offset;
+	}
+
+	uint result = input_index < cull.instance_count ? instance_results[input_index] : 0;
+	uint survived = result != 0 ? 1 : 0;
+
+	//Inclusive Hillis-Steele scan of the survivor flags.
+	uint read = 0;
+	scan[group_index] = survived;
+	GroupMemoryBarrierWithGroupSync();
+
+	for (uint step = 1; step < CULL_GROUP_SIZE; step <<= 1) {
+		uint write = CULL_GROUP_SIZE - read;
+		uint value = scan[read + group_index];
+		if (group_index >= step)
+			value += scan[read + group_index - step];
+		scan[write + group_index] = value;
+		GroupMemoryBarrierWithGroupSync();
+		read = write;
+	}
+
+	if (!survived) {
 		return;
 	}
 
+	uint output_index = group_offset + scan[read + group_index] - 1;
+	uint lod = result - 1;
 
-	DrawArguments result;
+	DrawCallInfo draw_call_info = input_draw_calls[input_index];
+	MeshLods lods = mesh_lods[draw_call_info.draw_info.vertex_buffer_index];
+
+	DrawArguments arguments;
 
 	{
-		result.packing_a = 0;
-		result.packing_b = 0;
+		arguments.packing_a = 0;
+		arguments.packing_b = 0;
+	}
+
+	arguments.index_buffer_view = draw_call_info.index_buffer_view;
+	arguments.draw_info = draw_call_info.draw_info;
+	arguments.indexed.IndexCountPerInstance = lods.index_count[lod];
+	arguments.indexed.InstanceCount = 1;
+	arguments.indexed.StartIndexLocation = lods.first_index[lod];
+	arguments.indexed.BaseVertexLocation = 0;
+	arguments.indexed.StartInstanceLocation = 0;
+
+	//The counter only counts, the slot comes from the scan. It ends up at the exact number of survivors, which is
+	//what ExecuteIndirect reads as the draw count.
+	if (cull.phase == CULL_PHASE_LATE) {
+		late_argument_buffer[output_index] = arguments;
+		late_argument_buffer.IncrementCounter();
+	}
+	else {
+		output_argument_buffer[output_index] = arguments;
+		output_argument_buffer.IncrementCounter();
+	}
+}
+
+
+//One group. Each thread walks its buckets down the groups, swapping every count for the survivors of the bucket in
+//the groups before it, then thread 0 lays the buckets out in bucket order and hands the non-empty ones a draw slot.
+[numthreads(CULL_GROUP_SIZE, 1, 1)]
+void bucket_offsets (uint group_index : SV_GroupIndex)
+{
+	uint group_count = (cull.instance_count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE;
+
+	for (uint bucket = group_index; bucket < MAX_INSTANCE_BUCKETS; bucket += CULL_GROUP_SIZE) {
+		uint total = 0;
+		if (bucket < cull.bucket_count) {
+			for (uint group = 0; group < group_count; ++group) {
+				uint count = group_bucket_counts[group * MAX_INSTANCE_BUCKETS + bucket];
+				group_bucket_counts[group * MAX_INSTANCE_BUCKETS + bucket] = total;
+				total += count;
+			}
+		}
+		bucket_histogram[bucket] = total;
+	}
+	GroupMemoryBarrierWithGroupSync();
+
+	if (group_index != 0) {
+		return;
+	}
+
+	uint first_instance = 0;
+	uint draw_index = 0;
+	for (uint b = 0; b < cull.bucket_count; ++b) {
+		BucketRange range;
+		range.first_instance = first_instance;
+		range.instance_count = bucket_histogram[b];
+		range.draw_index = draw_index;
+		range.packing = 0;
+		bucket_ranges[b] = range;
+
+		first_instance += range.instance_count;
+		draw_index += range.instance_count != 0 ? 1 : 0;
+	}
+}
+
+
+[numthreads(CULL_GROUP_SIZE, 1, 1)]
+void bucket_scatter (uint3 dispatch_thread_id : SV_DispatchThreadID, uint3 group_id : SV_GroupID, uint group_index : SV_GroupIndex)
+{
+	uint input_index = dispatch_thread_id.x;
+
+	uint result = input_index < cull.instance_count ? instance_results[input_index] : 0;
+	uint mesh_index = result != 0 ? cull_instance_mesh_index(cull_instances[input_index]) : 0;
+	uint bucket = result != 0 ? mesh_index * MAX_MESH_LODS + result - 1 : 0xffffffff;
+
+	lane_buckets[group_index] = bucket;
+	GroupMemoryBarrierWithGroupSync();
+
+	if (result == 0) {
+		return;
 	}
 
-	result.index_buffer_view = draw_call_info.index_buffer_view;
-	result.draw_info = draw_call_info.draw_info;
-	result.indexed.IndexCountPerInstance = draw_call_info.triangle_count * 3;
-	result.indexed.InstanceCount = 1;
-	result.indexed.StartIndexLocation = 0;
-	result.indexed.BaseVertexLocation = 0;
-	result.indexed.StartInstanceLocation = 0;
+	//Survivors of the same bucket earlier in this group.
+	uint rank = 0;
+	for (uint lane = 0; lane < group_index; ++lane)
+		rank += lane_buckets[lane] == bucket ? 1 : 0;
 
+	BucketRange range = bucket_ranges[bucket];
+	uint slot = range.first_instance + group_bucket_counts[group_id.x * MAX_INSTANCE_BUCKETS + bucket] + rank;
+	instance_ids[slot] = input_index;
 
+	//The bucket's first instance writes its draw.
+	if (slot != range.first_instance) {
+		return;
+	}
 
-	output_argument_buffer.Append(result);
-}
\ No newline at end of file
+	uint lod = result - 1;
+	DrawCallInfo draw_call_info = input_draw_calls[input_index];
+	MeshLods lods = mesh_lods[mesh_index];
+
+	InstancedDrawArguments arguments = (InstancedDrawArguments)0;
+	arguments.index_buffer_view = draw_call_info.index_buffer_view;
+	arguments.first_instance = range.first_instance;
+	arguments.instanced = 1;
+	arguments.indexed.IndexCountPerInstance = lods.index_count[lod];
+	arguments.indexed.InstanceCount = range.instance_count;
+	arguments.indexed.StartIndexLocation = lods.first_index[lod];
+	arguments.indexed.BaseVertexLocation = 0;
+	arguments.indexed.StartInstanceLocation = 0;//SV_InstanceID does not include it, first_instance does the job
+
+	if (cull.phase == CULL_PHASE_LATE) {
+		late_instanced_argument_buffer[range.draw_index] = arguments;
+		late_instanced_argument_buffer.IncrementCounter();
+	}
+	else {
+		instanced_argument_buffer[range.draw_index] = arguments;
+		instanced_argument_buffer.IncrementCounter();
+	}
+}
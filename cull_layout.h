@@ -0,0 +1,78 @@
+#pragma once
+
+// Instance data the culler reads for every instance, shared by cull_compute.hlsl and the C++ side so the two cannot
+// drift apart. Everything else about an instance (the index buffer view and DrawInfo payload) stays in DrawCallInfo,
+// which cull_compute only loads for the instances that survive.
+//
+// 20 bytes instead of DrawCallInfo's 80: a rejected instance costs one sphere and one word of bandwidth. The mesh and
+// visibility indices share that word, read them with cull_instance_mesh_index and cull_instance_visibility_index.
+
+#ifdef __HLSL_VERSION
+typedef float3 cull_float3;
+typedef uint cull_uint;
+#else
+typedef vec3 cull_float3;
+typedef u32 cull_uint;
+#endif
+
+struct CullInstance
+{
+	cull_float3 centre;
+	float radius;//Pre-scaled by bounds_scale like DrawCallInfo::bounding_radius
+	//High CULL_MESH_INDEX_SHIFT bits: index into the MeshLods table, same as DrawInfo::vertex_buffer_index.
+	//Low bits: instance store slot, which unlike the upload slot stays the same when the draw order changes. Keys the
+	//two phase visibility bits.
+	cull_uint mesh_visibility_index;
+};
+
+#define CULL_MESH_INDEX_SHIFT 16
+#define CULL_VISIBILITY_INDEX_MASK ((1u << CULL_MESH_INDEX_SHIFT) - 1)
+
+cull_uint cull_instance_mesh_index(CullInstance instance)
+{
+	return instance.mesh_visibility_index >> CULL_MESH_INDEX_SHIFT;
+}
+
+cull_uint cull_instance_visibility_index(CullInstance instance)
+{
+	return instance.mesh_visibility_index & CULL_VISIBILITY_INDEX_MASK;
+}
+
+//Threads per cull group. The compaction scans one group at a time, so this is also the scan width; compaction.h
+//mirrors it on the CPU.
+#define CULL_GROUP_SIZE 64
+
+//Visible instances are drawn with one instanced draw per mesh and LOD, bucket = mesh_index * MAX_MESH_LODS + lod.
+//instance_buckets.h has the CPU reference.
+#define MAX_INSTANCE_BUCKETS 64
+
+struct BucketRange
+{
+	cull_uint first_instance;//Into the instance id list
+	cull_uint instance_count;
+	cull_uint draw_index;//Slot of the bucket's draw, empty buckets take none
+	cull_uint packing;
+};
+
+#ifndef __HLSL_VERSION
+static_assert(sizeof(CullInstance) == 20, "CullInstance must match the shader's structured buffer stride");
+static_assert(sizeof(BucketRange) == 16, "BucketRange must match the shader's structured buffer stride");
+
+// bounding_centre is the sphere's offset from the instance position, zero for spheres around the instance origin.
+inline vec3 instance_sphere_centre(const DrawCallInfo* info)
+{
+	vec3 position = info->draw_info.position;
+	return position + info->bounding_centre;
+}
+
+inline CullInstance make_cull_instance(const DrawCallInfo* info, u32 visibility_index)
+{
+	assert(info->draw_info.vertex_buffer_index < (1u << (32 - CULL_MESH_INDEX_SHIFT)) && visibility_index <= CULL_VISIBILITY_INDEX_MASK);
+
+	CullInstance result;
+	result.centre = instance_sphere_centre(info);
+	result.radius = info->bounding_radius;
+	result.mesh_visibility_index = info->draw_info.vertex_buffer_index << CULL_MESH_INDEX_SHIFT | visibility_index;
+	return result;
+}
+#endif
@@ -0,0 +1,426 @@
+#pragma once
+
+// CPU reference for cull_compute.hlsl, plus the SIMD version used by the culling benchmarks.
+// Needs DrawCallInfo and ShaderGlobals from dx_window.cpp, and cull_layout.h.
+
+#include <xmmintrin.h>
+
+
+// The five planes cull_compute.hlsl tests (left, right, bottom, top, near; the far plane is at infinity),
+// moved from view space to world space so an instance position can be tested without the view transform.
+// Like the shader the planes are not normalized; the radius that gets compared against them is pre-scaled by
+// the longest projection row (bounds_scale in draw()), so world space distances have to be scaled the same way.
+struct CullFrustum
+{
+	vec4 planes[5];
+	f32 bounds_scale;
+};
+
+CullFrustum make_cull_frustum(const ShaderGlobals* globals)
+{
+	vec4 row_1 = globals->projection.row_vecs[0];
+	vec4 row_2 = globals->projection.row_vecs[1];
+	vec4 row_4 = globals->projection.row_vecs[3];
+
+	vec4 view_planes[5] = {
+		{row_4.x + row_1.x, row_4.y + row_1.y, row_4.z + row_1.z, row_4.w + row_1.w},
+		{row_4.x - row_1.x, row_4.y - row_1.y, row_4.z - row_1.z, row_4.w - row_1.w},
+		{row_4.x + row_2.x, row_4.y + row_2.y, row_4.z + row_2.z, row_4.w + row_2.w},
+		{row_4.x - row_2.x, row_4.y - row_2.y, row_4.z - row_2.z, row_4.w - row_2.w},
+		row_4,
+	};
+
+	//dot(plane, view * p) == dot(transpose(view) * plane, p)
+	Mat4x4 view_transposed = transpose(globals->view);
+
+	CullFrustum result = {};
+	for (u32 i = 0; i < 5; ++i)
+		result.planes[i] = mult(view_transposed, view_planes[i]);
+
+	vec4 row_3 = globals->projection.row_vecs[2];
+	result.bounds_scale = MAX(MAX(length(row_1), length(row_2)), length(row_3));
+
+	return result;
+}
+
+// The same five planes taken straight from a combined projection * view matrix, for views that are not the camera
+// (shadow cascades, cube faces). The planes are normalized, so bounds_scale is 1 and radii stay in world units.
+// With an orthographic projection w is always 1 and the fifth plane never rejects, like the missing far plane.
+CullFrustum make_cull_frustum_from_view_projection(const Mat4x4* view_projection)
+{
+	vec4 row_1 = view_projection->row_vecs[0];
+	vec4 row_2 = view_projection->row_vecs[1];
+	vec4 row_4 = view_projection->row_vecs[3];
+
+	vec4 planes[5] = {
+		{row_4.x + row_1.x, row_4.y + row_1.y, row_4.z + row_1.z, row_4.w + row_1.w},
+		{row_4.x - row_1.x, row_4.y - row_1.y, row_4.z - row_1.z, row_4.w - row_1.w},
+		{row_4.x + row_2.x, row_4.y + row_2.y, row_4.z + row_2.z, row_4.w + row_2.w},
+		{row_4.x - row_2.x, row_4.y - row_2.y, row_4.z - row_2.z, row_4.w - row_2.w},
+		row_4,
+	};
+
+	CullFrustum result = {};
+	for (u32 i = 0; i < 5; ++i)
+	{
+		f32 plane_length = sqrtf(planes[i].x * planes[i].x + planes[i].y * planes[i].y + planes[i].z * planes[i].z);
+		f32 inverse_length = plane_length > 0.0f ? 1.0f / plane_length : 0.0f;
+		result.planes[i] = {planes[i].x * inverse_length, planes[i].y * inverse_length, planes[i].z * inverse_length, planes[i].w * inverse_length};
+	}
+	result.bounds_scale = 1.0f;
+
+	return result;
+}
+
+// Same test as the shader: outside as soon as the centre is further than radius behind any plane.
+bool sphere_in_frustum(const CullFrustum* frustum, vec3 centre, f32 radius)
+{
+	for (u32 i = 0; i < 5; ++i)
+	{
+		const vec4& plane = frustum->planes[i];
+		if (plane.x * centre.x + plane.y * centre.y + plane.z * centre.z + plane.w < -radius) return false;
+	}
+	return true;
+}
+
+// Four spheres per iteration, one lane each. Writes 1/0 into visible for every sphere and returns the visible count.
+u32 cull_spheres_sse(const CullFrustum* frustum, const f32* x, const f32* y, const f32* z, const f32* radius, u32 count, u8* visible)
+{
+	__m128 plane_x[5], plane_y[5], plane_z[5], plane_w[5];
+	for (u32 i = 0; i < 5; ++i)
+	{
+		plane_x[i] = _mm_set1_ps(frustum->planes[i].x);
+		plane_y[i] = _mm_set1_ps(frustum->planes[i].y);
+		plane_z[i] = _mm_set1_ps(frustum->planes[i].z);
+		plane_w[i] = _mm_set1_ps(frustum->planes[i].w);
+	}
+
+	u32 visible_count = 0;
+	u32 i = 0;
+
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 cx = _mm_loadu_ps(x + i);
+		__m128 cy = _mm_loadu_ps(y + i);
+		__m128 cz = _mm_loadu_ps(z + i);
+		__m128 negative_radius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(radius + i));
+
+		__m128 outside = _mm_setzero_ps();
+		for (u32 p = 0; p < 5; ++p)
+		{
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(plane_x[p], cx), _mm_mul_ps(plane_y[p], cy)), _mm_add_ps(_mm_mul_ps(plane_z[p], cz), plane_w[p]));
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(distance, negative_radius));
+		}
+
+		u32 mask = ~_mm_movemask_ps(outside) & 15;
+		visible[i + 0] = (mask >> 0) & 1;
+		visible[i + 1] = (mask >> 1) & 1;
+		visible[i + 2] = (mask >> 2) & 1;
+		visible[i + 3] = (mask >> 3) & 1;
+		visible_count += visible[i + 0] + visible[i + 1] + visible[i + 2] + visible[i + 3];
+	}
+
+	for (; i < count; ++i)
+	{
+		visible[i] = sphere_in_frustum(frustum, Vec3(x[i], y[i], z[i]), radius[i]);
+		visible_count += visible[i];
+	}
+
+	return visible_count;
+}
+
+// Same test over cull_compute's hot stream. The sphere is the first 16 bytes of a CullInstance, so four loads and a
+// transpose give the same lanes cull_spheres_sse loads from SoA arrays.
+u32 cull_instances_sse(const CullFrustum* frustum, const CullInstance* instances, u32 count, u8* visible)
+{
+	__m128 plane_x[5], plane_y[5], plane_z[5], plane_w[5];
+	for (u32 i = 0; i < 5; ++i)
+	{
+		plane_x[i] = _mm_set1_ps(frustum->planes[i].x);
+		plane_y[i] = _mm_set1_ps(frustum->planes[i].y);
+		plane_z[i] = _mm_set1_ps(frustum->planes[i].z);
+		plane_w[i] = _mm_set1_ps(frustum->planes[i].w);
+	}
+
+	u32 visible_count = 0;
+	u32 i = 0;
+
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 cx = _mm_loadu_ps(&instances[i + 0].centre.x);
+		__m128 cy = _mm_loadu_ps(&instances[i + 1].centre.x);
+		__m128 cz = _mm_loadu_ps(&instances[i + 2].centre.x);
+		__m128 r = _mm_loadu_ps(&instances[i + 3].centre.x);
+		_MM_TRANSPOSE4_PS(cx, cy, cz, r);
+		__m128 negative_radius = _mm_sub_ps(_mm_setzero_ps(), r);
+
+		__m128 outside = _mm_setzero_ps();
+		for (u32 p = 0; p < 5; ++p)
+		{
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(plane_x[p], cx), _mm_mul_ps(plane_y[p], cy)), _mm_add_ps(_mm_mul_ps(plane_z[p], cz), plane_w[p]));
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(distance, negative_radius));
+		}
+
+		u32 mask = ~_mm_movemask_ps(outside) & 15;
+		visible[i + 0] = (mask >> 0) & 1;
+		visible[i + 1] = (mask >> 1) & 1;
+		visible[i + 2] = (mask >> 2) & 1;
+		visible[i + 3] = (mask >> 3) & 1;
+		visible_count += visible[i + 0] + visible[i + 1] + visible[i + 2] + visible[i + 3];
+	}
+
+	for (; i < count; ++i)
+	{
+		visible[i] = sphere_in_frustum(frustum, instances[i].centre, instances[i].radius);
+		visible_count += visible[i];
+	}
+
+	return visible_count;
+}
+
+
+// Pixel rectangle [x0, x1) x [y0, y1) a sphere covers on a width x height target, and the reversed Z depth of its
+// nearest point, under a symmetric perspective projection looking down -z (2D Polyhedral Bounds of a Clipped,
+// Perspective-Projected 3D Sphere, Mara and McGuire 2013). Returns false when the sphere reaches the near plane or
+// misses the target; nothing can be said about those. cull_compute.hlsl repeats these operations in this order.
+struct SphereScreenRect
+{
+	s32 x0;
+	s32 y0;
+	s32 x1;
+	s32 y1;
+	f32 depth;
+};
+
+bool project_sphere_rect(const Mat4x4* view, const Mat4x4* projection, vec3 centre, f32 radius, u32 width, u32 height, SphereScreenRect* rect)
+{
+	vec4 v = mult(*view, vec4{centre.x, centre.y, centre.z, 1.0f});
+	vec3 c = Vec3(v.x, v.y, -v.z);
+
+	f32 nearest = c.z - radius;
+	if (nearest <= 0) return false;
+
+	//Depth of the point straight ahead at the nearest distance, from the projection's z and w rows.
+	const Mat4x4& p = *projection;
+	rect->depth = (p.d[2][3] - p.d[2][2] * nearest) / (p.d[3][3] - p.d[3][2] * nearest);
+	if (rect->depth >= 1.0f) return false;
+
+	f32 czr2 = c.z * c.z - radius * radius;
+	f32 vx = sqrtf(c.x * c.x + czr2);
+	f32 vy = sqrtf(c.y * c.y + czr2);
+
+	f32 min_x = (vx * c.x - radius * c.z) / (vx * c.z + radius * c.x) * p.d[0][0];
+	f32 max_x = (vx * c.x + radius * c.z) / (vx * c.z - radius * c.x) * p.d[0][0];
+	f32 min_y = (vy * c.y - radius * c.z) / (vy * c.z + radius * c.y) * p.d[1][1];
+	f32 max_y = (vy * c.y + radius * c.z) / (vy * c.z - radius * c.y) * p.d[1][1];
+
+	//NDC to pixels, y flips so max_y is the top row.
+	f32 x0 = (min_x + 1.0f) * 0.5f * width;
+	f32 x1 = (max_x + 1.0f) * 0.5f * width;
+	f32 y0 = (1.0f - max_y) * 0.5f * height;
+	f32 y1 = (1.0f - min_y) * 0.5f * height;
+
+	//Entirely off screen spheres are the frustum culler's business.
+	if (x1 <= 0 || y1 <= 0 || x0 >= width || y0 >= height) return false;
+
+	rect->x0 = MAX((s32)floorf(x0), 0);
+	rect->x1 = MIN((s32)ceilf(x1), (s32)width);
+	rect->y0 = MAX((s32)floorf(y0), 0);
+	rect->y1 = MIN((s32)ceilf(y1), (s32)height);
+
+	return rect->x0 < rect->x1 && rect->y0 < rect->y1;
+}
+
+
+// Culling benchmarks work on the sphere of every DrawCallInfo copied out into SoA arrays.
+struct CullSpheres
+{
+	f32* x;
+	f32* y;
+	f32* z;
+	f32* radius;
+	u32 count;
+};
+
+void init_cull_spheres(CullSpheres* spheres, const DrawCallInfo* infos, u32 count)
+{
+	spheres->x = new f32[count];
+	spheres->y = new f32[count];
+	spheres->z = new f32[count];
+	spheres->radius = new f32[count];
+	spheres->count = count;
+
+	for (u32 i = 0; i < count; ++i)
+	{
+		vec3 centre = instance_sphere_centre(&infos[i]);
+		spheres->x[i] = centre.x;
+		spheres->y[i] = centre.y;
+		spheres->z[i] = centre.z;
+		spheres->radius[i] = infos[i].bounding_radius;
+	}
+}
+
+void free_cull_spheres(CullSpheres* spheres)
+{
+	delete[] spheres->x;
+	delete[] spheres->y;
+	delete[] spheres->z;
+	delete[] spheres->radius;
+	*spheres = {};
+}
+
+
+// What happens to the 64 instance chunks one cull_compute thread group handles.
+// A mixed chunk is a diverging wave; a chunk whose bounding sphere is outside can be rejected before looking at its instances.
+constexpr u32 CULL_CHUNK_SIZE = 64;
+
+struct CullChunkStats
+{
+	u32 chunk_count;
+	u32 all_visible;
+	u32 all_culled;
+	u32 mixed;
+	u32 rejected_by_bounds;
+};
+
+// Bounding sphere of spheres [first, first + count): centre of their AABB, radius covering every sphere.
+// Sphere radii are pre-scaled by bounds_scale, so the centre distances are too.
+void chunk_bounding_sphere(const CullSpheres* spheres, u32 first, u32 count, f32 bounds_scale, vec3* centre, f32* radius)
+{
+	vec3 minv = Vec3(FLT_MAX);
+	vec3 maxv = Vec3(-FLT_MAX);
+
+	for (u32 i = first; i < first + count; ++i)
+	{
+		minv.x = MIN(minv.x, spheres->x[i]); maxv.x = MAX(maxv.x, spheres->x[i]);
+		minv.y = MIN(minv.y, spheres->y[i]); maxv.y = MAX(maxv.y, spheres->y[i]);
+		minv.z = MIN(minv.z, spheres->z[i]); maxv.z = MAX(maxv.z, spheres->z[i]);
+	}
+
+	*centre = (minv + maxv) * 0.5f;
+	*radius = 0.0f;
+
+	for (u32 i = first; i < first + count; ++i)
+	{
+		vec3 d = Vec3(spheres->x[i], spheres->y[i], spheres->z[i]) - *centre;
+		*radius = MAX(*radius, length(d) * bounds_scale + spheres->radius[i]);
+	}
+}
+
+CullChunkStats measure_cull_chunks(const CullFrustum* frustum, const CullSpheres* spheres, const u8* visible)
+{
+	CullChunkStats stats = {};
+
+	for (u32 first = 0; first < spheres->count; first += CULL_CHUNK_SIZE)
+	{
+		u32 count = MIN(CULL_CHUNK_SIZE, spheres->count - first);
+
+		u32 visible_count = 0;
+		for (u32 i = first; i < first + count; ++i) visible_count += visible[i];
+
+		stats.chunk_count++;
+		stats.all_visible += visible_count == count;
+		stats.all_culled += visible_count == 0;
+		stats.mixed += visible_count != 0 && visible_count != count;
+
+		vec3 centre;
+		f32 radius;
+		chunk_bounding_sphere(spheres, first, count, frustum->bounds_scale, &centre, &radius);
+		stats.rejected_by_bounds += !sphere_in_frustum(frustum, centre, radius);
+	}
+
+	return stats;
+}
+
+
+// Frustum culls the same instances from three layouts and gathers the DrawInfo of every survivor, like cull_compute
+// filling the argument buffer: whole DrawCallInfos, the hot CullInstance stream with DrawCallInfo read only for
+// survivors (cull_compute's layout), and SoA spheres with the same survivor reads. Prints time and the bytes each
+// layout reads per instance. DrawCallInfos are tested one at a time, the way a GPU thread loads them; the other two
+// use SSE, so the times also include that difference.
+void benchmark_cull_layouts(u32 instance_count, const ShaderGlobals* globals)
+{
+	f32 scale = sqrtf(instance_count / 1250.0f);
+	vec3 world_max = Vec3(100.0f * scale, 25.0f, 100.0f * scale);
+	vec3 world_min = -world_max;
+
+	CullFrustum frustum = make_cull_frustum(globals);
+
+	DrawCallInfo* infos = new DrawCallInfo[instance_count];
+	u32 random = 101;
+	for (u32 i = 0; i < instance_count; ++i)
+	{
+		infos[i] = {};
+		infos[i].draw_info.position = {rand_f32_in_range(world_min.x, world_max.x, &random), rand_f32_in_range(world_min.y, world_max.y, &random), rand_f32_in_range(world_min.z, world_max.z, &random)};
+		infos[i].draw_info.vertex_buffer_index = i & 1;
+		infos[i].bounding_radius = rand_f32_in_range(0.5f, 3.0f, &random) * frustum.bounds_scale;
+	}
+
+	CullInstance* hot = new CullInstance[instance_count];
+	for (u32 i = 0; i < instance_count; ++i) hot[i] = make_cull_instance(&infos[i], i);
+
+	CullSpheres spheres;
+	init_cull_spheres(&spheres, infos, instance_count);
+
+	u8* visible = new u8[instance_count];
+	DrawInfo* gathered = new DrawInfo[instance_count];
+
+	u32 iterations = MAX(20000000 / instance_count, 1u);
+	u32 counts[3] = {};
+	f64 seconds[3] = {};
+
+	f64 start = time_in_seconds();
+	for (u32 it = 0; it < iterations; ++it)
+	{
+		u32 count = 0;
+		for (u32 i = 0; i < instance_count; ++i)
+			if (sphere_in_frustum(&frustum, instance_sphere_centre(&infos[i]), infos[i].bounding_radius)) gathered[count++] = infos[i].draw_info;
+		counts[0] = count;
+	}
+	seconds[0] = (time_in_seconds() - start) / iterations;
+
+	start = time_in_seconds();
+	for (u32 it = 0; it < iterations; ++it)
+	{
+		cull_instances_sse(&frustum, hot, instance_count, visible);
+
+		u32 count = 0;
+		for (u32 i = 0; i < instance_count; ++i)
+			if (visible[i]) gathered[count++] = infos[i].draw_info;
+		counts[1] = count;
+	}
+	seconds[1] = (time_in_seconds() - start) / iterations;
+
+	start = time_in_seconds();
+	for (u32 it = 0; it < iterations; ++it)
+	{
+		cull_spheres_sse(&frustum, spheres.x, spheres.y, spheres.z, spheres.radius, instance_count, visible);
+
+		u32 count = 0;
+		for (u32 i = 0; i < instance_count; ++i)
+			if (visible[i]) gathered[count++] = infos[i].draw_info;
+		counts[2] = count;
+	}
+	seconds[2] = (time_in_seconds() - start) / iterations;
+
+	assert(counts[0] == counts[1] && counts[1] == counts[2]);
+
+	//Every instance reads its hot data, survivors read their DrawCallInfo as well. Whole cache lines are not counted.
+	f64 survivors = (f64)counts[0] / instance_count;
+	f64 bytes[3] = {
+		(f64)sizeof(DrawCallInfo),
+		sizeof(CullInstance) + survivors * sizeof(DrawCallInfo),
+		4 * sizeof(f32) + survivors * sizeof(DrawCallInfo),
+	};
+	char* names[3] = {"DrawCallInfo", "CullInstance + cold", "SoA spheres + cold"};
+
+	printf("Cull layouts, %u instances, %u visible (%.1f%%):\n", instance_count, counts[0], survivors * 100.0);
+	for (u32 l = 0; l < 3; ++l)
+		printf("  %-20s: %5.1f bytes/instance, %.3fms (%.2fns/instance)\n", names[l], bytes[l], seconds[l] * 1000.0, seconds[l] * 1e9 / instance_count);
+
+	delete[] infos;
+	delete[] hot;
+	delete[] visible;
+	delete[] gathered;
+	free_cull_spheres(&spheres);
+}
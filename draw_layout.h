@@ -0,0 +1,37 @@
+#pragma once
+
+//Structs shared by dx_window.cpp, the shaders and the mesh and culling headers. Needs D3D12_INDEX_BUFFER_VIEW,
+//bench.cpp declares a stand-in with the same layout when building without the D3D12 headers.
+
+#pragma pack(push, 4)
+struct alignas(16) DrawInfo
+{
+	vec4 quat;
+	vec3 position;
+	u32 vertex_buffer_index;	
+};
+
+struct alignas(16) ShaderGlobals
+{
+	Mat4x4 projection;
+	Mat4x4 view;
+	float time;
+};
+
+struct alignas(16) DrawCallInfo {
+    DrawInfo draw_info;
+    D3D12_INDEX_BUFFER_VIEW index_buffer_view;
+    u32 triangle_count;
+	float bounding_radius;
+	u32 packing_a;
+	u32 packing_b;
+	vec3 bounding_centre;//Offset of the bounding sphere's centre from draw_info.position, world space
+};
+#pragma pack(pop)
+
+
+struct Vertex
+{
+	f32 position[3];
+	f32 normal [3];
+};
@@ -0,0 +1,382 @@
+#pragma once
+
+// Front to back draw order for the depth pre-pass. Every draw gets a 64 bit key, quantized view depth on top so
+// nearer draws come first, then mesh and material so equal depths keep draws with the same state together, and the
+// keys are sorted with their draw indices by a parallel LSD radix sort.
+//
+// The sort is meshopt's radixPass scheme (spatialorder.cpp, also radix_sort_keys in instance_store.h) widened to
+// 64 bit keys: one read builds the histograms of all eight byte digits, digits that are the same in every key are
+// skipped, and each remaining pass scatters stably through running offsets. To spread a pass over threads the keys
+// are cut into one contiguous chunk per thread; every chunk counts its own digits, and the offsets are laid out
+// digit by digit, chunk by chunk, so the chunks scatter at the same time and the result is still stable.
+//
+// The camera moves a little per frame, so last frame's order is nearly sorted for this frame's keys.
+// sort_draw_keys_coherent tries an insertion sort on it first and only falls back to the radix sort when too many
+// keys have to move. How many move grows with the number of instances along a view ray: draw()'s 1250 instances
+// orbited at 0.01 rad a frame move about 2 places each and never fall back, a quarter million at the same density
+// move about 40 at 0.001 rad and do.
+//
+// Needs jobs.h and culling.h in the same translation unit.
+
+constexpr u32 DRAW_SORT_DEPTH_BITS = 24;
+constexpr u32 DRAW_SORT_MESH_BITS = 20;
+constexpr u32 DRAW_SORT_MATERIAL_BITS = 20;
+static_assert(DRAW_SORT_DEPTH_BITS + DRAW_SORT_MESH_BITS + DRAW_SORT_MATERIAL_BITS == 64, "draw sort keys use all 64 bits");
+
+// Below this many keys the threads cost more than they save.
+constexpr u32 DRAW_SORT_PARALLEL_MIN_COUNT = 1 << 16;
+
+// The coherent sort gives up on insertion once it has shifted keys this many times the keys it has done, plus some
+// slack for the first few. Measured single threaded with benchmark_draw_sort, insertion stops beating the radix sort
+// at about 3 shifts per key for 1250 keys, 6 for 4096 and 13 for 262144.
+constexpr u32 DRAW_SORT_COHERENT_SHIFTS_PER_KEY = 8;
+constexpr u32 DRAW_SORT_COHERENT_MIN_SHIFTS = 1024;
+
+// Positive floats order the same as their bits, so the top bits below the sign are a quantized depth that keeps
+// relative precision at every distance. Depths behind the camera clamp to 0.
+u64 make_draw_sort_key(f32 view_depth, u32 mesh_index, u32 material)
+{
+	u32 depth_bits;
+	f32 depth = MAX(view_depth, 0.0f);
+	memcpy(&depth_bits, &depth, sizeof(depth_bits));
+
+	u64 depth_key = depth_bits >> (31 - DRAW_SORT_DEPTH_BITS);
+	u64 mesh_key = MIN(mesh_index, (1u << DRAW_SORT_MESH_BITS) - 1);
+	u64 material_key = MIN(material, (1u << DRAW_SORT_MATERIAL_BITS) - 1);
+
+	return (depth_key << (DRAW_SORT_MESH_BITS + DRAW_SORT_MATERIAL_BITS)) | (mesh_key << DRAW_SORT_MATERIAL_BITS) | material_key;
+}
+
+// Sorts after every real key: the largest depth key is the top of the largest finite float, below all ones.
+constexpr u64 DRAW_SORT_CULLED_KEY = ~0ull;
+
+// Keys for instances[order[i]], with order[i] as the value, so a list sorted last frame stays nearly sorted. Instances
+// outside the frustum get DRAW_SORT_CULLED_KEY and end up behind the visible set. order and values may be the same
+// array. Returns the visible count.
+// radius_scale is bounds_scale for unscaled instance store radii, 1 for radii that are already scaled. There are no
+// materials yet, so that field is 0 for now.
+u32 build_draw_sort_keys(const DrawCallInfo* instances, const u32* order, u32 count, const ShaderGlobals* globals, f32 radius_scale, u64* keys, u32* values)
+{
+	CullFrustum frustum = make_cull_frustum(globals);
+	u32 visible_count = 0;
+
+	for (u32 i = 0; i < count; ++i)
+	{
+		const DrawCallInfo* instance = &instances[order[i]];
+		vec3 position = instance_sphere_centre(instance);
+		values[i] = order[i];
+
+		if (!sphere_in_frustum(&frustum, position, instance->bounding_radius * radius_scale))
+		{
+			keys[i] = DRAW_SORT_CULLED_KEY;
+			continue;
+		}
+
+		vec4 p = mult(globals->view, vec4{position.x, position.y, position.z, 1.0f});
+		keys[i] = make_draw_sort_key(-p.z, instance->draw_info.vertex_buffer_index, 0);
+		visible_count++;
+	}
+
+	return visible_count;
+}
+
+
+struct DrawSortChunk
+{
+	u32 first;
+	u32 count;
+	u32 offsets[256];//Histogram of the pass's digit, then where the chunk writes each digit
+};
+
+// Sorts keys and values by key, stable. scratch_keys and scratch_values need room for count entries; the result
+// always ends up in keys and values. thread_count 0 uses every job thread.
+void radix_sort_draw_keys(u64* keys, u32* values, u64* scratch_keys, u32* scratch_values, u32 count, u32 thread_count = 0)
+{
+	if (count < 2) return;
+
+	if (thread_count == 0) thread_count = get_job_thread_count();
+	if (count < DRAW_SORT_PARALLEL_MIN_COUNT) thread_count = 1;
+
+	u32 chunk_count = thread_count;
+	u32 chunk_size = (count + chunk_count - 1) / chunk_count;
+	chunk_count = (count + chunk_size - 1) / chunk_size;
+
+	DrawSortChunk* chunks = new DrawSortChunk[chunk_count];
+	u32 (*chunk_histograms)[8][256] = new u32[chunk_count][8][256];
+
+	for (u32 c = 0; c < chunk_count; ++c)
+	{
+		chunks[c].first = c * chunk_size;
+		chunks[c].count = MIN(chunk_size, count - chunks[c].first);
+	}
+
+	//Every digit's histogram in one read, like meshopt's computeHistogram. The totals do not depend on the order,
+	//so they tell which passes would leave everything where it is.
+	parallel_for(chunk_count, thread_count, [&](u32 c, u32)
+	{
+		u32 (*histogram)[256] = chunk_histograms[c];
+		memset(histogram, 0, sizeof(chunk_histograms[c]));
+
+		const u64* chunk_keys = keys + chunks[c].first;
+		for (u32 i = 0; i < chunks[c].count; ++i)
+		{
+			u64 key = chunk_keys[i];
+			for (u32 pass = 0; pass < 8; ++pass) histogram[pass][(key >> (pass * 8)) & 255]++;
+		}
+	});
+
+	u64* source_keys = keys;
+	u32* source_values = values;
+	u64* destination_keys = scratch_keys;
+	u32* destination_values = scratch_values;
+	bool scattered = false;
+
+	for (u32 pass = 0; pass < 8; ++pass)
+	{
+		bool trivial = false;
+		for (u32 digit = 0; digit < 256; ++digit)
+		{
+			u32 total = 0;
+			for (u32 c = 0; c < chunk_count; ++c) total += chunk_histograms[c][pass][digit];
+
+			if (total == 0) continue;
+			trivial = total == count;
+			break;
+		}
+		if (trivial) continue;
+
+		u32 shift = pass * 8;
+
+		//Until the first scatter the chunks still hold the keys the histograms above were counted from, after it
+		//every pass has to count the current order again.
+		if (!scattered)
+		{
+			for (u32 c = 0; c < chunk_count; ++c) memcpy(chunks[c].offsets, chunk_histograms[c][pass], sizeof(chunks[c].offsets));
+		}
+		else
+		{
+			parallel_for(chunk_count, thread_count, [&](u32 c, u32)
+			{
+				DrawSortChunk* chunk = &chunks[c];
+				memset(chunk->offsets, 0, sizeof(chunk->offsets));
+
+				const u64* chunk_keys = source_keys + chunk->first;
+				for (u32 i = 0; i < chunk->count; ++i) chunk->offsets[(chunk_keys[i] >> shift) & 255]++;
+			});
+		}
+
+		u32 offset = 0;
+		for (u32 digit = 0; digit < 256; ++digit)
+		{
+			for (u32 c = 0; c < chunk_count; ++c)
+			{
+				u32 digit_count = chunks[c].offsets[digit];
+				chunks[c].offsets[digit] = offset;
+				offset += digit_count;
+			}
+		}
+
+		parallel_for(chunk_count, thread_count, [&](u32 c, u32)
+		{
+			DrawSortChunk* chunk = &chunks[c];
+			for (u32 i = chunk->first; i < chunk->first + chunk->count; ++i)
+			{
+				u64 key = source_keys[i];
+				u32 destination = chunk->offsets[(key >> shift) & 255]++;
+				destination_keys[destination] = key;
+				destination_values[destination] = source_values[i];
+			}
+		});
+
+		scattered = true;
+		u64* swap_keys = source_keys; source_keys = destination_keys; destination_keys = swap_keys;
+		u32* swap_values = source_values; source_values = destination_values; destination_values = swap_values;
+	}
+
+	if (source_keys != keys)
+	{
+		memcpy(keys, source_keys, sizeof(u64) * count);
+		memcpy(values, source_values, sizeof(u32) * count);
+	}
+
+	delete[] chunks;
+	delete[] chunk_histograms;
+}
+
+// For keys in last frame's order: insertion sort while that stays cheap, the radix sort otherwise. Every key only
+// has to move past the keys whose depth crossed its own since last frame, so a slow camera costs a few shifts per
+// key, a camera cut runs out of budget early and pays for the radix sort. Stable either way. Returns true when the
+// insertion sort was enough.
+bool sort_draw_keys_coherent(u64* keys, u32* values, u64* scratch_keys, u32* scratch_values, u32 count, u32 thread_count = 0)
+{
+	u64 shifts = 0;
+
+	for (u32 i = 1; i < count; ++i)
+	{
+		u64 key = keys[i];
+		if (keys[i - 1] <= key) continue;
+
+		u32 value = values[i];
+		u32 j = i;
+		while (j > 0 && keys[j - 1] > key)
+		{
+			keys[j] = keys[j - 1];
+			values[j] = values[j - 1];
+			j--;
+		}
+		keys[j] = key;
+		values[j] = value;
+
+		//The budget grows with the keys done so far, so a list that is not coherent is given up on after a few of
+		//them. Everything is still a permutation of the input, so the radix sort can pick up from here.
+		shifts += i - j;
+		if (shifts > (u64)i * DRAW_SORT_COHERENT_SHIFTS_PER_KEY + DRAW_SORT_COHERENT_MIN_SHIFTS)
+		{
+			radix_sort_draw_keys(keys, values, scratch_keys, scratch_values, count, thread_count);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+struct DrawSortReference
+{
+	u64 key;
+	u32 index;
+};
+
+int compare_draw_sort_references(const void* a, const void* b)
+{
+	const DrawSortReference* lhs = (const DrawSortReference*)a;
+	const DrawSortReference* rhs = (const DrawSortReference*)b;
+	if (lhs->key != rhs->key) return lhs->key < rhs->key ? -1 : 1;
+	return lhs->index < rhs->index ? -1 : lhs->index > rhs->index ? 1 : 0;
+}
+
+// Sorts instance_count random draw keys with 1 thread and with every job thread, then runs frames of a camera
+// orbiting a scatter of instances with the coherent sort fed last frame's order, checking every result against
+// qsort with ties kept in input order, and printing the times.
+void benchmark_draw_sort(u32 instance_count, u32 mesh_count)
+{
+	u64* keys = new u64[instance_count];
+	u32* values = new u32[instance_count];
+	u64* scratch_keys = new u64[instance_count];
+	u32* scratch_values = new u32[instance_count];
+	u64* reference_keys = new u64[instance_count];
+	u32* reference_values = new u32[instance_count];
+	DrawSortReference* references = new DrawSortReference[instance_count];
+
+	u32 random = 101;
+	vec3* positions = new vec3[instance_count];
+	u32* mesh_indices = new u32[instance_count];
+	f32 extent = 100.0f * sqrtf(instance_count / 1250.0f);
+	for (u32 i = 0; i < instance_count; ++i)
+	{
+		positions[i] = Vec3(rand_f32_in_range(-extent, extent, &random), rand_f32_in_range(-25.0f, 25.0f, &random), rand_f32_in_range(-extent, extent, &random));
+		mesh_indices[i] = (u32)(rand_f32_normal(&random) * mesh_count);
+	}
+
+	auto check_sorted = [&](u32 count) -> bool
+	{
+		for (u32 i = 0; i < count; ++i) references[i] = {reference_keys[i], i};
+		qsort(references, count, sizeof(DrawSortReference), compare_draw_sort_references);
+		for (u32 i = 0; i < count; ++i)
+		{
+			u32 r = references[i].index;
+			if (keys[i] != reference_keys[r] || values[i] != reference_values[r]) return false;
+		}
+		return true;
+	};
+
+	auto camera_view = [&](f32 angle) -> Mat4x4
+	{
+		vec3 eye = Vec3(sinf(angle), 0.3f, cosf(angle)) * extent;
+		return look_at(eye, {}, {0.0f, 1.0f, 0.0f});
+	};
+
+	auto build_keys = [&](const Mat4x4* view, u32 count, const u32* instance_order)
+	{
+		for (u32 i = 0; i < count; ++i)
+		{
+			u32 instance = instance_order ? instance_order[i] : i;
+			vec4 p = mult(*view, vec4{positions[instance].x, positions[instance].y, positions[instance].z, 1.0f});
+			keys[i] = make_draw_sort_key(-p.z, mesh_indices[instance], 0);
+			values[i] = instance;
+		}
+	};
+
+	printf("Draw sort, %u keys, %u job threads:\n", instance_count, get_job_thread_count());
+
+	Mat4x4 view = camera_view(0.0f);
+	u32 thread_counts[2] = {1, get_job_thread_count()};
+	for (u32 t = 0; t < 2; ++t)
+	{
+		const u32 iterations = 10;
+		f64 seconds = 0.0;
+		bool sorted = true;
+
+		for (u32 it = 0; it < iterations; ++it)
+		{
+			build_keys(&view, instance_count, 0);
+			memcpy(reference_keys, keys, sizeof(u64) * instance_count);
+			memcpy(reference_values, values, sizeof(u32) * instance_count);
+
+			f64 start = time_in_seconds();
+			radix_sort_draw_keys(keys, values, scratch_keys, scratch_values, instance_count, thread_counts[t]);
+			seconds += time_in_seconds() - start;
+
+			if (it == 0) sorted = check_sorted(instance_count);
+		}
+
+		printf("  full radix sort, %u threads: %.3fms%s\n", thread_counts[t], seconds * 1000.0 / iterations, sorted ? "" : " (WRONG ORDER)");
+	}
+
+	//Frame 0 sorts from scratch, every later frame starts from the order the one before it produced.
+	u32* frame_order = new u32[instance_count];
+	build_keys(&view, instance_count, 0);
+	radix_sort_draw_keys(keys, values, scratch_keys, scratch_values, instance_count);
+	u32* first_frame_order = new u32[instance_count];
+	memcpy(first_frame_order, values, sizeof(u32) * instance_count);
+
+	f32 angle_steps[4] = {0.0001f, 0.001f, 0.01f, 0.5f};//60fps orbits of about 17 minutes, 100s and 10s, and a camera cut
+	for (u32 s = 0; s < 4; ++s)
+	{
+		const u32 frames = 10;
+		f64 coherent_seconds = 0.0;
+		u32 cheap_frames = 0;
+		bool sorted = true;
+		memcpy(frame_order, first_frame_order, sizeof(u32) * instance_count);
+
+		for (u32 frame = 1; frame <= frames; ++frame)
+		{
+			Mat4x4 frame_view = camera_view(angle_steps[s] * frame);
+			build_keys(&frame_view, instance_count, frame_order);
+			memcpy(reference_keys, keys, sizeof(u64) * instance_count);
+			memcpy(reference_values, values, sizeof(u32) * instance_count);
+
+			f64 start = time_in_seconds();
+			cheap_frames += sort_draw_keys_coherent(keys, values, scratch_keys, scratch_values, instance_count);
+			coherent_seconds += time_in_seconds() - start;
+
+			sorted = check_sorted(instance_count) && sorted;
+			memcpy(frame_order, values, sizeof(u32) * instance_count);
+		}
+
+		printf("  coherent sort, camera step %g rad: %.3fms per frame, %u of %u frames by insertion%s\n",
+		       angle_steps[s], coherent_seconds * 1000.0 / frames, cheap_frames, frames, sorted ? "" : " (WRONG ORDER)");
+	}
+
+	delete[] frame_order;
+	delete[] first_frame_order;
+	delete[] keys;
+	delete[] values;
+	delete[] scratch_keys;
+	delete[] scratch_values;
+	delete[] reference_keys;
+	delete[] reference_values;
+	delete[] references;
+	delete[] positions;
+	delete[] mesh_indices;
+}
@@ -44,6 +44,7 @@ static u32 window_height = 1080;
 
 
 #include "utils.h"
+#include "jobs.h"
 
 #define FAST_OBJ_IMPLEMENTATION
 #include "include/fast_obj.h"
@@ -111,8 +112,17 @@ u32 render_target_view_descriptor_size;
 
 
 ID3D12PipelineState* cull_compute_pipeline_state = 0;
+ID3D12PipelineState* cull_compact_pipeline_state = 0;
+ID3D12PipelineState* cull_bucket_offsets_pipeline_state = 0;
+ID3D12PipelineState* cull_bucket_scatter_pipeline_state = 0;
 ID3D12RootSignature* cull_compute_root_signature = 0;
 
+ID3D12PipelineState* hiz_build_pipeline_state = 0;
+ID3D12RootSignature* hiz_build_root_signature = 0;
+ID3D12DescriptorHeap* hiz_heap;//Depth SRV per back buffer, then one SRV and one UAV per pyramid level
+ID3D12Resource* hiz_texture;//Power of two sized so every D3D mip holds the matching hiz.h level
+u32 hiz_levels;
+
 
 D3D12_DEPTH_STENCIL_DESC default_depth_stencil_state;
 ID3D12DescriptorHeap* depth_stencil_descriptor_heap;
@@ -136,21 +146,7 @@ UINT64 upload_fence_value;
 f64 gpu_ticks_per_second = 1.0;
 
 
-#pragma pack(push, 4)
-struct alignas(16) DrawInfo
-{
-	vec4 quat;
-	vec3 position;
-	u32 vertex_buffer_index;	
-};
-
-struct alignas(16) ShaderGlobals
-{
-	Mat4x4 projection;
-	Mat4x4 view;
-	float time;
-};
-#pragma pack(pop)
+#include "draw_layout.h"
 
 
 
@@ -163,6 +159,7 @@ struct Buffer
 
 
 Buffer vertex_buffer_1;
+Buffer mesh_lod_buffer;//MeshLods per mesh for cull_compute
 Buffer vertex_buffer_2;
 
 ID3D12QueryHeap* timestamp_query_heap;
@@ -172,19 +169,9 @@ constexpr u32 ZERO = 0;
 
 constexpr u32 MAX_NUM_DRAW_CALLS = 4096;
 ID3D12CommandSignature* command_signature;
+ID3D12CommandSignature* instanced_command_signature;
 
 #pragma pack(push,4)
-struct alignas(16) DrawCallInfo {
-    DrawInfo draw_info;
-    D3D12_INDEX_BUFFER_VIEW index_buffer_view;
-    u32 triangle_count;
-	float bounding_radius;
-	u32 packing_a;
-	u32 packing_b;
-	vec3 bounding_centre;
-};
-
-
 struct alignas(16) D3D12_DRAW_INDEXED_ARGUMENTS_ALIGNED
 {
     UINT IndexCountPerInstance;
@@ -208,6 +195,16 @@ struct alignas(16) DrawArguments {
 	D3D12_DRAW_INDEXED_ARGUMENTS_ALIGNED indexed;
 };
 
+//One instanced draw per mesh and LOD bucket, written into the same argument buffers as DrawArguments. Matches cull_compute.hlsl
+struct InstancedDrawArguments {
+    D3D12_INDEX_BUFFER_VIEW index_buffer_view;
+	u32 first_instance;//Into instance_id_buffer
+	u32 instanced;
+	D3D12_DRAW_INDEXED_ARGUMENTS indexed;
+	u32 packing[9];
+};
+static_assert(sizeof(InstancedDrawArguments) == sizeof(DrawArguments), "Both kinds of draw share the argument buffers");
+
 #pragma pack(pop)
 
 
@@ -216,10 +213,37 @@ ID3D12DescriptorHeap* draw_call_info_buffer_heap;
 ID3D12DescriptorHeap* argument_buffer_heap;
 Buffer draw_call_info_buffers[back_buffer_count];
 Buffer draw_call_argument_buffers[back_buffer_count];
+Buffer late_draw_call_argument_buffers[back_buffer_count];//Filled by the late phase of two phase occlusion culling
+ID3D12Resource* instance_visibility_buffer;//One bit per instance, kept between frames
+ID3D12Resource* instance_result_buffer;//Written by the cull pass, read by the compaction pass
+ID3D12Resource* group_count_buffer;
+ID3D12Resource* group_bucket_count_buffer;//Instancing scratch, see bucket_offsets in cull_compute.hlsl
+ID3D12Resource* bucket_range_buffer;
+ID3D12Resource* instance_id_buffer;//Visible instances grouped by bucket, read by vertex_shader.hlsl
 ID3D12Resource* draw_call_argument_count_reset_buffer;//literally just a value containing a single 0, so that we can copy it to another buffer 🤡
 
 DrawCallInfo draw_call_infos[back_buffer_count][MAX_NUM_DRAW_CALLS];
 
+//Matches cull_compute.hlsl
+enum CullPhase
+{
+	CULL_PHASE_ALL,
+	CULL_PHASE_EARLY,
+	CULL_PHASE_LATE,
+};
+
+struct CullParameters
+{
+	u32 phase;
+	u32 hiz_level_count;
+	u32 screen_width;
+	u32 screen_height;
+	f32 min_screen_radius;
+	f32 lod_pixel_error;
+	u32 instance_count;
+	u32 bucket_count;
+};
+
 
 void transition(ID3D12GraphicsCommandList* cl, ID3D12Resource* resource, D3D12_RESOURCE_STATES before, D3D12_RESOURCE_STATES after)
 {
@@ -233,6 +257,18 @@ void transition(ID3D12GraphicsCommandList* cl, ID3D12Resource* resource, D3D12_R
 	cl->ResourceBarrier(1, &barrier);
 }
 
+void transition_subresource(ID3D12GraphicsCommandList* cl, ID3D12Resource* resource, u32 subresource, D3D12_RESOURCE_STATES before, D3D12_RESOURCE_STATES after)
+{
+    D3D12_RESOURCE_BARRIER barrier;
+	barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION;
+	barrier.Flags = D3D12_RESOURCE_BARRIER_FLAG_NONE;
+	barrier.Transition.pResource = resource;
+	barrier.Transition.StateBefore = before;
+	barrier.Transition.StateAfter  = after;
+	barrier.Transition.Subresource = subresource;
+	cl->ResourceBarrier(1, &barrier);
+}
+
 
 
 Buffer create_readback_buffer(size_t size_in_bytes)
@@ -356,30 +392,6 @@ void download_from_buffer(Buffer* buffer, void* dest, size_t read_size_in_bytes)
 }
 
 
-struct Vertex
-{
-	f32 position[3];
-	f32 normal [3];
-};
-
-
-struct Mesh
-{
-	vec3 bounding_centre;
-	float bounding_radius;
-
-	u32 index_count;
-	Buffer index_buffer;//We may not need to keep this around (We only use the index_buffer_view when rendering right now.)
-	D3D12_INDEX_BUFFER_VIEW index_buffer_view;
-    
-	u32 vertex_count;
-	Buffer vertex_buffer;
-};
-
-
-Mesh meshes[4096];
-u32 mesh_count;
-
 void load_obj(char* filename, Vertex** vertices_out, size_t* vertices_count_out)
 {
 	fastObjMesh* obj_mesh = fast_obj_read(filename);
@@ -433,6 +445,114 @@ void load_obj(char* filename, Vertex** vertices_out, size_t* vertices_count_out)
 #include "include/vfetchoptimizer.cpp"
 #include "include/vcacheoptimizer.cpp"
 #include "include/indexgenerator.cpp"
+#include "include/simplifier.cpp"
+#include "include/spatialorder.cpp"
+#include "include/clusterizer.cpp"
+#include "include/vcacheanalyzer.cpp"
+#include "include/vfetchanalyzer.cpp"
+#include "include/overdrawanalyzer.cpp"
+#include "include/overdrawoptimizer.cpp"
+#include "include/stripifier.cpp"
+
+#include "mesh_simplify.h"
+#include "cluster_lod.h"
+#include "mesh_build.h"
+#include "mesh_weld.h"
+#include "mesh_overdraw.h"
+#include "mesh_tune.h"
+
+#include "cull_layout.h"
+#include "culling.h"
+#include "instance_store.h"
+#include "instance_bvh.h"
+#include "occlusion.h"
+#include "hiz.h"
+#include "multiview_cull.h"
+#include "instance_lod.h"
+#include "compaction.h"
+#include "instance_buckets.h"
+#include "draw_sort.h"
+#include "triangle_cull.h"
+#include "static_batch.h"
+#include "mesh_split.h"
+#include "bounds.h"
+#include "mesh_depth.h"
+#include "instance_transform.h"
+
+
+struct Mesh
+{
+	MeshBounds bounds;
+
+	u32 index_count;
+	Buffer index_buffer;//We may not need to keep this around (We only use the index_buffer_view when rendering right now.)
+	D3D12_INDEX_BUFFER_VIEW index_buffer_view;
+    
+	u32 vertex_count;
+	Buffer vertex_buffer;
+
+	//Positions only, for depth only passes, with index_buffer's LOD and chunk ranges. See mesh_depth.h.
+	u32 depth_vertex_count;
+	Buffer depth_vertex_buffer;
+	Buffer depth_index_buffer;
+	D3D12_INDEX_BUFFER_VIEW depth_index_buffer_view;
+
+	OccluderMesh occluder;//Simplified copy for the CPU occlusion culler
+	MeshLods lods;//Ranges of index_buffer, LOD 0 is the full mesh
+
+	MeshChunk* chunks;//Ranges of LOD 0 with their own bounds, only for meshes over MESH_SPLIT_MIN_TRIANGLES
+	u32 chunk_count;
+};
+
+
+Mesh meshes[4096];
+u32 mesh_count;
+
+//Hot half of draw_call_infos, the only part cull_compute reads for every instance
+Buffer cull_instance_buffers[back_buffer_count];
+CullInstance cull_instance_data[back_buffer_count][MAX_NUM_DRAW_CALLS];
+
+//Instance transforms packed once the store is built, decoded every frame into three float4 rows per uploaded instance for the instanced draws
+Buffer instance_matrix_buffers[back_buffer_count];
+PackedInstanceTransforms packed_instance_transforms;
+InstanceMatrices instance_matrices;
+
+//Runs the slow meshopt build passes on spatial partitions across all job threads. Slightly worse cache efficiency, much faster on big meshes.
+static bool parallel_mesh_build = false;
+
+//Snaps near duplicate vertices together before the remap, position_epsilon 0 turns it off.
+static WeldSettings weld_settings = {};
+
+//Tries every index order from mesh_tune.h per mesh and keeps the cheapest one, printing the comparison table.
+static bool tune_mesh_index_order = false;
+
+//Rasterizes the biggest instances on screen into a small CPU depth buffer and drops the instances hidden behind them before cull_compute runs.
+static bool cpu_occlusion_culling = false;
+
+//Draws what was visible last frame, builds a Hi-Z pyramid from that depth and draws whatever the pyramid cannot hide in a second pass.
+static bool two_phase_occlusion_culling = false;
+
+//F12 writes the next frame's depth buffer and instances to depth_recording.bin, analyze_depth_recording in hiz.h reads it back.
+static bool record_depth_next_frame = false;
+
+//Drops instances smaller than CONTRIBUTION_MIN_SCREEN_RADIUS pixels in cull_compute and picks the coarsest LOD that stays under CONTRIBUTION_LOD_PIXEL_ERROR.
+static bool contribution_culling = false;
+
+//Buckets the visible instances by mesh and LOD in cull_compute and draws each bucket with one instanced draw instead of one draw per instance.
+static bool gpu_instancing = false;
+
+//Uploads the instances nearest first so cull_compute emits their draws front to back. With gpu_instancing that only orders the instances within each bucket.
+static bool sort_draws_front_to_back = false;
+
+//Culls each instance, on the CPU and in cull_compute, with its mesh's tight sphere from bounds.h, turned with the instance every frame, instead of the sphere around the instance origin.
+static bool tight_instance_bounds = false;
+
+//Splits meshes over MESH_SPLIT_MIN_TRIANGLES into spatially compact chunks (mesh_split.h). Nothing culls the chunks yet.
+static bool split_big_meshes = false;
+
+//Builds and uploads a position only vertex stream and shadow index buffer per mesh (mesh_depth.h) for the depth pre-pass and shadows, which do not draw yet.
+static bool build_depth_streams = false;
+
 Mesh load_mesh(char* filename) {
 	Mesh result = {};
     
@@ -441,9 +561,16 @@ Mesh load_mesh(char* filename) {
     
 	load_obj(filename, &old_vertices, &index_count);
     
+	if (weld_settings.position_epsilon > 0.0f) {
+		WeldLayout layout = {sizeof(Vertex), offsetof(Vertex, normal), WELD_NO_ATTRIBUTE};//Vertex has no UVs yet
+		weld_vertices_with_report(filename, old_vertices, index_count, &layout, &weld_settings);
+	}
+    
 	u32* remap = new u32[index_count];
     
-	size_t vertex_count = meshopt_generateVertexRemap(remap, 0, index_count, old_vertices, index_count, sizeof(Vertex));
+	size_t vertex_count = parallel_mesh_build ?
+		generate_vertex_remap_parallel(remap, 0, index_count, old_vertices, index_count, sizeof(Vertex)) :
+		meshopt_generateVertexRemap(remap, 0, index_count, old_vertices, index_count, sizeof(Vertex));
     
 	Vertex* new_vertices = new Vertex[vertex_count];
 	u32* indices = new u32[index_count];
@@ -452,32 +579,55 @@ Mesh load_mesh(char* filename) {
 	meshopt_remapVertexBuffer(new_vertices, old_vertices, index_count, sizeof(Vertex), remap);
 	meshopt_remapIndexBuffer(indices, 0, index_count, remap);
     
-	meshopt_optimizeVertexCache(indices, indices, index_count, vertex_count);
-	meshopt_optimizeVertexFetch(new_vertices, indices, index_count, new_vertices, vertex_count, sizeof(Vertex));
-
-
-	float weight = 1.0 / (float)vertex_count;
-	for (int i = 0; i < vertex_count; ++i) {
-		Vertex& v = new_vertices[i];
-
-		result.bounding_centre.x += v.position[0] * weight;
-		result.bounding_centre.y += v.position[1] * weight;
-		result.bounding_centre.z += v.position[2] * weight;
+	if (tune_mesh_index_order) {
+		u32* tuned_indices = new u32[index_count];
+		TuneReport report;
+		tune_index_order(tuned_indices, indices, index_count, &new_vertices[0].position[0], vertex_count, sizeof(Vertex), 0.25f, &report);
+		print_tune_report_header();
+		print_tune_report(filename, &report);
+		memcpy(indices, tuned_indices, index_count * sizeof(u32));
+		delete[] tuned_indices;
+	}
+	else if (parallel_mesh_build) {
+		f64 start = time_in_seconds();
+		optimize_vertex_cache_parallel(indices, indices, index_count, &new_vertices[0].position[0], vertex_count, sizeof(Vertex));
+		printf("Mesh %s parallel vertex cache optimization took %.1fms\n", filename, (time_in_seconds() - start) * 1000.0);
+		print_vertex_cache_stats("parallel:", indices, index_count, vertex_count);
+	}
+	else {
+		meshopt_optimizeVertexCache(indices, indices, index_count, vertex_count);
 	}
 
-	for (int i = 0; i < vertex_count; ++i) {
-		Vertex& v = new_vertices[i];
-
-		vec3 p;
-		p.x = v.position[0];
-		p.y = v.position[1];
-		p.z = v.position[2];
+	//Before the fetch optimization so each chunk's vertices end up next to each other.
+	if (split_big_meshes && index_count / 3 > MESH_SPLIT_MIN_TRIANGLES) {
+		result.chunks = new MeshChunk[max_mesh_chunks(index_count / 3, MESH_CHUNK_TARGET_TRIANGLES)];
+		result.chunk_count = split_mesh_chunks(result.chunks, indices, index_count, &new_vertices[0].position[0], vertex_count, sizeof(Vertex), MESH_CHUNK_TARGET_TRIANGLES);
+		printf("Mesh %s split into %u chunks\n", filename, result.chunk_count);
+	}
+	meshopt_optimizeVertexFetch(new_vertices, indices, index_count, new_vertices, vertex_count, sizeof(Vertex));
 
-		// p -= result.bounding_centre;TODO(ANDREW) USE THIS
+	if (cpu_occlusion_culling) {
+		build_occluder_mesh(&result.occluder, indices, index_count, &new_vertices[0].position[0], vertex_count, sizeof(Vertex));
+		printf("Mesh %s occluder has %u triangles\n", filename, result.occluder.index_count / 3);
+	}
 
-		result.bounding_radius = MAX(result.bounding_radius, length(p));
+	//Every LOD goes into the one index buffer after the full mesh. Only contribution culling picks coarser LODs.
+	u32* lod_indices = new u32[index_count * 2];
+	u32 lod_index_count = build_mesh_lods(&result.lods, lod_indices, indices, index_count, &new_vertices[0].position[0], vertex_count, sizeof(Vertex),
+	                                      contribution_culling ? MAX_MESH_LODS : 1);
+	printf("Mesh %s has %u LODs:", filename, result.lods.lod_count);
+	for (u32 lod = 0; lod < result.lods.lod_count; ++lod) printf(" %u", result.lods.index_count[lod] / 3);
+	printf(" triangles\n");
+
+	DepthMesh depth_mesh = {};
+	if (build_depth_streams) {
+		build_depth_mesh(&depth_mesh, lod_indices, lod_index_count, &result.lods, result.chunks, result.chunk_count, &new_vertices[0].position[0], vertex_count, sizeof(Vertex));
+		print_depth_mesh_stats(filename, &depth_mesh, lod_indices, result.lods.index_count[0], vertex_count, sizeof(Vertex));
 	}
-	printf("Mesh %s had bounds %f, centre %f %f %f\n", filename, result.bounding_radius, result.bounding_centre.x, result.bounding_centre.y, result.bounding_centre.z);
+
+	compute_mesh_bounds(&result.bounds, &new_vertices[0].position[0], vertex_count, sizeof(Vertex));
+	printf("Mesh %s had bounds %f around the origin, %f around %f %f %f\n", filename, result.bounds.origin_radius, result.bounds.sphere_radius,
+	       result.bounds.sphere_centre.x, result.bounds.sphere_centre.y, result.bounds.sphere_centre.z);
     
 	result.index_count = index_count;
 	result.vertex_count = vertex_count;
@@ -489,14 +639,30 @@ Mesh load_mesh(char* filename) {
 	delete[] old_vertices;
     
     
-	u32 index_buffer_size_in_bytes = result.index_count * sizeof(u32);
+	u32 index_buffer_size_in_bytes = lod_index_count * sizeof(u32);
 	result.index_buffer = create_buffer(index_buffer_size_in_bytes);
-	upload_to_buffer(&result.index_buffer, indices, index_buffer_size_in_bytes, D3D12_RESOURCE_STATE_INDEX_BUFFER);
+	upload_to_buffer(&result.index_buffer, lod_indices, index_buffer_size_in_bytes, D3D12_RESOURCE_STATE_INDEX_BUFFER);
+	delete[] lod_indices;
     
 	result.index_buffer_view.BufferLocation = result.index_buffer.resource->GetGPUVirtualAddress();
 	result.index_buffer_view.Format = DXGI_FORMAT_R32_UINT;
 	result.index_buffer_view.SizeInBytes = index_buffer_size_in_bytes;
     
+	if (build_depth_streams) {
+		result.depth_vertex_count = depth_mesh.vertex_count;
+		u32 depth_vertex_buffer_size_in_bytes = depth_mesh.vertex_count * sizeof(f32) * 3;
+		result.depth_vertex_buffer = create_buffer(depth_vertex_buffer_size_in_bytes);
+		upload_to_buffer(&result.depth_vertex_buffer, depth_mesh.positions, depth_vertex_buffer_size_in_bytes);
+		
+		result.depth_index_buffer = create_buffer(index_buffer_size_in_bytes);
+		upload_to_buffer(&result.depth_index_buffer, depth_mesh.indices, index_buffer_size_in_bytes, D3D12_RESOURCE_STATE_INDEX_BUFFER);
+		free_depth_mesh(&depth_mesh);
+		
+		result.depth_index_buffer_view.BufferLocation = result.depth_index_buffer.resource->GetGPUVirtualAddress();
+		result.depth_index_buffer_view.Format = DXGI_FORMAT_R32_UINT;
+		result.depth_index_buffer_view.SizeInBytes = index_buffer_size_in_bytes;
+	}
+    
 	delete[] indices;
     
 	delete[] remap;
@@ -695,7 +861,7 @@ void init_directx12(HWND window)
 		resource_description.Height = window_height;
 		resource_description.DepthOrArraySize = 1;
 		resource_description.MipLevels = 1;
-		resource_description.Format = DXGI_FORMAT_D32_FLOAT;
+		resource_description.Format = DXGI_FORMAT_R32_TYPELESS;//Typeless so the Hi-Z build can read it as R32_FLOAT
 		resource_description.SampleDesc.Count = 1;
 		resource_description.SampleDesc.Quality = 0;
 		resource_description.Layout = D3D12_TEXTURE_LAYOUT_UNKNOWN;
@@ -747,7 +913,7 @@ void init_directx12(HWND window)
 	ranges[0].Flags = D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE;
     
     
-	D3D12_ROOT_PARAMETER1 root_parameters[3];
+	D3D12_ROOT_PARAMETER1 root_parameters[7];
 	root_parameters[0].ParameterType = D3D12_ROOT_PARAMETER_TYPE_DESCRIPTOR_TABLE;
 	root_parameters[0].ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
 	root_parameters[0].DescriptorTable.NumDescriptorRanges = sizeof(ranges) / sizeof(D3D12_DESCRIPTOR_RANGE1);
@@ -766,6 +932,31 @@ void init_directx12(HWND window)
 	root_parameters[2].Constants.RegisterSpace  = 0;
 	root_parameters[2].Constants.Num32BitValues = (sizeof(ShaderGlobals) + 3) / 4;
 	
+	//Instanced draws: first_instance and instanced, then the instance ids, the frame's draw call infos and instance matrix rows.
+	root_parameters[3].ParameterType = D3D12_ROOT_PARAMETER_TYPE_32BIT_CONSTANTS;
+	root_parameters[3].ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+	root_parameters[3].Constants.ShaderRegister = 2;
+	root_parameters[3].Constants.RegisterSpace  = 0;
+	root_parameters[3].Constants.Num32BitValues = 2;
+	
+	root_parameters[4].ParameterType = D3D12_ROOT_PARAMETER_TYPE_SRV;
+	root_parameters[4].ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+	root_parameters[4].Descriptor.ShaderRegister = 0;
+	root_parameters[4].Descriptor.RegisterSpace  = 1;
+	root_parameters[4].Descriptor.Flags = D3D12_ROOT_DESCRIPTOR_FLAG_NONE;
+	
+	root_parameters[5].ParameterType = D3D12_ROOT_PARAMETER_TYPE_SRV;
+	root_parameters[5].ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+	root_parameters[5].Descriptor.ShaderRegister = 1;
+	root_parameters[5].Descriptor.RegisterSpace  = 1;
+	root_parameters[5].Descriptor.Flags = D3D12_ROOT_DESCRIPTOR_FLAG_NONE;
+	
+	root_parameters[6].ParameterType = D3D12_ROOT_PARAMETER_TYPE_SRV;
+	root_parameters[6].ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+	root_parameters[6].Descriptor.ShaderRegister = 2;
+	root_parameters[6].Descriptor.RegisterSpace  = 1;
+	root_parameters[6].Descriptor.Flags = D3D12_ROOT_DESCRIPTOR_FLAG_NONE;
+	
     
     
 	
@@ -834,6 +1025,13 @@ void init_directx12(HWND window)
         {
             
         }
+        
+        //Instanced draws only set the instance range, the vertex shader loads every instance's DrawInfo itself.
+        arguments[1].Constant.RootParameterIndex = 3;
+        arguments[1].Constant.Num32BitValuesToSet = 2;
+        
+        command_signature_description.ByteStride = sizeof(InstancedDrawArguments);
+        MUST_SUCCEED(device->CreateCommandSignature(&command_signature_description, root_signature, IID_PPV_ARGS(&instanced_command_signature)));
     }
 	
 	{ //UPLOAD STUFF
@@ -879,6 +1077,15 @@ void init_directx12(HWND window)
 			handle.ptr += device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
 		}
 	}
+	
+	{//LOD ranges per mesh, bound as a root SRV for cull_compute
+		MeshLods* mesh_lods = new MeshLods[mesh_count];
+		for(u32 i = 0; i < mesh_count; ++i) mesh_lods[i] = meshes[i].lods;
+		
+		mesh_lod_buffer = create_buffer(sizeof(MeshLods) * mesh_count);
+		upload_to_buffer(&mesh_lod_buffer, mesh_lods, sizeof(MeshLods) * mesh_count);
+		delete[] mesh_lods;
+	}
     
     
 	D3D12_SHADER_BYTECODE vertex_shader_byte_code;
@@ -1030,15 +1237,207 @@ void init_directx12(HWND window)
     
     
     
-    {//Cull/ExecuteIndirect Fill Compute Shader
+    {//Hi-Z pyramid build compute shader, one dispatch per level
         D3D12_SHADER_BYTECODE shader_byte_code;
         
         {
-            LPCWSTR shader_path = L"cull_compute.hlsl";
+            LPCWSTR shader_path = L"hiz_build.hlsl";
             LPCWSTR shader_args[] =
             {
                 shader_path,
                 L"-E", L"main",
+                L"-T", L"cs_6_5",
+                L"-Zi"
+            };
+            IDxcBlobEncoding* source_pointer = 0;
+            utils->LoadFile(shader_path, 0, &source_pointer);
+            DxcBuffer source;
+            source.Ptr  = source_pointer->GetBufferPointer();
+            source.Size = source_pointer->GetBufferSize();
+            source.Encoding = DXC_CP_ACP;
+            
+            IDxcResult* shader_results;
+            compiler->Compile(&source, shader_args, sizeof(shader_args) / sizeof(shader_args[0]), include_handler, IID_PPV_ARGS(&shader_results));
+            
+            IDxcBlobUtf8* shader_errors = 0;
+            shader_results->GetOutput(DXC_OUT_ERRORS, IID_PPV_ARGS(&shader_errors), 0);
+            
+            if(shader_errors && shader_errors->GetStringLength()) printf("Shader Compilation Errors:\n%ls:%s\n", shader_path, (char*)shader_errors->GetBufferPointer());
+            
+            HRESULT shader_status;
+            shader_results->GetStatus(&shader_status);
+            if(FAILED(shader_status)) REPORT_ERROR("Hi-Z Compute Shader Blob is not valid.!");
+            
+            IDxcBlob* shader_blob = 0;
+            IDxcBlobUtf16* shader_name = 0;
+            shader_results->GetOutput(DXC_OUT_OBJECT, IID_PPV_ARGS(&shader_blob), &shader_name);
+            
+            shader_byte_code.pShaderBytecode = shader_blob->GetBufferPointer();
+            shader_byte_code.BytecodeLength = shader_blob->GetBufferSize();
+            if(!shader_byte_code.pShaderBytecode || !shader_byte_code.BytecodeLength)
+                REPORT_ERROR("Error getting bytecode from Hi-Z compute shader!");
+        }
+        
+        {//Create the Root Signature: source SRV table, destination UAV table, level sizes
+            D3D12_DESCRIPTOR_RANGE1 source_range = {};
+            source_range.RegisterSpace = 0;
+            source_range.BaseShaderRegister = 0;
+            source_range.RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_SRV;
+            source_range.NumDescriptors = 1;
+            source_range.OffsetInDescriptorsFromTableStart = 0;
+            source_range.Flags = D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE;
+            
+            D3D12_DESCRIPTOR_RANGE1 destination_range = source_range;
+            destination_range.RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_UAV;
+            
+            D3D12_ROOT_PARAMETER1 root_parameters[3];
+            root_parameters[0].ParameterType = D3D12_ROOT_PARAMETER_TYPE_DESCRIPTOR_TABLE;
+            root_parameters[0].ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+            root_parameters[0].DescriptorTable.NumDescriptorRanges = 1;
+            root_parameters[0].DescriptorTable.pDescriptorRanges = &source_range;
+            
+            root_parameters[1].ParameterType = D3D12_ROOT_PARAMETER_TYPE_DESCRIPTOR_TABLE;
+            root_parameters[1].ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+            root_parameters[1].DescriptorTable.NumDescriptorRanges = 1;
+            root_parameters[1].DescriptorTable.pDescriptorRanges = &destination_range;
+            
+            root_parameters[2].ParameterType = D3D12_ROOT_PARAMETER_TYPE_32BIT_CONSTANTS;
+            root_parameters[2].ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+            root_parameters[2].Constants.ShaderRegister = 0;
+            root_parameters[2].Constants.RegisterSpace  = 0;
+            root_parameters[2].Constants.Num32BitValues = 4;
+            
+            D3D12_VERSIONED_ROOT_SIGNATURE_DESC root_signature_description;
+            root_signature_description.Version = D3D_ROOT_SIGNATURE_VERSION_1_1;
+            root_signature_description.Desc_1_1.Flags = D3D12_ROOT_SIGNATURE_FLAG_NONE;
+            root_signature_description.Desc_1_1.NumParameters = _countof(root_parameters);
+            root_signature_description.Desc_1_1.pParameters = root_parameters;
+            root_signature_description.Desc_1_1.NumStaticSamplers = 0;
+            root_signature_description.Desc_1_1.pStaticSamplers = 0;
+            
+            ID3DBlob* signature = 0;
+            ID3DBlob* error = 0;
+            
+            if(D3D12SerializeVersionedRootSignature(&root_signature_description, &signature, &error) != S_OK)
+            {
+                char* error_string = (char*)error->GetBufferPointer();
+                REPORT_ERROR(error_string);
+                error->Release();
+                error = 0;
+            }
+            if(device->CreateRootSignature(0, signature->GetBufferPointer(), signature->GetBufferSize(), IID_PPV_ARGS(&hiz_build_root_signature)) != S_OK)
+            {
+                char* error_string = (char*)error->GetBufferPointer();
+                REPORT_ERROR(error_string);
+                error->Release();
+                error = 0;
+            }
+            if(signature)
+            {
+                signature->Release();
+                signature = 0;
+            }
+        }
+        
+        //Level 0 is half the depth buffer, rounded up, like hiz.h. Rounding the texture up to powers of two makes
+        //D3D's rounded down mip sizes at least as big as the rounded up levels.
+        hiz_levels = hiz_level_count(window_width, window_height);
+        
+        u32 hiz_texture_width = 1;
+        u32 hiz_texture_height = 1;
+        while(hiz_texture_width < (window_width + 1) / 2) hiz_texture_width *= 2;
+        while(hiz_texture_height < (window_height + 1) / 2) hiz_texture_height *= 2;
+        
+        {
+            D3D12_HEAP_PROPERTIES heap_properties = {};
+            heap_properties.Type = D3D12_HEAP_TYPE_DEFAULT;
+            heap_properties.CPUPageProperty = D3D12_CPU_PAGE_PROPERTY_UNKNOWN;
+            heap_properties.MemoryPoolPreference = D3D12_MEMORY_POOL_UNKNOWN;
+            heap_properties.CreationNodeMask = 1;
+            heap_properties.VisibleNodeMask = 1;
+            
+            D3D12_RESOURCE_DESC resource_description = {};
+            resource_description.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
+            resource_description.Alignment = 0;
+            resource_description.Width = hiz_texture_width;
+            resource_description.Height = hiz_texture_height;
+            resource_description.DepthOrArraySize = 1;
+            resource_description.MipLevels = hiz_levels;
+            resource_description.Format = DXGI_FORMAT_R32_FLOAT;
+            resource_description.SampleDesc.Count = 1;
+            resource_description.SampleDesc.Quality = 0;
+            resource_description.Layout = D3D12_TEXTURE_LAYOUT_UNKNOWN;
+            resource_description.Flags = D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS;
+            
+            MUST_SUCCEED(device->CreateCommittedResource(&heap_properties, D3D12_HEAP_FLAG_NONE, &resource_description, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE, nullptr, IID_PPV_ARGS(&hiz_texture)));
+            hiz_texture->SetName(L"Hi-Z Pyramid");
+        }
+        
+        D3D12_DESCRIPTOR_HEAP_DESC heap_desc = {};
+        heap_desc.NumDescriptors = back_buffer_count + 2 * HIZ_MAX_LEVELS;
+        heap_desc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV;
+        heap_desc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE;
+        MUST_SUCCEED(device->CreateDescriptorHeap(&heap_desc, IID_PPV_ARGS(&hiz_heap)));
+        
+        u32 descriptor_size = device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+        D3D12_CPU_DESCRIPTOR_HANDLE heap_handle = hiz_heap->GetCPUDescriptorHandleForHeapStart();
+        
+        D3D12_SHADER_RESOURCE_VIEW_DESC srv_description = {};
+        srv_description.Format = DXGI_FORMAT_R32_FLOAT;
+        srv_description.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+        srv_description.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+        srv_description.Texture2D.MostDetailedMip = 0;
+        srv_description.Texture2D.MipLevels = 1;
+        
+        for(u32 i = 0; i < back_buffer_count; ++i)
+        {
+            device->CreateShaderResourceView(depth_stencil_targets[i], &srv_description, heap_handle);
+            heap_handle.ptr += descriptor_size;
+        }
+        
+        for(u32 level = 0; level < hiz_levels; ++level)
+        {
+            srv_description.Texture2D.MostDetailedMip = level;
+            device->CreateShaderResourceView(hiz_texture, &srv_description, heap_handle);
+            heap_handle.ptr += descriptor_size;
+        }
+        
+        heap_handle.ptr = hiz_heap->GetCPUDescriptorHandleForHeapStart().ptr + (back_buffer_count + HIZ_MAX_LEVELS) * descriptor_size;
+        
+        D3D12_UNORDERED_ACCESS_VIEW_DESC uav_description = {};
+        uav_description.Format = DXGI_FORMAT_R32_FLOAT;
+        uav_description.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2D;
+        
+        for(u32 level = 0; level < hiz_levels; ++level)
+        {
+            uav_description.Texture2D.MipSlice = level;
+            device->CreateUnorderedAccessView(hiz_texture, nullptr, &uav_description, heap_handle);
+            heap_handle.ptr += descriptor_size;
+        }
+        
+        D3D12_COMPUTE_PIPELINE_STATE_DESC compute_pipeline_description = {};
+        compute_pipeline_description.pRootSignature = hiz_build_root_signature;
+        compute_pipeline_description.CS = shader_byte_code;
+        compute_pipeline_description.Flags = D3D12_PIPELINE_STATE_FLAG_NONE;
+        
+        MUST_SUCCEED(device->CreateComputePipelineState(&compute_pipeline_description, IID_PPV_ARGS(&hiz_build_pipeline_state)));
+    }
+    
+    
+    {//Cull/ExecuteIndirect Fill Compute Shader
+        //main culls and counts, compact writes the survivors in input order, or bucket_offsets and bucket_scatter group
+        //them into instanced draws. Same root signature for all of them.
+        LPCWSTR entry_points[] = { L"main", L"compact", L"bucket_offsets", L"bucket_scatter" };
+        D3D12_SHADER_BYTECODE shader_byte_codes[_countof(entry_points)];
+        
+        for(u32 entry = 0; entry < _countof(entry_points); ++entry)
+        {
+            D3D12_SHADER_BYTECODE& shader_byte_code = shader_byte_codes[entry];
+            LPCWSTR shader_path = L"cull_compute.hlsl";
+            LPCWSTR shader_args[] =
+            {
+                shader_path,
+                L"-E", entry_points[entry],
                 L"-T", L"cs_6_5",//6_5 is latest supported by my 1060, 6_3 latest on the surface (intel 520)
                 L"-Zi"
             };
@@ -1073,11 +1472,16 @@ void init_directx12(HWND window)
         
         
         {//Create the Root Signature
-            D3D12_DESCRIPTOR_RANGE1 ranges[3];
+            //Heap layout, one block of back_buffer_count descriptors each, the table starts at frame_index:
+            //draw call infos (t0), argument buffers (u0), late argument buffers (u2), visibility (u1), Hi-Z (t1), cull instances (t3),
+            //instance results (u3), group counts (u4), group bucket counts (u5), bucket ranges (u6), instance ids (u7),
+            //instanced views of the argument buffers (u8) and late argument buffers (u9).
+            //Visibility, Hi-Z and the compaction and instancing scratch hold the same resource in every slot.
+            D3D12_DESCRIPTOR_RANGE1 ranges[13];
             ranges[0].RegisterSpace = 0;
             ranges[0].BaseShaderRegister = 0;
             ranges[0].RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_SRV;
-            ranges[0].NumDescriptors = UINT_MAX;
+            ranges[0].NumDescriptors = 1;
             ranges[0].OffsetInDescriptorsFromTableStart = 0;
             ranges[0].Flags = D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE;
             
@@ -1089,14 +1493,84 @@ void init_directx12(HWND window)
             ranges[1].Flags = D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE;
             
             ranges[2].RegisterSpace = 0;
-            ranges[2].BaseShaderRegister = 1;
+            ranges[2].BaseShaderRegister = 2;
             ranges[2].RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_UAV;
             ranges[2].NumDescriptors = 1;
-            ranges[2].OffsetInDescriptorsFromTableStart = back_buffer_count * 2;//@sus
+            ranges[2].OffsetInDescriptorsFromTableStart = back_buffer_count * 2;
             ranges[2].Flags = D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE;
 
-
-            D3D12_ROOT_PARAMETER1 root_parameters[2];
+            ranges[3].RegisterSpace = 0;
+            ranges[3].BaseShaderRegister = 1;
+            ranges[3].RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_UAV;
+            ranges[3].NumDescriptors = 1;
+            ranges[3].OffsetInDescriptorsFromTableStart = back_buffer_count * 3;
+            ranges[3].Flags = D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE;
+
+            ranges[4].RegisterSpace = 0;
+            ranges[4].BaseShaderRegister = 1;
+            ranges[4].RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_SRV;
+            ranges[4].NumDescriptors = 1;
+            ranges[4].OffsetInDescriptorsFromTableStart = back_buffer_count * 4;
+            ranges[4].Flags = D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE;
+
+            ranges[5].RegisterSpace = 0;
+            ranges[5].BaseShaderRegister = 3;
+            ranges[5].RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_SRV;
+            ranges[5].NumDescriptors = 1;
+            ranges[5].OffsetInDescriptorsFromTableStart = back_buffer_count * 5;
+            ranges[5].Flags = D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE;
+
+            ranges[6].RegisterSpace = 0;
+            ranges[6].BaseShaderRegister = 3;
+            ranges[6].RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_UAV;
+            ranges[6].NumDescriptors = 1;
+            ranges[6].OffsetInDescriptorsFromTableStart = back_buffer_count * 6;
+            ranges[6].Flags = D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE;
+
+            ranges[7].RegisterSpace = 0;
+            ranges[7].BaseShaderRegister = 4;
+            ranges[7].RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_UAV;
+            ranges[7].NumDescriptors = 1;
+            ranges[7].OffsetInDescriptorsFromTableStart = back_buffer_count * 7;
+            ranges[7].Flags = D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE;
+
+            ranges[8].RegisterSpace = 0;
+            ranges[8].BaseShaderRegister = 5;
+            ranges[8].RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_UAV;
+            ranges[8].NumDescriptors = 1;
+            ranges[8].OffsetInDescriptorsFromTableStart = back_buffer_count * 8;
+            ranges[8].Flags = D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE;
+
+            ranges[9].RegisterSpace = 0;
+            ranges[9].BaseShaderRegister = 6;
+            ranges[9].RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_UAV;
+            ranges[9].NumDescriptors = 1;
+            ranges[9].OffsetInDescriptorsFromTableStart = back_buffer_count * 9;
+            ranges[9].Flags = D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE;
+
+            ranges[10].RegisterSpace = 0;
+            ranges[10].BaseShaderRegister = 7;
+            ranges[10].RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_UAV;
+            ranges[10].NumDescriptors = 1;
+            ranges[10].OffsetInDescriptorsFromTableStart = back_buffer_count * 10;
+            ranges[10].Flags = D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE;
+
+            ranges[11].RegisterSpace = 0;
+            ranges[11].BaseShaderRegister = 8;
+            ranges[11].RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_UAV;
+            ranges[11].NumDescriptors = 1;
+            ranges[11].OffsetInDescriptorsFromTableStart = back_buffer_count * 11;
+            ranges[11].Flags = D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE;
+
+            ranges[12].RegisterSpace = 0;
+            ranges[12].BaseShaderRegister = 9;
+            ranges[12].RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_UAV;
+            ranges[12].NumDescriptors = 1;
+            ranges[12].OffsetInDescriptorsFromTableStart = back_buffer_count * 12;
+            ranges[12].Flags = D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE;
+
+
+            D3D12_ROOT_PARAMETER1 root_parameters[4];
             root_parameters[0].ParameterType = D3D12_ROOT_PARAMETER_TYPE_DESCRIPTOR_TABLE;
             root_parameters[0].ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
             root_parameters[0].DescriptorTable.NumDescriptorRanges = _countof(ranges);
@@ -1109,6 +1583,17 @@ void init_directx12(HWND window)
 			root_parameters[1].Constants.RegisterSpace  = 0;
 			root_parameters[1].Constants.Num32BitValues = (sizeof(ShaderGlobals) + 3) / 4;
 			
+			root_parameters[2].ParameterType = D3D12_ROOT_PARAMETER_TYPE_32BIT_CONSTANTS;
+			root_parameters[2].ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+			root_parameters[2].Constants.ShaderRegister = 3;
+			root_parameters[2].Constants.RegisterSpace  = 0;
+			root_parameters[2].Constants.Num32BitValues = sizeof(CullParameters) / 4;
+			
+			root_parameters[3].ParameterType = D3D12_ROOT_PARAMETER_TYPE_SRV;
+			root_parameters[3].ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
+			root_parameters[3].Descriptor.ShaderRegister = 2;
+			root_parameters[3].Descriptor.RegisterSpace  = 0;
+			root_parameters[3].Descriptor.Flags = D3D12_ROOT_DESCRIPTOR_FLAG_DATA_STATIC;
             
             
             D3D12_VERSIONED_ROOT_SIGNATURE_DESC root_signature_description;
@@ -1149,7 +1634,7 @@ void init_directx12(HWND window)
         
         
         D3D12_DESCRIPTOR_HEAP_DESC heap_desc = {};
-		heap_desc.NumDescriptors = back_buffer_count * 2;
+		heap_desc.NumDescriptors = back_buffer_count * 13;
 		heap_desc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV;
 		heap_desc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE;
         
@@ -1173,7 +1658,9 @@ void init_directx12(HWND window)
             heap_handle.ptr += device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
         }
         
-		//Output Argument Buffer
+		//Output Argument Buffers, the early (or only) phase ones first, then the late phase ones
+		Buffer* argument_buffer_sets[2] = { draw_call_argument_buffers, late_draw_call_argument_buffers };
+		for(u32 set = 0; set < 2; ++set)
         for(u32 i = 0; i < back_buffer_count; ++i)
         {
 
@@ -1207,9 +1694,10 @@ void init_directx12(HWND window)
             resource_description.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
             resource_description.Flags = D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS;
             
-            MUST_SUCCEED(device->CreateCommittedResource(&heap_properties, D3D12_HEAP_FLAG_NONE, &resource_description, D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT, nullptr, IID_PPV_ARGS(&draw_call_argument_buffers[i].resource)));
+            Buffer* argument_buffer = &argument_buffer_sets[set][i];
+            MUST_SUCCEED(device->CreateCommittedResource(&heap_properties, D3D12_HEAP_FLAG_NONE, &resource_description, D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT, nullptr, IID_PPV_ARGS(&argument_buffer->resource)));
             
-			draw_call_argument_buffers[i].size_in_bytes = sizeof(DrawArguments)*MAX_NUM_DRAW_CALLS;
+			argument_buffer->size_in_bytes = sizeof(DrawArguments)*MAX_NUM_DRAW_CALLS;
 
             D3D12_UNORDERED_ACCESS_VIEW_DESC uav_desc = {};
             uav_desc.Format = DXGI_FORMAT_UNKNOWN;
@@ -1220,11 +1708,156 @@ void init_directx12(HWND window)
             uav_desc.Buffer.CounterOffsetInBytes = command_buffer_offset_to_counter;
             uav_desc.Buffer.Flags = D3D12_BUFFER_UAV_FLAG_NONE;
 
-            device->CreateUnorderedAccessView(draw_call_argument_buffers[i].resource, draw_call_argument_buffers[i].resource, &uav_desc,
+            device->CreateUnorderedAccessView(argument_buffer->resource, argument_buffer->resource, &uav_desc,
                                               heap_handle);
             heap_handle.ptr += device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
 
-			draw_call_argument_buffers[i].resource->SetName(i == 0 ? L"Output Argument Buffer 1" : L"Output Argument Buffer >1");
+			if (set == 0) argument_buffer->resource->SetName(i == 0 ? L"Output Argument Buffer 1" : L"Output Argument Buffer >1");
+			else argument_buffer->resource->SetName(i == 0 ? L"Late Output Argument Buffer 1" : L"Late Output Argument Buffer >1");
+        }
+        
+		{//Instance visibility bits, zeroed on creation so the first frame draws everything in the late phase
+            D3D12_HEAP_PROPERTIES heap_properties = {};
+            heap_properties.Type = D3D12_HEAP_TYPE_DEFAULT;
+            heap_properties.CPUPageProperty = D3D12_CPU_PAGE_PROPERTY_UNKNOWN;
+            heap_properties.MemoryPoolPreference = D3D12_MEMORY_POOL_UNKNOWN;
+            heap_properties.CreationNodeMask = 1;
+            heap_properties.VisibleNodeMask = 1;
+            
+            D3D12_RESOURCE_DESC resource_description = {};
+            resource_description.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
+            resource_description.Alignment = 0;
+            resource_description.Width = sizeof(u32) * (MAX_NUM_DRAW_CALLS / 32);
+            resource_description.Height = 1;
+            resource_description.DepthOrArraySize = 1;
+            resource_description.MipLevels = 1;
+            resource_description.Format = DXGI_FORMAT_UNKNOWN;
+            resource_description.SampleDesc.Count = 1;
+            resource_description.SampleDesc.Quality = 0;
+            resource_description.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
+            resource_description.Flags = D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS;
+            
+            MUST_SUCCEED(device->CreateCommittedResource(&heap_properties, D3D12_HEAP_FLAG_NONE, &resource_description, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, nullptr, IID_PPV_ARGS(&instance_visibility_buffer)));
+            instance_visibility_buffer->SetName(L"Instance Visibility Bits");
+            
+            D3D12_UNORDERED_ACCESS_VIEW_DESC uav_desc = {};
+            uav_desc.Format = DXGI_FORMAT_UNKNOWN;
+            uav_desc.ViewDimension = D3D12_UAV_DIMENSION_BUFFER;
+            uav_desc.Buffer.FirstElement = 0;
+            uav_desc.Buffer.NumElements = MAX_NUM_DRAW_CALLS / 32;
+            uav_desc.Buffer.StructureByteStride = sizeof(u32);
+            uav_desc.Buffer.CounterOffsetInBytes = 0;
+            uav_desc.Buffer.Flags = D3D12_BUFFER_UAV_FLAG_NONE;
+            
+            for(u32 i = 0; i < back_buffer_count; ++i)
+            {
+                device->CreateUnorderedAccessView(instance_visibility_buffer, nullptr, &uav_desc, heap_handle);
+                heap_handle.ptr += device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+            }
+        }
+        
+		{//The whole Hi-Z pyramid for the late phase
+            D3D12_SHADER_RESOURCE_VIEW_DESC hiz_srv_description = {};
+            hiz_srv_description.Format = DXGI_FORMAT_R32_FLOAT;
+            hiz_srv_description.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+            hiz_srv_description.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+            hiz_srv_description.Texture2D.MostDetailedMip = 0;
+            hiz_srv_description.Texture2D.MipLevels = hiz_levels;
+            
+            for(u32 i = 0; i < back_buffer_count; ++i)
+            {
+                device->CreateShaderResourceView(hiz_texture, &hiz_srv_description, heap_handle);
+                heap_handle.ptr += device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+            }
+        }
+        
+		//Cull instances, uploaded every frame next to the draw call infos
+        srv_description.Buffer.StructureByteStride = sizeof(CullInstance);
+        for(u32 i = 0; i < back_buffer_count; ++i)
+        {
+            cull_instance_buffers[i] = create_buffer(sizeof(CullInstance)*MAX_NUM_DRAW_CALLS);
+            cull_instance_buffers[i].resource->SetName(L"Cull Instances");
+            
+            device->CreateShaderResourceView(cull_instance_buffers[i].resource, &srv_description, heap_handle);
+            heap_handle.ptr += device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+        }
+        
+		//Instance matrix rows, a root SRV of the graphics root signature so no descriptor
+        for(u32 i = 0; i < back_buffer_count; ++i)
+        {
+            instance_matrix_buffers[i] = create_buffer(sizeof(vec4)*3*MAX_NUM_DRAW_CALLS);
+            instance_matrix_buffers[i].resource->SetName(L"Instance Matrices");
+        }
+        
+		//Compaction scratch: a result per instance and a survivor count per cull group. Only used within a frame.
+		//Then the instancing buffers: survivors per group and bucket, the bucket ranges and the instance ids, which
+		//sit in NON_PIXEL_SHADER_RESOURCE for the draws outside of the cull dispatches.
+		static_assert(MAX_NUM_DRAW_CALLS % CULL_GROUP_SIZE == 0, "group counts are sized for whole groups");
+		static_assert(MAX_NUM_DRAW_CALLS <= CULL_VISIBILITY_INDEX_MASK + 1, "instance store slots have to fit CullInstance's visibility index");
+		ID3D12Resource** compaction_buffers[5] = { &instance_result_buffer, &group_count_buffer, &group_bucket_count_buffer, &bucket_range_buffer, &instance_id_buffer };
+		u32 compaction_buffer_counts[5] = { MAX_NUM_DRAW_CALLS, MAX_NUM_DRAW_CALLS / CULL_GROUP_SIZE, MAX_NUM_DRAW_CALLS / CULL_GROUP_SIZE * MAX_INSTANCE_BUCKETS, MAX_INSTANCE_BUCKETS, MAX_NUM_DRAW_CALLS };
+		u32 compaction_buffer_strides[5] = { sizeof(u32), sizeof(u32), sizeof(u32), sizeof(BucketRange), sizeof(u32) };
+		D3D12_RESOURCE_STATES compaction_buffer_states[5] = { D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+		                                                      D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE };
+		const wchar_t* compaction_buffer_names[5] = { L"Cull Instance Results", L"Cull Group Counts", L"Cull Group Bucket Counts", L"Cull Bucket Ranges", L"Instance Ids" };
+		for(u32 set = 0; set < 5; ++set)
+		{
+            D3D12_HEAP_PROPERTIES heap_properties = {};
+            heap_properties.Type = D3D12_HEAP_TYPE_DEFAULT;
+            heap_properties.CPUPageProperty = D3D12_CPU_PAGE_PROPERTY_UNKNOWN;
+            heap_properties.MemoryPoolPreference = D3D12_MEMORY_POOL_UNKNOWN;
+            heap_properties.CreationNodeMask = 1;
+            heap_properties.VisibleNodeMask = 1;
+            
+            D3D12_RESOURCE_DESC resource_description = {};
+            resource_description.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
+            resource_description.Alignment = 0;
+            resource_description.Width = compaction_buffer_strides[set] * compaction_buffer_counts[set];
+            resource_description.Height = 1;
+            resource_description.DepthOrArraySize = 1;
+            resource_description.MipLevels = 1;
+            resource_description.Format = DXGI_FORMAT_UNKNOWN;
+            resource_description.SampleDesc.Count = 1;
+            resource_description.SampleDesc.Quality = 0;
+            resource_description.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
+            resource_description.Flags = D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS;
+            
+            ID3D12Resource** buffer = compaction_buffers[set];
+            MUST_SUCCEED(device->CreateCommittedResource(&heap_properties, D3D12_HEAP_FLAG_NONE, &resource_description, compaction_buffer_states[set], nullptr, IID_PPV_ARGS(buffer)));
+            (*buffer)->SetName(compaction_buffer_names[set]);
+            
+            D3D12_UNORDERED_ACCESS_VIEW_DESC uav_desc = {};
+            uav_desc.Format = DXGI_FORMAT_UNKNOWN;
+            uav_desc.ViewDimension = D3D12_UAV_DIMENSION_BUFFER;
+            uav_desc.Buffer.FirstElement = 0;
+            uav_desc.Buffer.NumElements = compaction_buffer_counts[set];
+            uav_desc.Buffer.StructureByteStride = compaction_buffer_strides[set];
+            uav_desc.Buffer.CounterOffsetInBytes = 0;
+            uav_desc.Buffer.Flags = D3D12_BUFFER_UAV_FLAG_NONE;
+            
+            for(u32 i = 0; i < back_buffer_count; ++i)
+            {
+                device->CreateUnorderedAccessView(*buffer, nullptr, &uav_desc, heap_handle);
+                heap_handle.ptr += device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+            }
+		}
+        
+		//The argument buffers again, viewed as InstancedDrawArguments with the same counter
+		for(u32 set = 0; set < 2; ++set)
+        for(u32 i = 0; i < back_buffer_count; ++i)
+        {
+            D3D12_UNORDERED_ACCESS_VIEW_DESC uav_desc = {};
+            uav_desc.Format = DXGI_FORMAT_UNKNOWN;
+            uav_desc.ViewDimension = D3D12_UAV_DIMENSION_BUFFER;
+            uav_desc.Buffer.FirstElement = 0;
+            uav_desc.Buffer.NumElements = MAX_NUM_DRAW_CALLS;
+            uav_desc.Buffer.StructureByteStride = sizeof(InstancedDrawArguments);
+            uav_desc.Buffer.CounterOffsetInBytes = command_buffer_offset_to_counter;
+            uav_desc.Buffer.Flags = D3D12_BUFFER_UAV_FLAG_NONE;
+            
+            ID3D12Resource* argument_buffer = argument_buffer_sets[set][i].resource;
+            device->CreateUnorderedAccessView(argument_buffer, argument_buffer, &uav_desc, heap_handle);
+            heap_handle.ptr += device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
         }
         
 		{
@@ -1269,10 +1902,19 @@ void init_directx12(HWND window)
 
         D3D12_COMPUTE_PIPELINE_STATE_DESC compute_pipeline_description = {};
         compute_pipeline_description.pRootSignature = cull_compute_root_signature;
-        compute_pipeline_description.CS = shader_byte_code;
+        compute_pipeline_description.CS = shader_byte_codes[0];
         compute_pipeline_description.Flags = D3D12_PIPELINE_STATE_FLAG_NONE;
         
         MUST_SUCCEED(device->CreateComputePipelineState(&compute_pipeline_description, IID_PPV_ARGS(&cull_compute_pipeline_state)));
+        
+        compute_pipeline_description.CS = shader_byte_codes[1];
+        MUST_SUCCEED(device->CreateComputePipelineState(&compute_pipeline_description, IID_PPV_ARGS(&cull_compact_pipeline_state)));
+        
+        compute_pipeline_description.CS = shader_byte_codes[2];
+        MUST_SUCCEED(device->CreateComputePipelineState(&compute_pipeline_description, IID_PPV_ARGS(&cull_bucket_offsets_pipeline_state)));
+        
+        compute_pipeline_description.CS = shader_byte_codes[3];
+        MUST_SUCCEED(device->CreateComputePipelineState(&compute_pipeline_description, IID_PPV_ARGS(&cull_bucket_scatter_pipeline_state)));
     }
     
     
@@ -1299,6 +1941,55 @@ LRESULT CALLBACK windowProc(HWND window, UINT message, WPARAM wParam, LPARAM lPa
 	return result;
 }
 
+InstanceStore instance_store;
+
+OcclusionBuffer occlusion_buffer;
+OccluderMesh occluder_meshes[4096];//Indexed by vertex_buffer_index like meshes
+u8 occluded_instances[MAX_NUM_DRAW_CALLS];
+
+// The cull passes, with the root signature and bindings already set. The argument buffer's counter ends up at the
+// exact number of draws: one per survivor in input order, or with instanced one per non-empty mesh and LOD bucket,
+// in bucket order with the instance ids in input order within each bucket.
+void dispatch_cull(ID3D12GraphicsCommandList* cl, u32 instance_count, bool instanced)
+{
+	u32 group_count = (instance_count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE;
+	
+	//The scratch buffers are shared by every cull, the last compaction may still be reading them.
+	D3D12_RESOURCE_BARRIER barriers[4] = {};
+	barriers[0].Type = D3D12_RESOURCE_BARRIER_TYPE_UAV;
+	barriers[0].UAV.pResource = instance_result_buffer;
+	barriers[1].Type = D3D12_RESOURCE_BARRIER_TYPE_UAV;
+	barriers[1].UAV.pResource = group_count_buffer;
+	barriers[2].Type = D3D12_RESOURCE_BARRIER_TYPE_UAV;
+	barriers[2].UAV.pResource = group_bucket_count_buffer;
+	barriers[3].Type = D3D12_RESOURCE_BARRIER_TYPE_UAV;
+	barriers[3].UAV.pResource = bucket_range_buffer;
+	cl->ResourceBarrier(_countof(barriers), barriers);
+	
+	cl->SetPipelineState(cull_compute_pipeline_state);
+	cl->Dispatch(group_count, 1, 1);
+	
+	cl->ResourceBarrier(_countof(barriers), barriers);
+	
+	if (!instanced)
+	{
+		cl->SetPipelineState(cull_compact_pipeline_state);
+		cl->Dispatch(group_count, 1, 1);
+		return;
+	}
+	
+	cl->SetPipelineState(cull_bucket_offsets_pipeline_state);
+	cl->Dispatch(1, 1, 1);
+	
+	cl->ResourceBarrier(_countof(barriers), barriers);
+	
+	//Waits for any draws still reading the ids.
+	transition(cl, instance_id_buffer, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+	cl->SetPipelineState(cull_bucket_scatter_pipeline_state);
+	cl->Dispatch(group_count, 1, 1);
+	transition(cl, instance_id_buffer, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
+}
+
 void draw(f64 dt)
 {
 	// Sleep(500);
@@ -1354,6 +2045,12 @@ void draw(f64 dt)
     
     bool execute_indirect = true;
     
+    //0 when every visible instance gets its own draw.
+    u32 instance_bucket_count = gpu_instancing ? mesh_count * MAX_MESH_LODS : 0;
+    assert(instance_bucket_count <= MAX_INSTANCE_BUCKETS);
+    ID3D12CommandSignature* draw_command_signature = instance_bucket_count ? instanced_command_signature : command_signature;
+    u32 max_draw_count = instance_bucket_count ? instance_bucket_count : draw_count;
+    
     if(execute_indirect)
     {//Fill the draw call argument buffer
         command_list->SetPipelineState(cull_compute_pipeline_state);
@@ -1366,37 +2063,149 @@ void draw(f64 dt)
         command_list->SetComputeRootDescriptorTable(0, heap_handle);        
 
 		command_list->SetComputeRoot32BitConstants(1, (sizeof(global_data) + 3) / 4, &global_data, 0);
+		
+		CullParameters cull_parameters = {};
+		cull_parameters.phase = two_phase_occlusion_culling ? CULL_PHASE_EARLY : CULL_PHASE_ALL;
+		cull_parameters.hiz_level_count = hiz_levels;
+		cull_parameters.screen_width = window_width;
+		cull_parameters.screen_height = window_height;
+		cull_parameters.min_screen_radius = contribution_culling ? CONTRIBUTION_MIN_SCREEN_RADIUS : 0.0f;
+		cull_parameters.lod_pixel_error = contribution_culling ? CONTRIBUTION_LOD_PIXEL_ERROR : -1.0f;
+		cull_parameters.instance_count = draw_count;
+		cull_parameters.bucket_count = instance_bucket_count;
+		command_list->SetComputeRoot32BitConstants(2, sizeof(cull_parameters) / 4, &cull_parameters, 0);
+		command_list->SetComputeRootShaderResourceView(3, mesh_lod_buffer.resource->GetGPUVirtualAddress());
 
 		transition(command_list, draw_call_argument_buffers[frame_index].resource, D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT, D3D12_RESOURCE_STATE_COPY_DEST);
 		command_list->CopyBufferRegion(draw_call_argument_buffers[frame_index].resource, command_buffer_offset_to_counter, draw_call_argument_count_reset_buffer, 0, sizeof(u32));
+		
+		transition(command_list, late_draw_call_argument_buffers[frame_index].resource, D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT, D3D12_RESOURCE_STATE_COPY_DEST);
+		command_list->CopyBufferRegion(late_draw_call_argument_buffers[frame_index].resource, command_buffer_offset_to_counter, draw_call_argument_count_reset_buffer, 0, sizeof(u32));
+		transition(command_list, late_draw_call_argument_buffers[frame_index].resource, D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
 
         {
 
+            //The scene is static, so the instances are generated once and kept in Morton order by the instance store.
+            if (!instance_store.capacity)
+            {
+                init_instance_store(&instance_store, MAX_NUM_DRAW_CALLS, Vec3(-h_range, -y_range, -h_range), Vec3(h_range, y_range, h_range));
+                
+                for(u32 i = 0; i < draw_count; ++i)
+                {
+                    u32 mesh_index = rand() % mesh_count;
+                    Mesh& mesh = meshes[mesh_index];
+                    
+                    DrawCallInfo info = {};
+                    info.triangle_count = mesh.index_count / 3;
+                    info.index_buffer_view = mesh.index_buffer_view;
+                    
+                    DrawInfo draw_info = {};
+                    draw_info.position = { rand_f32_in_range(-h_range, h_range, &rng), rand_f32_in_range(-y_range, y_range, &rng), rand_f32_in_range(-h_range, h_range, &rng) };
+                    draw_info.quat = { rand_f32_in_range(-1.0, 1.0, &rng), rand_f32_in_range(-1.0, 1.0, &rng), rand_f32_in_range(-1.0, 1.0, &rng), rand_f32_in_range(-1.0, 1.0, &rng) };
+                    
+                    draw_info.quat = normalize(draw_info.quat);
+                    draw_info.vertex_buffer_index = mesh_index;
+                    
+                    info.draw_info = draw_info;
+                    info.bounding_radius = mesh.bounds.origin_radius;//Holds for any rotation. Redone per frame below, and scaled there since bounds_scale follows the window size
+                    
+                    add_instance(&instance_store, &info);
+                }
+                
+                update_instance_order(&instance_store);
+                
+                //Nothing moves after this, so the store order and the packed transforms stay valid.
+                pack_instance_transforms(&packed_instance_transforms, instance_store.instances, instance_store.count);
+                init_instance_matrices(&instance_matrices, MAX_NUM_DRAW_CALLS);
+            }
+            
             //We fill the buffer here but in theory this could be done elsewhere on another thread or whatever?
             DrawCallInfo* infos = draw_call_infos[frame_index];
             *infos = {};
             
+            update_instance_order(&instance_store);
+            
+            //Spheres the CPU culling below and cull_compute all test. The tight sphere turns with its instance, so it is redone every frame.
+            for(u32 i = 0; i < instance_store.count; ++i)
+            {
+                DrawCallInfo* instance = &instance_store.instances[i];
+                const MeshBounds* bounds = &meshes[instance->draw_info.vertex_buffer_index].bounds;
+                
+                if (tight_instance_bounds)
+                {
+                    vec4 rotation = instance_rotation(instance->draw_info.quat, global_data.time);
+                    instance->bounding_centre = rotate_vec_by_quat(bounds->sphere_centre, rotation);
+                    instance->bounding_radius = bounds->sphere_radius;
+                }
+                else
+                {
+                    instance->bounding_centre = Vec3(0.0f);
+                    instance->bounding_radius = bounds->origin_radius;
+                }
+            }
+            
+            //Upload order into the instance store. Sorting starts from last frame's order, which the camera has barely changed.
+            static u32 draw_order[MAX_NUM_DRAW_CALLS];
+            static u32 draw_order_count;
+            if (draw_order_count != draw_count || !sort_draws_front_to_back)
+            {
+                for(u32 i = 0; i < draw_count; ++i) draw_order[i] = i;
+                draw_order_count = draw_count;
+            }
+            
+            if (sort_draws_front_to_back)
+            {
+                static u64 sort_keys[MAX_NUM_DRAW_CALLS];
+                static u64 scratch_keys[MAX_NUM_DRAW_CALLS];
+                static u32 scratch_values[MAX_NUM_DRAW_CALLS];
+                
+                build_draw_sort_keys(instance_store.instances, draw_order, draw_count, &global_data, bounds_scale, sort_keys, draw_order);
+                sort_draw_keys_coherent(sort_keys, draw_order, scratch_keys, scratch_values, draw_count);
+            }
+            
             triangle_count = 0;
             for(u32 i = 0; i < draw_count; ++i)
             {
-                u32 mesh_index = rand() % mesh_count;
-                Mesh& mesh = meshes[mesh_index];
-                
-                infos[i].triangle_count = mesh.index_count / 3;
-                infos[i].index_buffer_view = mesh.index_buffer_view;
+                infos[i] = instance_store.instances[draw_order[i]];
+                infos[i].bounding_radius *= bounds_scale;
+                triangle_count += infos[i].triangle_count;
+            }
+            
+            if (cpu_occlusion_culling)
+            {
+                if (!occlusion_buffer.depth)
+                {
+                    //Quarter of the window in each direction, width rounded to whole tiles.
+                    u32 occlusion_width = MIN((window_width / 4 + OCCLUSION_TILE_SIZE - 1) / OCCLUSION_TILE_SIZE * OCCLUSION_TILE_SIZE, 512u);
+                    init_occlusion_buffer(&occlusion_buffer, occlusion_width, MIN(window_height / 4, 512u));
+                    
+                    for(u32 i = 0; i < mesh_count; ++i) occluder_meshes[i] = meshes[i].occluder;
+                }
                 
-                DrawInfo draw_info = {};
-                draw_info.position = { rand_f32_in_range(-h_range, h_range, &rng), rand_f32_in_range(-y_range, y_range, &rng), rand_f32_in_range(-h_range, h_range, &rng) };
-                draw_info.quat = { rand_f32_in_range(-1.0, 1.0, &rng), rand_f32_in_range(-1.0, 1.0, &rng), rand_f32_in_range(-1.0, 1.0, &rng), rand_f32_in_range(-1.0, 1.0, &rng) };
-
-                draw_info.quat = normalize(draw_info.quat);
-                draw_info.vertex_buffer_index = mesh_index;
-
+                OcclusionStats occlusion_stats;
+                occlusion_cull_instances(&occlusion_buffer, &global_data, occluder_meshes, instance_store.instances, draw_count, occluded_instances, &occlusion_stats);
                 
-                infos[i].draw_info = draw_info;
-				infos[i].bounding_radius = mesh.bounding_radius*bounds_scale;
+                //A radius of -FLT_MAX fails every plane test in cull_compute, so hidden instances never reach the argument buffer.
+                for(u32 i = 0; i < draw_count; ++i)
+                {
+                    if (!occluded_instances[draw_order[i]]) continue;
+                    
+                    infos[i].bounding_radius = -FLT_MAX;
+                    triangle_count -= infos[i].triangle_count;
+                }
+            }
+            
+            if (contribution_culling)
+            {
+                //Same decisions as cull_compute, so the title shows what the GPU submits after the frustum, size and LOD tests.
+                static MeshLods mesh_lods[4096];
+                static u32 selected_lods[MAX_NUM_DRAW_CALLS];
+                for(u32 i = 0; i < mesh_count; ++i) mesh_lods[i] = meshes[i].lods;
                 
-                triangle_count += mesh.index_count / 3;
+                ContributionStats contribution_stats;
+                contribution_cull_instances(mesh_lods, infos, draw_count, &global_data, window_width, window_height,
+                                            CONTRIBUTION_MIN_SCREEN_RADIUS, CONTRIBUTION_LOD_PIXEL_ERROR, selected_lods, &contribution_stats);
+                triangle_count = contribution_stats.triangles_after;
             }
             
             u64 data_size_in_bytes = sizeof(DrawCallInfo) * draw_count;	
@@ -1414,11 +2223,47 @@ void draw(f64 dt)
 				command_list->CopyResource(draw_call_info_buffers[frame_index].resource, draw_call_info_buffers[frame_index].upload_resource);
 				transition(command_list, draw_call_info_buffers[frame_index].resource, D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_GENERIC_READ);
 			}
+			
+			{//Hot stream, after the CPU culling above has written its radii into infos
+				CullInstance* cull_instances = cull_instance_data[frame_index];
+				for(u32 i = 0; i < draw_count; ++i) cull_instances[i] = make_cull_instance(&infos[i], draw_order[i]);
+				
+				D3D12_RANGE read_range = {};
+				void* upload_destination = 0;
+				
+				Buffer* buffer = &cull_instance_buffers[frame_index];
+				MUST_SUCCEED(buffer->upload_resource->Map(0, &read_range, (void**)&upload_destination));
+				memcpy(upload_destination, cull_instances, sizeof(CullInstance) * draw_count);
+				buffer->upload_resource->Unmap(0, nullptr);
+				
+				command_list->CopyResource(buffer->resource, buffer->upload_resource);
+				transition(command_list, buffer->resource, D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_GENERIC_READ);
+			}
+			
+			if (instance_bucket_count)
+			{//Matrices for the instanced draws in upload order, with this frame's spin, interleaved straight into the upload heap
+				decode_instance_transforms_sse(&instance_matrices, &packed_instance_transforms, draw_order, draw_count, global_data.time);
+				
+				D3D12_RANGE read_range = {};
+				void* upload_destination = 0;
+				
+				Buffer* buffer = &instance_matrix_buffers[frame_index];
+				MUST_SUCCEED(buffer->upload_resource->Map(0, &read_range, (void**)&upload_destination));
+				interleave_instance_matrices_sse((vec4*)upload_destination, &instance_matrices, draw_count);
+				buffer->upload_resource->Unmap(0, nullptr);
+				
+				command_list->CopyResource(buffer->resource, buffer->upload_resource);
+				transition(command_list, buffer->resource, D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_GENERIC_READ);
+			}
 
             
 			transition(command_list, draw_call_argument_buffers[frame_index].resource, D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
-            command_list->Dispatch(draw_count / 64, 1, 1);
+            dispatch_cull(command_list, draw_count, instance_bucket_count != 0);
             transition(command_list, draw_call_argument_buffers[frame_index].resource, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT);
+            
+            //Only filled by the late phase, which runs after the early draws below.
+            if (!two_phase_occlusion_culling)
+                transition(command_list, late_draw_call_argument_buffers[frame_index].resource, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT);
         }
     }
     
@@ -1454,10 +2299,112 @@ void draw(f64 dt)
     
 	command_list->SetGraphicsRoot32BitConstants(2, (sizeof(global_data) + 3) / 4, &global_data, 0);
     
+    //Instanced draws set their own instance range, everything else draws from DrawInfo.
+    u32 no_instance_range[2] = {};
+	command_list->SetGraphicsRoot32BitConstants(3, 2, no_instance_range, 0);
+	command_list->SetGraphicsRootShaderResourceView(4, instance_id_buffer->GetGPUVirtualAddress());
+	command_list->SetGraphicsRootShaderResourceView(5, draw_call_info_buffers[frame_index].resource->GetGPUVirtualAddress());
+	command_list->SetGraphicsRootShaderResourceView(6, instance_matrix_buffers[frame_index].resource->GetGPUVirtualAddress());
+    
     if(execute_indirect) {
         Buffer* buffer = &draw_call_argument_buffers[frame_index];
-        command_list->ExecuteIndirect(command_signature, draw_count, buffer->resource, 0, buffer->resource, buffer->size_in_bytes);
+        command_list->ExecuteIndirect(draw_command_signature, max_draw_count, buffer->resource, 0, buffer->resource, buffer->size_in_bytes);
 		// command_list->ExecuteIndirect(command_signature, draw_count, buffer->resource, 0, nullptr, 0);
+        
+        if (two_phase_occlusion_culling)
+        {
+            u32 descriptor_size = device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+            
+            {//Hi-Z pyramid from the early phase depth, one dispatch per level
+                transition(command_list, depth_stencil_targets[frame_index], D3D12_RESOURCE_STATE_DEPTH_WRITE, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
+                transition(command_list, hiz_texture, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+                
+                command_list->SetPipelineState(hiz_build_pipeline_state);
+                command_list->SetComputeRootSignature(hiz_build_root_signature);
+                
+                ID3D12DescriptorHeap* hiz_heaps[] = { hiz_heap };
+                command_list->SetDescriptorHeaps(_countof(hiz_heaps), hiz_heaps);
+                D3D12_GPU_DESCRIPTOR_HANDLE hiz_heap_start = hiz_heap->GetGPUDescriptorHandleForHeapStart();
+                
+                u32 source_width = window_width;
+                u32 source_height = window_height;
+                
+                for(u32 level = 0; level < hiz_levels; ++level)
+                {
+                    u32 sizes[4] = { source_width, source_height, (source_width + 1) / 2, (source_height + 1) / 2 };
+                    
+                    //Level 0 reads the depth buffer, every other level the one before it.
+                    D3D12_GPU_DESCRIPTOR_HANDLE source = hiz_heap_start;
+                    source.ptr += descriptor_size * (level == 0 ? frame_index : back_buffer_count + level - 1);
+                    D3D12_GPU_DESCRIPTOR_HANDLE destination = hiz_heap_start;
+                    destination.ptr += descriptor_size * (back_buffer_count + HIZ_MAX_LEVELS + level);
+                    
+                    command_list->SetComputeRootDescriptorTable(0, source);
+                    command_list->SetComputeRootDescriptorTable(1, destination);
+                    command_list->SetComputeRoot32BitConstants(2, 4, sizes, 0);
+                    command_list->Dispatch((sizes[2] + 7) / 8, (sizes[3] + 7) / 8, 1);
+                    
+                    transition_subresource(command_list, hiz_texture, level, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
+                    
+                    source_width = sizes[2];
+                    source_height = sizes[3];
+                }
+                
+                transition(command_list, depth_stencil_targets[frame_index], D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE, D3D12_RESOURCE_STATE_DEPTH_WRITE);
+            }
+            
+            {//Late phase cull against the pyramid
+                command_list->SetPipelineState(cull_compute_pipeline_state);
+                command_list->SetComputeRootSignature(cull_compute_root_signature);
+                
+                ID3D12DescriptorHeap* cull_heaps[] = { draw_call_info_buffer_heap };
+                command_list->SetDescriptorHeaps(_countof(cull_heaps), cull_heaps);
+                D3D12_GPU_DESCRIPTOR_HANDLE heap_handle = draw_call_info_buffer_heap->GetGPUDescriptorHandleForHeapStart();
+                heap_handle.ptr += descriptor_size * frame_index;
+                command_list->SetComputeRootDescriptorTable(0, heap_handle);
+                
+                CullParameters cull_parameters = {};
+                cull_parameters.phase = CULL_PHASE_LATE;
+                cull_parameters.hiz_level_count = hiz_levels;
+                cull_parameters.screen_width = window_width;
+                cull_parameters.screen_height = window_height;
+                cull_parameters.min_screen_radius = contribution_culling ? CONTRIBUTION_MIN_SCREEN_RADIUS : 0.0f;
+                cull_parameters.lod_pixel_error = contribution_culling ? CONTRIBUTION_LOD_PIXEL_ERROR : -1.0f;
+                cull_parameters.instance_count = draw_count;
+                cull_parameters.bucket_count = instance_bucket_count;
+                command_list->SetComputeRoot32BitConstants(1, (sizeof(global_data) + 3) / 4, &global_data, 0);
+                command_list->SetComputeRoot32BitConstants(2, sizeof(cull_parameters) / 4, &cull_parameters, 0);
+                command_list->SetComputeRootShaderResourceView(3, mesh_lod_buffer.resource->GetGPUVirtualAddress());
+                
+                //The early phase read the visibility bits the late phase now rewrites.
+                D3D12_RESOURCE_BARRIER barrier = {};
+                barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_UAV;
+                barrier.UAV.pResource = instance_visibility_buffer;
+                command_list->ResourceBarrier(1, &barrier);
+                
+                dispatch_cull(command_list, draw_count, instance_bucket_count != 0);
+                transition(command_list, late_draw_call_argument_buffers[frame_index].resource, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT);
+            }
+            
+            {//Late phase draws, into the same targets
+                command_list->SetPipelineState(pipeline_state);
+                command_list->SetGraphicsRootSignature(root_signature);
+                command_list->SetDescriptorHeaps(_countof(descriptor_heaps), descriptor_heaps);
+                command_list->SetGraphicsRootDescriptorTable(0, vertex_buffer_heap->GetGPUDescriptorHandleForHeapStart());
+                command_list->OMSetRenderTargets(1, &render_target_view_handle, FALSE, &depth_stencil_target_view_handle);
+                command_list->RSSetViewports(1, &viewport);
+                command_list->RSSetScissorRects(1, &surface_rect);
+                command_list->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+                command_list->SetGraphicsRoot32BitConstants(2, (sizeof(global_data) + 3) / 4, &global_data, 0);
+                command_list->SetGraphicsRoot32BitConstants(3, 2, no_instance_range, 0);
+                command_list->SetGraphicsRootShaderResourceView(4, instance_id_buffer->GetGPUVirtualAddress());
+                command_list->SetGraphicsRootShaderResourceView(5, draw_call_info_buffers[frame_index].resource->GetGPUVirtualAddress());
+                command_list->SetGraphicsRootShaderResourceView(6, instance_matrix_buffers[frame_index].resource->GetGPUVirtualAddress());
+                
+                Buffer* late_buffer = &late_draw_call_argument_buffers[frame_index];
+                command_list->ExecuteIndirect(draw_command_signature, max_draw_count, late_buffer->resource, 0, late_buffer->resource, late_buffer->size_in_bytes);
+            }
+        }
     } else {
         triangle_count = 0;
         for (u32 i = 0; i < draw_count; ++i)
@@ -1484,6 +2431,33 @@ void draw(f64 dt)
     
     transition(command_list, render_targets[frame_index], D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_PRESENT);
     
+	static Buffer depth_readback = {};
+	D3D12_PLACED_SUBRESOURCE_FOOTPRINT depth_footprint = {};
+	bool record_depth = record_depth_next_frame && execute_indirect;
+	record_depth_next_frame = false;
+	
+	if (record_depth)
+	{
+		D3D12_RESOURCE_DESC depth_description = depth_stencil_targets[frame_index]->GetDesc();
+		u64 depth_readback_size = 0;
+		device->GetCopyableFootprints(&depth_description, 0, 1, 0, &depth_footprint, nullptr, nullptr, &depth_readback_size);
+		
+		if (!depth_readback.resource) depth_readback = create_readback_buffer(depth_readback_size);
+		
+		D3D12_TEXTURE_COPY_LOCATION source = {};
+		source.pResource = depth_stencil_targets[frame_index];
+		source.Type = D3D12_TEXTURE_COPY_TYPE_SUBRESOURCE_INDEX;
+		source.SubresourceIndex = 0;
+		
+		D3D12_TEXTURE_COPY_LOCATION destination = {};
+		destination.pResource = depth_readback.resource;
+		destination.Type = D3D12_TEXTURE_COPY_TYPE_PLACED_FOOTPRINT;
+		destination.PlacedFootprint = depth_footprint;
+		
+		transition(command_list, depth_stencil_targets[frame_index], D3D12_RESOURCE_STATE_DEPTH_WRITE, D3D12_RESOURCE_STATE_COPY_SOURCE);
+		command_list->CopyTextureRegion(&destination, 0, 0, 0, &source, nullptr);
+		transition(command_list, depth_stencil_targets[frame_index], D3D12_RESOURCE_STATE_COPY_SOURCE, D3D12_RESOURCE_STATE_DEPTH_WRITE);
+	}
 	
 	{
 		command_list->EndQuery(timestamp_query_heap, D3D12_QUERY_TYPE_TIMESTAMP, 1);
@@ -1507,6 +2481,16 @@ void draw(f64 dt)
 	}
     
 	command_queue->Wait(fence, current_fence_value);
+	
+	if (record_depth)
+	{
+		D3D12_RANGE read_range = { 0, (size_t)depth_readback.size_in_bytes };
+		u8* mapped = 0;
+		MUST_SUCCEED(depth_readback.resource->Map(0, &read_range, (void**)&mapped));
+		save_depth_recording("depth_recording.bin", &global_data, mapped + depth_footprint.Offset, window_width, window_height, depth_footprint.Footprint.RowPitch, draw_call_infos[frame_index], draw_count);
+		D3D12_RANGE write_range = {};
+		depth_readback.resource->Unmap(0, &write_range);
+	}
     
     
 	frame_index = swap_chain->GetCurrentBackBufferIndex();
@@ -1849,6 +2833,8 @@ int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PSTR cmdArgs,
 						should_quit = true;
 					if (message.wParam == VK_F11)
 						win32_toggle_fullscreen(window);
+					if (message.wParam == VK_F12)
+						record_depth_next_frame = true;
 				}break;
 				case WM_CLOSE:
 				case WM_DESTROY:
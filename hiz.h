@@ -0,0 +1,310 @@
+#pragma once
+
+// CPU reference for the two phase occlusion culling in cull_compute.hlsl and hiz_build.hlsl.
+// The pyramid starts at half the depth buffer size, every texel holding the furthest (smallest, reversed Z) depth of
+// the 2x2 texels below it, clamped at the odd edges. A sphere picks the level where its screen rectangle spans at
+// most two texels each way and is occluded when all four texels are nearer than its nearest point.
+//
+// The pyramid build only takes minimums, so it is bit exact with the GPU. The sphere test does the same operations
+// in the same order as the shader; a GPU is allowed to fuse multiply-adds and has looser division, which can move a
+// rectangle edge by a pixel, so rare disagreements there are expected.
+//
+// Depth recordings hold one frame: the header, the depth buffer and the DrawCallInfo array cull_compute saw.
+// Needs culling.h in the same translation unit.
+
+
+constexpr u32 HIZ_MAX_LEVELS = 16;
+
+struct HiZPyramid
+{
+	f32* levels[HIZ_MAX_LEVELS];
+	u32 widths[HIZ_MAX_LEVELS];
+	u32 heights[HIZ_MAX_LEVELS];
+	u32 level_count;
+
+	u32 width;//Of the depth buffer it was built from
+	u32 height;
+};
+
+// Levels down to and including 1x1.
+u32 hiz_level_count(u32 width, u32 height)
+{
+	u32 count = 0;
+	for (u32 w = width, h = height; w > 1 || h > 1; w = (w + 1) / 2, h = (h + 1) / 2) count++;
+	return MAX(count, 1u);
+}
+
+void free_hiz_pyramid(HiZPyramid* pyramid)
+{
+	for (u32 i = 0; i < pyramid->level_count; ++i) delete[] pyramid->levels[i];
+	*pyramid = {};
+}
+
+// Same reduction as hiz_build.hlsl, one level per dispatch there.
+void reduce_hiz_level(f32* destination, u32 destination_width, u32 destination_height, const f32* source, u32 source_width, u32 source_height)
+{
+	for (u32 y = 0; y < destination_height; ++y)
+	{
+		u32 y0 = MIN(y * 2, source_height - 1);
+		u32 y1 = MIN(y * 2 + 1, source_height - 1);
+
+		for (u32 x = 0; x < destination_width; ++x)
+		{
+			u32 x0 = MIN(x * 2, source_width - 1);
+			u32 x1 = MIN(x * 2 + 1, source_width - 1);
+
+			f32 a = MIN(source[y0 * source_width + x0], source[y0 * source_width + x1]);
+			f32 b = MIN(source[y1 * source_width + x0], source[y1 * source_width + x1]);
+			destination[y * destination_width + x] = MIN(a, b);
+		}
+	}
+}
+
+void build_hiz_pyramid(HiZPyramid* pyramid, const f32* depth, u32 width, u32 height)
+{
+	*pyramid = {};
+	pyramid->width = width;
+	pyramid->height = height;
+	pyramid->level_count = hiz_level_count(width, height);
+	assert(pyramid->level_count <= HIZ_MAX_LEVELS);
+
+	const f32* source = depth;
+	u32 source_width = width;
+	u32 source_height = height;
+
+	for (u32 i = 0; i < pyramid->level_count; ++i)
+	{
+		u32 w = (source_width + 1) / 2;
+		u32 h = (source_height + 1) / 2;
+
+		pyramid->widths[i] = w;
+		pyramid->heights[i] = h;
+		pyramid->levels[i] = new f32[w * h];
+		reduce_hiz_level(pyramid->levels[i], w, h, source, source_width, source_height);
+
+		source = pyramid->levels[i];
+		source_width = w;
+		source_height = h;
+	}
+}
+
+u32 ceil_log2(u32 value)
+{
+	u32 result = 0;
+	while ((1u << result) < value) result++;
+	return result;
+}
+
+bool sphere_occluded_hiz(const HiZPyramid* pyramid, const Mat4x4* view, const Mat4x4* projection, vec3 centre, f32 radius)
+{
+	SphereScreenRect rect;
+	if (!project_sphere_rect(view, projection, centre, radius, pyramid->width, pyramid->height, &rect)) return false;
+
+	//Level i halves the depth buffer i + 1 times; a rectangle up to 2^(i + 1) pixels wide touches at most two texels.
+	u32 extent = (u32)MAX(rect.x1 - rect.x0, rect.y1 - rect.y0);
+	u32 level = MIN(MAX(ceil_log2(extent), 1u) - 1, pyramid->level_count - 1);
+	u32 shift = level + 1;
+
+	u32 tx0 = (u32)rect.x0 >> shift;
+	u32 ty0 = (u32)rect.y0 >> shift;
+	u32 tx1 = (u32)(rect.x1 - 1) >> shift;
+	u32 ty1 = (u32)(rect.y1 - 1) >> shift;
+
+	const f32* texels = pyramid->levels[level];
+	u32 w = pyramid->widths[level];
+
+	f32 a = MIN(texels[ty0 * w + tx0], texels[ty0 * w + tx1]);
+	f32 b = MIN(texels[ty1 * w + tx0], texels[ty1 * w + tx1]);
+
+	return MIN(a, b) > rect.depth;
+}
+
+// Every pixel of the rectangle, for measuring how much the pyramid gives away.
+bool sphere_occluded_exact(const f32* depth, u32 width, u32 height, const Mat4x4* view, const Mat4x4* projection, vec3 centre, f32 radius)
+{
+	SphereScreenRect rect;
+	if (!project_sphere_rect(view, projection, centre, radius, width, height, &rect)) return false;
+
+	for (s32 y = rect.y0; y < rect.y1; ++y)
+		for (s32 x = rect.x0; x < rect.x1; ++x)
+			if (depth[y * width + x] <= rect.depth) return false;
+
+	return true;
+}
+
+
+constexpr u32 DEPTH_RECORDING_MAGIC = 0x445a4948;//"HIZD"
+
+struct DepthRecordingHeader
+{
+	u32 magic;
+	u32 width;
+	u32 height;
+	u32 instance_count;
+	ShaderGlobals globals;
+};
+
+struct DepthRecording
+{
+	DepthRecordingHeader header;
+	f32* depth;
+	DrawCallInfo* instances;//Radii pre-scaled by bounds_scale, as uploaded
+};
+
+void free_depth_recording(DepthRecording* recording)
+{
+	delete[] recording->depth;
+	delete[] recording->instances;
+	*recording = {};
+}
+
+// depth is row_pitch bytes per row, like a mapped readback of the depth target.
+bool save_depth_recording(const char* path, const ShaderGlobals* globals, const void* depth, u32 width, u32 height, u32 row_pitch, const DrawCallInfo* instances, u32 instance_count)
+{
+	FILE* file = fopen(path, "wb");
+	if (!file)
+	{
+		printf("Could not open %s for writing\n", path);
+		return false;
+	}
+
+	DepthRecordingHeader header = {};
+	header.magic = DEPTH_RECORDING_MAGIC;
+	header.width = width;
+	header.height = height;
+	header.instance_count = instance_count;
+	header.globals = *globals;
+
+	fwrite(&header, sizeof(header), 1, file);
+	for (u32 y = 0; y < height; ++y) fwrite((const u8*)depth + (size_t)y * row_pitch, sizeof(f32), width, file);
+	fwrite(instances, sizeof(DrawCallInfo), instance_count, file);
+
+	fclose(file);
+	printf("Recorded %ux%u depth and %u instances to %s\n", width, height, instance_count, path);
+	return true;
+}
+
+bool load_depth_recording(const char* path, DepthRecording* recording)
+{
+	*recording = {};
+
+	FILE* file = fopen(path, "rb");
+	if (!file)
+	{
+		printf("Could not open depth recording %s\n", path);
+		return false;
+	}
+
+	bool ok = fread(&recording->header, sizeof(DepthRecordingHeader), 1, file) == 1 && recording->header.magic == DEPTH_RECORDING_MAGIC;
+
+	if (ok)
+	{
+		u32 pixel_count = recording->header.width * recording->header.height;
+		recording->depth = new f32[pixel_count];
+		recording->instances = new DrawCallInfo[MAX(recording->header.instance_count, 1u)];
+
+		ok = fread(recording->depth, sizeof(f32), pixel_count, file) == pixel_count &&
+		     fread(recording->instances, sizeof(DrawCallInfo), recording->header.instance_count, file) == recording->header.instance_count;
+	}
+
+	fclose(file);
+
+	if (!ok)
+	{
+		printf("%s is not a valid depth recording\n", path);
+		free_depth_recording(recording);
+	}
+	return ok;
+}
+
+// Frustum culls every recorded instance, then tests the survivors against the pyramid and pixel by pixel.
+// The pyramid has to be conservative: anything it rejects must also be hidden per pixel. Returns false when it is not.
+bool analyze_depth_recording(const DepthRecording* recording)
+{
+	const DepthRecordingHeader* header = &recording->header;
+
+	f64 start = time_in_seconds();
+	HiZPyramid pyramid;
+	build_hiz_pyramid(&pyramid, recording->depth, header->width, header->height);
+	f64 build_seconds = time_in_seconds() - start;
+
+	CullFrustum frustum = make_cull_frustum(&header->globals);
+
+	u32 frustum_visible = 0, hiz_occluded = 0, exact_occluded = 0, not_conservative = 0;
+
+	start = time_in_seconds();
+	for (u32 i = 0; i < header->instance_count; ++i)
+	{
+		const DrawCallInfo* instance = &recording->instances[i];
+		vec3 centre = instance_sphere_centre(instance);
+		if (!sphere_in_frustum(&frustum, centre, instance->bounding_radius)) continue;
+
+		frustum_visible++;
+
+		//The shader only has the pre-scaled radius and divides the scale back out the same way.
+		f32 radius = instance->bounding_radius / frustum.bounds_scale;
+
+		bool hiz = sphere_occluded_hiz(&pyramid, &header->globals.view, &header->globals.projection, centre, radius);
+		bool exact = sphere_occluded_exact(recording->depth, header->width, header->height, &header->globals.view, &header->globals.projection, centre, radius);
+
+		hiz_occluded += hiz;
+		exact_occluded += exact;
+		not_conservative += hiz && !exact;
+	}
+	f64 test_seconds = time_in_seconds() - start;
+
+	printf("Hi-Z %ux%u, %u levels (build %.2fms): %u instances, %u in frustum\n",
+	       header->width, header->height, pyramid.level_count, build_seconds * 1000.0, header->instance_count, frustum_visible);
+	printf("  rejected: hi-z %u (%.1f%%), per pixel %u (%.1f%%), hi-z only %u; tests took %.3fms\n",
+	       hiz_occluded, frustum_visible ? 100.0 * hiz_occluded / frustum_visible : 0.0,
+	       exact_occluded, frustum_visible ? 100.0 * exact_occluded / frustum_visible : 0.0,
+	       not_conservative, test_seconds * 1000.0);
+	if (not_conservative) printf("  NOT CONSERVATIVE: %u instances rejected by the pyramid are visible per pixel\n", not_conservative);
+
+	free_hiz_pyramid(&pyramid);
+	return not_conservative == 0;
+}
+
+// A recording without a GPU: fronto-parallel occluder rectangles at random distances over a far background, and
+// spheres scattered in front of and behind them. Radii are pre-scaled like draw() uploads them.
+void build_synthetic_depth_recording(DepthRecording* recording, const ShaderGlobals* globals, u32 width, u32 height, u32 occluder_count, u32 instance_count)
+{
+	*recording = {};
+	recording->header.magic = DEPTH_RECORDING_MAGIC;
+	recording->header.width = width;
+	recording->header.height = height;
+	recording->header.instance_count = instance_count;
+	recording->header.globals = *globals;
+	recording->depth = new f32[width * height];
+	recording->instances = new DrawCallInfo[MAX(instance_count, 1u)];
+
+	//Reversed Z with an infinite far plane: depth is near / view distance, d[2][3] of the projection holds near.
+	f32 near_plane = globals->projection.d[2][3];
+	u32 random = 4242;
+
+	for (u32 i = 0; i < width * height; ++i) recording->depth[i] = 0.0f;
+
+	for (u32 o = 0; o < occluder_count; ++o)
+	{
+		u32 x0 = (u32)rand_f32_in_range(0.0f, (f32)(width - 1), &random);
+		u32 y0 = (u32)rand_f32_in_range(0.0f, (f32)(height - 1), &random);
+		u32 size_x = (u32)rand_f32_in_range(8.0f, width * 0.4f, &random);
+		u32 size_y = (u32)rand_f32_in_range(8.0f, height * 0.4f, &random);
+		u32 x1 = MIN(x0 + size_x, width);
+		u32 y1 = MIN(y0 + size_y, height);
+		f32 depth = near_plane / rand_f32_in_range(3.0f, 40.0f, &random);
+
+		for (u32 y = y0; y < y1; ++y)
+			for (u32 x = x0; x < x1; ++x)
+				recording->depth[y * width + x] = MAX(recording->depth[y * width + x], depth);
+	}
+
+	CullFrustum frustum = make_cull_frustum(globals);
+	for (u32 i = 0; i < instance_count; ++i)
+	{
+		DrawCallInfo* instance = &recording->instances[i];
+		*instance = {};
+		instance->draw_info.position = {rand_f32_in_range(-30.0f, 30.0f, &random), rand_f32_in_range(-15.0f, 15.0f, &random), rand_f32_in_range(-60.0f, 5.0f, &random)};
+		instance->bounding_radius = rand_f32_in_range(0.2f, 3.0f, &random) * frustum.bounds_scale;
+	}
+}
@@ -0,0 +1,39 @@
+// One level of the Hi-Z pyramid: every texel keeps the furthest (smallest, reversed Z) of the 2x2 texels below it.
+// Odd edges clamp, so the last row/column of the source is covered too. hiz.h has the CPU reference.
+
+Texture2D<float> source : register(t0, space0);
+RWTexture2D<float> destination : register(u0, space0);
+
+struct HiZParameters
+{
+	uint source_width;
+	uint source_height;
+	uint destination_width;
+	uint destination_height;
+};
+
+cbuffer HiZBindings : register(b0, space0)
+{
+	HiZParameters parameters;
+};
+
+
+[numthreads(8, 8, 1)]
+void main (uint3 dispatch_thread_id : SV_DispatchThreadID)
+{
+	uint2 texel = dispatch_thread_id.xy;
+
+	if (texel.x >= parameters.destination_width || texel.y >= parameters.destination_height)
+		return;
+
+	uint2 last = uint2(parameters.source_width - 1, parameters.source_height - 1);
+	uint x0 = min(texel.x * 2, last.x);
+	uint x1 = min(texel.x * 2 + 1, last.x);
+	uint y0 = min(texel.y * 2, last.y);
+	uint y1 = min(texel.y * 2 + 1, last.y);
+
+	float a = min(source[uint2(x0, y0)], source[uint2(x1, y0)]);
+	float b = min(source[uint2(x0, y1)], source[uint2(x1, y1)]);
+
+	destination[texel] = min(a, b);
+}
@@ -0,0 +1,259 @@
+#pragma once
+
+// CPU reference for the GPU instancing passes in cull_compute.hlsl. Without it every visible instance is its own
+// indirect draw with InstanceCount 1, so the command processor walks one draw per instance even though the scene
+// only has a handful of meshes. With it the survivors are bucketed by mesh and LOD and every non-empty bucket is one
+// DrawIndexedInstanced; vertex_shader.hlsl finds its instances through the instance id list.
+//
+// The passes, mirrored one group at a time:
+// - main counts the survivors of every bucket per group (count_instance_buckets)
+// - bucket_offsets swaps those counts for the survivors of the same bucket in earlier groups and lays the buckets
+//   out in bucket order, giving the non-empty ones a draw slot (build_bucket_ranges)
+// - bucket_scatter puts each survivor at its bucket's first instance + its group's offset + the survivors of the
+//   same bucket before it in the group (scatter_instance_buckets)
+// so the ids are sorted by bucket and keep their input order within a bucket, every frame.
+//
+// Results are 0 for culled instances and LOD + 1 otherwise, like instance_results in the shader and compaction.h.
+// Needs cull_layout.h and instance_lod.h in the same translation unit.
+
+
+inline u32 instance_bucket(u32 mesh_index, u32 result)
+{
+	return mesh_index * MAX_MESH_LODS + result - 1;
+}
+
+// main: group_bucket_counts[group * MAX_INSTANCE_BUCKETS + bucket]. Returns the group count.
+u32 count_instance_buckets(const u32* results, const CullInstance* instances, u32 count, u32 bucket_count, u32* group_bucket_counts)
+{
+	assert(bucket_count <= MAX_INSTANCE_BUCKETS);
+	u32 group_count = (count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE;
+
+	for (u32 group = 0; group < group_count; ++group)
+	{
+		u32* histogram = group_bucket_counts + group * MAX_INSTANCE_BUCKETS;
+		for (u32 bucket = 0; bucket < bucket_count; ++bucket) histogram[bucket] = 0;
+
+		for (u32 thread = 0; thread < CULL_GROUP_SIZE; ++thread)
+		{
+			u32 input_index = group * CULL_GROUP_SIZE + thread;
+			if (input_index >= count || results[input_index] == 0) continue;
+
+			histogram[instance_bucket(cull_instance_mesh_index(instances[input_index]), results[input_index])]++;
+		}
+	}
+
+	return group_count;
+}
+
+// bucket_offsets: turns the counts into offsets in place and fills ranges. Returns the number of draws.
+u32 build_bucket_ranges(u32* group_bucket_counts, u32 group_count, u32 bucket_count, BucketRange* ranges)
+{
+	u32 first_instance = 0;
+	u32 draw_index = 0;
+
+	for (u32 bucket = 0; bucket < bucket_count; ++bucket)
+	{
+		u32 total = 0;
+		for (u32 group = 0; group < group_count; ++group)
+		{
+			u32* slot = &group_bucket_counts[group * MAX_INSTANCE_BUCKETS + bucket];
+			u32 group_survivors = *slot;
+			*slot = total;
+			total += group_survivors;
+		}
+
+		ranges[bucket].first_instance = first_instance;
+		ranges[bucket].instance_count = total;
+		ranges[bucket].draw_index = draw_index;
+		ranges[bucket].packing = 0;
+
+		first_instance += total;
+		draw_index += total != 0;
+	}
+
+	return draw_index;
+}
+
+// bucket_scatter: instance_ids needs room for count ids, draw_buckets for bucket_count entries and gets the bucket
+// of every draw, which is what the first instance of each bucket writes on the GPU. Returns the ids written.
+u32 scatter_instance_buckets(const u32* results, const CullInstance* instances, u32 count, const u32* group_bucket_counts, const BucketRange* ranges,
+                             u32* instance_ids, u32* draw_buckets)
+{
+	u32 group_count = (count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE;
+	u32 written = 0;
+
+	for (u32 group = 0; group < group_count; ++group)
+	{
+		u32 lane_buckets[CULL_GROUP_SIZE];
+		for (u32 thread = 0; thread < CULL_GROUP_SIZE; ++thread)
+		{
+			u32 input_index = group * CULL_GROUP_SIZE + thread;
+			bool survived = input_index < count && results[input_index] != 0;
+			lane_buckets[thread] = survived ? instance_bucket(cull_instance_mesh_index(instances[input_index]), results[input_index]) : ~0u;
+		}
+
+		for (u32 thread = 0; thread < CULL_GROUP_SIZE; ++thread)
+		{
+			u32 bucket = lane_buckets[thread];
+			if (bucket == ~0u) continue;
+
+			u32 rank = 0;
+			for (u32 lane = 0; lane < thread; ++lane) rank += lane_buckets[lane] == bucket;
+
+			const BucketRange* range = &ranges[bucket];
+			u32 slot = range->first_instance + group_bucket_counts[group * MAX_INSTANCE_BUCKETS + bucket] + rank;
+			instance_ids[slot] = group * CULL_GROUP_SIZE + thread;
+			written++;
+
+			if (slot == range->first_instance) draw_buckets[range->draw_index] = bucket;
+		}
+	}
+
+	return written;
+}
+
+struct InstanceBucketResult
+{
+	u32 survivors;
+	u32 draw_count;
+};
+
+// All three passes. group_bucket_counts needs MAX_INSTANCE_BUCKETS entries per group of CULL_GROUP_SIZE instances.
+InstanceBucketResult bucket_instances(const u32* results, const CullInstance* instances, u32 count, u32 bucket_count,
+                                      u32* group_bucket_counts, BucketRange* ranges, u32* instance_ids, u32* draw_buckets)
+{
+	InstanceBucketResult result;
+	u32 group_count = count_instance_buckets(results, instances, count, bucket_count, group_bucket_counts);
+	result.draw_count = build_bucket_ranges(group_bucket_counts, group_count, bucket_count, ranges);
+	result.survivors = scatter_instance_buckets(results, instances, count, group_bucket_counts, ranges, instance_ids, draw_buckets);
+	return result;
+}
+
+// Checks bucket_instances against a plain counting sort: the ids have to be the survivors sorted by bucket with the
+// input order kept within a bucket, the ranges have to cover them exactly and there has to be one draw per non-empty
+// bucket, in bucket order. Prints the first mismatch and returns false otherwise.
+bool verify_instance_buckets(const u32* results, const CullInstance* instances, u32 count, u32 bucket_count,
+                             u32* group_bucket_counts, BucketRange* ranges, u32* instance_ids, u32* draw_buckets)
+{
+	InstanceBucketResult result = bucket_instances(results, instances, count, bucket_count, group_bucket_counts, ranges, instance_ids, draw_buckets);
+
+	u32 expected_index = 0;
+	u32 expected_draws = 0;
+	for (u32 bucket = 0; bucket < bucket_count; ++bucket)
+	{
+		const BucketRange* range = &ranges[bucket];
+		if (range->first_instance != expected_index || range->draw_index != expected_draws)
+		{
+			printf("Instance buckets of %u instances: bucket %u starts at %u (draw %u), expected %u (draw %u)\n",
+			       count, bucket, range->first_instance, range->draw_index, expected_index, expected_draws);
+			return false;
+		}
+
+		for (u32 i = 0; i < count; ++i)
+		{
+			if (results[i] == 0 || instance_bucket(cull_instance_mesh_index(instances[i]), results[i]) != bucket) continue;
+
+			if (expected_index >= result.survivors || instance_ids[expected_index] != i)
+			{
+				printf("Instance buckets of %u instances: id %u should be instance %u in bucket %u\n", count, expected_index, i, bucket);
+				return false;
+			}
+			expected_index++;
+		}
+
+		u32 instance_count = expected_index - range->first_instance;
+		if (range->instance_count != instance_count)
+		{
+			printf("Instance buckets of %u instances: bucket %u holds %u instances, expected %u\n", count, bucket, range->instance_count, instance_count);
+			return false;
+		}
+
+		if (instance_count)
+		{
+			if (draw_buckets[expected_draws] != bucket)
+			{
+				printf("Instance buckets of %u instances: draw %u is bucket %u, expected %u\n", count, expected_draws, draw_buckets[expected_draws], bucket);
+				return false;
+			}
+			expected_draws++;
+		}
+	}
+
+	if (result.survivors != expected_index || result.draw_count != expected_draws)
+	{
+		printf("Instance buckets of %u instances: %u ids in %u draws, expected %u in %u\n", count, result.survivors, result.draw_count, expected_index, expected_draws);
+		return false;
+	}
+
+	return true;
+}
+
+// Checks the bucketing for partial groups and several survivor patterns over mesh_count meshes, then prints how many
+// indirect draws a random frame submits one per instance and bucketed, and how long the CPU reference takes.
+// Returns false when any case does not verify.
+bool benchmark_instance_buckets(u32 max_count, u32 mesh_count)
+{
+	u32 bucket_count = mesh_count * MAX_MESH_LODS;
+	assert(bucket_count <= MAX_INSTANCE_BUCKETS);
+
+	u32 group_count = (max_count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE;
+	u32* results = new u32[max_count];
+	CullInstance* instances = new CullInstance[max_count];
+	u32* group_bucket_counts = new u32[group_count * MAX_INSTANCE_BUCKETS];
+	BucketRange ranges[MAX_INSTANCE_BUCKETS];
+	u32* instance_ids = new u32[max_count];
+	u32 draw_buckets[MAX_INSTANCE_BUCKETS];
+
+	u32 random = 101;
+	for (u32 i = 0; i < max_count; ++i)
+	{
+		instances[i] = {};
+		instances[i].mesh_visibility_index = (u32)(rand_f32_normal(&random) * mesh_count) << CULL_MESH_INDEX_SHIFT;
+	}
+
+	u32 counts[] = { 0, 1, CULL_GROUP_SIZE - 1, CULL_GROUP_SIZE, CULL_GROUP_SIZE + 1, 1250, max_count };
+	u32 checked = 0;
+	bool all_passed = true;
+
+	for (u32 c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c)
+	{
+		u32 count = MIN(counts[c], max_count);
+
+		for (u32 pattern = 0; pattern < 5; ++pattern)
+		{
+			for (u32 i = 0; i < count; ++i)
+			{
+				switch (pattern)
+				{
+					case 0: results[i] = 0; break;
+					case 1: results[i] = 1; break;//Everything at LOD 0
+					case 2: results[i] = 1 + i % MAX_MESH_LODS; break;
+					case 3: results[i] = (i % CULL_GROUP_SIZE == CULL_GROUP_SIZE - 1) ? MAX_MESH_LODS : 0; break;//One survivor per group, last lane
+					default: results[i] = rand_f32_normal(&random) < 0.3f ? 1 + (u32)(rand_f32_normal(&random) * MAX_MESH_LODS) : 0; break;
+				}
+			}
+
+			all_passed = verify_instance_buckets(results, instances, count, bucket_count, group_bucket_counts, ranges, instance_ids, draw_buckets) && all_passed;
+			checked++;
+		}
+	}
+
+	const u32 iterations = 1000;
+	InstanceBucketResult result = {};
+	f64 start = time_in_seconds();
+	for (u32 it = 0; it < iterations; ++it)
+		result = bucket_instances(results, instances, max_count, bucket_count, group_bucket_counts, ranges, instance_ids, draw_buckets);
+	f64 seconds = (time_in_seconds() - start) / iterations;
+
+	printf("Instance buckets: %u cases %s\n", checked, all_passed ? "sorted by bucket in input order" : "FAILED");
+	printf("  %u instances of %u meshes, %u visible: %u indirect draws -> %u instanced draws (%.0fx fewer), %.3fms\n",
+	       max_count, mesh_count, result.survivors, result.survivors, result.draw_count,
+	       result.draw_count ? (f64)result.survivors / result.draw_count : 0.0, seconds * 1000.0);
+
+	delete[] results;
+	delete[] instances;
+	delete[] group_bucket_counts;
+	delete[] instance_ids;
+
+	return all_passed;
+}
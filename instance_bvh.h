@@ -0,0 +1,307 @@
+#pragma once
+
+// Hierarchical instance culling over the Morton ordered instance store.
+// Leaves are the 64 instance chunks a cull_compute thread group handles, inner nodes merge CULL_BVH_BRANCH
+// consecutive nodes of the level below. Because the store is in Morton order the tree needs no build step beyond
+// computing boxes, and refitting after instances move or get re-sorted is one bottom-up pass.
+//
+// Traversal rejects whole nodes outside the frustum and accepts whole nodes inside it; only the instances of leaves
+// that straddle a plane are tested one by one.
+//
+// Needs culling.h and instance_store.h in the same translation unit.
+
+
+constexpr u32 CULL_BVH_BRANCH = 8;
+constexpr u32 CULL_BVH_LEAF_FLAG = 0x80000000;
+
+// 32 bytes, no pointers, 16 byte aligned fields: the node array can be uploaded as is and read as a
+// StructuredBuffer of { float3 aabb_min; uint first; float3 aabb_max; uint count; }.
+// first/count are child nodes for inner nodes and instance slots for leaves (count has CULL_BVH_LEAF_FLAG set).
+struct alignas(16) CullBvhNode
+{
+	vec3 aabb_min;
+	u32 first;
+	vec3 aabb_max;
+	u32 count;
+};
+
+static_assert(sizeof(CullBvhNode) == 32, "CullBvhNode is shared with the GPU");
+
+struct InstanceBvh
+{
+	CullBvhNode* nodes;//Root first, every level after the one above it
+	u32 node_count;
+	u32 leaf_offset;//Leaves are nodes[leaf_offset..node_count)
+	u32 instance_count;
+
+	CullSpheres spheres;//World space copy of the instance spheres in store order, for the leaf tests
+};
+
+struct BvhCullStats
+{
+	u32 nodes_visited;
+	u32 leaves_inside;//Accepted without testing instances
+	u32 leaves_partial;
+	u32 instances_tested;
+};
+
+void free_instance_bvh(InstanceBvh* bvh)
+{
+	delete[] bvh->nodes;
+	free_cull_spheres(&bvh->spheres);
+	*bvh = {};
+}
+
+// Recomputes every box from the current instance positions. The tree shape only depends on the instance count.
+void refit_instance_bvh(InstanceBvh* bvh, const InstanceStore* store)
+{
+	assert(store->count == bvh->instance_count);
+
+	for (u32 i = 0; i < store->count; ++i)
+	{
+		vec3 centre = instance_sphere_centre(&store->instances[i]);
+		bvh->spheres.x[i] = centre.x;
+		bvh->spheres.y[i] = centre.y;
+		bvh->spheres.z[i] = centre.z;
+		bvh->spheres.radius[i] = store->instances[i].bounding_radius;
+	}
+
+	for (u32 n = bvh->leaf_offset; n < bvh->node_count; ++n)
+	{
+		CullBvhNode* node = &bvh->nodes[n];
+		node->aabb_min = Vec3(FLT_MAX);
+		node->aabb_max = Vec3(-FLT_MAX);
+
+		u32 count = node->count & ~CULL_BVH_LEAF_FLAG;
+		for (u32 i = node->first; i < node->first + count; ++i)
+		{
+			f32 r = bvh->spheres.radius[i];
+
+			node->aabb_min.x = MIN(node->aabb_min.x, bvh->spheres.x[i] - r); node->aabb_max.x = MAX(node->aabb_max.x, bvh->spheres.x[i] + r);
+			node->aabb_min.y = MIN(node->aabb_min.y, bvh->spheres.y[i] - r); node->aabb_max.y = MAX(node->aabb_max.y, bvh->spheres.y[i] + r);
+			node->aabb_min.z = MIN(node->aabb_min.z, bvh->spheres.z[i] - r); node->aabb_max.z = MAX(node->aabb_max.z, bvh->spheres.z[i] + r);
+		}
+	}
+
+	//Children always come after their parent, so walking backwards visits every child before its parent.
+	for (u32 n = bvh->leaf_offset; n-- > 0;)
+	{
+		CullBvhNode* node = &bvh->nodes[n];
+		node->aabb_min = Vec3(FLT_MAX);
+		node->aabb_max = Vec3(-FLT_MAX);
+
+		for (u32 c = node->first; c < node->first + node->count; ++c)
+		{
+			const CullBvhNode* child = &bvh->nodes[c];
+
+			node->aabb_min.x = MIN(node->aabb_min.x, child->aabb_min.x); node->aabb_max.x = MAX(node->aabb_max.x, child->aabb_max.x);
+			node->aabb_min.y = MIN(node->aabb_min.y, child->aabb_min.y); node->aabb_max.y = MAX(node->aabb_max.y, child->aabb_max.y);
+			node->aabb_min.z = MIN(node->aabb_min.z, child->aabb_min.z); node->aabb_max.z = MAX(node->aabb_max.z, child->aabb_max.z);
+		}
+	}
+}
+
+// Instance radii in the store are in world units (draw() scales them by bounds_scale only for the GPU copy).
+void build_instance_bvh(InstanceBvh* bvh, const InstanceStore* store)
+{
+	*bvh = {};
+	bvh->instance_count = store->count;
+
+	u32 leaf_count = MAX((store->count + CULL_CHUNK_SIZE - 1) / CULL_CHUNK_SIZE, 1u);
+
+	//Level sizes bottom up, then lay the levels out top down.
+	u32 level_sizes[32];
+	u32 level_count = 0;
+	for (u32 size = leaf_count;; size = (size + CULL_BVH_BRANCH - 1) / CULL_BVH_BRANCH)
+	{
+		level_sizes[level_count++] = size;
+		if (size == 1) break;
+	}
+
+	u32 level_offsets[32];
+	u32 offset = 0;
+	for (u32 l = level_count; l-- > 0;)
+	{
+		level_offsets[l] = offset;
+		offset += level_sizes[l];
+	}
+
+	bvh->node_count = offset;
+	bvh->leaf_offset = level_offsets[0];
+	bvh->nodes = new CullBvhNode[bvh->node_count];
+	memset(bvh->nodes, 0, sizeof(CullBvhNode) * bvh->node_count);
+
+	for (u32 i = 0; i < leaf_count; ++i)
+	{
+		CullBvhNode* leaf = &bvh->nodes[level_offsets[0] + i];
+		leaf->first = i * CULL_CHUNK_SIZE;
+		leaf->count = MIN(CULL_CHUNK_SIZE, store->count - leaf->first) | CULL_BVH_LEAF_FLAG;
+	}
+
+	for (u32 l = 1; l < level_count; ++l)
+	{
+		for (u32 i = 0; i < level_sizes[l]; ++i)
+		{
+			CullBvhNode* node = &bvh->nodes[level_offsets[l] + i];
+			node->first = level_offsets[l - 1] + i * CULL_BVH_BRANCH;
+			node->count = MIN(CULL_BVH_BRANCH, level_sizes[l - 1] - i * CULL_BVH_BRANCH);
+		}
+	}
+
+	bvh->spheres.x = new f32[MAX(store->count, 1u)];
+	bvh->spheres.y = new f32[MAX(store->count, 1u)];
+	bvh->spheres.z = new f32[MAX(store->count, 1u)];
+	bvh->spheres.radius = new f32[MAX(store->count, 1u)];
+	bvh->spheres.count = store->count;
+
+	refit_instance_bvh(bvh, store);
+}
+
+
+enum FrustumOverlap
+{
+	FRUSTUM_OUTSIDE,
+	FRUSTUM_PARTIAL,
+	FRUSTUM_INSIDE,
+};
+
+// Box against the unnormalized planes: outside if the corner furthest along a plane normal is behind it,
+// inside if the nearest corner is in front of every plane.
+FrustumOverlap aabb_frustum_overlap(const CullFrustum* frustum, vec3 aabb_min, vec3 aabb_max)
+{
+	FrustumOverlap result = FRUSTUM_INSIDE;
+
+	for (u32 i = 0; i < 5; ++i)
+	{
+		const vec4& plane = frustum->planes[i];
+
+		f32 far_distance = plane.x * (plane.x > 0 ? aabb_max.x : aabb_min.x) + plane.y * (plane.y > 0 ? aabb_max.y : aabb_min.y) + plane.z * (plane.z > 0 ? aabb_max.z : aabb_min.z) + plane.w;
+		if (far_distance < 0) return FRUSTUM_OUTSIDE;
+
+		f32 near_distance = plane.x * (plane.x > 0 ? aabb_min.x : aabb_max.x) + plane.y * (plane.y > 0 ? aabb_min.y : aabb_max.y) + plane.z * (plane.z > 0 ? aabb_min.z : aabb_max.z) + plane.w;
+		if (near_distance < 0) result = FRUSTUM_PARTIAL;
+	}
+
+	return result;
+}
+
+// Appends the store slots of every visible instance to visible (in slot order) and returns how many there are.
+// The per instance test is the cull_compute one, with the world radius scaled by bounds_scale like draw() does.
+// scratch needs CULL_CHUNK_SIZE bytes.
+u32 cull_instance_bvh(const InstanceBvh* bvh, const CullFrustum* frustum, u32* visible, u8* scratch, f32* scaled_radius_scratch, BvhCullStats* stats)
+{
+	BvhCullStats local_stats = {};
+	u32 visible_count = 0;
+
+	u32 stack[32 * CULL_BVH_BRANCH];
+	u32 stack_size = 0;
+	stack[stack_size++] = 0;
+
+	while (stack_size)
+	{
+		const CullBvhNode* node = &bvh->nodes[stack[--stack_size]];
+		local_stats.nodes_visited++;
+
+		FrustumOverlap overlap = aabb_frustum_overlap(frustum, node->aabb_min, node->aabb_max);
+		if (overlap == FRUSTUM_OUTSIDE) continue;
+
+		bool is_leaf = (node->count & CULL_BVH_LEAF_FLAG) != 0;
+		u32 count = node->count & ~CULL_BVH_LEAF_FLAG;
+
+		if (!is_leaf)
+		{
+			//Pushed in reverse so children pop in order and the output stays in slot order.
+			for (u32 c = count; c-- > 0;) stack[stack_size++] = node->first + c;
+			continue;
+		}
+
+		if (overlap == FRUSTUM_INSIDE)
+		{
+			local_stats.leaves_inside++;
+			for (u32 i = node->first; i < node->first + count; ++i) visible[visible_count++] = i;
+			continue;
+		}
+
+		local_stats.leaves_partial++;
+		local_stats.instances_tested += count;
+
+		for (u32 i = 0; i < count; ++i) scaled_radius_scratch[i] = bvh->spheres.radius[node->first + i] * frustum->bounds_scale;
+
+		cull_spheres_sse(frustum, bvh->spheres.x + node->first, bvh->spheres.y + node->first, bvh->spheres.z + node->first, scaled_radius_scratch, count, scratch);
+		for (u32 i = 0; i < count; ++i)
+			if (scratch[i]) visible[visible_count++] = node->first + i;
+	}
+
+	if (stats) *stats = local_stats;
+	return visible_count;
+}
+
+
+// Random instances in the draw() volume scaled up with the count to keep the density constant, culled flat with
+// SSE and through the BVH from the same camera as draw().
+void benchmark_instance_bvh(u32 instance_count, const ShaderGlobals* globals)
+{
+	f32 scale = sqrtf(instance_count / 1250.0f);
+	vec3 world_max = Vec3(100.0f * scale, 25.0f, 100.0f * scale);
+	vec3 world_min = -world_max;
+
+	InstanceStore store;
+	init_instance_store(&store, instance_count, world_min, world_max);
+
+	u32 random = 101;
+	for (u32 i = 0; i < instance_count; ++i)
+	{
+		DrawCallInfo info = {};
+		info.draw_info.position = {rand_f32_in_range(world_min.x, world_max.x, &random), rand_f32_in_range(world_min.y, world_max.y, &random), rand_f32_in_range(world_min.z, world_max.z, &random)};
+		info.bounding_radius = rand_f32_in_range(0.5f, 3.0f, &random);
+		add_instance(&store, &info);
+	}
+
+	update_instance_order(&store);
+
+	f64 start = time_in_seconds();
+	InstanceBvh bvh;
+	build_instance_bvh(&bvh, &store);
+	f64 build_seconds = time_in_seconds() - start;
+
+	start = time_in_seconds();
+	refit_instance_bvh(&bvh, &store);
+	f64 refit_seconds = time_in_seconds() - start;
+
+	CullFrustum frustum = make_cull_frustum(globals);
+
+	f32* scaled_radius = new f32[instance_count];
+	for (u32 i = 0; i < instance_count; ++i) scaled_radius[i] = bvh.spheres.radius[i] * frustum.bounds_scale;
+
+	u8* flat_visible = new u8[instance_count];
+	u32* visible = new u32[instance_count];
+	u8 scratch[CULL_CHUNK_SIZE];
+	f32 radius_scratch[CULL_CHUNK_SIZE];
+
+	u32 iterations = MAX(10000000 / instance_count, 1u);
+
+	u32 flat_count = 0;
+	start = time_in_seconds();
+	for (u32 it = 0; it < iterations; ++it)
+		flat_count = cull_spheres_sse(&frustum, bvh.spheres.x, bvh.spheres.y, bvh.spheres.z, scaled_radius, instance_count, flat_visible);
+	f64 flat_seconds = (time_in_seconds() - start) / iterations;
+
+	u32 bvh_count = 0;
+	BvhCullStats stats = {};
+	start = time_in_seconds();
+	for (u32 it = 0; it < iterations; ++it)
+		bvh_count = cull_instance_bvh(&bvh, &frustum, visible, scratch, radius_scratch, &stats);
+	f64 bvh_seconds = (time_in_seconds() - start) / iterations;
+
+	assert(bvh_count == flat_count);
+
+	printf("Instance BVH %u instances: build %.2fms, refit %.2fms, %u nodes, %u visible\n", instance_count, build_seconds * 1000.0, refit_seconds * 1000.0, bvh.node_count, bvh_count);
+	printf("  flat SSE %.3fms, bvh %.3fms (%.1fx); %u nodes visited, %u leaves inside, %u partial, %u instances tested\n",
+	       flat_seconds * 1000.0, bvh_seconds * 1000.0, flat_seconds / bvh_seconds, stats.nodes_visited, stats.leaves_inside, stats.leaves_partial, stats.instances_tested);
+
+	delete[] scaled_radius;
+	delete[] flat_visible;
+	delete[] visible;
+	free_instance_bvh(&bvh);
+	free_instance_store(&store);
+}
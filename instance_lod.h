@@ -0,0 +1,189 @@
+#pragma once
+
+// Per mesh discrete LODs and the screen space contribution test cull_compute.hlsl runs after the frustum test.
+//
+// Every LOD is simplified from the full mesh and appended to the same index buffer, so picking a LOD only changes
+// IndexCountPerInstance and StartIndexLocation in the draw arguments. The error of a LOD is meshopt's simplification
+// error scaled back to mesh units; instances are only rotated, so it is a world space distance as well.
+//
+// An instance is dropped when its bounding sphere covers less than min_screen_radius pixels, otherwise it gets the
+// coarsest LOD whose error stays under lod_pixel_error pixels. Both use the view depth of the sphere's nearest point,
+// which is never further than the true distance, so sizes and errors are only ever overestimated.
+// Same projection_scale convention as LodCamera in cluster_lod.h.
+//
+// Needs include/simplifier.cpp and include/vcacheoptimizer.cpp in the same translation unit.
+
+
+constexpr u32 MAX_MESH_LODS = 4;
+constexpr u32 INSTANCE_TOO_SMALL = ~0u;
+
+constexpr f32 CONTRIBUTION_MIN_SCREEN_RADIUS = 1.0f;//Pixels
+constexpr f32 CONTRIBUTION_LOD_PIXEL_ERROR = 1.0f;
+
+// Matches MeshLods in cull_compute.hlsl, one per mesh, indexed by DrawInfo::vertex_buffer_index.
+struct MeshLods
+{
+	u32 first_index[MAX_MESH_LODS];
+	u32 index_count[MAX_MESH_LODS];
+	f32 error[MAX_MESH_LODS];//Mesh units, 0 for LOD 0
+	u32 lod_count;
+	u32 packing[3];
+};
+static_assert(sizeof(MeshLods) == 64, "MeshLods must match the shader's structured buffer stride");
+
+// Writes LOD 0 (the given indices) followed by every coarser LOD into lod_indices and returns the total index count.
+// Each LOD targets a quarter of the one before, and one that does not get below LOD_MIN_REDUCTION of the previous one
+// ends the chain, so lod_indices never needs room for more than index_count * 2 indices. max_lod_count 1 only writes
+// LOD 0.
+constexpr f32 LOD_MIN_REDUCTION = 0.5f;
+
+u32 build_mesh_lods(MeshLods* lods, u32* lod_indices, const u32* indices, u32 index_count, const f32* vertex_positions, u32 vertex_count, size_t vertex_positions_stride,
+                    u32 max_lod_count = MAX_MESH_LODS)
+{
+	*lods = {};
+
+	memcpy(lod_indices, indices, index_count * sizeof(u32));
+	lods->first_index[0] = 0;
+	lods->index_count[0] = index_count;
+	lods->error[0] = 0.0f;
+	lods->lod_count = 1;
+
+	max_lod_count = MIN(max_lod_count, MAX_MESH_LODS);
+	if (max_lod_count <= 1) return index_count;
+
+	f32 scale = meshopt_simplifyScale(vertex_positions, vertex_count, vertex_positions_stride);
+	u32 total_index_count = index_count;
+
+	//meshopt_simplify works in its destination, which has to hold index_count indices.
+	u32* scratch = new u32[index_count];
+
+	for (u32 lod = 1; lod < max_lod_count; ++lod)
+	{
+		u32 previous_count = lods->index_count[lod - 1];
+		u32 target_index_count = (u32)(index_count >> (2 * lod)) / 3 * 3;
+		if (target_index_count < 3) break;
+
+		//Simplified from the full mesh every time, so errors do not stack up along the chain.
+		f32 result_error = 0.0f;
+		u32 lod_index_count = (u32)meshopt_simplify(scratch, indices, index_count, vertex_positions, vertex_count, vertex_positions_stride,
+		                                            target_index_count, 1.0f, 0, &result_error);
+
+		if (lod_index_count == 0 || lod_index_count > previous_count * LOD_MIN_REDUCTION) break;
+
+		meshopt_optimizeVertexCache(lod_indices + total_index_count, scratch, lod_index_count, vertex_count);
+
+		lods->first_index[lod] = total_index_count;
+		lods->index_count[lod] = lod_index_count;
+		lods->error[lod] = MAX(result_error * scale, lods->error[lod - 1]);
+		lods->lod_count = lod + 1;
+
+		total_index_count += lod_index_count;
+	}
+
+	delete[] scratch;
+	return total_index_count;
+}
+
+// projection.d[1][1] * height / 2 and projection.d[0][0] * width / 2 are equal for a square pixel projection; the
+// larger one is used so nothing is underestimated if they are not.
+f32 contribution_projection_scale(const Mat4x4* projection, u32 width, u32 height)
+{
+	return MAX(projection->d[0][0] * width, projection->d[1][1] * height) * 0.5f;
+}
+
+// view_depth is the distance of the sphere centre in front of the camera, -(view * position).z.
+// Returns INSTANCE_TOO_SMALL or the LOD to draw. A negative lod_pixel_error always selects LOD 0.
+u32 select_instance_lod(const MeshLods* lods, f32 view_depth, f32 radius, f32 near_plane, f32 projection_scale, f32 min_screen_radius, f32 lod_pixel_error)
+{
+	//Spheres reaching the near plane are treated as being on it, like lod_error_is_acceptable.
+	f32 distance = MAX(view_depth - radius, near_plane);
+	f32 pixels_per_unit = projection_scale / distance;
+
+	if (radius * pixels_per_unit < min_screen_radius) return INSTANCE_TOO_SMALL;
+
+	for (u32 lod = lods->lod_count - 1; lod > 0; --lod)
+		if (lods->error[lod] * pixels_per_unit <= lod_pixel_error) return lod;
+
+	return 0;
+}
+
+
+struct ContributionStats
+{
+	u32 frustum_visible;
+	u32 too_small;
+	u32 lod_histogram[MAX_MESH_LODS];
+	u64 triangles_before;//Full meshes for everything in the frustum
+	u64 triangles_after;
+};
+
+// The frustum test, then the contribution test for every instance, exactly as cull_compute does them. Radii are
+// pre-scaled by bounds_scale, as uploaded. lods is indexed by vertex_buffer_index.
+void contribution_cull_instances(const MeshLods* lods, const DrawCallInfo* instances, u32 count, const ShaderGlobals* globals, u32 width, u32 height,
+                                 f32 min_screen_radius, f32 lod_pixel_error, u32* selected_lods, ContributionStats* stats)
+{
+	*stats = {};
+
+	CullFrustum frustum = make_cull_frustum(globals);
+	f32 projection_scale = contribution_projection_scale(&globals->projection, width, height);
+	f32 near_plane = globals->projection.d[2][3];
+
+	for (u32 i = 0; i < count; ++i)
+	{
+		const DrawCallInfo* instance = &instances[i];
+		selected_lods[i] = INSTANCE_TOO_SMALL;
+
+		vec3 position = instance_sphere_centre(instance);
+		if (!sphere_in_frustum(&frustum, position, instance->bounding_radius)) continue;
+
+		const MeshLods* mesh_lods = &lods[instance->draw_info.vertex_buffer_index];
+		stats->frustum_visible++;
+		stats->triangles_before += mesh_lods->index_count[0] / 3;
+
+		vec4 p = mult(globals->view, vec4{position.x, position.y, position.z, 1.0f});
+		f32 radius = instance->bounding_radius / frustum.bounds_scale;
+
+		u32 lod = select_instance_lod(mesh_lods, -p.z, radius, near_plane, projection_scale, min_screen_radius, lod_pixel_error);
+		selected_lods[i] = lod;
+
+		if (lod == INSTANCE_TOO_SMALL)
+		{
+			stats->too_small++;
+			continue;
+		}
+
+		stats->lod_histogram[lod]++;
+		stats->triangles_after += mesh_lods->index_count[lod] / 3;
+	}
+}
+
+// Prints the triangles submitted for the frustum survivors with full meshes, then with contribution culling and LOD
+// selection, and how the survivors spread over the LODs.
+void benchmark_contribution_culling(const MeshLods* lods, u32 mesh_count, const DrawCallInfo* instances, u32 count, const ShaderGlobals* globals, u32 width, u32 height,
+                                    f32 min_screen_radius = CONTRIBUTION_MIN_SCREEN_RADIUS, f32 lod_pixel_error = CONTRIBUTION_LOD_PIXEL_ERROR)
+{
+	for (u32 m = 0; m < mesh_count; ++m)
+	{
+		printf("Mesh %u LODs:", m);
+		for (u32 lod = 0; lod < lods[m].lod_count; ++lod) printf(" %u tris (error %.4f)", lods[m].index_count[lod] / 3, lods[m].error[lod]);
+		printf("\n");
+	}
+
+	u32* selected_lods = new u32[count];
+	ContributionStats stats;
+
+	const u32 iterations = 100;
+	f64 start = time_in_seconds();
+	for (u32 it = 0; it < iterations; ++it)
+		contribution_cull_instances(lods, instances, count, globals, width, height, min_screen_radius, lod_pixel_error, selected_lods, &stats);
+	f64 seconds = (time_in_seconds() - start) / iterations;
+
+	printf("Contribution culling %u instances at %ux%u (min radius %.1fpx, lod error %.1fpx): %u in frustum, %u too small, %.3fms\n",
+	       count, width, height, min_screen_radius, lod_pixel_error, stats.frustum_visible, stats.too_small, seconds * 1000.0);
+	printf("  triangles submitted: %llu before, %llu after (%.1f%%); lods:", (unsigned long long)stats.triangles_before, (unsigned long long)stats.triangles_after,
+	       stats.triangles_before ? 100.0 * stats.triangles_after / stats.triangles_before : 0.0);
+	for (u32 lod = 0; lod < MAX_MESH_LODS; ++lod) printf(" %u", stats.lod_histogram[lod]);
+	printf("\n");
+
+	delete[] selected_lods;
+}
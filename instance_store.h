@@ -0,0 +1,358 @@
+#pragma once
+
+// Keeps the DrawCallInfo array in Morton order of instance position, so every 64 instance cull wave covers a compact
+// region of the world: whole waves are either in or out of the frustum, and neighbouring argument buffer entries
+// are neighbours on screen.
+//
+// Instances are addressed through stable handles; moving one only recomputes its key and flags it. The next
+// update_instance_order either merges the moved instances back into the still sorted rest, or re-sorts everything
+// with the same 3x10 bit radix sort as meshopt_spatialSortRemap when a lot has moved.
+//
+// Needs include/spatialorder.cpp and culling.h in the same translation unit.
+
+
+struct InstanceStore
+{
+	DrawCallInfo* instances;//Morton order
+	u32* keys;//Per slot
+	u32* slot_handles;//Slot -> handle
+	u32* handle_slots;//Handle -> slot
+	u8* moved;//Per slot, key may be out of order
+
+	u32 count;
+	u32 capacity;
+	u32 moved_count;
+
+	vec3 world_min;
+	f32 world_scale;//1023 / largest world extent
+};
+
+void init_instance_store(InstanceStore* store, u32 capacity, vec3 world_min, vec3 world_max)
+{
+	*store = {};
+	store->instances = new DrawCallInfo[capacity];
+	store->keys = new u32[capacity];
+	store->slot_handles = new u32[capacity];
+	store->handle_slots = new u32[capacity];
+	store->moved = new u8[capacity];
+	store->capacity = capacity;
+
+	vec3 extent = world_max - world_min;
+	store->world_min = world_min;
+	store->world_scale = 1023.0f / MAX(MAX(extent.x, extent.y), MAX(extent.z, 1e-6f));
+}
+
+void free_instance_store(InstanceStore* store)
+{
+	delete[] store->instances;
+	delete[] store->keys;
+	delete[] store->slot_handles;
+	delete[] store->handle_slots;
+	delete[] store->moved;
+	*store = {};
+}
+
+// Keys are quantized against the fixed world bounds, not the current instance bounds like meshopt does, so the
+// key of an instance that did not move never changes. Positions outside the bounds clamp to the border cells.
+u32 instance_morton_key(const InstanceStore* store, vec3 position)
+{
+	vec3 p = (position - store->world_min) * store->world_scale;
+
+	u32 x = (u32)MIN(MAX(p.x + 0.5f, 0.0f), 1023.0f);
+	u32 y = (u32)MIN(MAX(p.y + 0.5f, 0.0f), 1023.0f);
+	u32 z = (u32)MIN(MAX(p.z + 0.5f, 0.0f), 1023.0f);
+
+	return meshopt::part1By2(x) | (meshopt::part1By2(y) << 1) | (meshopt::part1By2(z) << 2);
+}
+
+u32 add_instance(InstanceStore* store, const DrawCallInfo* info)
+{
+	assert(store->count < store->capacity);
+
+	u32 slot = store->count++;
+	u32 handle = slot;
+
+	store->instances[slot] = *info;
+	store->keys[slot] = instance_morton_key(store, info->draw_info.position);
+	store->slot_handles[slot] = handle;
+	store->handle_slots[handle] = slot;
+	store->moved[slot] = 1;
+	store->moved_count++;
+
+	return handle;
+}
+
+DrawCallInfo* get_instance(InstanceStore* store, u32 handle)
+{
+	return &store->instances[store->handle_slots[handle]];
+}
+
+void move_instance(InstanceStore* store, u32 handle, vec3 position)
+{
+	u32 slot = store->handle_slots[handle];
+	store->instances[slot].draw_info.position = position;
+
+	u32 key = instance_morton_key(store, position);
+	if (key == store->keys[slot]) return;
+
+	store->keys[slot] = key;
+	if (!store->moved[slot])
+	{
+		store->moved[slot] = 1;
+		store->moved_count++;
+	}
+}
+
+// meshopt's radix sort over an index list: order gets 0..count-1 sorted by keys[order[i]], stable.
+void radix_sort_keys(u32* order, u32* scratch, const u32* keys, u32 count)
+{
+	u32 hist[1024][3];
+	meshopt::computeHistogram(hist, keys, count);
+
+	for (u32 i = 0; i < count; ++i) scratch[i] = i;
+
+	meshopt::radixPass(order, scratch, keys, count, hist, 0);
+	meshopt::radixPass(scratch, order, keys, count, hist, 1);
+	meshopt::radixPass(order, scratch, keys, count, hist, 2);
+}
+
+// Past this fraction of moved instances a full sort is cheaper than sorting the moved ones and merging.
+constexpr u32 INSTANCE_FULL_SORT_DIVISOR = 8;
+
+void update_instance_order(InstanceStore* store)
+{
+	if (store->moved_count == 0) return;
+
+	u32 count = store->count;
+	u32* order = new u32[count];//New slot -> old slot
+	u32* scratch = new u32[count];
+
+	if (store->moved_count * INSTANCE_FULL_SORT_DIVISOR > count)
+	{
+		radix_sort_keys(order, scratch, store->keys, count);
+	}
+	else
+	{
+		//Slots that did not move are still in order; sort the moved ones on their own and merge the two runs.
+		u32 moved_count = store->moved_count;
+		u32* moved_slots = new u32[moved_count];
+		u32* moved_keys = new u32[moved_count];
+		u32* moved_order = new u32[moved_count];
+
+		u32 stationary_count = 0;
+		moved_count = 0;
+
+		for (u32 slot = 0; slot < count; ++slot)
+		{
+			if (store->moved[slot])
+			{
+				moved_slots[moved_count] = slot;
+				moved_keys[moved_count] = store->keys[slot];
+				moved_count++;
+			}
+			else
+			{
+				scratch[stationary_count++] = slot;
+			}
+		}
+
+		radix_sort_keys(moved_order, order, moved_keys, moved_count);
+
+		u32 a = 0, b = 0, output = 0;
+		while (a < stationary_count || b < moved_count)
+		{
+			bool take_stationary = b == moved_count || (a < stationary_count && store->keys[scratch[a]] <= moved_keys[moved_order[b]]);
+			order[output++] = take_stationary ? scratch[a++] : moved_slots[moved_order[b++]];
+		}
+
+		delete[] moved_slots;
+		delete[] moved_keys;
+		delete[] moved_order;
+	}
+
+	DrawCallInfo* instances = new DrawCallInfo[store->capacity];
+	u32* keys = new u32[store->capacity];
+	u32* slot_handles = new u32[store->capacity];
+
+	for (u32 slot = 0; slot < count; ++slot)
+	{
+		u32 old_slot = order[slot];
+
+		instances[slot] = store->instances[old_slot];
+		keys[slot] = store->keys[old_slot];
+		slot_handles[slot] = store->slot_handles[old_slot];
+		store->handle_slots[slot_handles[slot]] = slot;
+	}
+
+	delete[] store->instances;
+	delete[] store->keys;
+	delete[] store->slot_handles;
+	store->instances = instances;
+	store->keys = keys;
+	store->slot_handles = slot_handles;
+
+	memset(store->moved, 0, count);
+	store->moved_count = 0;
+
+	delete[] order;
+	delete[] scratch;
+}
+
+
+// Moves move_count instances so update_instance_order takes the merge path, and checks the result against
+// radix_sort_keys over all keys: the same key sequence, keys that match the positions and handles that still find
+// their own instance. Equal keys may tie break differently between the two paths, so only keys are compared by slot.
+bool verify_instance_order(const DrawCallInfo* infos, u32 count, vec3 world_min, vec3 world_max, u32 move_count)
+{
+	InstanceStore store;
+	init_instance_store(&store, count, world_min, world_max);
+	for (u32 i = 0; i < count; ++i) add_instance(&store, &infos[i]);
+	update_instance_order(&store);
+
+	vec3* positions = new vec3[count];//Per handle
+	for (u32 i = 0; i < count; ++i) positions[i] = infos[i].draw_info.position;
+
+	u32 random = 313;
+	for (u32 m = 0; m < move_count; ++m)
+	{
+		u32 handle = (u32)rand_f32_in_range(0.0f, (f32)count, &random);
+		handle = MIN(handle, count - 1);
+		vec3 position = {rand_f32_in_range(world_min.x, world_max.x, &random), rand_f32_in_range(world_min.y, world_max.y, &random), rand_f32_in_range(world_min.z, world_max.z, &random)};
+		move_instance(&store, handle, position);
+		positions[handle] = position;
+	}
+
+	bool passed = true;
+	if (store.moved_count * INSTANCE_FULL_SORT_DIVISOR > count)
+	{
+		printf("Instance order: %u of %u moved takes the full sort, not the merge\n", store.moved_count, count);
+		passed = false;
+	}
+
+	u32* order = new u32[count];
+	u32* scratch = new u32[count];
+	u32* expected_keys = new u32[count];
+	radix_sort_keys(order, scratch, store.keys, count);
+	for (u32 slot = 0; slot < count; ++slot) expected_keys[slot] = store.keys[order[slot]];
+
+	update_instance_order(&store);
+
+	for (u32 slot = 0; slot < count && passed; ++slot)
+	{
+		u32 handle = store.slot_handles[slot];
+		vec3 position = store.instances[slot].draw_info.position;
+
+		if (store.keys[slot] != expected_keys[slot] || store.keys[slot] != instance_morton_key(&store, position))
+		{
+			printf("Instance order MISMATCH: slot %u key %u, full sort key %u\n", slot, store.keys[slot], expected_keys[slot]);
+			passed = false;
+		}
+		else if (store.handle_slots[handle] != slot || memcmp(&position, &positions[handle], sizeof(vec3)) != 0)
+		{
+			printf("Instance order MISMATCH: slot %u lost handle %u\n", slot, handle);
+			passed = false;
+		}
+	}
+
+	delete[] order;
+	delete[] scratch;
+	delete[] expected_keys;
+	delete[] positions;
+	free_instance_store(&store);
+
+	return passed;
+}
+
+
+// Culls the same instances in their given order and in Morton order, flat and with a per chunk bounds test
+// that skips whole 64 instance chunks, and prints throughput and chunk statistics for both.
+void benchmark_instance_order(const DrawCallInfo* infos, u32 count, const ShaderGlobals* globals, vec3 world_min, vec3 world_max)
+{
+	InstanceStore store;
+	init_instance_store(&store, count, world_min, world_max);
+	for (u32 i = 0; i < count; ++i) add_instance(&store, &infos[i]);
+
+	f64 start = time_in_seconds();
+	update_instance_order(&store);
+	f64 sort_seconds = time_in_seconds() - start;
+
+	CullFrustum frustum = make_cull_frustum(globals);
+	u8* visible = new u8[count];
+
+	printf("Instance order (%u instances, full sort %.3fms):\n", count, sort_seconds * 1000.0);
+
+	const DrawCallInfo* orders[2] = {infos, store.instances};
+	char* order_names[2] = {"submission", "morton"};
+
+	for (u32 o = 0; o < 2; ++o)
+	{
+		CullSpheres spheres;
+		init_cull_spheres(&spheres, orders[o], count);
+
+		const u32 iterations = 1000;
+		u32 visible_count = 0;
+
+		start = time_in_seconds();
+		for (u32 it = 0; it < iterations; ++it)
+			visible_count = cull_spheres_sse(&frustum, spheres.x, spheres.y, spheres.z, spheres.radius, count, visible);
+		f64 flat_seconds = (time_in_seconds() - start) / iterations;
+
+		CullChunkStats stats = measure_cull_chunks(&frustum, &spheres, visible);
+
+		//Chunk spheres are built once here, like a BVH leaf level would be; only the tests are timed.
+		u32 chunk_count = stats.chunk_count;
+		f32* chunk_x = new f32[chunk_count];
+		f32* chunk_y = new f32[chunk_count];
+		f32* chunk_z = new f32[chunk_count];
+		f32* chunk_radius = new f32[chunk_count];
+		u8* chunk_visible = new u8[chunk_count];
+
+		for (u32 c = 0; c < chunk_count; ++c)
+		{
+			vec3 centre;
+			chunk_bounding_sphere(&spheres, c * CULL_CHUNK_SIZE, MIN(CULL_CHUNK_SIZE, count - c * CULL_CHUNK_SIZE), frustum.bounds_scale, &centre, &chunk_radius[c]);
+			chunk_x[c] = centre.x;
+			chunk_y[c] = centre.y;
+			chunk_z[c] = centre.z;
+		}
+
+		u32 chunked_visible_count = 0;
+		start = time_in_seconds();
+		for (u32 it = 0; it < iterations; ++it)
+		{
+			cull_spheres_sse(&frustum, chunk_x, chunk_y, chunk_z, chunk_radius, chunk_count, chunk_visible);
+
+			chunked_visible_count = 0;
+			for (u32 c = 0; c < chunk_count; ++c)
+			{
+				u32 first = c * CULL_CHUNK_SIZE;
+				u32 chunk_size = MIN(CULL_CHUNK_SIZE, count - first);
+
+				if (!chunk_visible[c])
+				{
+					memset(visible + first, 0, chunk_size);
+					continue;
+				}
+
+				chunked_visible_count += cull_spheres_sse(&frustum, spheres.x + first, spheres.y + first, spheres.z + first, spheres.radius + first, chunk_size, visible + first);
+			}
+		}
+		f64 chunked_seconds = (time_in_seconds() - start) / iterations;
+
+		assert(chunked_visible_count == visible_count);
+
+		printf("  %-10s: %u visible, flat %.2fns/instance, chunked %.2fns/instance; chunks %u: %u visible, %u culled, %u mixed, %u rejected by chunk bounds\n",
+		       order_names[o], visible_count, flat_seconds * 1e9 / count, chunked_seconds * 1e9 / count,
+		       chunk_count, stats.all_visible, stats.all_culled, stats.mixed, stats.rejected_by_bounds);
+
+		delete[] chunk_x;
+		delete[] chunk_y;
+		delete[] chunk_z;
+		delete[] chunk_radius;
+		delete[] chunk_visible;
+		free_cull_spheres(&spheres);
+	}
+
+	delete[] visible;
+	free_instance_store(&store);
+}
@@ -0,0 +1,462 @@
+#pragma once
+
+// Packed instance transforms, and the SSE kernels that turn them into the 3x4 matrices the instanced draws in
+// vertex_shader.hlsl read.
+//
+// DrawInfo spends 28 of its 32 bytes on a float quaternion and a float position, and the vertex shader composes the
+// quaternion with the time spin, normalizes it and rotates with two cross products for every vertex. Packed, an
+// instance is 16 bytes:
+// - the rotation as its smallest three components. The largest is dropped and made positive (q and -q are the same
+//   rotation), so the other three are within +-1/sqrt(2) and 16 bits each; decoding rebuilds the largest from unit length.
+// - the position as 16 bits per axis in the bounds of its block of INSTANCE_TRANSFORM_BLOCK_SIZE instances. The
+//   instance store keeps instances in Morton order, so a block is a small part of the world and the step stays fine.
+// - the mesh's vertex buffer index, with which component was dropped in the top two bits.
+//
+// decode_instance_transforms_sse decodes four instances per iteration, composes them with the spin and writes the
+// matrices as twelve arrays, one per element. interleave_instance_matrices_sse turns those into the three float4 rows
+// per instance the shader reads, so each vertex is one 3x4 multiply.
+//
+// Needs occlusion.h and instance_store.h in the same translation unit.
+
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+
+constexpr u32 INSTANCE_TRANSFORM_BLOCK_SIZE = 64;
+constexpr f32 INSTANCE_ROTATION_RANGE = 0.70710678f;//Smallest three are within +-1/sqrt(2)
+
+struct PackedInstanceTransform
+{
+	u16 position[3];//Steps from the block's origin
+	u16 rotation[3];//Smallest three, in component order
+	u32 mesh_and_axis;//vertex_buffer_index in the low 30 bits, dropped component in the top 2
+};
+static_assert(sizeof(PackedInstanceTransform) == 16, "PackedInstanceTransform should be 16 bytes");
+
+struct InstanceTransformBlock
+{
+	vec3 origin;
+	vec3 step;
+};
+
+struct PackedInstanceTransforms
+{
+	PackedInstanceTransform* transforms;
+	InstanceTransformBlock* blocks;//One per INSTANCE_TRANSFORM_BLOCK_SIZE transforms
+	u32 count;
+};
+
+// Row major 3x4 matrices, one array per element: elements[r * 4 + c], column 3 the translation.
+struct InstanceMatrices
+{
+	f32* elements[12];
+	u32 capacity;
+};
+
+inline u16 quantize_instance_unorm(f32 v)
+{
+	return (u16)(MIN(MAX(v, 0.0f), 1.0f) * 65535.0f + 0.5f);
+}
+
+void pack_instance_transforms(PackedInstanceTransforms* packed, const DrawCallInfo* instances, u32 count)
+{
+	u32 block_count = (count + INSTANCE_TRANSFORM_BLOCK_SIZE - 1) / INSTANCE_TRANSFORM_BLOCK_SIZE;
+
+	*packed = {};
+	packed->count = count;
+	packed->transforms = new PackedInstanceTransform[MAX(count, 1u)];
+	packed->blocks = new InstanceTransformBlock[MAX(block_count, 1u)];
+
+	for (u32 b = 0; b < block_count; ++b)
+	{
+		u32 first = b * INSTANCE_TRANSFORM_BLOCK_SIZE;
+		u32 last = MIN(first + INSTANCE_TRANSFORM_BLOCK_SIZE, count);
+
+		vec3 lowest = instances[first].draw_info.position;
+		vec3 highest = lowest;
+		for (u32 i = first + 1; i < last; ++i)
+		{
+			vec3 p = instances[i].draw_info.position;
+			for (u32 a = 0; a < 3; ++a)
+			{
+				lowest.data[a] = MIN(lowest.data[a], p.data[a]);
+				highest.data[a] = MAX(highest.data[a], p.data[a]);
+			}
+		}
+
+		InstanceTransformBlock* block = &packed->blocks[b];
+		block->origin = lowest;
+		for (u32 a = 0; a < 3; ++a) block->step.data[a] = (highest.data[a] - lowest.data[a]) / 65535.0f;
+
+		for (u32 i = first; i < last; ++i)
+		{
+			const DrawInfo* draw_info = &instances[i].draw_info;
+			PackedInstanceTransform* t = &packed->transforms[i];
+
+			for (u32 a = 0; a < 3; ++a)
+			{
+				f32 step = block->step.data[a];
+				t->position[a] = step > 0.0f ? quantize_instance_unorm((draw_info->position.data[a] - lowest.data[a]) / (step * 65535.0f)) : 0;
+			}
+
+			vec4 q = normalize(draw_info->quat);
+			u32 largest = 0;
+			for (u32 c = 1; c < 4; ++c)
+			{
+				if (fabsf(q.data[c]) > fabsf(q.data[largest])) largest = c;
+			}
+			f32 sign = q.data[largest] < 0.0f ? -1.0f : 1.0f;
+
+			u32 stored = 0;
+			for (u32 c = 0; c < 4; ++c)
+			{
+				if (c == largest) continue;
+				t->rotation[stored++] = quantize_instance_unorm((sign * q.data[c] / INSTANCE_ROTATION_RANGE) * 0.5f + 0.5f);
+			}
+
+			assert(draw_info->vertex_buffer_index < (1u << 30));
+			t->mesh_and_axis = draw_info->vertex_buffer_index | (largest << 30);
+		}
+	}
+}
+
+void free_packed_instance_transforms(PackedInstanceTransforms* packed)
+{
+	delete[] packed->transforms;
+	delete[] packed->blocks;
+	*packed = {};
+}
+
+void init_instance_matrices(InstanceMatrices* matrices, u32 capacity)
+{
+	*matrices = {};
+	matrices->capacity = capacity;
+	for (u32 e = 0; e < 12; ++e) matrices->elements[e] = new f32[MAX(capacity, 1u)];
+}
+
+void free_instance_matrices(InstanceMatrices* matrices)
+{
+	for (u32 e = 0; e < 12; ++e) delete[] matrices->elements[e];
+	*matrices = {};
+}
+
+inline u32 packed_instance_vertex_buffer_index(const PackedInstanceTransform* t)
+{
+	return t->mesh_and_axis & ((1u << 30) - 1);
+}
+
+// The spin instance_rotation composes every instance with.
+inline vec4 instance_spin(f32 time)
+{
+	return normalize(vec4{0.0f, 1.0f, 0.0f, cosf(time / 2)});
+}
+
+// Scalar decode of transform slot into matrix (row major 3x4), the same steps as the SSE kernel.
+void decode_instance_transform(const PackedInstanceTransforms* packed, u32 slot, vec4 spin, f32* matrix)
+{
+	const PackedInstanceTransform* t = &packed->transforms[slot];
+	const InstanceTransformBlock* block = &packed->blocks[slot / INSTANCE_TRANSFORM_BLOCK_SIZE];
+
+	f32 s[3];
+	for (u32 c = 0; c < 3; ++c) s[c] = (t->rotation[c] * (2.0f / 65535.0f) - 1.0f) * INSTANCE_ROTATION_RANGE;
+	f32 l = sqrtf(MAX(1.0f - s[0] * s[0] - s[1] * s[1] - s[2] * s[2], 0.0f));
+
+	u32 axis = t->mesh_and_axis >> 30;
+	vec4 q;
+	q.x = axis == 0 ? l : s[0];
+	q.y = axis == 1 ? l : (axis == 0 ? s[0] : s[1]);
+	q.z = axis == 2 ? l : (axis == 3 ? s[2] : s[1]);
+	q.w = axis == 3 ? l : s[2];
+
+	q = quat_mul(q, spin);
+	f32 inverse_length = 1.0f / sqrtf(q.x * q.x + q.y * q.y + q.z * q.z + q.w * q.w);
+	f32 x = q.x * inverse_length, y = q.y * inverse_length, z = q.z * inverse_length, w = q.w * inverse_length;
+
+	matrix[0] = 1.0f - 2.0f * (y * y + z * z);
+	matrix[1] = 2.0f * (x * y - w * z);
+	matrix[2] = 2.0f * (x * z + w * y);
+	matrix[4] = 2.0f * (x * y + w * z);
+	matrix[5] = 1.0f - 2.0f * (x * x + z * z);
+	matrix[6] = 2.0f * (y * z - w * x);
+	matrix[8] = 2.0f * (x * z - w * y);
+	matrix[9] = 2.0f * (y * z + w * x);
+	matrix[10] = 1.0f - 2.0f * (x * x + y * y);
+
+	matrix[3] = block->origin.x + t->position[0] * block->step.x;
+	matrix[7] = block->origin.y + t->position[1] * block->step.y;
+	matrix[11] = block->origin.z + t->position[2] * block->step.z;
+}
+
+// Decodes transforms order[0] to order[count - 1] (0 to count - 1 without an order) into matrices 0 to count - 1,
+// four per iteration with one transform per lane.
+void decode_instance_transforms_sse(InstanceMatrices* matrices, const PackedInstanceTransforms* packed, const u32* order, u32 count, f32 time)
+{
+	assert(count <= matrices->capacity);
+
+	vec4 spin = instance_spin(time);
+	__m128 spin_x = _mm_set1_ps(spin.x), spin_y = _mm_set1_ps(spin.y), spin_z = _mm_set1_ps(spin.z), spin_w = _mm_set1_ps(spin.w);
+	__m128 rotation_scale = _mm_set1_ps(2.0f / 65535.0f * INSTANCE_ROTATION_RANGE);
+	__m128 rotation_bias = _mm_set1_ps(-INSTANCE_ROTATION_RANGE);
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 two = _mm_set1_ps(2.0f);
+	__m128 zero = _mm_setzero_ps();
+
+	f32** e = matrices->elements;
+
+	u32 i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		u32 slots[4];
+		for (u32 l = 0; l < 4; ++l) slots[l] = order ? order[i + l] : i + l;
+		const PackedInstanceTransform* t0 = &packed->transforms[slots[0]];
+		const PackedInstanceTransform* t1 = &packed->transforms[slots[1]];
+		const PackedInstanceTransform* t2 = &packed->transforms[slots[2]];
+		const PackedInstanceTransform* t3 = &packed->transforms[slots[3]];
+		const InstanceTransformBlock* b0 = &packed->blocks[slots[0] / INSTANCE_TRANSFORM_BLOCK_SIZE];
+		const InstanceTransformBlock* b1 = &packed->blocks[slots[1] / INSTANCE_TRANSFORM_BLOCK_SIZE];
+		const InstanceTransformBlock* b2 = &packed->blocks[slots[2] / INSTANCE_TRANSFORM_BLOCK_SIZE];
+		const InstanceTransformBlock* b3 = &packed->blocks[slots[3] / INSTANCE_TRANSFORM_BLOCK_SIZE];
+
+		//Smallest three to [-1/sqrt(2), 1/sqrt(2)], the largest from unit length
+		__m128 s0 = _mm_cvtepi32_ps(_mm_set_epi32(t3->rotation[0], t2->rotation[0], t1->rotation[0], t0->rotation[0]));
+		__m128 s1 = _mm_cvtepi32_ps(_mm_set_epi32(t3->rotation[1], t2->rotation[1], t1->rotation[1], t0->rotation[1]));
+		__m128 s2 = _mm_cvtepi32_ps(_mm_set_epi32(t3->rotation[2], t2->rotation[2], t1->rotation[2], t0->rotation[2]));
+		s0 = _mm_add_ps(_mm_mul_ps(s0, rotation_scale), rotation_bias);
+		s1 = _mm_add_ps(_mm_mul_ps(s1, rotation_scale), rotation_bias);
+		s2 = _mm_add_ps(_mm_mul_ps(s2, rotation_scale), rotation_bias);
+		__m128 sum = _mm_add_ps(_mm_add_ps(_mm_mul_ps(s0, s0), _mm_mul_ps(s1, s1)), _mm_mul_ps(s2, s2));
+		__m128 l = _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(one, sum), zero));
+
+		//Put the largest back where it was dropped from
+		__m128i axis = _mm_set_epi32(t3->mesh_and_axis >> 30, t2->mesh_and_axis >> 30, t1->mesh_and_axis >> 30, t0->mesh_and_axis >> 30);
+		__m128 axis_0 = _mm_castsi128_ps(_mm_cmpeq_epi32(axis, _mm_set1_epi32(0)));
+		__m128 axis_1 = _mm_castsi128_ps(_mm_cmpeq_epi32(axis, _mm_set1_epi32(1)));
+		__m128 axis_2 = _mm_castsi128_ps(_mm_cmpeq_epi32(axis, _mm_set1_epi32(2)));
+		__m128 axis_3 = _mm_castsi128_ps(_mm_cmpeq_epi32(axis, _mm_set1_epi32(3)));
+		auto select = [](__m128 mask, __m128 a, __m128 b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); };
+
+		__m128 qx = select(axis_0, l, s0);
+		__m128 qy = select(axis_1, l, select(axis_0, s0, s1));
+		__m128 qz = select(axis_2, l, select(axis_3, s2, s1));
+		__m128 qw = select(axis_3, l, s2);
+
+		//quat_mul(q, spin)
+		__m128 x = _mm_add_ps(_mm_add_ps(_mm_mul_ps(spin_x, qw), _mm_mul_ps(qx, spin_w)), _mm_sub_ps(_mm_mul_ps(qy, spin_z), _mm_mul_ps(qz, spin_y)));
+		__m128 y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(spin_y, qw), _mm_mul_ps(qy, spin_w)), _mm_sub_ps(_mm_mul_ps(qz, spin_x), _mm_mul_ps(qx, spin_z)));
+		__m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(spin_z, qw), _mm_mul_ps(qz, spin_w)), _mm_sub_ps(_mm_mul_ps(qx, spin_y), _mm_mul_ps(qy, spin_x)));
+		__m128 w = _mm_sub_ps(_mm_mul_ps(qw, spin_w), _mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, spin_x), _mm_mul_ps(qy, spin_y)), _mm_mul_ps(qz, spin_z)));
+
+		__m128 length_squared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_add_ps(_mm_mul_ps(z, z), _mm_mul_ps(w, w)));
+		__m128 inverse_length = _mm_div_ps(one, _mm_sqrt_ps(length_squared));
+		x = _mm_mul_ps(x, inverse_length);
+		y = _mm_mul_ps(y, inverse_length);
+		z = _mm_mul_ps(z, inverse_length);
+		w = _mm_mul_ps(w, inverse_length);
+
+		__m128 xx = _mm_mul_ps(x, x), yy = _mm_mul_ps(y, y), zz = _mm_mul_ps(z, z);
+		__m128 xy = _mm_mul_ps(x, y), xz = _mm_mul_ps(x, z), yz = _mm_mul_ps(y, z);
+		__m128 wx = _mm_mul_ps(w, x), wy = _mm_mul_ps(w, y), wz = _mm_mul_ps(w, z);
+
+		_mm_storeu_ps(e[0] + i, _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))));
+		_mm_storeu_ps(e[1] + i, _mm_mul_ps(two, _mm_sub_ps(xy, wz)));
+		_mm_storeu_ps(e[2] + i, _mm_mul_ps(two, _mm_add_ps(xz, wy)));
+		_mm_storeu_ps(e[4] + i, _mm_mul_ps(two, _mm_add_ps(xy, wz)));
+		_mm_storeu_ps(e[5] + i, _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))));
+		_mm_storeu_ps(e[6] + i, _mm_mul_ps(two, _mm_sub_ps(yz, wx)));
+		_mm_storeu_ps(e[8] + i, _mm_mul_ps(two, _mm_sub_ps(xz, wy)));
+		_mm_storeu_ps(e[9] + i, _mm_mul_ps(two, _mm_add_ps(yz, wx)));
+		_mm_storeu_ps(e[10] + i, _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))));
+
+		//Block origin plus steps
+		for (u32 a = 0; a < 3; ++a)
+		{
+			__m128 origin = _mm_set_ps(b3->origin.data[a], b2->origin.data[a], b1->origin.data[a], b0->origin.data[a]);
+			__m128 step = _mm_set_ps(b3->step.data[a], b2->step.data[a], b1->step.data[a], b0->step.data[a]);
+			__m128 steps = _mm_cvtepi32_ps(_mm_set_epi32(t3->position[a], t2->position[a], t1->position[a], t0->position[a]));
+			_mm_storeu_ps(e[a * 4 + 3] + i, _mm_add_ps(origin, _mm_mul_ps(steps, step)));
+		}
+	}
+
+	for (; i < count; ++i)
+	{
+		f32 matrix[12];
+		decode_instance_transform(packed, order ? order[i] : i, spin, matrix);
+		for (u32 k = 0; k < 12; ++k) e[k][i] = matrix[k];
+	}
+}
+
+// Matrices 0 to count - 1 as three float4 rows each, the layout vertex_shader.hlsl reads. rows can be mapped upload
+// memory, every row is written once with a whole 16 byte store.
+void interleave_instance_matrices_sse(vec4* rows, const InstanceMatrices* matrices, u32 count)
+{
+	f32* const* e = matrices->elements;
+
+	u32 i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		for (u32 r = 0; r < 3; ++r)
+		{
+			__m128 c0 = _mm_loadu_ps(e[r * 4 + 0] + i);
+			__m128 c1 = _mm_loadu_ps(e[r * 4 + 1] + i);
+			__m128 c2 = _mm_loadu_ps(e[r * 4 + 2] + i);
+			__m128 c3 = _mm_loadu_ps(e[r * 4 + 3] + i);
+			_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+			_mm_storeu_ps(rows[(i + 0) * 3 + r].data, c0);
+			_mm_storeu_ps(rows[(i + 1) * 3 + r].data, c1);
+			_mm_storeu_ps(rows[(i + 2) * 3 + r].data, c2);
+			_mm_storeu_ps(rows[(i + 3) * 3 + r].data, c3);
+		}
+	}
+
+	for (; i < count; ++i)
+	{
+		for (u32 r = 0; r < 3; ++r) rows[i * 3 + r] = {e[r * 4 + 0][i], e[r * 4 + 1][i], e[r * 4 + 2][i], e[r * 4 + 3][i]};
+	}
+}
+
+// Packs instance_count instances scattered the way draw() places them, in instance store order, and prints the bytes
+// per instance, the largest rotation and position error against instance_world_matrix, and how many instances a
+// second each way of building the frame's matrices gets through: instance_world_matrix from the float DrawInfos,
+// the scalar decode, and the SSE decode with and without interleaving into rows.
+void benchmark_instance_transforms(u32 instance_count)
+{
+	u32 random = 57;
+	f32 extent = 100.0f * sqrtf(instance_count / 1250.0f);
+	vec3 world_min = Vec3(-extent, -25.0f, -extent);
+	vec3 world_max = Vec3(extent, 25.0f, extent);
+
+	InstanceStore store;
+	init_instance_store(&store, instance_count, world_min, world_max);
+	for (u32 i = 0; i < instance_count; ++i)
+	{
+		DrawCallInfo info = {};
+		info.draw_info.position = Vec3(rand_f32_in_range(-extent, extent, &random), rand_f32_in_range(-25.0f, 25.0f, &random), rand_f32_in_range(-extent, extent, &random));
+		info.draw_info.quat = normalize(vec4{rand_f32_in_range(-1.0f, 1.0f, &random), rand_f32_in_range(-1.0f, 1.0f, &random), rand_f32_in_range(-1.0f, 1.0f, &random), rand_f32_in_range(-1.0f, 1.0f, &random)});
+		info.draw_info.vertex_buffer_index = i % 7;
+		add_instance(&store, &info);
+	}
+	update_instance_order(&store);
+
+	//A draw order that is not the store's, like the frame's sorted draws
+	u32* order = new u32[instance_count];
+	for (u32 i = 0; i < instance_count; ++i) order[i] = i;
+	for (u32 i = instance_count - 1; i > 0; --i)
+	{
+		u32 j = (u32)rand_f32_in_range(0.0f, (f32)(i + 1), &random);
+		j = MIN(j, i);
+		u32 swap = order[i];
+		order[i] = order[j];
+		order[j] = swap;
+	}
+
+	PackedInstanceTransforms packed;
+	pack_instance_transforms(&packed, store.instances, instance_count);
+
+	InstanceMatrices matrices;
+	init_instance_matrices(&matrices, instance_count);
+	vec4* rows = new vec4[instance_count * 3];
+
+	f32 time = 1.3f;
+	decode_instance_transforms_sse(&matrices, &packed, order, instance_count, time);
+	interleave_instance_matrices_sse(rows, &matrices, instance_count);
+
+	f32 rotation_error = 0.0f;
+	f32 position_error = 0.0f;
+	f64 position_error_sum = 0.0;
+	f32 scalar_difference = 0.0f;
+	bool indices_match = true;
+	vec4 spin = instance_spin(time);
+	for (u32 i = 0; i < instance_count; ++i)
+	{
+		const DrawCallInfo* info = &store.instances[order[i]];
+		Mat4x4 world = instance_world_matrix(&info->draw_info, time);
+
+		f32 scalar[12];
+		decode_instance_transform(&packed, order[i], spin, scalar);
+
+		for (u32 r = 0; r < 3; ++r)
+		{
+			for (u32 c = 0; c < 4; ++c)
+			{
+				f32 error = fabsf(rows[i * 3 + r].data[c] - world.d[r][c]);
+				if (c == 3)
+				{
+					position_error = MAX(position_error, error);
+					position_error_sum += error;
+				}
+				else rotation_error = MAX(rotation_error, error);
+				scalar_difference = MAX(scalar_difference, fabsf(rows[i * 3 + r].data[c] - scalar[r * 4 + c]));
+			}
+		}
+		indices_match = indices_match && packed_instance_vertex_buffer_index(&packed.transforms[order[i]]) == info->draw_info.vertex_buffer_index;
+	}
+
+	u32 block_count = (instance_count + INSTANCE_TRANSFORM_BLOCK_SIZE - 1) / INSTANCE_TRANSFORM_BLOCK_SIZE;
+	printf("Instance transforms, %u instances:\n", instance_count);
+	printf("  %.2f bytes per instance packed (blocks included), %u as DrawInfo\n",
+	       (f64)(sizeof(PackedInstanceTransform) * instance_count + sizeof(InstanceTransformBlock) * block_count) / instance_count, (u32)sizeof(DrawInfo));
+	printf("  largest error against instance_world_matrix: rotation %.6f, position %.6f (mean %.6f, world extent %.0f); SSE against scalar %.2g%s\n",
+	       rotation_error, position_error, position_error_sum / (instance_count * 3.0), extent * 2.0f, scalar_difference, indices_match ? "" : " (VERTEX BUFFER INDEX WRONG)");
+
+	const u32 iterations = 100;
+	volatile f32 sink = 0.0f;//Keeps the timed loops' results alive
+
+	f64 start = time_in_seconds();
+	for (u32 it = 0; it < iterations; ++it)
+	{
+		for (u32 i = 0; i < instance_count; ++i)
+		{
+			Mat4x4 world = instance_world_matrix(&store.instances[order[i]].draw_info, time + it);
+			rows[i * 3 + 0] = world.row_vecs[0];
+			rows[i * 3 + 1] = world.row_vecs[1];
+			rows[i * 3 + 2] = world.row_vecs[2];
+		}
+		sink = sink + rows[it % instance_count].x;
+	}
+	f64 world_matrix_seconds = time_in_seconds() - start;
+
+	start = time_in_seconds();
+	for (u32 it = 0; it < iterations; ++it)
+	{
+		vec4 frame_spin = instance_spin(time + it);
+		for (u32 i = 0; i < instance_count; ++i) decode_instance_transform(&packed, order[i], frame_spin, rows[i * 3].data);
+		sink = sink + rows[it % instance_count].x;
+	}
+	f64 scalar_seconds = time_in_seconds() - start;
+
+	start = time_in_seconds();
+	for (u32 it = 0; it < iterations; ++it)
+	{
+		decode_instance_transforms_sse(&matrices, &packed, order, instance_count, time + it);
+		sink = sink + matrices.elements[0][it % instance_count];
+	}
+	f64 sse_seconds = time_in_seconds() - start;
+
+	start = time_in_seconds();
+	for (u32 it = 0; it < iterations; ++it)
+	{
+		decode_instance_transforms_sse(&matrices, &packed, order, instance_count, time + it);
+		interleave_instance_matrices_sse(rows, &matrices, instance_count);
+		sink = sink + rows[it % instance_count].x;
+	}
+	f64 sse_rows_seconds = time_in_seconds() - start;
+
+	start = time_in_seconds();
+	for (u32 it = 0; it < iterations; ++it)
+	{
+		decode_instance_transforms_sse(&matrices, &packed, 0, instance_count, time + it);
+		sink = sink + matrices.elements[0][it % instance_count];
+	}
+	f64 sse_in_order_seconds = time_in_seconds() - start;
+
+	f64 processed = (f64)instance_count * iterations / 1e6;
+	printf("  million instances a second: instance_world_matrix %.1f, scalar decode %.1f, SSE decode %.1f (%.1f in store order), SSE decode and rows %.1f\n",
+	       processed / world_matrix_seconds, processed / scalar_seconds, processed / sse_seconds, processed / sse_in_order_seconds,
+	       processed / sse_rows_seconds);
+
+	delete[] rows;
+	delete[] order;
+	free_instance_matrices(&matrices);
+	free_packed_instance_transforms(&packed);
+	free_instance_store(&store);
+}
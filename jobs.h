@@ -0,0 +1,71 @@
+#pragma once
+
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+
+//Set this to force a thread count for all parallel_for calls, 0 means use every hardware thread.
+static u32 job_thread_count = 0;
+
+u32 get_job_thread_count()
+{
+	if (job_thread_count) return job_thread_count;
+
+	u32 hardware_threads = std::thread::hardware_concurrency();
+	return hardware_threads ? hardware_threads : 1;
+}
+
+
+// Calls func(item_index, thread_index) once for every item in [0, item_count).
+// Items are handed out one at a time from an atomic counter, so uneven items balance themselves.
+// thread_index is in [0, thread_count) and is stable for the duration of a func call, so it can be used to pick per-thread scratch memory.
+// Threads are spawned per call; this is meant for asset building and benchmarks, not for work that runs every frame.
+template <typename Func>
+void parallel_for(u32 item_count, u32 thread_count, Func func)
+{
+	if (thread_count == 0) thread_count = get_job_thread_count();
+	thread_count = MIN(thread_count, item_count);
+
+	if (thread_count <= 1)
+	{
+		for (u32 i = 0; i < item_count; ++i)
+			func(i, 0u);
+		return;
+	}
+
+	std::atomic<u32> next_item(0);
+
+	auto worker = [&](u32 thread_index)
+	{
+		for (;;)
+		{
+			u32 item = next_item.fetch_add(1);
+			if (item >= item_count) break;
+			func(item, thread_index);
+		}
+	};
+
+	std::thread* threads = new std::thread[thread_count - 1];
+	for (u32 i = 1; i < thread_count; ++i)
+		threads[i - 1] = std::thread(worker, i);
+
+	worker(0);
+
+	for (u32 i = 1; i < thread_count; ++i)
+		threads[i - 1].join();
+	delete[] threads;
+}
+
+template <typename Func>
+void parallel_for(u32 item_count, Func func)
+{
+	parallel_for(item_count, 0, func);
+}
+
+
+f64 time_in_seconds()
+{
+	using namespace std::chrono;
+	return duration<f64>(steady_clock::now().time_since_epoch()).count();
+}
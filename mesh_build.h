@@ -0,0 +1,473 @@
+#pragma once
+
+// Parallel versions of the serial meshoptimizer build steps.
+// Each one splits the mesh into spatial partitions (mesh_partition.h), runs the meshopt pass on every partition
+// on its own thread in a compact local vertex space, and stitches the results back together.
+//
+// Needs include/clusterizer.cpp, include/spatialorder.cpp and include/vcacheanalyzer.cpp in the same translation unit.
+
+#include "jobs.h"
+#include "mesh_partition.h"
+
+
+// Picks a partition count: enough partitions to keep every thread busy, but none smaller than min_partition_triangles,
+// since every partition boundary costs a little quality.
+u32 choose_partition_count(u32 index_count, u32 thread_count, u32 min_partition_triangles)
+{
+	u32 partition_count = thread_count * 4;
+	partition_count = MIN(partition_count, index_count / 3 / min_partition_triangles);
+	return MAX(partition_count, 1u);
+}
+
+// One scratch remap per worker for extract_mesh_partition.
+u32** allocate_vertex_scratch(u32 thread_count, u32 vertex_count)
+{
+	u32** scratch = new u32*[thread_count];
+	for (u32 i = 0; i < thread_count; ++i)
+	{
+		scratch[i] = new u32[vertex_count];
+		memset(scratch[i], 0xff, sizeof(u32) * vertex_count);
+	}
+	return scratch;
+}
+
+void free_vertex_scratch(u32** scratch, u32 thread_count)
+{
+	for (u32 i = 0; i < thread_count; ++i) delete[] scratch[i];
+	delete[] scratch;
+}
+
+
+// ---------------------------------------------------------------------------------------------------------------------
+// Meshlets
+// ---------------------------------------------------------------------------------------------------------------------
+
+struct MeshletBuild
+{
+	meshopt_Meshlet* meshlets;
+	u32 meshlet_count;
+
+	u32* meshlet_vertices;//Source vertex indices
+	u32 meshlet_vertex_count;
+
+	u8* meshlet_triangles;
+	u32 meshlet_triangle_bytes;
+};
+
+void free_meshlet_build(MeshletBuild* build)
+{
+	delete[] build->meshlets;
+	delete[] build->meshlet_vertices;
+	delete[] build->meshlet_triangles;
+	*build = {};
+}
+
+constexpr u32 MIN_MESHLET_PARTITION_TRIANGLES = 32768;
+
+// Same output as meshopt_buildMeshlets (meshlet_vertices refer to the source vertex buffer), built one spatial
+// partition per job. Meshlets never cross partitions, so only the last meshlet of each partition can come out
+// underfilled; with the minimum partition size that is well under 1% extra meshlets.
+void build_meshlets_parallel(MeshletBuild* result, const u32* indices, u32 index_count, const f32* vertex_positions, u32 vertex_count, size_t vertex_positions_stride, u32 max_vertices, u32 max_triangles, f32 cone_weight, u32 thread_count = 0)
+{
+	*result = {};
+	if (thread_count == 0) thread_count = get_job_thread_count();
+
+	//A single thread builds the whole mesh as one partition, which is exactly the serial meshopt_buildMeshlets result.
+	u32 partition_count = thread_count > 1 ? choose_partition_count(index_count, thread_count, MIN_MESHLET_PARTITION_TRIANGLES) : 1;
+
+	u32* sorted = new u32[index_count];
+	u32* offsets = new u32[partition_count + 1];
+
+	if (partition_count > 1)
+	{
+		spatial_partition_triangles(sorted, offsets, partition_count, indices, index_count, vertex_positions, vertex_count, vertex_positions_stride);
+	}
+	else
+	{
+		memcpy(sorted, indices, sizeof(u32) * index_count);
+		offsets[0] = 0;
+		offsets[1] = index_count;
+	}
+
+	MeshletBuild* partitions = new MeshletBuild[partition_count];
+	memset(partitions, 0, sizeof(MeshletBuild) * partition_count);
+
+	u32 worker_count = MIN(thread_count, partition_count);
+	u32** vertex_scratch = allocate_vertex_scratch(worker_count, vertex_count);
+
+	parallel_for(partition_count, worker_count, [&](u32 p, u32 thread_index)
+	{
+		MeshPartition partition = {};
+		extract_mesh_partition(&partition, vertex_scratch[thread_index], sorted + offsets[p], offsets[p + 1] - offsets[p], vertex_positions, vertex_positions_stride);
+
+		size_t max_meshlets = meshopt_buildMeshletsBound(partition.index_count, max_vertices, max_triangles);
+
+		MeshletBuild* build = &partitions[p];
+		build->meshlets = new meshopt_Meshlet[max_meshlets];
+		build->meshlet_vertices = new u32[max_meshlets * max_vertices];
+		build->meshlet_triangles = new u8[max_meshlets * max_triangles * 3];
+
+		build->meshlet_count = (u32)meshopt_buildMeshlets(build->meshlets, build->meshlet_vertices, build->meshlet_triangles, partition.indices, partition.index_count,
+		                                                  partition.positions, partition.vertex_count, sizeof(f32) * 3, max_vertices, max_triangles, cone_weight);
+
+		if (build->meshlet_count)
+		{
+			const meshopt_Meshlet& last = build->meshlets[build->meshlet_count - 1];
+			build->meshlet_vertex_count = last.vertex_offset + last.vertex_count;
+			build->meshlet_triangle_bytes = last.triangle_offset + ((last.triangle_count * 3 + 3) & ~3);
+		}
+
+		for (u32 i = 0; i < build->meshlet_vertex_count; ++i)
+			build->meshlet_vertices[i] = partition.vertices[build->meshlet_vertices[i]];
+
+		free_mesh_partition(&partition);
+	});
+
+	free_vertex_scratch(vertex_scratch, worker_count);
+	delete[] sorted;
+	delete[] offsets;
+
+	for (u32 p = 0; p < partition_count; ++p)
+	{
+		result->meshlet_count += partitions[p].meshlet_count;
+		result->meshlet_vertex_count += partitions[p].meshlet_vertex_count;
+		result->meshlet_triangle_bytes += partitions[p].meshlet_triangle_bytes;
+	}
+
+	result->meshlets = new meshopt_Meshlet[MAX(result->meshlet_count, 1u)];
+	result->meshlet_vertices = new u32[MAX(result->meshlet_vertex_count, 1u)];
+	result->meshlet_triangles = new u8[MAX(result->meshlet_triangle_bytes, 1u)];
+
+	u32 meshlet_base = 0;
+	u32 vertex_base = 0;
+	u32 triangle_base = 0;
+
+	for (u32 p = 0; p < partition_count; ++p)
+	{
+		MeshletBuild* build = &partitions[p];
+
+		for (u32 i = 0; i < build->meshlet_count; ++i)
+		{
+			meshopt_Meshlet meshlet = build->meshlets[i];
+			meshlet.vertex_offset += vertex_base;
+			meshlet.triangle_offset += triangle_base;
+			result->meshlets[meshlet_base + i] = meshlet;
+		}
+
+		memcpy(result->meshlet_vertices + vertex_base, build->meshlet_vertices, sizeof(u32) * build->meshlet_vertex_count);
+		memcpy(result->meshlet_triangles + triangle_base, build->meshlet_triangles, build->meshlet_triangle_bytes);
+
+		meshlet_base += build->meshlet_count;
+		vertex_base += build->meshlet_vertex_count;
+		triangle_base += build->meshlet_triangle_bytes;
+
+		free_meshlet_build(build);
+	}
+
+	delete[] partitions;
+}
+
+// Average normal cone cutoff (cos of the half angle) and the fraction of meshlets whose cone can ever reject them.
+void measure_meshlet_cones(const MeshletBuild* build, const f32* vertex_positions, u32 vertex_count, size_t vertex_positions_stride, f32* average_cutoff, f32* cullable_fraction)
+{
+	f64 cutoff_sum = 0.0;
+	u32 cullable = 0;
+
+	for (u32 i = 0; i < build->meshlet_count; ++i)
+	{
+		const meshopt_Meshlet& meshlet = build->meshlets[i];
+		meshopt_Bounds bounds = meshopt_computeMeshletBounds(&build->meshlet_vertices[meshlet.vertex_offset], &build->meshlet_triangles[meshlet.triangle_offset],
+		                                                     meshlet.triangle_count, vertex_positions, vertex_count, vertex_positions_stride);
+		cutoff_sum += bounds.cone_cutoff;
+		cullable += bounds.cone_cutoff < 1.0f;
+	}
+
+	*average_cutoff = build->meshlet_count ? (f32)(cutoff_sum / build->meshlet_count) : 0.0f;
+	*cullable_fraction = build->meshlet_count ? (f32)cullable / build->meshlet_count : 0.0f;
+}
+
+void benchmark_parallel_meshlets(char* name, const u32* indices, u32 index_count, const f32* vertex_positions, u32 vertex_count, size_t vertex_positions_stride, u32 max_vertices, u32 max_triangles, f32 cone_weight)
+{
+	f64 start = time_in_seconds();
+	MeshletBuild serial = {};
+	build_meshlets_parallel(&serial, indices, index_count, vertex_positions, vertex_count, vertex_positions_stride, max_vertices, max_triangles, cone_weight, 1);
+	f64 serial_seconds = time_in_seconds() - start;
+
+	start = time_in_seconds();
+	MeshletBuild parallel = {};
+	build_meshlets_parallel(&parallel, indices, index_count, vertex_positions, vertex_count, vertex_positions_stride, max_vertices, max_triangles, cone_weight);
+	f64 parallel_seconds = time_in_seconds() - start;
+
+	f32 serial_cutoff, serial_cullable, parallel_cutoff, parallel_cullable;
+	measure_meshlet_cones(&serial, vertex_positions, vertex_count, vertex_positions_stride, &serial_cutoff, &serial_cullable);
+	measure_meshlet_cones(&parallel, vertex_positions, vertex_count, vertex_positions_stride, &parallel_cutoff, &parallel_cullable);
+
+	printf("Meshlets %s (%u triangles, %u threads):\n", name, index_count / 3, get_job_thread_count());
+	printf("  serial:   %u meshlets, avg cone cutoff %.3f, %.1f%% cullable, %.1fms\n", serial.meshlet_count, serial_cutoff, serial_cullable * 100.0f, serial_seconds * 1000.0);
+	printf("  parallel: %u meshlets, avg cone cutoff %.3f, %.1f%% cullable, %.1fms\n", parallel.meshlet_count, parallel_cutoff, parallel_cullable * 100.0f, parallel_seconds * 1000.0);
+	printf("  speedup %.2fx, meshlet count %+.2f%%\n", serial_seconds / parallel_seconds, 100.0 * ((f64)parallel.meshlet_count / serial.meshlet_count - 1.0));
+
+	free_meshlet_build(&serial);
+	free_meshlet_build(&parallel);
+}
+
+
+// ---------------------------------------------------------------------------------------------------------------------
+// Vertex cache
+// ---------------------------------------------------------------------------------------------------------------------
+
+constexpr u32 MIN_VERTEX_CACHE_PARTITION_TRIANGLES = 16384;
+
+// meshopt_optimizeVertexCache run on spatial partitions in parallel. The partitions are written back in Morton order,
+// one after the other, so the only cache misses added over the serial version are the ones at partition seams.
+// destination may alias indices. Positions are only used to pick the partitions.
+void optimize_vertex_cache_parallel(u32* destination, const u32* indices, u32 index_count, const f32* vertex_positions, u32 vertex_count, size_t vertex_positions_stride, u32 thread_count = 0)
+{
+	if (thread_count == 0) thread_count = get_job_thread_count();
+
+	u32 partition_count = thread_count > 1 ? choose_partition_count(index_count, thread_count, MIN_VERTEX_CACHE_PARTITION_TRIANGLES) : 1;
+	if (partition_count == 1)
+	{
+		meshopt_optimizeVertexCache(destination, indices, index_count, vertex_count);
+		return;
+	}
+
+	u32* sorted = new u32[index_count];
+	u32* offsets = new u32[partition_count + 1];
+	spatial_partition_triangles(sorted, offsets, partition_count, indices, index_count, vertex_positions, vertex_count, vertex_positions_stride);
+
+	u32 worker_count = MIN(thread_count, partition_count);
+	u32** vertex_scratch = allocate_vertex_scratch(worker_count, vertex_count);
+
+	//Partitions are disjoint ranges of destination, so every job writes its result straight into place.
+	parallel_for(partition_count, worker_count, [&](u32 p, u32 thread_index)
+	{
+		MeshPartition partition = {};
+		extract_mesh_partition(&partition, vertex_scratch[thread_index], sorted + offsets[p], offsets[p + 1] - offsets[p], vertex_positions, vertex_positions_stride);
+
+		meshopt_optimizeVertexCache(partition.indices, partition.indices, partition.index_count, partition.vertex_count);
+
+		u32* output = destination + offsets[p];
+		for (u32 i = 0; i < partition.index_count; ++i)
+			output[i] = partition.vertices[partition.indices[i]];
+
+		free_mesh_partition(&partition);
+	});
+
+	free_vertex_scratch(vertex_scratch, worker_count);
+	delete[] sorted;
+	delete[] offsets;
+}
+
+void print_vertex_cache_stats(char* label, const u32* indices, u32 index_count, u32 vertex_count)
+{
+	meshopt_VertexCacheStatistics stats = meshopt_analyzeVertexCache(indices, index_count, vertex_count, 16, 0, 0);
+	printf("  %s ACMR %.3f, ATVR %.3f\n", label, stats.acmr, stats.atvr);
+}
+
+void benchmark_parallel_vertex_cache(char* name, const u32* indices, u32 index_count, const f32* vertex_positions, u32 vertex_count, size_t vertex_positions_stride)
+{
+	u32* serial = new u32[index_count];
+	u32* parallel = new u32[index_count];
+
+	f64 start = time_in_seconds();
+	meshopt_optimizeVertexCache(serial, indices, index_count, vertex_count);
+	f64 serial_seconds = time_in_seconds() - start;
+
+	start = time_in_seconds();
+	optimize_vertex_cache_parallel(parallel, indices, index_count, vertex_positions, vertex_count, vertex_positions_stride);
+	f64 parallel_seconds = time_in_seconds() - start;
+
+	printf("Vertex cache %s (%u triangles, %u threads):\n", name, index_count / 3, get_job_thread_count());
+	print_vertex_cache_stats("input:   ", indices, index_count, vertex_count);
+	print_vertex_cache_stats("serial:  ", serial, index_count, vertex_count);
+	print_vertex_cache_stats("parallel:", parallel, index_count, vertex_count);
+	printf("  serial %.1fms, parallel %.1fms, speedup %.2fx\n", serial_seconds * 1000.0, parallel_seconds * 1000.0, serial_seconds / parallel_seconds);
+
+	delete[] serial;
+	delete[] parallel;
+}
+
+
+// ---------------------------------------------------------------------------------------------------------------------
+// Vertex remap
+// ---------------------------------------------------------------------------------------------------------------------
+
+constexpr u32 REMAP_SHARD_BITS = 8;
+constexpr u32 REMAP_SHARD_COUNT = 1 << REMAP_SHARD_BITS;
+constexpr u32 MIN_REMAP_BLOCK_VERTICES = 65536;
+
+// Looks vertices up by a hash computed up front, so each vertex is only hashed once across the sharding and dedup passes.
+struct PrehashedVertexHasher
+{
+	const u32* hashes;
+	meshopt::VertexHasher vertex;
+
+	size_t hash(unsigned int index) const { return hashes[index]; }
+	bool equal(unsigned int lhs, unsigned int rhs) const { return vertex.equal(lhs, rhs); }
+};
+
+// Shard from the top hash bits, the shard tables probe with the low bits.
+u32 remap_shard(u32 hash)
+{
+	return hash >> (32 - REMAP_SHARD_BITS);
+}
+
+// meshopt_generateVertexRemap for unindexed vertex streams (indices == 0), bit for bit the same output for any thread count.
+//  1. Hash every vertex and scatter vertex indices into REMAP_SHARD_COUNT shards, keeping them in index order within a shard.
+//  2. Dedup every shard against its own hash table. Equal vertices always land in the same shard, and since a shard is
+//     walked in index order the first vertex found is the lowest index of its class, same as the serial table.
+//  3. The serial version numbers classes in order of their lowest index, so a prefix sum over "first of its class"
+//     flags gives every class its final id, and every other vertex copies the id of its first.
+// Indexed input has no cheap equivalent of step 3 and goes through the serial version.
+// block_count = 0 picks 4 blocks per thread, and the serial version for a single thread or block. Passing a block count
+// forces the sharded path, which is how the benchmark times it on one thread.
+u32 generate_vertex_remap_parallel(u32* destination, const u32* indices, u32 index_count, const void* vertices, u32 vertex_count, size_t vertex_size, u32 thread_count = 0, u32 block_count = 0)
+{
+	if (thread_count == 0) thread_count = get_job_thread_count();
+
+	if (block_count == 0) block_count = thread_count > 1 ? MIN(thread_count * 4, vertex_count / MIN_REMAP_BLOCK_VERTICES) : 1;
+	block_count = MIN(block_count, vertex_count);
+	if (indices || block_count <= 1)
+		return (u32)meshopt_generateVertexRemap(destination, indices, index_count, vertices, vertex_count, vertex_size);
+
+	assert(index_count == vertex_count);
+
+	meshopt::VertexHasher vertex_hasher = {(const u8*)vertices, vertex_size, vertex_size};
+
+	u32* hashes = new u32[vertex_count];
+	u32* shard_vertices = new u32[vertex_count];
+	u32* first = new u32[vertex_count];
+
+	u32* block_shard_offsets = new u32[block_count * REMAP_SHARD_COUNT];
+	memset(block_shard_offsets, 0, sizeof(u32) * block_count * REMAP_SHARD_COUNT);
+	u32* shard_offsets = new u32[REMAP_SHARD_COUNT + 1];
+	u32* block_ids = new u32[block_count];
+
+	auto block_begin = [&](u32 block) { return (u32)((u64)vertex_count * block / block_count); };
+
+	parallel_for(block_count, thread_count, [&](u32 block, u32)
+	{
+		u32* counts = block_shard_offsets + block * REMAP_SHARD_COUNT;
+
+		for (u32 i = block_begin(block); i < block_begin(block + 1); ++i)
+		{
+			hashes[i] = (u32)vertex_hasher.hash(i);
+			counts[remap_shard(hashes[i])]++;
+		}
+	});
+
+	//Shard major, then block, so every shard is one contiguous run in index order.
+	u32 offset = 0;
+	for (u32 shard = 0; shard < REMAP_SHARD_COUNT; ++shard)
+	{
+		shard_offsets[shard] = offset;
+
+		for (u32 block = 0; block < block_count; ++block)
+		{
+			u32 count = block_shard_offsets[block * REMAP_SHARD_COUNT + shard];
+			block_shard_offsets[block * REMAP_SHARD_COUNT + shard] = offset;
+			offset += count;
+		}
+	}
+	shard_offsets[REMAP_SHARD_COUNT] = offset;
+
+	parallel_for(block_count, thread_count, [&](u32 block, u32)
+	{
+		u32* offsets = block_shard_offsets + block * REMAP_SHARD_COUNT;
+
+		for (u32 i = block_begin(block); i < block_begin(block + 1); ++i)
+			shard_vertices[offsets[remap_shard(hashes[i])]++] = i;
+	});
+
+	PrehashedVertexHasher hasher = {hashes, vertex_hasher};
+
+	parallel_for(REMAP_SHARD_COUNT, thread_count, [&](u32 shard, u32)
+	{
+		u32 shard_size = shard_offsets[shard + 1] - shard_offsets[shard];
+		if (shard_size == 0) return;
+
+		size_t table_size = meshopt::hashBuckets(shard_size);
+		u32* table = new u32[table_size];
+		memset(table, -1, table_size * sizeof(u32));
+
+		for (u32 i = shard_offsets[shard]; i < shard_offsets[shard + 1]; ++i)
+		{
+			u32 index = shard_vertices[i];
+			u32* entry = meshopt::hashLookup(table, table_size, hasher, index, ~0u);
+
+			if (*entry == ~0u) *entry = index;
+			first[index] = *entry;
+		}
+
+		delete[] table;
+	});
+
+	parallel_for(block_count, thread_count, [&](u32 block, u32)
+	{
+		u32 count = 0;
+		for (u32 i = block_begin(block); i < block_begin(block + 1); ++i)
+			count += first[i] == i;
+		block_ids[block] = count;
+	});
+
+	u32 unique_count = 0;
+	for (u32 block = 0; block < block_count; ++block)
+	{
+		u32 count = block_ids[block];
+		block_ids[block] = unique_count;
+		unique_count += count;
+	}
+
+	parallel_for(block_count, thread_count, [&](u32 block, u32)
+	{
+		u32 id = block_ids[block];
+		for (u32 i = block_begin(block); i < block_begin(block + 1); ++i)
+			if (first[i] == i) destination[i] = id++;
+	});
+
+	//first[i] < i for the rest, and those entries were all written by the previous pass.
+	parallel_for(block_count, thread_count, [&](u32 block, u32)
+	{
+		for (u32 i = block_begin(block); i < block_begin(block + 1); ++i)
+			if (first[i] != i) destination[i] = destination[first[i]];
+	});
+
+	delete[] hashes;
+	delete[] shard_vertices;
+	delete[] first;
+	delete[] block_shard_offsets;
+	delete[] shard_offsets;
+	delete[] block_ids;
+
+	return unique_count;
+}
+
+// Every row goes through the sharded path, the 1 thread row included, with 4 blocks per thread and at least 4.
+void benchmark_parallel_vertex_remap(char* name, const void* vertices, u32 vertex_count, size_t vertex_size)
+{
+	u32* serial = new u32[vertex_count];
+	u32* parallel = new u32[vertex_count];
+
+	f64 start = time_in_seconds();
+	u32 serial_unique = (u32)meshopt_generateVertexRemap(serial, 0, vertex_count, vertices, vertex_count, vertex_size);
+	f64 serial_seconds = time_in_seconds() - start;
+
+	printf("Vertex remap %s (%u corners -> %u vertices):\n", name, vertex_count, serial_unique);
+	printf("  serial meshopt: %.1fms\n", serial_seconds * 1000.0);
+
+	u32 thread_counts[] = {1, 4, 16, 64};
+	for (u32 thread_count : thread_counts)
+	{
+		start = time_in_seconds();
+		u32 block_count = MAX(MIN(thread_count * 4, vertex_count / MIN_REMAP_BLOCK_VERTICES), 4u);
+		u32 unique = generate_vertex_remap_parallel(parallel, 0, vertex_count, vertices, vertex_count, vertex_size, thread_count, block_count);
+		f64 seconds = time_in_seconds() - start;
+
+		bool matches = unique == serial_unique && memcmp(serial, parallel, sizeof(u32) * vertex_count) == 0;
+		printf("  %2u threads, %3u blocks: %.1fms, speedup %.2fx, %s\n", thread_count, block_count, seconds * 1000.0, serial_seconds / seconds, matches ? "matches serial" : "MISMATCH");
+	}
+
+	delete[] serial;
+	delete[] parallel;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+// Position only copy of a mesh for the depth only passes (the planned depth pre-pass and shadows). Vertex is 24 bytes
+// and a depth pass only needs the first 12, and vertices the mesh build split only for their normals are the same
+// vertex as far as depth goes. meshopt_generateShadowIndexBuffer points every index at the first vertex with the same
+// position, so those duplicates are transformed once.
+//
+// The depth index buffer keeps the ranges of the mesh's own: every LOD, and every mesh_split.h chunk of LOD 0, has the
+// same first_index and index_count in both, so MeshLods and the chunks work for either buffer. Merging vertices changes
+// which triangles share them, so each range is vertex cache optimized again on its own, and the positions are laid out
+// in the order the ranges first use them, dropping the ones no index uses any more.
+//
+// Needs include/indexgenerator.cpp, include/vcacheoptimizer.cpp, include/vfetchoptimizer.cpp,
+// include/vcacheanalyzer.cpp, include/vfetchanalyzer.cpp, instance_lod.h and mesh_split.h in the same translation unit.
+
+
+struct DepthMesh
+{
+	f32* positions;//Three floats a vertex
+	u32 vertex_count;
+	u32* indices;
+	u32 index_count;
+};
+
+// indices are all of the mesh's LODs as build_mesh_lods lays them out, with LOD 0 split into the chunks if there are any.
+void build_depth_mesh(DepthMesh* result, const u32* indices, u32 index_count, const MeshLods* lods, const MeshChunk* chunks, u32 chunk_count,
+                      const f32* vertex_positions, u32 vertex_count, size_t vertex_positions_stride)
+{
+	size_t stride_in_floats = vertex_positions_stride / sizeof(f32);
+
+	*result = {};
+	result->index_count = index_count;
+	result->indices = new u32[index_count];
+	meshopt_generateShadowIndexBuffer(result->indices, indices, index_count, vertex_positions, vertex_count, sizeof(f32) * 3, vertex_positions_stride);
+
+	for (u32 lod = 0; lod < lods->lod_count; ++lod)
+	{
+		if (lod == 0 && chunk_count)
+		{
+			for (u32 c = 0; c < chunk_count; ++c)
+			{
+				u32* range = result->indices + lods->first_index[0] + chunks[c].first_index;
+				meshopt_optimizeVertexCache(range, range, chunks[c].index_count, vertex_count);
+			}
+			continue;
+		}
+
+		u32* range = result->indices + lods->first_index[lod];
+		meshopt_optimizeVertexCache(range, range, lods->index_count[lod], vertex_count);
+	}
+
+	u32* remap = new u32[vertex_count];
+	result->vertex_count = (u32)meshopt_optimizeVertexFetchRemap(remap, result->indices, index_count, vertex_count);
+	meshopt_remapIndexBuffer(result->indices, result->indices, index_count, remap);
+
+	result->positions = new f32[MAX(result->vertex_count, 1u) * 3];
+	for (u32 v = 0; v < vertex_count; ++v)
+	{
+		if (remap[v] == ~0u) continue;
+		memcpy(&result->positions[remap[v] * 3], vertex_positions + v * stride_in_floats, sizeof(f32) * 3);
+	}
+
+	delete[] remap;
+}
+
+void free_depth_mesh(DepthMesh* mesh)
+{
+	delete[] mesh->positions;
+	delete[] mesh->indices;
+	*mesh = {};
+}
+
+void print_vertex_fetch_stats(char* label, const u32* indices, u32 index_count, u32 vertex_count, u32 vertex_size)
+{
+	meshopt_VertexCacheStatistics cache = meshopt_analyzeVertexCache(indices, index_count, vertex_count, 16, 0, 0);
+	meshopt_VertexFetchStatistics fetch = meshopt_analyzeVertexFetch(indices, index_count, vertex_count, vertex_size);
+	printf("  %s %u vertices of %u bytes, ACMR %.3f, fetched %.1fKB (overfetch %.2f)\n", label, vertex_count, vertex_size, cache.acmr,
+	       fetch.bytes_fetched / 1024.0, fetch.overfetch);
+}
+
+// LOD 0 of the full vertex stream against LOD 0 of the depth stream.
+void print_depth_mesh_stats(char* name, const DepthMesh* depth, const u32* indices, u32 lod0_index_count, u32 vertex_count, u32 vertex_size)
+{
+	printf("Mesh %s depth stream, LOD 0:\n", name);
+	print_vertex_fetch_stats("full: ", indices, lod0_index_count, vertex_count, vertex_size);
+	print_vertex_fetch_stats("depth:", depth->indices, lod0_index_count, depth->vertex_count, sizeof(f32) * 3);
+}
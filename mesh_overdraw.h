@@ -0,0 +1,527 @@
+#pragma once
+
+// Parallel overdraw analysis and optimization.
+// meshopt_analyzeOverdraw rasterizes every triangle into a fixed 256x256 buffer for three axis views on one thread.
+// Here the viewport size is a parameter, and every (view, band of rows) pair is a job with its own buffer; the jobs'
+// pixel counts are summed at the end. At 256 the statistics are identical to meshopt_analyzeOverdraw.
+//
+// Needs include/overdrawanalyzer.cpp and include/overdrawoptimizer.cpp in the same translation unit.
+
+#include "jobs.h"
+
+
+// Rows [y0, y1) of a viewport x viewport target, two layers per pixel like meshopt's OverdrawBuffer:
+// front facing triangles in layer 0, back facing ones in layer 1 with reversed depth.
+struct OverdrawBand
+{
+	f32* z;
+	u32* overdraw;
+	s32 viewport;
+	s32 y0;
+	s32 y1;
+};
+
+// meshopt's half-space fixed point rasterizer (overdrawanalyzer.cpp) with the viewport size as a parameter.
+// Rows outside the band are still stepped, not skipped with a multiply, so the depth values match the
+// full-screen rasterizer exactly.
+void rasterize_overdraw(OverdrawBand* band, f32 v1x, f32 v1y, f32 v1z, f32 v2x, f32 v2y, f32 v2z, f32 v3x, f32 v3y, f32 v3z)
+{
+	s32 viewport = band->viewport;
+
+	//Flipping below only swaps v2 and v3, so the row range is known up front and most triangles leave here.
+	s32 Y1 = s32(16.0f * v1y + 0.5f);
+	s32 Y2 = s32(16.0f * v2y + 0.5f);
+	s32 Y3 = s32(16.0f * v3y + 0.5f);
+
+	s32 miny = MAX((MIN(Y1, MIN(Y2, Y3)) + 7) >> 4, 0);
+	s32 maxy = MIN((MAX(Y1, MAX(Y2, Y3)) + 7) >> 4, viewport);
+
+	if (maxy <= band->y0 || miny >= band->y1) return;
+	maxy = MIN(maxy, band->y1);
+
+	f32 DZx, DZy;
+	f32 det = meshopt::computeDepthGradients(DZx, DZy, v1x, v1y, v1z, v2x, v2y, v2z, v3x, v3y, v3z);
+	s32 sign = det > 0;
+
+	if (sign)
+	{
+		f32 t;
+		t = v2x, v2x = v3x, v3x = t;
+		t = v2y, v2y = v3y, v3y = t;
+		t = v2z, v2z = v3z, v3z = t;
+		s32 T = Y2; Y2 = Y3; Y3 = T;
+
+		v1z = viewport - v1z;
+		DZx = -DZx;
+		DZy = -DZy;
+	}
+
+	s32 X1 = s32(16.0f * v1x + 0.5f);
+	s32 X2 = s32(16.0f * v2x + 0.5f);
+	s32 X3 = s32(16.0f * v3x + 0.5f);
+
+	s32 minx = MAX((MIN(X1, MIN(X2, X3)) + 7) >> 4, 0);
+	s32 maxx = MIN((MAX(X1, MAX(X2, X3)) + 7) >> 4, viewport);
+
+	s32 DX12 = X1 - X2;
+	s32 DX23 = X2 - X3;
+	s32 DX31 = X3 - X1;
+
+	s32 DY12 = Y1 - Y2;
+	s32 DY23 = Y2 - Y3;
+	s32 DY31 = Y3 - Y1;
+
+	s32 TL1 = DY12 < 0 || (DY12 == 0 && DX12 > 0);
+	s32 TL2 = DY23 < 0 || (DY23 == 0 && DX23 > 0);
+	s32 TL3 = DY31 < 0 || (DY31 == 0 && DX31 > 0);
+
+	s32 FX = (minx << 4) + 8;
+	s32 FY = (miny << 4) + 8;
+	s32 CY1 = DX12 * (FY - Y1) - DY12 * (FX - X1) + TL1 - 1;
+	s32 CY2 = DX23 * (FY - Y2) - DY23 * (FX - X2) + TL2 - 1;
+	s32 CY3 = DX31 * (FY - Y3) - DY31 * (FX - X3) + TL3 - 1;
+	f32 ZY = v1z + (DZx * f32(FX - X1) + DZy * f32(FY - Y1)) * (1 / 16.f);
+
+	for (s32 y = miny; y < maxy; y++)
+	{
+		if (y >= band->y0)
+		{
+			s32 CX1 = CY1;
+			s32 CX2 = CY2;
+			s32 CX3 = CY3;
+			f32 ZX = ZY;
+
+			f32* z = band->z + (y - band->y0) * viewport * 2;
+			u32* overdraw = band->overdraw + (y - band->y0) * viewport * 2;
+
+			for (s32 x = minx; x < maxx; x++)
+			{
+				if ((CX1 | CX2 | CX3) >= 0)
+				{
+					if (ZX >= z[x * 2 + sign])
+					{
+						z[x * 2 + sign] = ZX;
+						overdraw[x * 2 + sign]++;
+					}
+				}
+
+				CX1 -= s32(u32(DY12) << 4);
+				CX2 -= s32(u32(DY23) << 4);
+				CX3 -= s32(u32(DY31) << 4);
+				ZX += DZx;
+			}
+		}
+
+		CY1 += s32(u32(DX12) << 4);
+		CY2 += s32(u32(DX23) << 4);
+		CY3 += s32(u32(DX31) << 4);
+		ZY += DZy;
+	}
+}
+
+constexpr u32 MIN_OVERDRAW_BAND_ROWS = 16;
+
+meshopt_OverdrawStatistics analyze_overdraw_parallel(const u32* indices, u32 index_count, const f32* vertex_positions, u32 vertex_count, size_t vertex_positions_stride, u32 viewport = 256, u32 thread_count = 0)
+{
+	assert(index_count % 3 == 0);
+	if (thread_count == 0) thread_count = get_job_thread_count();
+
+	size_t stride_in_floats = vertex_positions_stride / sizeof(f32);
+
+	f32 minv[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+	f32 maxv[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+
+	for (u32 i = 0; i < vertex_count; ++i)
+	{
+		const f32* v = vertex_positions + i * stride_in_floats;
+
+		for (u32 j = 0; j < 3; ++j)
+		{
+			minv[j] = MIN(minv[j], v[j]);
+			maxv[j] = MAX(maxv[j], v[j]);
+		}
+	}
+
+	f32 extent = MAX(maxv[0] - minv[0], MAX(maxv[1] - minv[1], maxv[2] - minv[2]));
+	f32 scale = viewport / extent;
+
+	f32* triangles = new f32[(size_t)index_count * 3];
+
+	u32 block_count = MAX(MIN(thread_count * 4, index_count / 65536), 1u);
+	parallel_for(block_count, thread_count, [&](u32 block, u32)
+	{
+		u32 begin = (u32)((u64)index_count * block / block_count);
+		u32 end = (u32)((u64)index_count * (block + 1) / block_count);
+
+		for (u32 i = begin; i < end; ++i)
+		{
+			const f32* v = vertex_positions + indices[i] * stride_in_floats;
+
+			triangles[i * 3 + 0] = (v[0] - minv[0]) * scale;
+			triangles[i * 3 + 1] = (v[1] - minv[1]) * scale;
+			triangles[i * 3 + 2] = (v[2] - minv[2]) * scale;
+		}
+	});
+
+	u32 band_count = thread_count > 1 ? MAX(MIN(thread_count, viewport / MIN_OVERDRAW_BAND_ROWS), 1u) : 1;
+	u32 band_rows = (viewport + band_count - 1) / band_count;
+	u32 job_count = band_count * 3;
+	u32 worker_count = MIN(thread_count, job_count);
+
+	//One band sized buffer per worker, reused by every job that worker picks up.
+	size_t band_pixels = (size_t)band_rows * viewport * 2;
+	f32** band_z = new f32*[worker_count];
+	u32** band_overdraw = new u32*[worker_count];
+	for (u32 i = 0; i < worker_count; ++i)
+	{
+		band_z[i] = new f32[band_pixels];
+		band_overdraw[i] = new u32[band_pixels];
+	}
+
+	//Bin triangles into the bands their rows overlap, per view, in submission order so depth ties resolve like the
+	//serial rasterizer. Screen y is vertex component 1, 2, 0 for views 0, 1, 2 (see the swizzles below).
+	u32* band_offsets[3];//band_count + 1 entries per view
+	u32* band_triangles[3];
+
+	parallel_for(3, worker_count, [&](u32 axis, u32)
+	{
+		u32 y_component = (axis + 1) % 3;
+
+		auto band_range = [&](u32 triangle, u32* first_band, u32* last_band)
+		{
+			s32 Y1 = s32(16.0f * triangles[(triangle * 3 + 0) * 3 + y_component] + 0.5f);
+			s32 Y2 = s32(16.0f * triangles[(triangle * 3 + 1) * 3 + y_component] + 0.5f);
+			s32 Y3 = s32(16.0f * triangles[(triangle * 3 + 2) * 3 + y_component] + 0.5f);
+
+			s32 miny = MAX((MIN(Y1, MIN(Y2, Y3)) + 7) >> 4, 0);
+			s32 maxy = MIN((MAX(Y1, MAX(Y2, Y3)) + 7) >> 4, (s32)viewport);
+			if (miny >= maxy) return false;
+
+			*first_band = miny / band_rows;
+			*last_band = (maxy - 1) / band_rows;
+			return true;
+		};
+
+		u32* offsets = new u32[band_count + 1];
+		memset(offsets, 0, sizeof(u32) * (band_count + 1));
+
+		u32 first_band, last_band;
+		for (u32 triangle = 0; triangle < index_count / 3; ++triangle)
+			if (band_range(triangle, &first_band, &last_band))
+				for (u32 band = first_band; band <= last_band; ++band) offsets[band + 1]++;
+
+		for (u32 band = 0; band < band_count; ++band) offsets[band + 1] += offsets[band];
+
+		u32* binned = new u32[MAX(offsets[band_count], 1u)];
+		u32* cursor = new u32[band_count];
+		memcpy(cursor, offsets, sizeof(u32) * band_count);
+
+		for (u32 triangle = 0; triangle < index_count / 3; ++triangle)
+			if (band_range(triangle, &first_band, &last_band))
+				for (u32 band = first_band; band <= last_band; ++band) binned[cursor[band]++] = triangle;
+
+		delete[] cursor;
+
+		band_offsets[axis] = offsets;
+		band_triangles[axis] = binned;
+	});
+
+	u64* pixels_covered = new u64[job_count];
+	u64* pixels_shaded = new u64[job_count];
+
+	parallel_for(job_count, worker_count, [&](u32 job, u32 thread_index)
+	{
+		u32 axis = job / band_count;
+
+		OverdrawBand band = {};
+		band.z = band_z[thread_index];
+		band.overdraw = band_overdraw[thread_index];
+		band.viewport = viewport;
+		band.y0 = MIN((job % band_count) * band_rows, viewport);
+		band.y1 = MIN(band.y0 + band_rows, viewport);
+
+		memset(band.z, 0, sizeof(f32) * band_pixels);
+		memset(band.overdraw, 0, sizeof(u32) * band_pixels);
+
+		u32 band_index = job % band_count;
+		for (u32 t = band_offsets[axis][band_index]; t < band_offsets[axis][band_index + 1]; ++t)
+		{
+			u32 i = band_triangles[axis][t] * 3;
+
+			const f32* vn0 = &triangles[3 * (i + 0)];
+			const f32* vn1 = &triangles[3 * (i + 1)];
+			const f32* vn2 = &triangles[3 * (i + 2)];
+
+			switch (axis)
+			{
+			case 0:
+				rasterize_overdraw(&band, vn0[2], vn0[1], vn0[0], vn1[2], vn1[1], vn1[0], vn2[2], vn2[1], vn2[0]);
+				break;
+			case 1:
+				rasterize_overdraw(&band, vn0[0], vn0[2], vn0[1], vn1[0], vn1[2], vn1[1], vn2[0], vn2[2], vn2[1]);
+				break;
+			case 2:
+				rasterize_overdraw(&band, vn0[1], vn0[0], vn0[2], vn1[1], vn1[0], vn1[2], vn2[1], vn2[0], vn2[2]);
+				break;
+			}
+		}
+
+		u64 covered = 0;
+		u64 shaded = 0;
+
+		size_t pixel_count = (size_t)(band.y1 - band.y0) * viewport * 2;
+		for (size_t i = 0; i < pixel_count; ++i)
+		{
+			covered += band.overdraw[i] > 0;
+			shaded += band.overdraw[i];
+		}
+
+		pixels_covered[job] = covered;
+		pixels_shaded[job] = shaded;
+	});
+
+	u64 covered = 0;
+	u64 shaded = 0;
+	for (u32 i = 0; i < job_count; ++i)
+	{
+		covered += pixels_covered[i];
+		shaded += pixels_shaded[i];
+	}
+
+	meshopt_OverdrawStatistics result = {};
+	result.pixels_covered = (u32)covered;
+	result.pixels_shaded = (u32)shaded;
+	result.overdraw = covered ? f32((f64)shaded / (f64)covered) : 0.f;
+
+	for (u32 i = 0; i < worker_count; ++i)
+	{
+		delete[] band_z[i];
+		delete[] band_overdraw[i];
+	}
+	delete[] band_z;
+	delete[] band_overdraw;
+	for (u32 axis = 0; axis < 3; ++axis)
+	{
+		delete[] band_offsets[axis];
+		delete[] band_triangles[axis];
+	}
+	delete[] pixels_covered;
+	delete[] pixels_shaded;
+	delete[] triangles;
+
+	return result;
+}
+
+
+constexpr u32 MIN_OVERDRAW_JOB_CLUSTERS = 64;
+
+// The per cluster half of meshopt's calculateSortData, for clusters [cluster_begin, cluster_end).
+// Same float operations in the same order, so the sort keys match the serial optimizer bit for bit.
+void calculate_cluster_sort_data(f32* sort_data, const u32* indices, u32 index_count, const f32* vertex_positions, size_t vertex_positions_stride, const u32* clusters, u32 cluster_count, u32 cluster_begin, u32 cluster_end, const f32* mesh_centroid)
+{
+	size_t stride_in_floats = vertex_positions_stride / sizeof(f32);
+
+	for (u32 cluster = cluster_begin; cluster < cluster_end; ++cluster)
+	{
+		u32 begin = clusters[cluster] * 3;
+		u32 end = (cluster + 1 < cluster_count) ? clusters[cluster + 1] * 3 : index_count;
+
+		f32 cluster_area = 0;
+		f32 cluster_centroid[3] = {};
+		f32 cluster_normal[3] = {};
+
+		for (u32 i = begin; i < end; i += 3)
+		{
+			const f32* p0 = vertex_positions + stride_in_floats * indices[i + 0];
+			const f32* p1 = vertex_positions + stride_in_floats * indices[i + 1];
+			const f32* p2 = vertex_positions + stride_in_floats * indices[i + 2];
+
+			f32 p10[3] = {p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]};
+			f32 p20[3] = {p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]};
+
+			f32 normalx = p10[1] * p20[2] - p10[2] * p20[1];
+			f32 normaly = p10[2] * p20[0] - p10[0] * p20[2];
+			f32 normalz = p10[0] * p20[1] - p10[1] * p20[0];
+
+			f32 area = sqrtf(normalx * normalx + normaly * normaly + normalz * normalz);
+
+			cluster_centroid[0] += (p0[0] + p1[0] + p2[0]) * (area / 3);
+			cluster_centroid[1] += (p0[1] + p1[1] + p2[1]) * (area / 3);
+			cluster_centroid[2] += (p0[2] + p1[2] + p2[2]) * (area / 3);
+			cluster_normal[0] += normalx;
+			cluster_normal[1] += normaly;
+			cluster_normal[2] += normalz;
+			cluster_area += area;
+		}
+
+		f32 inv_cluster_area = cluster_area == 0 ? 0 : 1 / cluster_area;
+
+		cluster_centroid[0] *= inv_cluster_area;
+		cluster_centroid[1] *= inv_cluster_area;
+		cluster_centroid[2] *= inv_cluster_area;
+
+		f32 cluster_normal_length = sqrtf(cluster_normal[0] * cluster_normal[0] + cluster_normal[1] * cluster_normal[1] + cluster_normal[2] * cluster_normal[2]);
+		f32 inv_cluster_normal_length = cluster_normal_length == 0 ? 0 : 1 / cluster_normal_length;
+
+		cluster_normal[0] *= inv_cluster_normal_length;
+		cluster_normal[1] *= inv_cluster_normal_length;
+		cluster_normal[2] *= inv_cluster_normal_length;
+
+		f32 centroid_vector[3] = {cluster_centroid[0] - mesh_centroid[0], cluster_centroid[1] - mesh_centroid[1], cluster_centroid[2] - mesh_centroid[2]};
+
+		sort_data[cluster] = centroid_vector[0] * cluster_normal[0] + centroid_vector[1] * cluster_normal[1] + centroid_vector[2] * cluster_normal[2];
+	}
+}
+
+// Same output as meshopt_optimizeOverdraw. The hard cluster split is one cache simulation over the whole buffer and
+// stays serial, but every hard cluster is split into soft clusters with a reset cache, so runs of hard clusters are
+// split as independent jobs. The sort data is per cluster as well; only the mesh centroid and the 11 bit radix sort
+// see the whole mesh. destination may alias indices.
+void optimize_overdraw_parallel(u32* destination, const u32* indices, u32 index_count, const f32* vertex_positions, u32 vertex_count, size_t vertex_positions_stride, f32 threshold, u32 thread_count = 0)
+{
+	assert(index_count % 3 == 0);
+	if (thread_count == 0) thread_count = get_job_thread_count();
+
+	if (index_count == 0 || vertex_count == 0) return;
+
+	u32* source = (u32*)indices;
+	if (destination == indices)
+	{
+		source = new u32[index_count];
+		memcpy(source, indices, sizeof(u32) * index_count);
+	}
+
+	const u32 cache_size = 16;
+	u32 triangle_count = index_count / 3;
+
+	u32* hard_cache_timestamps = new u32[vertex_count];
+	u32* hard_clusters = new u32[triangle_count];
+	u32 hard_cluster_count = (u32)meshopt::generateHardBoundaries(hard_clusters, source, index_count, vertex_count, cache_size, hard_cache_timestamps);
+	delete[] hard_cache_timestamps;
+
+	u32 job_count = thread_count > 1 ? MAX(MIN(thread_count * 2, hard_cluster_count / MIN_OVERDRAW_JOB_CLUSTERS), 1u) : 1;
+	u32 worker_count = MIN(thread_count, job_count);
+
+	u32** job_soft_clusters = new u32*[job_count];
+	u32* job_soft_counts = new u32[job_count];
+	u32** cache_timestamps = new u32*[worker_count];
+	for (u32 i = 0; i < worker_count; ++i) cache_timestamps[i] = new u32[vertex_count];
+
+	parallel_for(job_count, worker_count, [&](u32 job, u32 thread_index)
+	{
+		u32 first = (u32)((u64)hard_cluster_count * job / job_count);
+		u32 last = (u32)((u64)hard_cluster_count * (job + 1) / job_count);
+		u32 end_triangle = last < hard_cluster_count ? hard_clusters[last] : triangle_count;
+
+		job_soft_clusters[job] = new u32[end_triangle - hard_clusters[first] + 1];
+		job_soft_counts[job] = (u32)meshopt::generateSoftBoundaries(job_soft_clusters[job], source, end_triangle * 3, vertex_count, hard_clusters + first, last - first, cache_size, threshold, cache_timestamps[thread_index]);
+	});
+
+	u32 cluster_count = 0;
+	for (u32 i = 0; i < job_count; ++i) cluster_count += job_soft_counts[i];
+
+	u32* clusters = new u32[cluster_count];
+	cluster_count = 0;
+	for (u32 i = 0; i < job_count; ++i)
+	{
+		memcpy(clusters + cluster_count, job_soft_clusters[i], sizeof(u32) * job_soft_counts[i]);
+		cluster_count += job_soft_counts[i];
+		delete[] job_soft_clusters[i];
+	}
+
+	size_t stride_in_floats = vertex_positions_stride / sizeof(f32);
+
+	f32 mesh_centroid[3] = {};
+	for (u32 i = 0; i < index_count; ++i)
+	{
+		const f32* p = vertex_positions + stride_in_floats * source[i];
+
+		mesh_centroid[0] += p[0];
+		mesh_centroid[1] += p[1];
+		mesh_centroid[2] += p[2];
+	}
+
+	mesh_centroid[0] /= index_count;
+	mesh_centroid[1] /= index_count;
+	mesh_centroid[2] /= index_count;
+
+	f32* sort_data = new f32[cluster_count];
+
+	parallel_for(job_count, worker_count, [&](u32 job, u32)
+	{
+		u32 first = (u32)((u64)cluster_count * job / job_count);
+		u32 last = (u32)((u64)cluster_count * (job + 1) / job_count);
+
+		calculate_cluster_sort_data(sort_data, source, index_count, vertex_positions, vertex_positions_stride, clusters, cluster_count, first, last, mesh_centroid);
+	});
+
+	u16* sort_keys = new u16[cluster_count];
+	u32* sort_order = new u32[cluster_count];
+	meshopt::calculateSortOrderRadix(sort_order, sort_data, sort_keys, cluster_count);
+
+	u32 offset = 0;
+	for (u32 i = 0; i < cluster_count; ++i)
+	{
+		u32 cluster = sort_order[i];
+
+		u32 begin = clusters[cluster] * 3;
+		u32 end = (cluster + 1 < cluster_count) ? clusters[cluster + 1] * 3 : index_count;
+
+		memcpy(destination + offset, source + begin, sizeof(u32) * (end - begin));
+		offset += end - begin;
+	}
+	assert(offset == index_count);
+
+	for (u32 i = 0; i < worker_count; ++i) delete[] cache_timestamps[i];
+	delete[] cache_timestamps;
+	delete[] job_soft_clusters;
+	delete[] job_soft_counts;
+	delete[] hard_clusters;
+	delete[] clusters;
+	delete[] sort_data;
+	delete[] sort_keys;
+	delete[] sort_order;
+	if (source != indices) delete[] source;
+}
+
+void benchmark_parallel_overdraw(char* name, const u32* indices, u32 index_count, const f32* vertex_positions, u32 vertex_count, size_t vertex_positions_stride, f32 threshold)
+{
+	printf("Overdraw %s (%u triangles, %u threads):\n", name, index_count / 3, get_job_thread_count());
+
+	f64 start = time_in_seconds();
+	meshopt_OverdrawStatistics serial = meshopt_analyzeOverdraw(indices, index_count, vertex_positions, vertex_count, vertex_positions_stride);
+	f64 serial_seconds = time_in_seconds() - start;
+
+	start = time_in_seconds();
+	meshopt_OverdrawStatistics parallel = analyze_overdraw_parallel(indices, index_count, vertex_positions, vertex_count, vertex_positions_stride);
+	f64 parallel_seconds = time_in_seconds() - start;
+
+	printf("  analyze 256: serial %.3f in %.1fms, parallel %.3f in %.1fms (%s)\n", serial.overdraw, serial_seconds * 1000.0, parallel.overdraw, parallel_seconds * 1000.0,
+	       serial.pixels_shaded == parallel.pixels_shaded && serial.pixels_covered == parallel.pixels_covered ? "identical" : "MISMATCH");
+
+	start = time_in_seconds();
+	meshopt_OverdrawStatistics high_resolution = analyze_overdraw_parallel(indices, index_count, vertex_positions, vertex_count, vertex_positions_stride, 1024);
+	printf("  analyze 1024: parallel %.3f in %.1fms\n", high_resolution.overdraw, (time_in_seconds() - start) * 1000.0);
+
+	u32* serial_indices = new u32[index_count];
+	u32* parallel_indices = new u32[index_count];
+
+	start = time_in_seconds();
+	meshopt_optimizeOverdraw(serial_indices, indices, index_count, vertex_positions, vertex_count, vertex_positions_stride, threshold);
+	serial_seconds = time_in_seconds() - start;
+
+	start = time_in_seconds();
+	optimize_overdraw_parallel(parallel_indices, indices, index_count, vertex_positions, vertex_count, vertex_positions_stride, threshold);
+	parallel_seconds = time_in_seconds() - start;
+
+	serial = analyze_overdraw_parallel(serial_indices, index_count, vertex_positions, vertex_count, vertex_positions_stride);
+	parallel = analyze_overdraw_parallel(parallel_indices, index_count, vertex_positions, vertex_count, vertex_positions_stride);
+
+	printf("  optimize %.2f: serial overdraw %.3f ACMR %.3f in %.1fms, parallel overdraw %.3f ACMR %.3f in %.1fms (%s)\n", threshold,
+	       serial.overdraw, meshopt_analyzeVertexCache(serial_indices, index_count, vertex_count, 16, 0, 0).acmr, serial_seconds * 1000.0,
+	       parallel.overdraw, meshopt_analyzeVertexCache(parallel_indices, index_count, vertex_count, 16, 0, 0).acmr, parallel_seconds * 1000.0,
+	       memcmp(serial_indices, parallel_indices, sizeof(u32) * index_count) == 0 ? "identical" : "MISMATCH");
+
+	delete[] serial_indices;
+	delete[] parallel_indices;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+// Splits a mesh into spatially coherent triangle ranges so that serial meshoptimizer passes can run on each range
+// on its own thread. Needs include/spatialorder.cpp in the same translation unit.
+
+
+// Reorders the triangles of indices into Morton order (meshopt_spatialSortTriangles) and cuts the result into
+// partition_count contiguous runs of roughly equal size. Partition p covers
+// sorted_indices[partition_offsets[p] .. partition_offsets[p + 1]), so partition_offsets needs partition_count + 1 entries.
+// Offsets are always a multiple of 3.
+void spatial_partition_triangles(u32* sorted_indices, u32* partition_offsets, u32 partition_count, const u32* indices, u32 index_count, const f32* vertex_positions, u32 vertex_count, size_t vertex_positions_stride)
+{
+	assert(partition_count > 0);
+	assert(index_count % 3 == 0);
+
+	meshopt_spatialSortTriangles(sorted_indices, indices, index_count, vertex_positions, vertex_count, vertex_positions_stride);
+
+	u32 triangle_count = index_count / 3;
+	for (u32 p = 0; p <= partition_count; ++p)
+		partition_offsets[p] = (u32)(((u64)triangle_count * p / partition_count) * 3);
+}
+
+
+// A partition copied out into its own compact vertex space, so meshopt passes over it only pay for the vertices it uses.
+struct MeshPartition
+{
+	u32* indices;//Local vertex indices
+	u32 index_count;
+
+	u32* vertices;//Local vertex -> source vertex
+	u32 vertex_count;
+
+	f32* positions;//Packed float3 per local vertex
+};
+
+void free_mesh_partition(MeshPartition* partition)
+{
+	delete[] partition->indices;
+	delete[] partition->vertices;
+	delete[] partition->positions;
+	*partition = {};
+}
+
+// vertex_scratch must have vertex_count entries all set to ~0u, they are restored to ~0u before returning,
+// so one scratch array per thread can be reused for every partition that thread extracts.
+void extract_mesh_partition(MeshPartition* result, u32* vertex_scratch, const u32* indices, u32 index_count, const f32* vertex_positions, size_t vertex_positions_stride)
+{
+	size_t stride_in_floats = vertex_positions_stride / sizeof(f32);
+
+	result->index_count = index_count;
+	result->indices = new u32[index_count];
+	result->vertices = new u32[index_count];
+	result->vertex_count = 0;
+
+	for (u32 i = 0; i < index_count; ++i)
+	{
+		u32 v = indices[i];
+
+		if (vertex_scratch[v] == ~0u)
+		{
+			vertex_scratch[v] = result->vertex_count;
+			result->vertices[result->vertex_count++] = v;
+		}
+
+		result->indices[i] = vertex_scratch[v];
+	}
+
+	result->positions = new f32[result->vertex_count * 3];
+	for (u32 i = 0; i < result->vertex_count; ++i)
+	{
+		u32 v = result->vertices[i];
+		memcpy(&result->positions[i * 3], vertex_positions + v * stride_in_floats, sizeof(f32) * 3);
+
+		vertex_scratch[v] = ~0u;
+	}
+}
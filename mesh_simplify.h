@@ -0,0 +1,1122 @@
+#pragma once
+
+// Offline simplification helpers that sit on top of the vendored meshoptimizer.
+// This needs include/simplifier.cpp and include/spatialorder.cpp to be part of the same translation unit: we reuse
+// meshopt's Quadric helpers directly so the out of core path clusters exactly like meshopt_simplifySloppy does.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+
+#include "jobs.h"
+#include "mesh_partition.h"
+
+
+// ---------------------------------------------------------------------------------------------------------------------
+// Triangle soup files
+//
+// Inputs that are too big to load are stored as a flat triangle soup: a header followed by triangle_count * 9 floats.
+// The bounds are stored up front so the simplifier doesn't need an extra pass over the file just to find them.
+// ---------------------------------------------------------------------------------------------------------------------
+
+constexpr u32 TRIANGLE_SOUP_MAGIC = 0x50554f53;//'SOUP'
+constexpr u32 TRIANGLE_SOUP_VERSION = 1;
+
+struct TriangleSoupHeader
+{
+	u32 magic;
+	u32 version;
+	u64 triangle_count;
+	f32 min[3];
+	f32 max[3];
+};
+
+
+bool write_triangle_soup(char* path, const f32* vertex_positions, size_t vertex_positions_stride, const u32* indices, u64 index_count)
+{
+	assert(index_count % 3 == 0);
+	size_t stride_in_floats = vertex_positions_stride / sizeof(f32);
+
+	TriangleSoupHeader header = {};
+	header.magic = TRIANGLE_SOUP_MAGIC;
+	header.version = TRIANGLE_SOUP_VERSION;
+	header.triangle_count = index_count / 3;
+
+	for (u32 j = 0; j < 3; ++j)
+	{
+		header.min[j] = FLT_MAX;
+		header.max[j] = -FLT_MAX;
+	}
+
+	for (u64 i = 0; i < index_count; ++i)
+	{
+		const f32* v = vertex_positions + indices[i] * stride_in_floats;
+		for (u32 j = 0; j < 3; ++j)
+		{
+			header.min[j] = MIN(header.min[j], v[j]);
+			header.max[j] = MAX(header.max[j], v[j]);
+		}
+	}
+
+	FILE* file = fopen(path, "wb");
+	if (!file)
+	{
+		printf("mesh_simplify.h Error: Could not open %s for writing\n", path);
+		return false;
+	}
+
+	bool success = fwrite(&header, sizeof(header), 1, file) == 1;
+
+	constexpr u32 block_triangle_count = 1024;
+	f32 block[block_triangle_count * 9];
+
+	for (u64 first = 0; success && first < header.triangle_count; first += block_triangle_count)
+	{
+		u32 count = (u32)MIN((u64)block_triangle_count, header.triangle_count - first);
+
+		for (u32 t = 0; t < count; ++t)
+		{
+			for (u32 k = 0; k < 3; ++k)
+			{
+				const f32* v = vertex_positions + indices[(first + t) * 3 + k] * stride_in_floats;
+				memcpy(&block[t * 9 + k * 3], v, sizeof(f32) * 3);
+			}
+		}
+
+		success = fwrite(block, sizeof(f32) * 9, count, file) == count;
+	}
+
+	if (!success) printf("mesh_simplify.h Error: Could not write triangles to %s\n", path);
+
+	fclose(file);
+	return success;
+}
+
+
+bool write_obj(char* path, const f32* positions, u32 vertex_count, const u32* indices, u32 index_count)
+{
+	FILE* file = fopen(path, "w");
+	if (!file)
+	{
+		printf("mesh_simplify.h Error: Could not open %s for writing\n", path);
+		return false;
+	}
+
+	for (u32 i = 0; i < vertex_count; ++i)
+		fprintf(file, "v %f %f %f\n", positions[i * 3 + 0], positions[i * 3 + 1], positions[i * 3 + 2]);
+
+	for (u32 i = 0; i < index_count; i += 3)
+		fprintf(file, "f %u %u %u\n", indices[i + 0] + 1, indices[i + 1] + 1, indices[i + 2] + 1);
+
+	fclose(file);
+	return true;
+}
+
+
+// ---------------------------------------------------------------------------------------------------------------------
+// Sparse per-cell storage
+//
+// The in memory sloppy simplifier can size its cell arrays from the vertex count, out of core we only ever see
+// the cells that actually get touched, so they live in a small open addressing map keyed by the packed grid id.
+// ---------------------------------------------------------------------------------------------------------------------
+
+constexpr u32 EMPTY_CELL = ~0u;//Grid ids only use the low 30 bits so this never collides with a real cell.
+
+inline u32 hash_cell_id(u32 h)
+{
+	// MurmurHash2 finalizer, same as meshopt's CellHasher
+	h ^= h >> 13;
+	h *= 0x5bd1e995;
+	h ^= h >> 15;
+	return h;
+}
+
+template <typename T>
+struct CellMap
+{
+	u32* keys;
+	T* values;
+	u32 capacity;//Always a power of two.
+	u32 count;
+};
+
+template <typename T>
+void init_cell_map(CellMap<T>* map, u32 capacity)
+{
+	u32 buckets = 16;
+	while (buckets < capacity) buckets *= 2;
+
+	map->capacity = buckets;
+	map->count = 0;
+	map->keys = new u32[buckets];
+	map->values = new T[buckets];
+	memset(map->keys, 0xff, sizeof(u32) * buckets);
+}
+
+template <typename T>
+void free_cell_map(CellMap<T>* map)
+{
+	delete[] map->keys;
+	delete[] map->values;
+	*map = {};
+}
+
+template <typename T>
+u32 cell_map_slot(const CellMap<T>* map, u32 key)
+{
+	u32 mask = map->capacity - 1;
+	u32 bucket = hash_cell_id(key) & mask;
+
+	for (u32 probe = 0; ; ++probe)
+	{
+		u32 existing = map->keys[bucket];
+		if (existing == key || existing == EMPTY_CELL) return bucket;
+
+		bucket = (bucket + probe + 1) & mask;//quadratic probing
+	}
+}
+
+template <typename T>
+T* cell_map_find(const CellMap<T>* map, u32 key)
+{
+	u32 slot = cell_map_slot(map, key);
+	return map->keys[slot] == key ? &map->values[slot] : 0;
+}
+
+// Returns the value for key, inserting a zero initialized one if it isn't in the map yet.
+template <typename T>
+T* cell_map_get(CellMap<T>* map, u32 key, bool* was_added = 0)
+{
+	assert(key != EMPTY_CELL);
+
+	if ((map->count + 1) * 4 > map->capacity * 3)
+	{
+		CellMap<T> grown = {};
+		init_cell_map(&grown, map->capacity * 2);
+
+		for (u32 i = 0; i < map->capacity; ++i)
+		{
+			if (map->keys[i] == EMPTY_CELL) continue;
+
+			u32 slot = cell_map_slot(&grown, map->keys[i]);
+			grown.keys[slot] = map->keys[i];
+			grown.values[slot] = map->values[i];
+		}
+		grown.count = map->count;
+
+		free_cell_map(map);
+		*map = grown;
+	}
+
+	u32 slot = cell_map_slot(map, key);
+	bool added = map->keys[slot] == EMPTY_CELL;
+
+	if (added)
+	{
+		map->keys[slot] = key;
+		map->values[slot] = {};
+		++map->count;
+	}
+
+	if (was_added) *was_added = added;
+	return &map->values[slot];
+}
+
+
+// A triangle between three distinct cells. The first triangle in the soup that produced it is kept so that the
+// output order doesn't depend on which thread got which chunk.
+struct CellTriangle
+{
+	u32 cells[3];
+	u64 first_triangle;
+};
+
+struct CellTriangleSet
+{
+	CellTriangle* entries;//entries[i].cells[0] == EMPTY_CELL marks a free slot.
+	u32 capacity;
+	u32 count;
+};
+
+void init_cell_triangle_set(CellTriangleSet* set, u32 capacity)
+{
+	u32 buckets = 16;
+	while (buckets < capacity) buckets *= 2;
+
+	set->capacity = buckets;
+	set->count = 0;
+	set->entries = new CellTriangle[buckets];
+	for (u32 i = 0; i < buckets; ++i) set->entries[i].cells[0] = EMPTY_CELL;
+}
+
+void free_cell_triangle_set(CellTriangleSet* set)
+{
+	delete[] set->entries;
+	*set = {};
+}
+
+u32 cell_triangle_set_slot(const CellTriangleSet* set, const u32 cells[3])
+{
+	u32 mask = set->capacity - 1;
+	// Optimized Spatial Hashing for Collision Detection of Deformable Objects, same as meshopt's TriangleHasher
+	u32 bucket = ((cells[0] * 73856093) ^ (cells[1] * 19349663) ^ (cells[2] * 83492791)) & mask;
+
+	for (u32 probe = 0; ; ++probe)
+	{
+		const u32* existing = set->entries[bucket].cells;
+		if (existing[0] == EMPTY_CELL) return bucket;
+		if (existing[0] == cells[0] && existing[1] == cells[1] && existing[2] == cells[2]) return bucket;
+
+		bucket = (bucket + probe + 1) & mask;
+	}
+}
+
+void cell_triangle_set_add(CellTriangleSet* set, const u32 cells[3], u64 first_triangle)
+{
+	if ((set->count + 1) * 4 > set->capacity * 3)
+	{
+		CellTriangleSet grown = {};
+		init_cell_triangle_set(&grown, set->capacity * 2);
+
+		for (u32 i = 0; i < set->capacity; ++i)
+		{
+			if (set->entries[i].cells[0] == EMPTY_CELL) continue;
+			grown.entries[cell_triangle_set_slot(&grown, set->entries[i].cells)] = set->entries[i];
+		}
+		grown.count = set->count;
+
+		free_cell_triangle_set(set);
+		*set = grown;
+	}
+
+	CellTriangle& entry = set->entries[cell_triangle_set_slot(set, cells)];
+
+	if (entry.cells[0] == EMPTY_CELL)
+	{
+		memcpy(entry.cells, cells, sizeof(entry.cells));
+		entry.first_triangle = first_triangle;
+		++set->count;
+	}
+	else
+	{
+		entry.first_triangle = MIN(entry.first_triangle, first_triangle);
+	}
+}
+
+
+// ---------------------------------------------------------------------------------------------------------------------
+// Out of core grid simplification
+//
+// Same algorithm as meshopt_simplifySloppy with a fixed grid: every corner is snapped to a grid cell, each cell
+// accumulates the quadrics of the triangles touching it, and each cell is represented by the corner with the lowest
+// quadric error. Triangles that still span three cells survive.
+//
+// The soup is streamed in chunks of chunk_triangle_count triangles, chunks are processed in parallel with per-thread
+// sparse maps that get merged afterwards. Memory use is proportional to the number of occupied cells and surviving
+// triangles plus one chunk buffer per thread, not to the size of the input.
+//
+// The file is read twice: once to accumulate the cell quadrics and collect triangles, and once more to pick each cell's
+// representative corner, which needs the final quadrics.
+// ---------------------------------------------------------------------------------------------------------------------
+
+struct SimplifiedMesh
+{
+	f32* positions;//3 floats per vertex
+	u32 vertex_count;
+	u32* indices;
+	u32 index_count;
+	f32 error;//Relative to the mesh extents, same units as meshopt's result_error
+};
+
+void free_simplified_mesh(SimplifiedMesh* mesh)
+{
+	delete[] mesh->positions;
+	delete[] mesh->indices;
+	*mesh = {};
+}
+
+
+struct CellRepresentative
+{
+	f32 error;
+	u64 corner;//Index of the corner in the soup (triangle * 3 + k), used to break ties deterministically.
+	f32 position[3];
+};
+
+struct SoupChunkReader
+{
+	char* path;
+	u64 triangle_count;
+	u32 chunk_triangle_count;
+
+	FILE** files;//One per thread, opened on first use.
+	f32** buffers;
+};
+
+void init_soup_chunk_reader(SoupChunkReader* reader, char* path, u64 triangle_count, u32 chunk_triangle_count, u32 thread_count)
+{
+	reader->path = path;
+	reader->triangle_count = triangle_count;
+	reader->chunk_triangle_count = chunk_triangle_count;
+	reader->files = new FILE*[thread_count];
+	reader->buffers = new f32*[thread_count];
+
+	for (u32 i = 0; i < thread_count; ++i)
+	{
+		reader->files[i] = 0;
+		reader->buffers[i] = 0;
+	}
+}
+
+void free_soup_chunk_reader(SoupChunkReader* reader, u32 thread_count)
+{
+	for (u32 i = 0; i < thread_count; ++i)
+	{
+		if (reader->files[i]) fclose(reader->files[i]);
+		delete[] reader->buffers[i];
+	}
+	delete[] reader->files;
+	delete[] reader->buffers;
+	*reader = {};
+}
+
+// Reads the triangles of one chunk, returns the number of triangles read or 0 on failure.
+u32 read_soup_chunk(SoupChunkReader* reader, u32 chunk_index, u32 thread_index, f32** triangles_out)
+{
+	if (!reader->files[thread_index])
+	{
+		reader->files[thread_index] = fopen(reader->path, "rb");
+		reader->buffers[thread_index] = new f32[(size_t)reader->chunk_triangle_count * 9];
+	}
+
+	FILE* file = reader->files[thread_index];
+	if (!file) return 0;
+
+	u64 first_triangle = (u64)chunk_index * reader->chunk_triangle_count;
+	u32 count = (u32)MIN((u64)reader->chunk_triangle_count, reader->triangle_count - first_triangle);
+
+	if (seek_file_64(file, (int64_t)(sizeof(TriangleSoupHeader) + first_triangle * sizeof(f32) * 9)) != 0) return 0;
+	if (fread(reader->buffers[thread_index], sizeof(f32) * 9, count, file) != count) return 0;
+
+	*triangles_out = reader->buffers[thread_index];
+	return count;
+}
+
+
+int compare_cell_triangles(const void* a, const void* b)
+{
+	u64 lhs = ((const CellTriangle*)a)->first_triangle;
+	u64 rhs = ((const CellTriangle*)b)->first_triangle;
+	return lhs < rhs ? -1 : lhs > rhs ? 1 : 0;
+}
+
+// grid_size is the number of cells along the longest axis of the bounds, in [2, 1024], the same grid meshopt_simplifySloppy searches over.
+bool simplify_out_of_core(SimplifiedMesh* result, char* soup_path, u32 grid_size, u32 chunk_triangle_count = 1 << 20, u32 thread_count = 0)
+{
+	using namespace meshopt;
+
+	assert(grid_size >= 2 && grid_size <= 1024);
+	*result = {};
+
+	FILE* file = fopen(soup_path, "rb");
+	if (!file)
+	{
+		printf("mesh_simplify.h Error: Could not open %s\n", soup_path);
+		return false;
+	}
+
+	TriangleSoupHeader header = {};
+	bool header_ok = fread(&header, sizeof(header), 1, file) == 1;
+	fclose(file);
+
+	if (!header_ok || header.magic != TRIANGLE_SOUP_MAGIC || header.version != TRIANGLE_SOUP_VERSION)
+	{
+		printf("mesh_simplify.h Error: %s is not a triangle soup file\n", soup_path);
+		return false;
+	}
+
+	if (header.triangle_count == 0) return true;
+
+	u64 chunk_count_64 = (header.triangle_count + chunk_triangle_count - 1) / chunk_triangle_count;
+	assert(chunk_count_64 <= UINT32_MAX);
+	u32 chunk_count = (u32)chunk_count_64;
+
+	if (thread_count == 0) thread_count = get_job_thread_count();
+	thread_count = MIN(thread_count, chunk_count);
+
+	// same rescale as meshopt's rescalePositions: unit cube anchored at the minimum, scaled by the longest extent
+	f32 extent = 0.0f;
+	for (u32 j = 0; j < 3; ++j) extent = MAX(extent, header.max[j] - header.min[j]);
+	f32 scale = extent == 0.0f ? 0.0f : 1.0f / extent;
+	f32 cell_scale = f32(grid_size - 1);
+
+	auto rescale = [&](const f32* p) -> Vector3
+	{
+		Vector3 v = { (p[0] - header.min[0]) * scale, (p[1] - header.min[1]) * scale, (p[2] - header.min[2]) * scale };
+		return v;
+	};
+
+	// matches computeVertexIds
+	auto cell_id = [&](const Vector3& v) -> u32
+	{
+		int xi = int(v.x * cell_scale + 0.5f);
+		int yi = int(v.y * cell_scale + 0.5f);
+		int zi = int(v.z * cell_scale + 0.5f);
+		return (xi << 20) | (yi << 10) | zi;
+	};
+
+	SoupChunkReader reader = {};
+	init_soup_chunk_reader(&reader, soup_path, header.triangle_count, chunk_triangle_count, thread_count);
+
+	std::atomic<bool> read_failed(false);
+
+	// Pass 1: cell quadrics and surviving triangles, per thread
+	CellMap<Quadric>* thread_quadrics = new CellMap<Quadric>[thread_count];
+	CellTriangleSet* thread_triangles = new CellTriangleSet[thread_count];
+	for (u32 i = 0; i < thread_count; ++i)
+	{
+		init_cell_map(&thread_quadrics[i], 1024);
+		init_cell_triangle_set(&thread_triangles[i], 1024);
+	}
+
+	parallel_for(chunk_count, thread_count, [&](u32 chunk_index, u32 thread_index)
+	{
+		f32* triangles = 0;
+		u32 count = read_soup_chunk(&reader, chunk_index, thread_index, &triangles);
+		if (count == 0)
+		{
+			read_failed = true;
+			return;
+		}
+
+		CellMap<Quadric>* quadrics = &thread_quadrics[thread_index];
+		u64 first_triangle = (u64)chunk_index * chunk_triangle_count;
+
+		for (u32 t = 0; t < count; ++t)
+		{
+			Vector3 p[3];
+			u32 c[3];
+			for (u32 k = 0; k < 3; ++k)
+			{
+				p[k] = rescale(&triangles[t * 9 + k * 3]);
+				c[k] = cell_id(p[k]);
+			}
+
+			// matches the triangle version of fillCellQuadrics
+			bool single_cell = (c[0] == c[1]) & (c[0] == c[2]);
+
+			Quadric Q;
+			quadricFromTriangle(Q, p[0], p[1], p[2], single_cell ? 3.f : 1.f);
+
+			if (single_cell)
+			{
+				quadricAdd(*cell_map_get(quadrics, c[0]), Q);
+			}
+			else
+			{
+				quadricAdd(*cell_map_get(quadrics, c[0]), Q);
+				quadricAdd(*cell_map_get(quadrics, c[1]), Q);
+				quadricAdd(*cell_map_get(quadrics, c[2]), Q);
+			}
+
+			if (c[0] != c[1] && c[0] != c[2] && c[1] != c[2])
+			{
+				// rotate so the smallest cell comes first, keeping the winding, like filterTriangles
+				u32 rotation = (c[1] < c[0] && c[1] < c[2]) ? 1 : (c[2] < c[0] && c[2] < c[1]) ? 2 : 0;
+				u32 cells[3] = { c[rotation], c[(rotation + 1) % 3], c[(rotation + 2) % 3] };
+
+				cell_triangle_set_add(&thread_triangles[thread_index], cells, first_triangle + t);
+			}
+		}
+	});
+
+	// Merge into the first thread's tables. Float addition order changes with the chunk->thread assignment,
+	// so quadrics can differ in the last bits between runs, the selected triangles can't.
+	CellMap<Quadric> cell_quadrics = thread_quadrics[0];
+	CellTriangleSet cell_triangles = thread_triangles[0];
+
+	for (u32 i = 1; i < thread_count; ++i)
+	{
+		CellMap<Quadric>* quadrics = &thread_quadrics[i];
+		for (u32 j = 0; j < quadrics->capacity; ++j)
+		{
+			if (quadrics->keys[j] != EMPTY_CELL)
+				quadricAdd(*cell_map_get(&cell_quadrics, quadrics->keys[j]), quadrics->values[j]);
+		}
+		free_cell_map(quadrics);
+
+		CellTriangleSet* triangles = &thread_triangles[i];
+		for (u32 j = 0; j < triangles->capacity; ++j)
+		{
+			if (triangles->entries[j].cells[0] != EMPTY_CELL)
+				cell_triangle_set_add(&cell_triangles, triangles->entries[j].cells, triangles->entries[j].first_triangle);
+		}
+		free_cell_triangle_set(triangles);
+	}
+	delete[] thread_quadrics;
+	delete[] thread_triangles;
+
+	// Pass 2: for every cell, the corner with the smallest error under the final quadric (fillCellRemap)
+	CellMap<CellRepresentative>* thread_representatives = new CellMap<CellRepresentative>[thread_count];
+	for (u32 i = 0; i < thread_count; ++i)
+		init_cell_map(&thread_representatives[i], cell_quadrics.count);
+
+	if (!read_failed)
+	{
+		parallel_for(chunk_count, thread_count, [&](u32 chunk_index, u32 thread_index)
+		{
+			f32* triangles = 0;
+			u32 count = read_soup_chunk(&reader, chunk_index, thread_index, &triangles);
+			if (count == 0)
+			{
+				read_failed = true;
+				return;
+			}
+
+			CellMap<CellRepresentative>* representatives = &thread_representatives[thread_index];
+			u64 first_corner = (u64)chunk_index * chunk_triangle_count * 3;
+
+			for (u32 i = 0; i < count * 3; ++i)
+			{
+				const f32* position = &triangles[i * 3];
+				Vector3 v = rescale(position);
+				u32 cell = cell_id(v);
+
+				f32 error = quadricError(*cell_map_find(&cell_quadrics, cell), v);
+
+				bool added = false;
+				CellRepresentative* best = cell_map_get(representatives, cell, &added);
+
+				if (added || error < best->error)
+				{
+					best->error = error;
+					best->corner = first_corner + i;
+					memcpy(best->position, position, sizeof(best->position));
+				}
+			}
+		});
+	}
+
+	CellMap<CellRepresentative> cell_representatives = thread_representatives[0];
+	for (u32 i = 1; i < thread_count; ++i)
+	{
+		CellMap<CellRepresentative>* representatives = &thread_representatives[i];
+		for (u32 j = 0; j < representatives->capacity; ++j)
+		{
+			if (representatives->keys[j] == EMPTY_CELL) continue;
+
+			CellRepresentative& candidate = representatives->values[j];
+
+			bool added = false;
+			CellRepresentative* best = cell_map_get(&cell_representatives, representatives->keys[j], &added);
+
+			if (added || candidate.error < best->error || (candidate.error == best->error && candidate.corner < best->corner))
+				*best = candidate;
+		}
+		free_cell_map(representatives);
+	}
+	delete[] thread_representatives;
+
+	free_soup_chunk_reader(&reader, thread_count);
+	free_cell_map(&cell_quadrics);
+
+	if (read_failed)
+	{
+		printf("mesh_simplify.h Error: Could not read triangles from %s\n", soup_path);
+		free_cell_map(&cell_representatives);
+		free_cell_triangle_set(&cell_triangles);
+		return false;
+	}
+
+	f32 max_error = 0.0f;
+	for (u32 i = 0; i < cell_representatives.capacity; ++i)
+	{
+		if (cell_representatives.keys[i] != EMPTY_CELL)
+			max_error = MAX(max_error, cell_representatives.values[i].error);
+	}
+	result->error = sqrtf(max_error);
+
+	// Output triangles in the order they first appear in the soup, vertices in the order they are first referenced
+	CellTriangle* triangles = new CellTriangle[MAX(cell_triangles.count, 1u)];
+	u32 triangle_count = 0;
+	for (u32 i = 0; i < cell_triangles.capacity; ++i)
+	{
+		if (cell_triangles.entries[i].cells[0] != EMPTY_CELL)
+			triangles[triangle_count++] = cell_triangles.entries[i];
+	}
+	free_cell_triangle_set(&cell_triangles);
+
+	qsort(triangles, triangle_count, sizeof(CellTriangle), compare_cell_triangles);
+
+	CellMap<u32> cell_vertices = {};
+	init_cell_map(&cell_vertices, triangle_count);
+
+	result->index_count = triangle_count * 3;
+	result->indices = new u32[result->index_count];
+	result->positions = new f32[(size_t)MIN(cell_representatives.count, result->index_count) * 3 + 3];
+
+	for (u32 i = 0; i < triangle_count; ++i)
+	{
+		for (u32 k = 0; k < 3; ++k)
+		{
+			u32 cell = triangles[i].cells[k];
+
+			bool added = false;
+			u32* vertex = cell_map_get(&cell_vertices, cell, &added);
+
+			if (added)
+			{
+				*vertex = result->vertex_count++;
+				memcpy(&result->positions[*vertex * 3], cell_map_find(&cell_representatives, cell)->position, sizeof(f32) * 3);
+			}
+
+			result->indices[i * 3 + k] = *vertex;
+		}
+	}
+
+	free_cell_map(&cell_vertices);
+	free_cell_map(&cell_representatives);
+	delete[] triangles;
+
+	return true;
+}
+
+
+// Streams soup_path and writes a proxy LOD of it to obj_path.
+bool build_proxy_lod(char* soup_path, char* obj_path, u32 grid_size)
+{
+	f64 start = time_in_seconds();
+
+	SimplifiedMesh proxy = {};
+	if (!simplify_out_of_core(&proxy, soup_path, grid_size)) return false;
+
+	printf("Proxy LOD of %s: grid %u, %u triangles, error %f, took %.2fs\n", soup_path, grid_size, proxy.index_count / 3, proxy.error, time_in_seconds() - start);
+
+	bool success = write_obj(obj_path, proxy.positions, proxy.vertex_count, proxy.indices, proxy.index_count);
+	free_simplified_mesh(&proxy);
+	return success;
+}
+
+
+int compare_triangle_positions(const void* a, const void* b)
+{
+	return memcmp(a, b, sizeof(f32) * 9);
+}
+
+int compare_triangle_cells(const void* a, const void* b)
+{
+	const u32* lhs = (const u32*)a;
+	const u32* rhs = (const u32*)b;
+	for (u32 k = 0; k < 3; ++k)
+	{
+		if (lhs[k] != rhs[k]) return lhs[k] < rhs[k] ? -1 : 1;
+	}
+	return 0;
+}
+
+// Rotates the 9 floats of a triangle so the corner that compares lowest comes first, keeping the winding.
+void rotate_triangle_positions(f32* triangle)
+{
+	u32 first = 0;
+	for (u32 k = 1; k < 3; ++k)
+	{
+		if (memcmp(&triangle[k * 3], &triangle[first * 3], sizeof(f32) * 3) < 0) first = k;
+	}
+
+	f32 rotated[9];
+	for (u32 k = 0; k < 3; ++k)
+		memcpy(&rotated[k * 3], &triangle[((first + k) % 3) * 3], sizeof(f32) * 3);
+	memcpy(triangle, rotated, sizeof(rotated));
+}
+
+// Writes the mesh to soup_path and simplifies it at each grid size both out of core and in memory with
+// meshopt_simplifySloppy held to the same grid. Both have to keep the same number of triangles with the same error.
+// With one thread the out of core quadrics are summed in the same order as meshopt's, so the triangles also have to
+// match corner for corner with the same winding. With several threads the partial sums round differently and a cell
+// whose corners nearly tie can pick another representative, so there the triangles only have to join the same cells,
+// which still catches a wrong cell merge. Both runs use several chunks per thread. Every vertex has to be referenced,
+// meshopt_simplifySloppy takes its bounds from the vertex buffer and the soup from the triangles. Returns false and
+// prints the first mismatch otherwise.
+bool verify_out_of_core_simplify(char* soup_path, const u32* indices, u32 index_count, const f32* vertex_positions, u32 vertex_count, size_t vertex_positions_stride,
+                                 const u32* grid_sizes, u32 grid_size_count)
+{
+	if (!write_triangle_soup(soup_path, vertex_positions, vertex_positions_stride, indices, index_count)) return false;
+
+	size_t stride_in_floats = vertex_positions_stride / sizeof(f32);
+	u32 thread_counts[] = { 1, MAX(get_job_thread_count(), 4u) };//At least 4 so the merge runs on single core machines too
+	u32 chunk_triangle_count = MAX(index_count / 3 / (thread_counts[1] * 4), 1u);
+
+	f32 bounds_min[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+	f32 extent = 0.0f;
+	for (u32 j = 0; j < 3; ++j)
+	{
+		f32 bounds_max = -FLT_MAX;
+		for (u32 i = 0; i < vertex_count; ++i)
+		{
+			bounds_min[j] = MIN(bounds_min[j], vertex_positions[i * stride_in_floats + j]);
+			bounds_max = MAX(bounds_max, vertex_positions[i * stride_in_floats + j]);
+		}
+		extent = MAX(extent, bounds_max - bounds_min[j]);
+	}
+	f32 scale = extent == 0.0f ? 0.0f : 1.0f / extent;
+
+	u32* destination = new u32[index_count];
+	f32* sloppy_triangles = new f32[index_count * 3];
+	f32* simplified_triangles = new f32[index_count * 3];
+	u32* sloppy_cells = new u32[index_count];
+	u32* simplified_cells = new u32[index_count];
+	bool passed = true;
+
+	for (u32 g = 0; passed && g < grid_size_count; ++g)
+	{
+		u32 grid_size = grid_sizes[g];
+		f32 cell_scale = f32(grid_size - 1);
+
+		// Same cell as simplify_out_of_core and computeVertexIds put the position in
+		auto cell_id = [&](const f32* p) -> u32
+		{
+			u32 id = 0;
+			for (u32 j = 0; j < 3; ++j)
+				id = (id << 10) | u32(int((p[j] - bounds_min[j]) * scale * cell_scale + 0.5f));
+			return id;
+		};
+
+		// A zero target stops meshopt's grid search at the grid the error allows, the half keeps the int() from rounding down
+		f64 start = time_in_seconds();
+		f32 sloppy_error = 0.0f;
+		u32 sloppy_count = (u32)meshopt_simplifySloppy(destination, indices, index_count, vertex_positions, vertex_count, vertex_positions_stride, 0, 1.0f / (grid_size + 0.5f), &sloppy_error);
+		f64 sloppy_seconds = time_in_seconds() - start;
+
+		u32 triangle_count = sloppy_count / 3;
+		for (u32 t = 0; t < triangle_count; ++t)
+		{
+			for (u32 k = 0; k < 3; ++k)
+				memcpy(&sloppy_triangles[t * 9 + k * 3], vertex_positions + destination[t * 3 + k] * stride_in_floats, sizeof(f32) * 3);
+			rotate_triangle_positions(&sloppy_triangles[t * 9]);
+		}
+
+		for (u32 run = 0; passed && run < 2; ++run)
+		{
+			start = time_in_seconds();
+			SimplifiedMesh simplified = {};
+			if (!simplify_out_of_core(&simplified, soup_path, grid_size, chunk_triangle_count, thread_counts[run]))
+			{
+				passed = false;
+				break;
+			}
+			f64 out_of_core_seconds = time_in_seconds() - start;
+
+			printf("Out of core simplify, grid %u, %u threads: %u -> %u triangles, error %f in %.1fms; meshopt_simplifySloppy %u triangles, error %f in %.1fms\n",
+			       grid_size, thread_counts[run], index_count / 3, simplified.index_count / 3, simplified.error, out_of_core_seconds * 1000.0, triangle_count, sloppy_error, sloppy_seconds * 1000.0);
+
+			if (simplified.index_count != sloppy_count)
+			{
+				printf("Out of core simplify, grid %u: kept %u triangles, meshopt_simplifySloppy kept %u\n", grid_size, simplified.index_count / 3, triangle_count);
+				passed = false;
+			}
+			else if (fabsf(simplified.error - sloppy_error) > 1e-5f)
+			{
+				printf("Out of core simplify, grid %u: error %f, meshopt_simplifySloppy error %f\n", grid_size, simplified.error, sloppy_error);
+				passed = false;
+			}
+			else
+			{
+				for (u32 t = 0; t < triangle_count; ++t)
+				{
+					for (u32 k = 0; k < 3; ++k)
+						memcpy(&simplified_triangles[t * 9 + k * 3], &simplified.positions[simplified.indices[t * 3 + k] * 3], sizeof(f32) * 3);
+					rotate_triangle_positions(&simplified_triangles[t * 9]);
+				}
+
+				if (run == 0)
+				{
+					qsort(sloppy_triangles, triangle_count, sizeof(f32) * 9, compare_triangle_positions);
+					qsort(simplified_triangles, triangle_count, sizeof(f32) * 9, compare_triangle_positions);
+
+					for (u32 t = 0; passed && t < triangle_count; ++t)
+					{
+						if (compare_triangle_positions(&sloppy_triangles[t * 9], &simplified_triangles[t * 9]) != 0)
+						{
+							const f32* a = &simplified_triangles[t * 9];
+							const f32* b = &sloppy_triangles[t * 9];
+							printf("Out of core simplify, grid %u: triangle (%f %f %f) (%f %f %f) (%f %f %f), meshopt_simplifySloppy has (%f %f %f) (%f %f %f) (%f %f %f)\n", grid_size,
+							       a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7], b[8]);
+							passed = false;
+						}
+					}
+				}
+				else
+				{
+					// Rotated so the lowest cell comes first, like the representative positions above
+					for (u32 t = 0; t < triangle_count; ++t)
+					{
+						u32 sloppy_triangle[3];
+						u32 simplified_triangle[3];
+						for (u32 k = 0; k < 3; ++k)
+						{
+							sloppy_triangle[k] = cell_id(&sloppy_triangles[t * 9 + k * 3]);
+							simplified_triangle[k] = cell_id(&simplified_triangles[t * 9 + k * 3]);
+						}
+
+						u32 sloppy_first = sloppy_triangle[1] < sloppy_triangle[0] && sloppy_triangle[1] < sloppy_triangle[2] ? 1 : sloppy_triangle[2] < sloppy_triangle[0] && sloppy_triangle[2] < sloppy_triangle[1] ? 2 : 0;
+						u32 simplified_first = simplified_triangle[1] < simplified_triangle[0] && simplified_triangle[1] < simplified_triangle[2] ? 1 : simplified_triangle[2] < simplified_triangle[0] && simplified_triangle[2] < simplified_triangle[1] ? 2 : 0;
+						for (u32 k = 0; k < 3; ++k)
+						{
+							sloppy_cells[t * 3 + k] = sloppy_triangle[(sloppy_first + k) % 3];
+							simplified_cells[t * 3 + k] = simplified_triangle[(simplified_first + k) % 3];
+						}
+					}
+					qsort(sloppy_cells, triangle_count, sizeof(u32) * 3, compare_triangle_cells);
+					qsort(simplified_cells, triangle_count, sizeof(u32) * 3, compare_triangle_cells);
+
+					for (u32 t = 0; passed && t < triangle_count; ++t)
+					{
+						if (compare_triangle_cells(&sloppy_cells[t * 3], &simplified_cells[t * 3]) != 0)
+						{
+							printf("Out of core simplify, grid %u, %u threads: triangle between cells %x %x %x, meshopt_simplifySloppy has %x %x %x\n", grid_size, thread_counts[run],
+							       simplified_cells[t * 3 + 0], simplified_cells[t * 3 + 1], simplified_cells[t * 3 + 2], sloppy_cells[t * 3 + 0], sloppy_cells[t * 3 + 1], sloppy_cells[t * 3 + 2]);
+							passed = false;
+						}
+					}
+				}
+			}
+
+			free_simplified_mesh(&simplified);
+		}
+	}
+
+	delete[] destination;
+	delete[] sloppy_triangles;
+	delete[] simplified_triangles;
+	delete[] sloppy_cells;
+	delete[] simplified_cells;
+	remove(soup_path);
+	return passed;
+}
+
+
+// ---------------------------------------------------------------------------------------------------------------------
+// Parallel meshopt_simplify
+//
+// meshopt_simplify's collapse loop is serial, so big meshes are cut into spatial partitions (mesh_partition.h) that
+// are simplified on separate threads with meshopt_SimplifyLockBorder. Cutting the mesh turns the partition boundaries
+// into borders, so locking them keeps neighbouring partitions watertight against each other.
+// The seams are then collapsed by one more meshopt_simplify over just the triangles that touch a partition border,
+// with the edge of that strip locked so it still fits the partition interiors. Every partition goes to its own share
+// of the target, so the seam pass only has the strip's own reduction left to do. Interiors never see a second pass
+// that could even out the partitions, which is the price of keeping the serial part down to the seams.
+// ---------------------------------------------------------------------------------------------------------------------
+
+struct ParallelSimplifyStats
+{
+	u32 partition_count;
+	u32 partitioned_index_count;//After the partition pass, before the seam pass
+	u32 seam_index_count;//Triangles touching a partition border, the seam pass input
+	f32 partition_error;//Worst partition, relative to the whole mesh's extents
+	f32 seam_error;
+	f64 partition_seconds;//Wall time up to the seam pass, including the partitioning and gathering
+	f64 partition_work_seconds;//meshopt_simplify time summed over the partitions
+	f64 slowest_partition_seconds;//The longest single partition, what the partition pass takes with a thread per partition
+	f64 seam_seconds;
+};
+
+// Partitions smaller than this spend more time on setup and locked borders than they save.
+constexpr u32 MIN_SIMPLIFY_PARTITION_TRIANGLES = 2048;
+
+// Same contract as meshopt_simplify: destination needs room for index_count indices, target_error and result_error are
+// relative to the mesh extents. result_error is the partition error plus the seam pass error, which is an upper bound
+// since the seam pass measures its error against the already simplified mesh.
+// partition_count = 0 picks one partition per thread.
+u32 simplify_parallel(u32* destination, const u32* indices, u32 index_count, const f32* vertex_positions, u32 vertex_count, size_t vertex_positions_stride, u32 target_index_count, f32 target_error, f32* result_error = 0, u32 partition_count = 0, u32 thread_count = 0, ParallelSimplifyStats* stats = 0)
+{
+	assert(index_count % 3 == 0);
+	assert(target_index_count <= index_count);
+
+	if (thread_count == 0) thread_count = get_job_thread_count();
+	if (partition_count == 0) partition_count = thread_count;
+	partition_count = MAX(1u, MIN(partition_count, index_count / 3 / MIN_SIMPLIFY_PARTITION_TRIANGLES));
+
+	ParallelSimplifyStats local_stats = {};
+	if (!stats) stats = &local_stats;
+	*stats = {};
+	stats->partition_count = partition_count;
+
+	f64 start = time_in_seconds();
+
+	if (partition_count == 1)
+	{
+		u32 result_count = (u32)meshopt_simplify(destination, indices, index_count, vertex_positions, vertex_count, vertex_positions_stride, target_index_count, target_error, 0, &stats->partition_error);
+		stats->partition_seconds = time_in_seconds() - start;
+		stats->partitioned_index_count = result_count;
+		if (result_error) *result_error = stats->partition_error;
+		return result_count;
+	}
+
+	f32 mesh_scale = meshopt_simplifyScale(vertex_positions, vertex_count, vertex_positions_stride);
+
+	u32* sorted = new u32[index_count];
+	u32* offsets = new u32[partition_count + 1];
+	spatial_partition_triangles(sorted, offsets, partition_count, indices, index_count, vertex_positions, vertex_count, vertex_positions_stride);
+
+	//Partition of every vertex, or SEAM_VERTEX for the ones more than one partition uses. Those are the locked borders.
+	const u32 SEAM_VERTEX = ~1u;
+	u32* vertex_partitions = new u32[vertex_count];
+	memset(vertex_partitions, 0xff, sizeof(u32) * vertex_count);
+	for (u32 p = 0; p < partition_count; ++p)
+	{
+		for (u32 i = offsets[p]; i < offsets[p + 1]; ++i)
+		{
+			u32* owner = &vertex_partitions[sorted[i]];
+			if (*owner == ~0u) *owner = p;
+			else if (*owner != p) *owner = SEAM_VERTEX;
+		}
+	}
+
+	u32* result_counts = new u32[partition_count];
+	f32* result_errors = new f32[partition_count];
+	f64* partition_times = new f64[partition_count];
+
+	u32 worker_count = MIN(thread_count, partition_count);
+	u32** vertex_scratch = new u32*[worker_count];
+	for (u32 i = 0; i < worker_count; ++i)
+	{
+		vertex_scratch[i] = new u32[vertex_count];
+		memset(vertex_scratch[i], 0xff, sizeof(u32) * vertex_count);
+	}
+
+	parallel_for(partition_count, worker_count, [&](u32 p, u32 thread_index)
+	{
+		u32 first = offsets[p];
+		u32 count = offsets[p + 1] - first;
+
+		MeshPartition partition = {};
+		extract_mesh_partition(&partition, vertex_scratch[thread_index], sorted + first, count, vertex_positions, vertex_positions_stride);
+
+		// the error limit is rescaled from the whole mesh's extents to the partition's
+		u32 partition_target = (u32)((u64)target_index_count * count / index_count) / 3 * 3;
+		f32 partition_scale = meshopt_simplifyScale(partition.positions, partition.vertex_count, sizeof(f32) * 3);
+		f32 error_to_partition = partition_scale == 0.0f ? 0.0f : mesh_scale / partition_scale;
+
+		f64 partition_start = time_in_seconds();
+		f32 partition_error = 0.0f;
+		u32 result_count = (u32)meshopt_simplify(partition.indices, partition.indices, count, partition.positions, partition.vertex_count, sizeof(f32) * 3,
+		                                         partition_target, target_error * error_to_partition, meshopt_SimplifyLockBorder, &partition_error);
+		partition_times[p] = time_in_seconds() - partition_start;
+
+		// results go back into this partition's own range of sorted, so there's no sharing between threads
+		for (u32 i = 0; i < result_count; ++i)
+			sorted[first + i] = partition.vertices[partition.indices[i]];
+
+		result_counts[p] = result_count;
+		result_errors[p] = mesh_scale == 0.0f ? 0.0f : partition_error * partition_scale / mesh_scale;
+
+		free_mesh_partition(&partition);
+	});
+
+	//Interior triangles go straight to destination, the ones touching a seam are gathered for the seam pass.
+	u32 result_count = 0;
+	u32* seam_indices = new u32[index_count];
+	u32 seam_index_count = 0;
+	for (u32 p = 0; p < partition_count; ++p)
+	{
+		stats->partitioned_index_count += result_counts[p];
+		stats->partition_error = MAX(stats->partition_error, result_errors[p]);
+		stats->partition_work_seconds += partition_times[p];
+		stats->slowest_partition_seconds = MAX(stats->slowest_partition_seconds, partition_times[p]);
+
+		for (u32 i = offsets[p]; i < offsets[p] + result_counts[p]; i += 3)
+		{
+			const u32* triangle = &sorted[i];
+			bool on_seam = vertex_partitions[triangle[0]] == SEAM_VERTEX || vertex_partitions[triangle[1]] == SEAM_VERTEX || vertex_partitions[triangle[2]] == SEAM_VERTEX;
+
+			u32* out = on_seam ? &seam_indices[seam_index_count] : &destination[result_count];
+			memcpy(out, triangle, sizeof(u32) * 3);
+			if (on_seam) seam_index_count += 3;
+			else result_count += 3;
+		}
+	}
+
+	f64 seam_start = time_in_seconds();
+	stats->partition_seconds = seam_start - start;
+	stats->seam_index_count = seam_index_count;
+
+	if (seam_index_count)
+	{
+		//The strip takes whatever reduction the partitions left, its own edge stays locked against the interiors.
+		u32 overshoot = stats->partitioned_index_count > target_index_count ? stats->partitioned_index_count - target_index_count : 0;
+		u32 seam_target = seam_index_count > overshoot ? (seam_index_count - overshoot) / 3 * 3 : 0;
+
+		MeshPartition seam = {};
+		extract_mesh_partition(&seam, vertex_scratch[0], seam_indices, seam_index_count, vertex_positions, vertex_positions_stride);
+
+		f32 seam_scale = meshopt_simplifyScale(seam.positions, seam.vertex_count, sizeof(f32) * 3);
+		f32 error_to_seam = seam_scale == 0.0f ? 0.0f : mesh_scale / seam_scale;
+
+		f32 seam_error = 0.0f;
+		u32 seam_result_count = (u32)meshopt_simplify(seam.indices, seam.indices, seam_index_count, seam.positions, seam.vertex_count, sizeof(f32) * 3,
+		                                              seam_target, target_error * error_to_seam, meshopt_SimplifyLockBorder, &seam_error);
+		stats->seam_error = mesh_scale == 0.0f ? 0.0f : seam_error * seam_scale / mesh_scale;
+
+		for (u32 i = 0; i < seam_result_count; ++i)
+			destination[result_count + i] = seam.vertices[seam.indices[i]];
+		result_count += seam_result_count;
+
+		free_mesh_partition(&seam);
+	}
+
+	stats->seam_seconds = time_in_seconds() - seam_start;
+
+	for (u32 i = 0; i < worker_count; ++i) delete[] vertex_scratch[i];
+	delete[] vertex_scratch;
+	delete[] seam_indices;
+	delete[] vertex_partitions;
+	delete[] result_counts;
+	delete[] result_errors;
+	delete[] partition_times;
+	delete[] offsets;
+	delete[] sorted;
+
+	if (result_error) *result_error = stats->partition_error + stats->seam_error;
+	return result_count;
+}
+
+
+// Simplifies the mesh to target_index_count with meshopt_simplify and with simplify_parallel on 2 to 16 threads, one
+// partition per thread, and prints how they compare. Besides the wall time every row prints the critical path, timed
+// with the same partitions on one thread: the serial parts plus the slowest partition, which is what the wall time
+// comes down to with a core per thread, so the speedup the partitioning allows shows up on machines with fewer cores.
+void benchmark_parallel_simplify(char* name, const u32* indices, u32 index_count, const f32* vertex_positions, u32 vertex_count, size_t vertex_positions_stride, u32 target_index_count, f32 target_error)
+{
+	u32* destination = new u32[index_count];
+
+	f64 start = time_in_seconds();
+	f32 serial_error = 0.0f;
+	u32 serial_count = (u32)meshopt_simplify(destination, indices, index_count, vertex_positions, vertex_count, vertex_positions_stride, target_index_count, target_error, 0, &serial_error);
+	f64 serial_seconds = time_in_seconds() - start;
+
+	printf("Simplify %s to %u triangles, %u hardware threads:\n", name, target_index_count / 3, get_job_thread_count());
+	printf("  serial:     %u triangles, error %f, %.1fms\n", serial_count / 3, serial_error, serial_seconds * 1000.0);
+
+	for (u32 thread_count = 2; thread_count <= 16; thread_count *= 2)
+	{
+		start = time_in_seconds();
+		f32 parallel_error = 0.0f;
+		ParallelSimplifyStats stats = {};
+		u32 parallel_count = simplify_parallel(destination, indices, index_count, vertex_positions, vertex_count, vertex_positions_stride, target_index_count, target_error, &parallel_error, 0, thread_count, &stats);
+		f64 parallel_seconds = time_in_seconds() - start;
+
+		// Same partitions on one thread, so no partition's time includes waiting for a core
+		start = time_in_seconds();
+		ParallelSimplifyStats serial_stats = {};
+		simplify_parallel(destination, indices, index_count, vertex_positions, vertex_count, vertex_positions_stride, target_index_count, target_error, 0, stats.partition_count, 1, &serial_stats);
+		f64 critical_seconds = time_in_seconds() - start - serial_stats.partition_work_seconds + serial_stats.slowest_partition_seconds;
+
+		printf("  %2u threads: %u triangles, error %f (%.2fx), %.1fms (%.2fx), critical path %.1fms (%.2fx); %u partitions -> %u triangles, seams: %u triangles in %.1fms\n",
+		       thread_count, parallel_count / 3, parallel_error, serial_error == 0.0f ? 1.0f : parallel_error / serial_error,
+		       parallel_seconds * 1000.0, serial_seconds / parallel_seconds, critical_seconds * 1000.0, serial_seconds / critical_seconds,
+		       stats.partition_count, stats.partitioned_index_count / 3, stats.seam_index_count / 3, stats.seam_seconds * 1000.0);
+	}
+
+	delete[] destination;
+}
@@ -0,0 +1,446 @@
+#pragma once
+
+// Splits big meshes into spatially compact chunks that can be culled on their own. The Apollo statue is one draw with
+// one bounding sphere, so with the camera close to it every triangle is submitted even when most of the statue is off
+// screen or facing away.
+//
+// The triangles are split kd style: the centroids of a range are cut at the median along the longest axis of their
+// bounds until every range is at most target_triangles. The index buffer is then rewritten chunk by chunk, each chunk
+// keeping its triangles in the order they had, so the vertex cache order the mesh build produced survives inside every
+// chunk. The chunks are ranges of the mesh's own index buffer over its shared vertex buffer.
+//
+// Each chunk gets an AABB, a bounding sphere and a normal cone computed the way meshopt_computeClusterBounds does (it
+// only takes up to 512 triangles): the chunk is back facing, and can be dropped, when
+//   dot(normalize(cone_apex - camera), cone_axis) >= cone_cutoff
+// Chunks whose normals spread over more than a hemisphere get a cutoff of 1 and are never cone culled.
+//
+// Needs include/clusterizer.cpp, culling.h and occlusion.h in the same translation unit.
+
+constexpr u32 MESH_SPLIT_MIN_TRIANGLES = 16384;//Meshes up to this size stay one cull item
+constexpr u32 MESH_CHUNK_TARGET_TRIANGLES = 2048;
+
+struct MeshChunk
+{
+	u32 first_index;
+	u32 index_count;
+
+	//Mesh space
+	vec3 bounds_min;
+	vec3 bounds_max;
+	vec3 centre;
+	f32 radius;
+
+	vec3 cone_apex;
+	vec3 cone_axis;
+	f32 cone_cutoff;//1 when the cone is too wide to ever cull
+};
+
+// Median splits halve a range, so the chunk count is a power of two.
+u32 max_mesh_chunks(u32 triangle_count, u32 target_triangles)
+{
+	u32 chunk_count = 1;
+	while ((triangle_count + chunk_count - 1) / chunk_count > target_triangles) chunk_count *= 2;
+	return chunk_count;
+}
+
+void compute_mesh_chunk_bounds(MeshChunk* chunk, const u32* indices, const f32* vertex_positions, size_t vertex_positions_stride)
+{
+	size_t stride_in_floats = vertex_positions_stride / sizeof(f32);
+	u32 triangle_count = chunk->index_count / 3;
+
+	f32 (*corners)[3] = new f32[chunk->index_count][3];
+	f32 (*normals)[3] = new f32[MAX(triangle_count, 1u)][3];
+	u32 normal_count = 0;
+
+	chunk->bounds_min = Vec3(FLT_MAX);
+	chunk->bounds_max = Vec3(-FLT_MAX);
+
+	for (u32 t = 0; t < triangle_count; ++t)
+	{
+		vec3 p[3];
+		for (u32 k = 0; k < 3; ++k)
+		{
+			const f32* v = vertex_positions + indices[chunk->first_index + t * 3 + k] * stride_in_floats;
+			p[k] = Vec3(v[0], v[1], v[2]);
+			memcpy(corners[t * 3 + k], v, sizeof(f32) * 3);
+
+			chunk->bounds_min = Vec3(MIN(chunk->bounds_min.x, p[k].x), MIN(chunk->bounds_min.y, p[k].y), MIN(chunk->bounds_min.z, p[k].z));
+			chunk->bounds_max = Vec3(MAX(chunk->bounds_max.x, p[k].x), MAX(chunk->bounds_max.y, p[k].y), MAX(chunk->bounds_max.z, p[k].z));
+		}
+
+		//Zero area triangles have no facing and can not be hit, meshopt skips them too.
+		vec3 n = cross(p[1] - p[0], p[2] - p[0]);
+		f32 area = length(n);
+		if (area == 0.0f) continue;
+
+		n = n * (1.0f / area);
+		normals[normal_count][0] = n.x;
+		normals[normal_count][1] = n.y;
+		normals[normal_count][2] = n.z;
+		normal_count++;
+	}
+
+	f32 sphere[4] = {};
+	meshopt::computeBoundingSphere(sphere, corners, chunk->index_count);
+	chunk->centre = Vec3(sphere[0], sphere[1], sphere[2]);
+	chunk->radius = sphere[3];
+
+	chunk->cone_apex = chunk->centre;
+	chunk->cone_axis = Vec3(0.0f, 0.0f, 1.0f);
+	chunk->cone_cutoff = 1.0f;
+
+	if (normal_count)
+	{
+		//The centre of the normals' bounding sphere is the axis of the tightest cone around them.
+		f32 normal_sphere[4] = {};
+		meshopt::computeBoundingSphere(normal_sphere, normals, normal_count);
+		vec3 axis = Vec3(normal_sphere[0], normal_sphere[1], normal_sphere[2]);
+		f32 axis_length = length(axis);
+
+		f32 min_dot = 1.0f;
+		if (axis_length > 0.0f)
+		{
+			axis = axis * (1.0f / axis_length);
+			for (u32 i = 0; i < normal_count; ++i) min_dot = MIN(min_dot, normals[i][0] * axis.x + normals[i][1] * axis.y + normals[i][2] * axis.z);
+		}
+		else
+		{
+			min_dot = -1.0f;
+		}
+
+		//Same cut off as meshopt: a cone of ~168 degrees or more is not worth testing.
+		if (min_dot > 0.1f)
+		{
+			//The apex goes back along the axis until it is behind every triangle's plane.
+			f32 max_t = 0.0f;
+			for (u32 t = 0, n = 0; t < triangle_count; ++t)
+			{
+				const f32* c = corners[t * 3];
+				vec3 p0 = Vec3(c[0], c[1], c[2]);
+				vec3 e1 = Vec3(corners[t * 3 + 1][0], corners[t * 3 + 1][1], corners[t * 3 + 1][2]) - p0;
+				vec3 e2 = Vec3(corners[t * 3 + 2][0], corners[t * 3 + 2][1], corners[t * 3 + 2][2]) - p0;
+				if (length(cross(e1, e2)) == 0.0f) continue;
+
+				vec3 normal = Vec3(normals[n][0], normals[n][1], normals[n][2]);
+				n++;
+
+				f32 dc = dot(chunk->centre - p0, normal);
+				f32 dn = dot(axis, normal);
+				max_t = MAX(max_t, dc / dn);
+			}
+
+			chunk->cone_apex = chunk->centre - axis * max_t;
+			chunk->cone_axis = axis;
+			chunk->cone_cutoff = sqrtf(1.0f - min_dot * min_dot);
+		}
+	}
+
+	delete[] corners;
+	delete[] normals;
+}
+
+struct SplitTriangle
+{
+	f32 key;//Centroid along the axis being split
+	u32 triangle;
+};
+
+int compare_split_triangle_keys(const void* a, const void* b)
+{
+	const SplitTriangle* lhs = (const SplitTriangle*)a;
+	const SplitTriangle* rhs = (const SplitTriangle*)b;
+	if (lhs->key != rhs->key) return lhs->key < rhs->key ? -1 : 1;
+	return lhs->triangle < rhs->triangle ? -1 : lhs->triangle > rhs->triangle ? 1 : 0;
+}
+
+int compare_split_triangle_ids(const void* a, const void* b)
+{
+	u32 lhs = ((const SplitTriangle*)a)->triangle;
+	u32 rhs = ((const SplitTriangle*)b)->triangle;
+	return lhs < rhs ? -1 : lhs > rhs ? 1 : 0;
+}
+
+// Rewrites indices (one LOD's triangles) so every chunk is a contiguous range and fills chunks, which needs
+// max_mesh_chunks entries. first_index of every chunk is relative to indices. Returns the chunk count.
+u32 split_mesh_chunks(MeshChunk* chunks, u32* indices, u32 index_count, const f32* vertex_positions, u32 vertex_count, size_t vertex_positions_stride, u32 target_triangles)
+{
+	assert(index_count % 3 == 0 && target_triangles > 0);
+
+	size_t stride_in_floats = vertex_positions_stride / sizeof(f32);
+	u32 triangle_count = index_count / 3;
+	if (triangle_count == 0) return 0;
+
+	vec3* centroids = new vec3[triangle_count];
+	SplitTriangle* triangles = new SplitTriangle[triangle_count];
+	for (u32 t = 0; t < triangle_count; ++t)
+	{
+		vec3 sum = Vec3(0.0f);
+		for (u32 k = 0; k < 3; ++k)
+		{
+			assert(indices[t * 3 + k] < vertex_count);
+			const f32* v = vertex_positions + indices[t * 3 + k] * stride_in_floats;
+			sum = sum + Vec3(v[0], v[1], v[2]);
+		}
+		centroids[t] = sum * (1.0f / 3.0f);
+		triangles[t] = {0.0f, t};
+	}
+
+	//Ranges of triangles still to split, depth first so chunks come out neighbour after neighbour.
+	u32 stack[64][2];
+	u32 stack_size = 0;
+	stack[stack_size][0] = 0;
+	stack[stack_size][1] = triangle_count;
+	stack_size++;
+
+	u32 chunk_count = 0;
+	u32* sorted = new u32[index_count];
+	u32 written = 0;
+
+	while (stack_size)
+	{
+		stack_size--;
+		u32 begin = stack[stack_size][0];
+		u32 end = stack[stack_size][1];
+
+		if (end - begin <= target_triangles)
+		{
+			//Original order within the chunk.
+			qsort(triangles + begin, end - begin, sizeof(SplitTriangle), compare_split_triangle_ids);
+
+			MeshChunk* chunk = &chunks[chunk_count++];
+			*chunk = {};
+			chunk->first_index = written;
+			for (u32 i = begin; i < end; ++i)
+			{
+				memcpy(&sorted[written], &indices[triangles[i].triangle * 3], sizeof(u32) * 3);
+				written += 3;
+			}
+			chunk->index_count = written - chunk->first_index;
+			continue;
+		}
+
+		vec3 centroid_min = Vec3(FLT_MAX), centroid_max = Vec3(-FLT_MAX);
+		for (u32 i = begin; i < end; ++i)
+		{
+			vec3 c = centroids[triangles[i].triangle];
+			centroid_min = Vec3(MIN(centroid_min.x, c.x), MIN(centroid_min.y, c.y), MIN(centroid_min.z, c.z));
+			centroid_max = Vec3(MAX(centroid_max.x, c.x), MAX(centroid_max.y, c.y), MAX(centroid_max.z, c.z));
+		}
+
+		vec3 extent = centroid_max - centroid_min;
+		u32 axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z ? 1 : 2);
+
+		u32 middle = begin + (end - begin) / 2;
+		for (u32 i = begin; i < end; ++i) triangles[i].key = centroids[triangles[i].triangle].data[axis];
+		qsort(triangles + begin, end - begin, sizeof(SplitTriangle), compare_split_triangle_keys);
+
+		//Right half first so the left one is split next.
+		assert(stack_size + 2 <= 64);
+		stack[stack_size][0] = middle;
+		stack[stack_size][1] = end;
+		stack_size++;
+		stack[stack_size][0] = begin;
+		stack[stack_size][1] = middle;
+		stack_size++;
+	}
+
+	memcpy(indices, sorted, sizeof(u32) * index_count);
+
+	for (u32 c = 0; c < chunk_count; ++c) compute_mesh_chunk_bounds(&chunks[c], indices, vertex_positions, vertex_positions_stride);
+
+	delete[] centroids;
+	delete[] triangles;
+	delete[] sorted;
+
+	return chunk_count;
+}
+
+inline bool mesh_chunk_back_facing(const MeshChunk* chunk, vec3 apex, vec3 axis, vec3 camera)
+{
+	if (chunk->cone_cutoff >= 1.0f) return false;
+	return dot(normalize(apex - camera), axis) >= chunk->cone_cutoff;
+}
+
+struct MeshChunkCullStats
+{
+	u32 frustum_culled;
+	u32 cone_culled;
+	u32 visible;
+	u32 triangles_visible;
+};
+
+// Chunks of one instance against the frustum and the camera position, with the instance rotation vertex_shader.hlsl
+// applies at time. Radii are in mesh units, the frustum's bounds_scale is applied here. visible gets 1 per chunk that
+// has to be drawn. Returns the visible count.
+u32 cull_mesh_chunks(const MeshChunk* chunks, u32 chunk_count, const DrawInfo* draw_info, f32 time, const CullFrustum* frustum, vec3 camera, u8* visible, MeshChunkCullStats* stats)
+{
+	MeshChunkCullStats local_stats = {};
+	vec4 quat = instance_rotation(draw_info->quat, time);
+
+	for (u32 c = 0; c < chunk_count; ++c)
+	{
+		const MeshChunk* chunk = &chunks[c];
+		visible[c] = 0;
+
+		vec3 centre = rotate_vec_by_quat(chunk->centre, quat) + draw_info->position;
+		if (!sphere_in_frustum(frustum, centre, chunk->radius * frustum->bounds_scale))
+		{
+			local_stats.frustum_culled++;
+			continue;
+		}
+
+		vec3 apex = rotate_vec_by_quat(chunk->cone_apex, quat) + draw_info->position;
+		if (mesh_chunk_back_facing(chunk, apex, rotate_vec_by_quat(chunk->cone_axis, quat), camera))
+		{
+			local_stats.cone_culled++;
+			continue;
+		}
+
+		visible[c] = 1;
+		local_stats.visible++;
+		local_stats.triangles_visible += chunk->index_count / 3;
+	}
+
+	if (stats) *stats = local_stats;
+	return local_stats.visible;
+}
+
+
+int compare_split_triangle_corners(const void* a, const void* b)
+{
+	return memcmp(a, b, sizeof(u32) * 3);
+}
+
+// Splits the mesh, checks the chunks hold every triangle once and contain their triangles, then prints the chunk
+// sizes, how tight the chunk bounds are against the whole mesh's, and the triangles submitted along a few camera
+// paths around one instance with the whole mesh as one cull item and with the chunks.
+void benchmark_mesh_split(char* name, const u32* indices, u32 index_count, const f32* vertex_positions, u32 vertex_count, size_t vertex_positions_stride, u32 target_triangles)
+{
+	u32 triangle_count = index_count / 3;
+	u32 max_chunks = max_mesh_chunks(triangle_count, target_triangles);
+	MeshChunk* chunks = new MeshChunk[max_chunks];
+	u32* split_indices = new u32[index_count];
+	memcpy(split_indices, indices, sizeof(u32) * index_count);
+
+	f64 start = time_in_seconds();
+	u32 chunk_count = split_mesh_chunks(chunks, split_indices, index_count, vertex_positions, vertex_count, vertex_positions_stride, target_triangles);
+	f64 split_seconds = time_in_seconds() - start;
+
+	//Same triangles, each once, and every chunk inside its bounds.
+	u32* before = new u32[MAX(index_count, 1u)];
+	u32* after = new u32[MAX(index_count, 1u)];
+	memcpy(before, indices, sizeof(u32) * index_count);
+	memcpy(after, split_indices, sizeof(u32) * index_count);
+	qsort(before, triangle_count, sizeof(u32) * 3, compare_split_triangle_corners);
+	qsort(after, triangle_count, sizeof(u32) * 3, compare_split_triangle_corners);
+	bool passed = memcmp(before, after, sizeof(u32) * index_count) == 0;
+	delete[] before;
+	delete[] after;
+
+	size_t stride_in_floats = vertex_positions_stride / sizeof(f32);
+	u32 covered = 0;
+	for (u32 c = 0; c < chunk_count; ++c)
+	{
+		const MeshChunk* chunk = &chunks[c];
+		passed = passed && chunk->first_index == covered;
+		covered += chunk->index_count;
+
+		for (u32 i = chunk->first_index; i < chunk->first_index + chunk->index_count; ++i)
+		{
+			const f32* v = vertex_positions + split_indices[i] * stride_in_floats;
+			vec3 p = Vec3(v[0], v[1], v[2]);
+			passed = passed && length(p - chunk->centre) <= chunk->radius * 1.0001f + 1e-6f;
+			passed = passed && p.x >= chunk->bounds_min.x && p.y >= chunk->bounds_min.y && p.z >= chunk->bounds_min.z &&
+			         p.x <= chunk->bounds_max.x && p.y <= chunk->bounds_max.y && p.z <= chunk->bounds_max.z;
+		}
+	}
+	passed = passed && covered == index_count;
+
+	//The whole mesh as one chunk for comparison.
+	MeshChunk whole = {};
+	whole.index_count = index_count;
+	compute_mesh_chunk_bounds(&whole, indices, vertex_positions, vertex_positions_stride);
+
+	u32 min_triangles = ~0u, max_triangles = 0, coned = 0;
+	f64 sphere_volume = 0.0, box_volume = 0.0, radius_sum = 0.0;
+	for (u32 c = 0; c < chunk_count; ++c)
+	{
+		const MeshChunk* chunk = &chunks[c];
+		vec3 bounds_max = chunk->bounds_max;
+		vec3 extent = bounds_max - chunk->bounds_min;
+		min_triangles = MIN(min_triangles, chunk->index_count / 3);
+		max_triangles = MAX(max_triangles, chunk->index_count / 3);
+		coned += chunk->cone_cutoff < 1.0f;
+		sphere_volume += 4.0 / 3.0 * 3.14159265 * chunk->radius * chunk->radius * chunk->radius;
+		box_volume += (f64)extent.x * extent.y * extent.z;
+		radius_sum += chunk->radius;
+	}
+
+	vec3 whole_extent = whole.bounds_max - whole.bounds_min;
+	f64 whole_sphere_volume = 4.0 / 3.0 * 3.14159265 * whole.radius * whole.radius * whole.radius;
+	f64 whole_box_volume = (f64)whole_extent.x * whole_extent.y * whole_extent.z;
+
+	printf("Mesh split %s, %u triangles -> %u chunks of %u-%u triangles in %.2fms, %s\n",
+	       name, triangle_count, chunk_count, min_triangles, max_triangles, split_seconds * 1000.0, passed ? "every triangle once and inside its chunk" : "SPLIT FAILED");
+	printf("  chunk spheres: mean radius %.2f of the mesh's, %.2fx the mesh sphere's volume in total; boxes %.2fx the mesh box's; %u of %u chunks can be cone culled\n",
+	       chunk_count ? radius_sum / chunk_count / whole.radius : 0.0, sphere_volume / whole_sphere_volume, box_volume / whole_box_volume, coned, chunk_count);
+
+	//Camera paths around an instance at the origin, in units of the mesh radius, 64 frames each.
+	ShaderGlobals globals = {};
+	globals.projection = perspective_infinite_reversed_z(70.0, 0.01f, 1280.0f, 720.0f);
+
+	DrawInfo draw_info = {};
+	draw_info.quat = {0.0f, 0.0f, 0.0f, 1.0f};
+	vec3 target = whole.centre;//Mesh space and world space agree up to the spin, which the paths do not care about
+	f32 r = whole.radius;
+
+	u8* visible = new u8[MAX(chunk_count, 1u)];
+	char* path_names[4] = {"close orbit", "walk past", "close up", "far orbit"};
+	const u32 frames = 64;
+
+	for (u32 path = 0; path < 4; ++path)
+	{
+		u64 whole_triangles = 0, frustum_triangles = 0, chunk_triangles = 0, chunk_draws = 0;
+
+		for (u32 frame = 0; frame < frames; ++frame)
+		{
+			f32 t = frame / (f32)frames;
+			f32 angle = t * 6.2831853f;
+			vec3 eye, look;
+			switch (path)
+			{
+				case 0: eye = target + Vec3(sinf(angle), 0.2f, cosf(angle)) * (1.5f * r); look = target; break;
+				case 1: eye = target + Vec3((t * 2.0f - 1.0f) * 3.0f * r, 0.0f, 1.2f * r); look = eye + Vec3(0.0f, 0.0f, -1.0f); break;
+				case 2: eye = target + Vec3(sinf(angle), 0.0f, cosf(angle)) * (1.1f * r); look = target + Vec3(sinf(angle), 0.5f * cosf(angle * 3.0f), cosf(angle)) * (0.5f * r); break;
+				default: eye = target + Vec3(sinf(angle), 0.3f, cosf(angle)) * (6.0f * r); look = target; break;
+			}
+
+			globals.view = look_at(eye, look, {0.0f, 1.0f, 0.0f});
+			CullFrustum frustum = make_cull_frustum(&globals);
+			globals.time = t * 10.0f;
+
+			vec4 quat = instance_rotation(draw_info.quat, globals.time);
+			vec3 whole_centre = rotate_vec_by_quat(whole.centre, quat) + draw_info.position;
+			if (sphere_in_frustum(&frustum, whole_centre, whole.radius * frustum.bounds_scale)) whole_triangles += triangle_count;
+
+			MeshChunkCullStats stats;
+			cull_mesh_chunks(chunks, chunk_count, &draw_info, globals.time, &frustum, eye, visible, &stats);
+			chunk_triangles += stats.triangles_visible;
+			chunk_draws += stats.visible;
+
+			for (u32 c = 0; c < chunk_count; ++c)
+			{
+				vec3 centre = rotate_vec_by_quat(chunks[c].centre, quat) + draw_info.position;
+				if (sphere_in_frustum(&frustum, centre, chunks[c].radius * frustum.bounds_scale)) frustum_triangles += chunks[c].index_count / 3;
+			}
+		}
+
+		printf("  %-11s triangles per frame: whole mesh %llu, chunks frustum culled %llu, + cone culled %llu (%.1f%% of the whole mesh), %.1f chunk draws\n",
+		       path_names[path], (unsigned long long)(whole_triangles / frames), (unsigned long long)(frustum_triangles / frames), (unsigned long long)(chunk_triangles / frames),
+		       whole_triangles ? 100.0 * chunk_triangles / whole_triangles : 0.0, (f64)chunk_draws / frames);
+	}
+
+	delete[] visible;
+	delete[] chunks;
+	delete[] split_indices;
+}
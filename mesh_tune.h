@@ -0,0 +1,232 @@
+#pragma once
+
+// Per mesh index order tuning against a set of vertex reuse models.
+// The NV profile is a batch model (Kerbl et al., Revisiting the Vertex Cache): triangles are cut into batches of at
+// most batch_vertices unique vertices and batch_triangles triangles, every unique vertex of a batch is shaded once and
+// there is no reuse across batches. The AMD and Intel profiles are only approximations: they are parameter sets for
+// meshopt_analyzeVertexCache's FIFO, which is flushed whenever a warp runs out of vertex slots or the primitive group is
+// full. The cost of a profile is shader lanes per triangle: a warp based design pays for every lane of every warp it
+// launches, partially filled or not, a FIFO design only for the vertices it transforms.
+//
+// Needs include/vcacheanalyzer.cpp, include/stripifier.cpp and mesh_overdraw.h in the same translation unit.
+
+
+enum VertexReuseModel
+{
+	REUSE_BATCH,
+	REUSE_FIFO,
+};
+
+struct VertexReuseProfile
+{
+	char* name;
+	VertexReuseModel model;
+	u32 cache_size;//Unique vertices per batch for REUSE_BATCH
+	u32 warp_size;//0 for designs that are not warp limited
+	u32 primgroup_size;//Triangles per batch or primitive group, 0 for no limit
+};
+
+static VertexReuseProfile vertex_reuse_profiles[] =
+{
+	{"NV batch", REUSE_BATCH, 32, 32, 32},
+	{"AMD FIFO", REUSE_FIFO, 14, 64, 128},
+	{"Intel FIFO", REUSE_FIFO, 128, 0, 0},
+};
+
+constexpr u32 VERTEX_REUSE_PROFILE_COUNT = sizeof(vertex_reuse_profiles) / sizeof(vertex_reuse_profiles[0]);
+
+// Shader lanes the batch model launches for the whole index buffer, each batch rounded up to whole warps.
+u32 simulate_batch_lanes(const u32* indices, u32 index_count, u32 vertex_count, u32 batch_vertices, u32 batch_triangles, u32 warp_size)
+{
+	u32* vertex_batches = new u32[vertex_count];//Last batch each vertex was shaded in
+	memset(vertex_batches, 0xff, sizeof(u32) * vertex_count);
+
+	u32 batch = 0;
+	u32 batch_vertex_count = 0;
+	u32 batch_triangle_count = 0;
+	u32 lanes = 0;
+
+	auto close_batch = [&]()
+	{
+		lanes += warp_size ? (batch_vertex_count + warp_size - 1) / warp_size * warp_size : batch_vertex_count;
+		batch++;
+		batch_vertex_count = 0;
+		batch_triangle_count = 0;
+	};
+
+	for (u32 i = 0; i < index_count; i += 3)
+	{
+		u32 a = indices[i + 0], b = indices[i + 1], c = indices[i + 2];
+
+		auto new_vertices = [&]() -> u32
+		{
+			return (vertex_batches[a] != batch) + (vertex_batches[b] != batch && b != a) + (vertex_batches[c] != batch && c != a && c != b);
+		};
+
+		if (batch_vertex_count + new_vertices() > batch_vertices || (batch_triangles && batch_triangle_count == batch_triangles))
+			close_batch();
+
+		batch_vertex_count += new_vertices();
+		batch_triangle_count++;
+		vertex_batches[a] = vertex_batches[b] = vertex_batches[c] = batch;
+	}
+	if (batch_triangle_count) close_batch();
+
+	delete[] vertex_batches;
+	return lanes;
+}
+
+f32 simulate_vertex_reuse(const VertexReuseProfile* profile, const u32* indices, u32 index_count, u32 vertex_count)
+{
+	u32 lanes = 0;
+	if (profile->model == REUSE_BATCH)
+	{
+		lanes = simulate_batch_lanes(indices, index_count, vertex_count, profile->cache_size, profile->primgroup_size, profile->warp_size);
+	}
+	else
+	{
+		meshopt_VertexCacheStatistics stats = meshopt_analyzeVertexCache(indices, index_count, vertex_count, profile->cache_size, profile->warp_size, profile->primgroup_size);
+		lanes = profile->warp_size ? stats.warps_executed * profile->warp_size : stats.vertices_transformed;
+	}
+
+	return index_count ? (f32)lanes / (f32)(index_count / 3) : 0.0f;
+}
+
+
+enum IndexOrder
+{
+	ORDER_FORSYTH,
+	ORDER_FIFO,
+	ORDER_STRIP,
+	ORDER_OVERDRAW_101,
+	ORDER_OVERDRAW_105,
+	ORDER_OVERDRAW_120,
+
+	ORDER_COUNT
+};
+
+static char* index_order_names[ORDER_COUNT] = {"forsyth", "fifo", "strip", "overdraw 1.01", "overdraw 1.05", "overdraw 1.20"};
+
+struct IndexOrderResult
+{
+	f32 lanes_per_triangle[VERTEX_REUSE_PROFILE_COUNT];
+	f32 overdraw;
+	f32 cost;
+};
+
+struct TuneReport
+{
+	IndexOrderResult orders[ORDER_COUNT];
+	u32 best;
+};
+
+// destination gets index_count indices in the given order. Strip orders are converted back to a list, the strip with
+// restarts only decides the triangle order.
+void generate_index_order(u32* destination, IndexOrder order, const u32* indices, u32 index_count, const f32* vertex_positions, u32 vertex_count, size_t vertex_positions_stride)
+{
+	switch (order)
+	{
+	case ORDER_FORSYTH:
+		meshopt_optimizeVertexCache(destination, indices, index_count, vertex_count);
+		break;
+	case ORDER_FIFO:
+		meshopt_optimizeVertexCacheFifo(destination, indices, index_count, vertex_count, 16);
+		break;
+	case ORDER_STRIP:
+	{
+		u32* list = new u32[index_count];
+		u32* strip = new u32[meshopt_stripifyBound(index_count)];
+
+		meshopt_optimizeVertexCache(list, indices, index_count, vertex_count);
+		u32 strip_size = (u32)meshopt_stripify(strip, list, index_count, vertex_count, ~0u);
+		u32 list_size = (u32)meshopt_unstripify(list, strip, strip_size, ~0u);
+
+		//Unstripify drops the degenerate triangles, which the original list can contain, so keep them at the end.
+		memcpy(destination, list, sizeof(u32) * list_size);
+		u32 output = list_size;
+		for (u32 i = 0; i < index_count && output < index_count; i += 3)
+		{
+			u32 a = indices[i + 0], b = indices[i + 1], c = indices[i + 2];
+			if (a == b || b == c || c == a)
+			{
+				destination[output++] = a;
+				destination[output++] = b;
+				destination[output++] = c;
+			}
+		}
+		assert(output == index_count);
+
+		delete[] list;
+		delete[] strip;
+	} break;
+	case ORDER_OVERDRAW_101:
+	case ORDER_OVERDRAW_105:
+	case ORDER_OVERDRAW_120:
+	{
+		f32 threshold = order == ORDER_OVERDRAW_101 ? 1.01f : order == ORDER_OVERDRAW_105 ? 1.05f : 1.2f;
+
+		meshopt_optimizeVertexCache(destination, indices, index_count, vertex_count);
+		optimize_overdraw_parallel(destination, destination, index_count, vertex_positions, vertex_count, vertex_positions_stride, threshold);
+	} break;
+	default:
+		assert(false);
+	}
+}
+
+// Tries every IndexOrder and writes the cheapest into destination.
+// cost = mean lanes per triangle over the profiles + overdraw_weight * overdraw, so overdraw_weight is the price of
+// one full screen layer of overdraw in vertex lanes per triangle; it mostly depends on how big the mesh is on screen.
+u32 tune_index_order(u32* destination, const u32* indices, u32 index_count, const f32* vertex_positions, u32 vertex_count, size_t vertex_positions_stride, f32 overdraw_weight, TuneReport* report)
+{
+	*report = {};
+	report->best = ORDER_FORSYTH;
+
+	u32* candidate = new u32[index_count];
+
+	for (u32 order = 0; order < ORDER_COUNT; ++order)
+	{
+		generate_index_order(candidate, (IndexOrder)order, indices, index_count, vertex_positions, vertex_count, vertex_positions_stride);
+
+		IndexOrderResult* result = &report->orders[order];
+
+		f32 lanes = 0.0f;
+		for (u32 p = 0; p < VERTEX_REUSE_PROFILE_COUNT; ++p)
+		{
+			result->lanes_per_triangle[p] = simulate_vertex_reuse(&vertex_reuse_profiles[p], candidate, index_count, vertex_count);
+			lanes += result->lanes_per_triangle[p];
+		}
+
+		result->overdraw = analyze_overdraw_parallel(candidate, index_count, vertex_positions, vertex_count, vertex_positions_stride).overdraw;
+		result->cost = lanes / VERTEX_REUSE_PROFILE_COUNT + overdraw_weight * result->overdraw;
+
+		if (order == 0 || result->cost < report->orders[report->best].cost)
+		{
+			report->best = order;
+			memcpy(destination, candidate, sizeof(u32) * index_count);
+		}
+	}
+
+	delete[] candidate;
+
+	return report->best;
+}
+
+void print_tune_report_header()
+{
+	printf("%-24s %-14s", "mesh", "order");
+	for (u32 p = 0; p < VERTEX_REUSE_PROFILE_COUNT; ++p) printf(" %11s", vertex_reuse_profiles[p].name);
+	printf(" %9s %7s\n", "overdraw", "cost");
+}
+
+// One row per order, lanes per triangle for every profile, best order marked with a *.
+void print_tune_report(char* name, const TuneReport* report)
+{
+	for (u32 order = 0; order < ORDER_COUNT; ++order)
+	{
+		const IndexOrderResult* result = &report->orders[order];
+
+		printf("%-24s %-14s", order == 0 ? name : "", index_order_names[order]);
+		for (u32 p = 0; p < VERTEX_REUSE_PROFILE_COUNT; ++p) printf(" %11.3f", result->lanes_per_triangle[p]);
+		printf(" %9.3f %7.3f%s\n", result->overdraw, result->cost, order == report->best ? " *" : "");
+	}
+}
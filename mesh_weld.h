@@ -0,0 +1,155 @@
+#pragma once
+
+// Tolerance based welding for unindexed vertex streams, run before meshopt_generateVertexRemap.
+// The remap only merges bit identical vertices; scanned and exported meshes carry float noise that leaves lots of
+// near duplicates. Welding snaps every vertex onto the first earlier vertex that is within epsilon in position and in
+// every attribute, so after welding the remap sees them as identical.
+//
+// Needs mesh_simplify.h (CellMap) and include/vcacheanalyzer.cpp in the same translation unit.
+
+
+constexpr size_t WELD_NO_ATTRIBUTE = ~(size_t)0;
+
+struct WeldSettings
+{
+	f32 position_epsilon;//0 disables welding
+	f32 normal_epsilon;//Per component
+	f32 uv_epsilon;//Per component
+};
+
+// Positions are the first 3 floats of every vertex, normal_offset and uv_offset are byte offsets of 3 and 2 floats
+// or WELD_NO_ATTRIBUTE.
+struct WeldLayout
+{
+	size_t stride;
+	size_t normal_offset;
+	size_t uv_offset;
+};
+
+
+// Cells are epsilon wide so any vertex within epsilon of another is in the same or a neighbouring cell.
+// The three cell coordinates are hashed down to a CellMap key; two cells that collide only add candidates,
+// which are all checked against the real positions anyway.
+inline u32 weld_cell_key(s32 x, s32 y, s32 z)
+{
+	u32 h = hash_cell_id((u32)x * 73856093u ^ (u32)y * 19349663u ^ (u32)z * 83492791u);
+	return h == EMPTY_CELL ? 0 : h;
+}
+
+inline bool weld_floats_match(const f32* a, const f32* b, u32 count, f32 epsilon)
+{
+	for (u32 i = 0; i < count; ++i)
+		if (fabsf(a[i] - b[i]) > epsilon) return false;
+	return true;
+}
+
+// Returns the number of vertices that were moved onto another vertex. Representatives are the first vertex of their
+// neighbourhood in stream order, so the result is deterministic and never chains: a snapped vertex is at most epsilon
+// away from where it started.
+u32 weld_vertices(void* vertices, u32 vertex_count, const WeldLayout* layout, const WeldSettings* settings)
+{
+	if (settings->position_epsilon <= 0.0f) return 0;
+
+	u8* data = (u8*)vertices;
+	f32 inverse_cell_size = 1.0f / settings->position_epsilon;
+
+	//cells maps a cell to the head of its representative list, + 1 so that the zeroed default means empty.
+	CellMap<u32> cells = {};
+	init_cell_map(&cells, 1024);
+
+	u32* representatives = new u32[vertex_count];
+	u32* next_representative = new u32[vertex_count];
+	u32 representative_count = 0;
+
+	u32 snapped_count = 0;
+
+	for (u32 i = 0; i < vertex_count; ++i)
+	{
+		u8* vertex = data + i * layout->stride;
+		const f32* position = (const f32*)vertex;
+
+		s32 cell[3];
+		for (u32 k = 0; k < 3; ++k)
+			cell[k] = (s32)floorf(position[k] * inverse_cell_size);
+
+		u32 match = ~0u;
+
+		for (s32 dz = -1; dz <= 1 && match == ~0u; ++dz)
+		for (s32 dy = -1; dy <= 1 && match == ~0u; ++dy)
+		for (s32 dx = -1; dx <= 1 && match == ~0u; ++dx)
+		{
+			u32* head = cell_map_find(&cells, weld_cell_key(cell[0] + dx, cell[1] + dy, cell[2] + dz));
+			if (!head) continue;
+
+			for (u32 r = *head; r != 0; r = next_representative[r - 1])
+			{
+				const u8* candidate = data + representatives[r - 1] * layout->stride;
+
+				if (!weld_floats_match((const f32*)candidate, position, 3, settings->position_epsilon)) continue;
+				if (layout->normal_offset != WELD_NO_ATTRIBUTE &&
+				    !weld_floats_match((const f32*)(candidate + layout->normal_offset), (const f32*)(vertex + layout->normal_offset), 3, settings->normal_epsilon)) continue;
+				if (layout->uv_offset != WELD_NO_ATTRIBUTE &&
+				    !weld_floats_match((const f32*)(candidate + layout->uv_offset), (const f32*)(vertex + layout->uv_offset), 2, settings->uv_epsilon)) continue;
+
+				match = representatives[r - 1];
+				break;
+			}
+		}
+
+		if (match == ~0u)
+		{
+			u32* head = cell_map_get(&cells, weld_cell_key(cell[0], cell[1], cell[2]));
+			representatives[representative_count] = i;
+			next_representative[representative_count] = *head;
+			*head = ++representative_count;
+		}
+		else if (memcmp(vertex, data + match * layout->stride, layout->stride) != 0)
+		{
+			memcpy(vertex, data + match * layout->stride, layout->stride);
+			++snapped_count;
+		}
+	}
+
+	delete[] representatives;
+	delete[] next_representative;
+	free_cell_map(&cells);
+
+	return snapped_count;
+}
+
+
+struct VertexStreamStats
+{
+	u32 unique_vertex_count;
+	f32 acmr;
+};
+
+// Unique vertex count and post-optimization ACMR of an unindexed stream, i.e. what load_mesh would end up with.
+VertexStreamStats measure_vertex_stream(const void* vertices, u32 vertex_count, size_t vertex_size)
+{
+	u32* remap = new u32[vertex_count];
+	u32* indices = new u32[vertex_count];
+
+	VertexStreamStats stats = {};
+	stats.unique_vertex_count = (u32)meshopt_generateVertexRemap(remap, 0, vertex_count, vertices, vertex_count, vertex_size);
+
+	meshopt_remapIndexBuffer(indices, 0, vertex_count, remap);
+	meshopt_optimizeVertexCache(indices, indices, vertex_count, stats.unique_vertex_count);
+	stats.acmr = meshopt_analyzeVertexCache(indices, vertex_count, stats.unique_vertex_count, 16, 0, 0).acmr;
+
+	delete[] remap;
+	delete[] indices;
+
+	return stats;
+}
+
+// Welds in place and prints how much it merged and what that did to the cache efficiency.
+void weld_vertices_with_report(char* name, void* vertices, u32 vertex_count, const WeldLayout* layout, const WeldSettings* settings)
+{
+	VertexStreamStats before = measure_vertex_stream(vertices, vertex_count, layout->stride);
+	u32 snapped_count = weld_vertices(vertices, vertex_count, layout, settings);
+	VertexStreamStats after = measure_vertex_stream(vertices, vertex_count, layout->stride);
+
+	printf("Weld %s: snapped %u corners, %u -> %u vertices (%u merged), ACMR %.3f -> %.3f\n", name, snapped_count,
+	       before.unique_vertex_count, after.unique_vertex_count, before.unique_vertex_count - after.unique_vertex_count, before.acmr, after.acmr);
+}
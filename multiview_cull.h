@@ -0,0 +1,225 @@
+#pragma once
+
+// Culls instances against up to 32 views in one pass: the camera plus shadow cascades, cube faces or whatever the
+// depth, normal and surfel passes end up needing. Every sphere is loaded once and tested against all views while it
+// is in registers, so instance memory traffic does not grow with the view count; only the per view draw lists do.
+//
+// Output is a bitmask per instance (bit v set when visible in view v) and one compacted index list per view.
+// Radii are in world units, like the instance store; the planes are normalized per view.
+//
+// Needs culling.h in the same translation unit.
+
+
+constexpr u32 MAX_CULL_VIEWS = 32;
+
+struct MultiViewFrustums
+{
+	//Per view and plane x, y, z and w, each already broadcast to four lanes
+	__m128 planes[MAX_CULL_VIEWS][5][4];
+	CullFrustum frustums[MAX_CULL_VIEWS];//For the scalar tail
+	u32 view_count;
+};
+
+// Returns the view's bit index.
+u32 add_cull_view(MultiViewFrustums* views, const Mat4x4* view_projection)
+{
+	assert(views->view_count < MAX_CULL_VIEWS);
+
+	u32 view = views->view_count++;
+	CullFrustum frustum = make_cull_frustum_from_view_projection(view_projection);
+	views->frustums[view] = frustum;
+
+	for (u32 p = 0; p < 5; ++p)
+	{
+		views->planes[view][p][0] = _mm_set1_ps(frustum.planes[p].x);
+		views->planes[view][p][1] = _mm_set1_ps(frustum.planes[p].y);
+		views->planes[view][p][2] = _mm_set1_ps(frustum.planes[p].z);
+		views->planes[view][p][3] = _mm_set1_ps(frustum.planes[p].w);
+	}
+
+	return view;
+}
+
+// view_lists[v] needs room for count indices. Returns how many instances are visible in at least one view.
+u32 cull_spheres_multi_view(const MultiViewFrustums* views, const f32* x, const f32* y, const f32* z, const f32* radius, u32 count,
+                            u32* view_masks, u32** view_lists, u32* view_counts)
+{
+	u32 view_count = views->view_count;
+	for (u32 v = 0; v < view_count; ++v) view_counts[v] = 0;
+
+	u32 visible_count = 0;
+	u32 i = 0;
+
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 cx = _mm_loadu_ps(x + i);
+		__m128 cy = _mm_loadu_ps(y + i);
+		__m128 cz = _mm_loadu_ps(z + i);
+		__m128 negative_radius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(radius + i));
+
+		u32 masks[4] = {};
+
+		for (u32 v = 0; v < view_count; ++v)
+		{
+			const __m128 (*planes)[4] = views->planes[v];
+
+			//Same operation order as cull_spheres_sse, so both agree bit for bit.
+			__m128 outside = _mm_setzero_ps();
+			for (u32 p = 0; p < 5; ++p)
+			{
+				__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(planes[p][0], cx), _mm_mul_ps(planes[p][1], cy)), _mm_add_ps(_mm_mul_ps(planes[p][2], cz), planes[p][3]));
+				outside = _mm_or_ps(outside, _mm_cmplt_ps(distance, negative_radius));
+			}
+
+			u32 mask = ~_mm_movemask_ps(outside) & 15;
+
+			masks[0] |= ((mask >> 0) & 1) << v;
+			masks[1] |= ((mask >> 1) & 1) << v;
+			masks[2] |= ((mask >> 2) & 1) << v;
+			masks[3] |= ((mask >> 3) & 1) << v;
+
+			//Every lane is written and only visible ones advance the count. The count is never past the lane's own
+			//index, so this stays inside the list without any slack.
+			u32* list = view_lists[v];
+			u32 list_count = view_counts[v];
+			list[list_count] = i + 0; list_count += (mask >> 0) & 1;
+			list[list_count] = i + 1; list_count += (mask >> 1) & 1;
+			list[list_count] = i + 2; list_count += (mask >> 2) & 1;
+			list[list_count] = i + 3; list_count += (mask >> 3) & 1;
+			view_counts[v] = list_count;
+		}
+
+		view_masks[i + 0] = masks[0];
+		view_masks[i + 1] = masks[1];
+		view_masks[i + 2] = masks[2];
+		view_masks[i + 3] = masks[3];
+		visible_count += (masks[0] != 0) + (masks[1] != 0) + (masks[2] != 0) + (masks[3] != 0);
+	}
+
+	for (; i < count; ++i)
+	{
+		u32 mask = 0;
+		for (u32 v = 0; v < view_count; ++v)
+		{
+			if (!sphere_in_frustum(&views->frustums[v], Vec3(x[i], y[i], z[i]), radius[i])) continue;
+
+			mask |= 1u << v;
+			view_lists[v][view_counts[v]++] = i;
+		}
+
+		view_masks[i] = mask;
+		visible_count += mask != 0;
+	}
+
+	return visible_count;
+}
+
+
+// Culls the draw() scene against 1 to 16 views spread around it, once per view with cull_spheres_sse followed by
+// a compaction pass, and once with cull_spheres_multi_view, checks both give the same lists and prints the times
+// and how much instance data each read.
+void benchmark_multi_view_cull(u32 instance_count, const ShaderGlobals* globals)
+{
+	f32 scale = sqrtf(instance_count / 1250.0f);
+	vec3 world_max = Vec3(100.0f * scale, 25.0f, 100.0f * scale);
+	vec3 world_min = -world_max;
+
+	CullSpheres spheres = {};
+	spheres.x = new f32[instance_count];
+	spheres.y = new f32[instance_count];
+	spheres.z = new f32[instance_count];
+	spheres.radius = new f32[instance_count];
+	spheres.count = instance_count;
+
+	u32 random = 101;
+	for (u32 i = 0; i < instance_count; ++i)
+	{
+		spheres.x[i] = rand_f32_in_range(world_min.x, world_max.x, &random);
+		spheres.y[i] = rand_f32_in_range(world_min.y, world_max.y, &random);
+		spheres.z[i] = rand_f32_in_range(world_min.z, world_max.z, &random);
+		spheres.radius[i] = rand_f32_in_range(0.5f, 3.0f, &random);
+	}
+
+	//View 0 is the camera, the rest look at the origin from a ring around it.
+	Mat4x4 view_projections[16];
+	view_projections[0] = mult(globals->projection, globals->view);
+	for (u32 v = 1; v < 16; ++v)
+	{
+		f32 angle = 2.0f * 3.14159265f * v / 16.0f;
+		vec3 eye = Vec3(sinf(angle) * 50.0f * scale, 20.0f, cosf(angle) * 50.0f * scale);
+		view_projections[v] = mult(globals->projection, look_at(eye, {}, {0.0f, 1.0f, 0.0f}));
+	}
+
+	u8* visible = new u8[instance_count];
+	u32* view_masks = new u32[instance_count];
+	u32* view_lists[16];
+	u32* reference_lists[16];
+	u32 view_counts[16];
+	u32 reference_counts[16];
+	for (u32 v = 0; v < 16; ++v)
+	{
+		view_lists[v] = new u32[instance_count];
+		reference_lists[v] = new u32[instance_count];
+	}
+
+	u32 iterations = MAX(2000000 / instance_count, 1u);
+
+	printf("Multi view cull, %u instances:\n", instance_count);
+
+	u32 view_count_steps[] = {1, 2, 4, 8, 16};
+	for (u32 step = 0; step < sizeof(view_count_steps) / sizeof(view_count_steps[0]); ++step)
+	{
+		u32 view_count = view_count_steps[step];
+
+		CullFrustum frustums[16];
+		MultiViewFrustums views = {};
+		for (u32 v = 0; v < view_count; ++v)
+		{
+			frustums[v] = make_cull_frustum_from_view_projection(&view_projections[v]);
+			add_cull_view(&views, &view_projections[v]);
+		}
+
+		f64 start = time_in_seconds();
+		for (u32 it = 0; it < iterations; ++it)
+		{
+			for (u32 v = 0; v < view_count; ++v)
+			{
+				cull_spheres_sse(&frustums[v], spheres.x, spheres.y, spheres.z, spheres.radius, instance_count, visible);
+
+				u32 list_count = 0;
+				for (u32 i = 0; i < instance_count; ++i)
+					if (visible[i]) reference_lists[v][list_count++] = i;
+				reference_counts[v] = list_count;
+			}
+		}
+		f64 per_view_seconds = (time_in_seconds() - start) / iterations;
+
+		u32 any_visible = 0;
+		start = time_in_seconds();
+		for (u32 it = 0; it < iterations; ++it)
+			any_visible = cull_spheres_multi_view(&views, spheres.x, spheres.y, spheres.z, spheres.radius, instance_count, view_masks, view_lists, view_counts);
+		f64 multi_view_seconds = (time_in_seconds() - start) / iterations;
+
+		u32 listed = 0;
+		for (u32 v = 0; v < view_count; ++v)
+		{
+			assert(view_counts[v] == reference_counts[v]);
+			assert(memcmp(view_lists[v], reference_lists[v], sizeof(u32) * view_counts[v]) == 0);
+			listed += view_counts[v];
+		}
+
+		f64 sphere_megabytes = 4.0 * sizeof(f32) * instance_count / (1024.0 * 1024.0);
+		printf("  %2u views: per view %.3fms (%.1fMB spheres read), one pass %.3fms (%.1fMB) %.1fx; %u visible in any view, %u list entries\n",
+		       view_count, per_view_seconds * 1000.0, sphere_megabytes * view_count, multi_view_seconds * 1000.0, sphere_megabytes,
+		       per_view_seconds / multi_view_seconds, any_visible, listed);
+	}
+
+	for (u32 v = 0; v < 16; ++v)
+	{
+		delete[] view_lists[v];
+		delete[] reference_lists[v];
+	}
+	delete[] visible;
+	delete[] view_masks;
+	free_cull_spheres(&spheres);
+}
@@ -0,0 +1,526 @@
+#pragma once
+
+// CPU occlusion culling against a small software depth buffer.
+// Every frame the instances that cover the most screen are picked as occluders and their simplified meshes are
+// rasterized into a quarter resolution reversed Z buffer with meshopt's half-space fixed point rasterizer, four pixels
+// at a time with SSE2. The buffer is then reduced to 8x8 tiles holding their furthest depth. An instance is occluded
+// when every pixel its projected bounding sphere covers has an occluder in front of the sphere's nearest point;
+// whole tiles pass on their furthest depth, only tiles that do not get looked at pixel by pixel.
+//
+// Occluders are meshopt_simplify output and not conservative: a simplified silhouette can bulge past the real one
+// by up to the simplification error, which benchmark_occlusion_culling measures against the full meshes.
+//
+// Needs culling.h, include/simplifier.cpp and include/vfetchoptimizer.cpp in the same translation unit.
+
+#include <emmintrin.h>
+
+
+constexpr u32 OCCLUSION_TILE_SIZE = 8;
+constexpr u32 OCCLUDER_TARGET_TRIANGLES = 256;
+constexpr f32 OCCLUDER_TARGET_ERROR = 0.025f;
+constexpr u32 MAX_OCCLUDERS = 64;
+constexpr u32 OCCLUDER_TRIANGLE_BUDGET = 8192;
+constexpr f64 OCCLUSION_FRAME_BUDGET_SECONDS = 0.001;//Rasterize and test on one core, for a 1280x720 window
+
+// Low poly copy of a mesh, positions packed as float3.
+struct OccluderMesh
+{
+	f32* positions;
+	u32 vertex_count;
+	u32* indices;
+	u32 index_count;
+};
+
+void build_occluder_mesh(OccluderMesh* result, const u32* indices, u32 index_count, const f32* vertex_positions, u32 vertex_count, size_t vertex_positions_stride)
+{
+	*result = {};
+
+	u32* simplified = new u32[index_count];
+	u32 target_index_count = MIN(index_count, OCCLUDER_TARGET_TRIANGLES * 3);
+	u32 simplified_count = (u32)meshopt_simplify(simplified, indices, index_count, vertex_positions, vertex_count, vertex_positions_stride, target_index_count, OCCLUDER_TARGET_ERROR);
+
+	u32* remap = new u32[vertex_count];
+	u32 used_vertex_count = (u32)meshopt_optimizeVertexFetchRemap(remap, simplified, simplified_count, vertex_count);
+
+	result->positions = new f32[MAX(used_vertex_count, 1u) * 3];
+	result->vertex_count = used_vertex_count;
+	result->indices = new u32[MAX(simplified_count, 3u)];
+	result->index_count = simplified_count;
+
+	size_t stride_in_floats = vertex_positions_stride / sizeof(f32);
+	for (u32 i = 0; i < vertex_count; ++i)
+	{
+		if (remap[i] == ~0u) continue;
+		memcpy(&result->positions[remap[i] * 3], vertex_positions + i * stride_in_floats, sizeof(f32) * 3);
+	}
+
+	for (u32 i = 0; i < simplified_count; ++i) result->indices[i] = remap[simplified[i]];
+
+	delete[] simplified;
+	delete[] remap;
+}
+
+void free_occluder_mesh(OccluderMesh* mesh)
+{
+	delete[] mesh->positions;
+	delete[] mesh->indices;
+	*mesh = {};
+}
+
+
+// The instance rotation vertex_shader.hlsl applies: the per instance quaternion times a spin around y driven by time.
+vec4 quat_mul(vec4 q1, vec4 q2)
+{
+	vec3 v1 = Vec3(q1.x, q1.y, q1.z);
+	vec3 v2 = Vec3(q2.x, q2.y, q2.z);
+	vec3 v = v2 * q1.w + v1 * q2.w + cross(v1, v2);
+	return {v.x, v.y, v.z, q1.w * q2.w - dot(v1, v2)};
+}
+
+vec3 rotate_vec_by_quat(vec3 v, vec4 q)
+{
+	vec3 u = Vec3(q.x, q.y, q.z);
+	return v + 2.0f * cross(u, cross(u, v) + q.w * v);
+}
+
+vec4 instance_rotation(vec4 quat, f32 time)
+{
+	vec4 spin = normalize(vec4{0.0f, 1.0f, 0.0f, cosf(time / 2)});
+	return normalize(quat_mul(quat, spin));
+}
+
+// Instance rotation and position as a 4x4 so it folds into the view projection; columns are the rotated basis vectors.
+Mat4x4 instance_world_matrix(const DrawInfo* draw_info, f32 time)
+{
+	vec4 quat = instance_rotation(draw_info->quat, time);
+
+	vec3 bx = rotate_vec_by_quat(Vec3(1, 0, 0), quat);
+	vec3 by = rotate_vec_by_quat(Vec3(0, 1, 0), quat);
+	vec3 bz = rotate_vec_by_quat(Vec3(0, 0, 1), quat);
+	vec3 t = draw_info->position;
+
+	Mat4x4 world = {};
+	world.row_vecs[0] = {bx.x, by.x, bz.x, t.x};
+	world.row_vecs[1] = {bx.y, by.y, bz.y, t.y};
+	world.row_vecs[2] = {bx.z, by.z, bz.z, t.z};
+	world.row_vecs[3] = {0, 0, 0, 1};
+	return world;
+}
+
+
+struct OcclusionBuffer
+{
+	f32* depth;//width * height, reversed Z so larger is nearer, 0 where nothing was drawn
+	f32* tile_depth;//Furthest depth per OCCLUSION_TILE_SIZE square tile
+	u32 width;
+	u32 height;
+	u32 tiles_x;
+	u32 tiles_y;
+
+	Mat4x4 view_projection;
+	Mat4x4 view;
+	Mat4x4 projection;
+	f32 time;
+
+	u32 occluder_count;
+	u32 triangles_rasterized;
+};
+
+// width has to be a multiple of OCCLUSION_TILE_SIZE. Screen coordinates are 16.4 fixed point, edge functions
+// multiply two of them, so the guard band of one buffer size on every side keeps them inside 32 bits up to 512.
+void init_occlusion_buffer(OcclusionBuffer* buffer, u32 width, u32 height)
+{
+	assert(width % OCCLUSION_TILE_SIZE == 0 && width <= 512 && height <= 512);
+
+	*buffer = {};
+	buffer->width = width;
+	buffer->height = height;
+	buffer->tiles_x = width / OCCLUSION_TILE_SIZE;
+	buffer->tiles_y = (height + OCCLUSION_TILE_SIZE - 1) / OCCLUSION_TILE_SIZE;
+	buffer->depth = new f32[width * height];
+	buffer->tile_depth = new f32[buffer->tiles_x * buffer->tiles_y];
+}
+
+void free_occlusion_buffer(OcclusionBuffer* buffer)
+{
+	delete[] buffer->depth;
+	delete[] buffer->tile_depth;
+	*buffer = {};
+}
+
+void begin_occlusion_frame(OcclusionBuffer* buffer, const ShaderGlobals* globals)
+{
+	buffer->view = globals->view;
+	buffer->projection = globals->projection;
+	buffer->view_projection = mult(globals->projection, globals->view);
+	buffer->time = globals->time;
+	buffer->occluder_count = 0;
+	buffer->triangles_rasterized = 0;
+
+	memset(buffer->depth, 0, sizeof(f32) * buffer->width * buffer->height);
+}
+
+// meshopt's computeDepthGradients applies 1/det to only one of the two products; depth has to be right here.
+f32 compute_depth_gradients(f32* dzdx, f32* dzdy, f32 x1, f32 y1, f32 z1, f32 x2, f32 y2, f32 z2, f32 x3, f32 y3, f32 z3)
+{
+	f32 det = (x2 - x1) * (y3 - y1) - (y2 - y1) * (x3 - x1);
+	f32 invdet = (det == 0) ? 0 : 1 / det;
+
+	*dzdx = ((z2 - z1) * (y3 - y1) - (y2 - y1) * (z3 - z1)) * invdet;
+	*dzdy = ((x2 - x1) * (z3 - z1) - (z2 - z1) * (x3 - x1)) * invdet;
+
+	return det;
+}
+
+// rasterize_overdraw without the flip: back facing and degenerate triangles are skipped, they can not add coverage
+// to a closed occluder. Depth is z/w, which is linear in screen space, and keeps the nearest value per pixel.
+// The x range is widened to multiples of four; the extra pixels are outside the triangle and fail the edge tests.
+void rasterize_occluder_triangle(OcclusionBuffer* buffer, f32 v1x, f32 v1y, f32 v1z, f32 v2x, f32 v2y, f32 v2z, f32 v3x, f32 v3y, f32 v3z)
+{
+	f32 DZx, DZy;
+	f32 det = compute_depth_gradients(&DZx, &DZy, v1x, v1y, v1z, v2x, v2y, v2z, v3x, v3y, v3z);
+	if (det >= 0) return;//Screen y points down, so front faces (counter clockwise in NDC) have a negative determinant
+
+	s32 X1 = s32(16.0f * v1x + 0.5f);
+	s32 X2 = s32(16.0f * v2x + 0.5f);
+	s32 X3 = s32(16.0f * v3x + 0.5f);
+
+	s32 Y1 = s32(16.0f * v1y + 0.5f);
+	s32 Y2 = s32(16.0f * v2y + 0.5f);
+	s32 Y3 = s32(16.0f * v3y + 0.5f);
+
+	s32 minx = MAX((MIN(X1, MIN(X2, X3)) + 7) >> 4, 0);
+	s32 maxx = MIN((MAX(X1, MAX(X2, X3)) + 7) >> 4, (s32)buffer->width);
+	s32 miny = MAX((MIN(Y1, MIN(Y2, Y3)) + 7) >> 4, 0);
+	s32 maxy = MIN((MAX(Y1, MAX(Y2, Y3)) + 7) >> 4, (s32)buffer->height);
+
+	if (minx >= maxx || miny >= maxy) return;
+
+	minx &= ~3;
+	maxx = (maxx + 3) & ~3;
+
+	s32 DX12 = X1 - X2;
+	s32 DX23 = X2 - X3;
+	s32 DX31 = X3 - X1;
+
+	s32 DY12 = Y1 - Y2;
+	s32 DY23 = Y2 - Y3;
+	s32 DY31 = Y3 - Y1;
+
+	s32 TL1 = DY12 < 0 || (DY12 == 0 && DX12 > 0);
+	s32 TL2 = DY23 < 0 || (DY23 == 0 && DX23 > 0);
+	s32 TL3 = DY31 < 0 || (DY31 == 0 && DX31 > 0);
+
+	s32 FX = (minx << 4) + 8;
+	s32 FY = (miny << 4) + 8;
+	s32 CY1 = DX12 * (FY - Y1) - DY12 * (FX - X1) + TL1 - 1;
+	s32 CY2 = DX23 * (FY - Y2) - DY23 * (FX - X2) + TL2 - 1;
+	s32 CY3 = DX31 * (FY - Y3) - DY31 * (FX - X3) + TL3 - 1;
+	f32 ZY = v1z + (DZx * f32(FX - X1) + DZy * f32(FY - Y1)) * (1 / 16.f);
+
+	//Lane i is pixel x + i; one step moves four pixels.
+	s32 SX1 = s32(u32(DY12) << 4);
+	s32 SX2 = s32(u32(DY23) << 4);
+	s32 SX3 = s32(u32(DY31) << 4);
+
+	__m128i lane_x1 = _mm_set_epi32(-3 * SX1, -2 * SX1, -SX1, 0);
+	__m128i lane_x2 = _mm_set_epi32(-3 * SX2, -2 * SX2, -SX2, 0);
+	__m128i lane_x3 = _mm_set_epi32(-3 * SX3, -2 * SX3, -SX3, 0);
+	__m128i step_x1 = _mm_set1_epi32(4 * SX1);
+	__m128i step_x2 = _mm_set1_epi32(4 * SX2);
+	__m128i step_x3 = _mm_set1_epi32(4 * SX3);
+	__m128 lane_z = _mm_set_ps(3 * DZx, 2 * DZx, DZx, 0);
+	__m128 step_z = _mm_set1_ps(4 * DZx);
+	__m128i minus_one = _mm_set1_epi32(-1);
+
+	for (s32 y = miny; y < maxy; y++)
+	{
+		__m128i CX1 = _mm_add_epi32(_mm_set1_epi32(CY1), lane_x1);
+		__m128i CX2 = _mm_add_epi32(_mm_set1_epi32(CY2), lane_x2);
+		__m128i CX3 = _mm_add_epi32(_mm_set1_epi32(CY3), lane_x3);
+		__m128 ZX = _mm_add_ps(_mm_set1_ps(ZY), lane_z);
+
+		f32* z = buffer->depth + y * buffer->width;
+
+		for (s32 x = minx; x < maxx; x += 4)
+		{
+			__m128i inside = _mm_cmpgt_epi32(_mm_or_si128(_mm_or_si128(CX1, CX2), CX3), minus_one);
+
+			//Masked lanes become depth 0, the far plane, which never wins the max.
+			__m128 depth = _mm_loadu_ps(z + x);
+			_mm_storeu_ps(z + x, _mm_max_ps(depth, _mm_and_ps(ZX, _mm_castsi128_ps(inside))));
+
+			CX1 = _mm_sub_epi32(CX1, step_x1);
+			CX2 = _mm_sub_epi32(CX2, step_x2);
+			CX3 = _mm_sub_epi32(CX3, step_x3);
+			ZX = _mm_add_ps(ZX, step_z);
+		}
+
+		CY1 += s32(u32(DX12) << 4);
+		CY2 += s32(u32(DX23) << 4);
+		CY3 += s32(u32(DX31) << 4);
+		ZY += DZy;
+	}
+}
+
+// Transforms the mesh by the instance rotation and position like vertex_shader.hlsl does and rasterizes it.
+// Triangles touching the near plane or leaving the guard band are dropped, which only makes the occluder smaller.
+// screen_scratch needs 4 floats per occluder vertex.
+void rasterize_occluder(OcclusionBuffer* buffer, const OccluderMesh* mesh, const DrawInfo* draw_info, f32* screen_scratch)
+{
+	Mat4x4 world = instance_world_matrix(draw_info, buffer->time);
+	Mat4x4 m = mult(buffer->view_projection, world);
+
+	f32 half_width = buffer->width * 0.5f;
+	f32 half_height = buffer->height * 0.5f;
+	f32 guard_min_x = -(f32)buffer->width, guard_max_x = 2.0f * buffer->width;
+	f32 guard_min_y = -(f32)buffer->height, guard_max_y = 2.0f * buffer->height;
+
+	for (u32 i = 0; i < mesh->vertex_count; ++i)
+	{
+		const f32* p = &mesh->positions[i * 3];
+		f32* s = &screen_scratch[i * 4];
+
+		f32 cx = m.d[0][0] * p[0] + m.d[0][1] * p[1] + m.d[0][2] * p[2] + m.d[0][3];
+		f32 cy = m.d[1][0] * p[0] + m.d[1][1] * p[1] + m.d[1][2] * p[2] + m.d[1][3];
+		f32 cz = m.d[2][0] * p[0] + m.d[2][1] * p[1] + m.d[2][2] * p[2] + m.d[2][3];
+		f32 cw = m.d[3][0] * p[0] + m.d[3][1] * p[1] + m.d[3][2] * p[2] + m.d[3][3];
+
+		//Behind the camera or in front of the near plane (reversed Z depth above 1).
+		if (cw <= 0 || cz > cw)
+		{
+			s[3] = 0.0f;
+			continue;
+		}
+
+		f32 inv_w = 1.0f / cw;
+		s[0] = (cx * inv_w + 1.0f) * half_width;
+		s[1] = (1.0f - cy * inv_w) * half_height;
+		s[2] = cz * inv_w;
+		s[3] = (s[0] >= guard_min_x && s[0] <= guard_max_x && s[1] >= guard_min_y && s[1] <= guard_max_y) ? 1.0f : 0.0f;
+	}
+
+	for (u32 i = 0; i < mesh->index_count; i += 3)
+	{
+		const f32* a = &screen_scratch[mesh->indices[i + 0] * 4];
+		const f32* b = &screen_scratch[mesh->indices[i + 1] * 4];
+		const f32* c = &screen_scratch[mesh->indices[i + 2] * 4];
+
+		if (a[3] == 0.0f || b[3] == 0.0f || c[3] == 0.0f) continue;
+
+		rasterize_occluder_triangle(buffer, a[0], a[1], a[2], b[0], b[1], b[2], c[0], c[1], c[2]);
+	}
+
+	buffer->occluder_count++;
+	buffer->triangles_rasterized += mesh->index_count / 3;
+}
+
+void build_occlusion_tiles(OcclusionBuffer* buffer)
+{
+	for (u32 ty = 0; ty < buffer->tiles_y; ++ty)
+	{
+		u32 y0 = ty * OCCLUSION_TILE_SIZE;
+		u32 y1 = MIN(y0 + OCCLUSION_TILE_SIZE, buffer->height);
+
+		for (u32 tx = 0; tx < buffer->tiles_x; ++tx)
+		{
+			__m128 furthest = _mm_set1_ps(FLT_MAX);
+
+			for (u32 y = y0; y < y1; ++y)
+			{
+				const f32* row = buffer->depth + y * buffer->width + tx * OCCLUSION_TILE_SIZE;
+				furthest = _mm_min_ps(furthest, _mm_min_ps(_mm_loadu_ps(row), _mm_loadu_ps(row + 4)));
+			}
+
+			furthest = _mm_min_ps(furthest, _mm_shuffle_ps(furthest, furthest, _MM_SHUFFLE(1, 0, 3, 2)));
+			furthest = _mm_min_ps(furthest, _mm_shuffle_ps(furthest, furthest, _MM_SHUFFLE(2, 3, 0, 1)));
+			buffer->tile_depth[ty * buffer->tiles_x + tx] = _mm_cvtss_f32(furthest);
+		}
+	}
+}
+
+// Tests the sphere's screen rectangle against the tiles and then the pixels. Spheres reaching the near plane are
+// never occluded.
+bool sphere_occluded(const OcclusionBuffer* buffer, vec3 centre, f32 radius)
+{
+	SphereScreenRect rect;
+	if (!project_sphere_rect(&buffer->view, &buffer->projection, centre, radius, buffer->width, buffer->height, &rect)) return false;
+
+	s32 px0 = rect.x0, px1 = rect.x1, py0 = rect.y0, py1 = rect.y1;
+	f32 sphere_depth = rect.depth;
+
+	for (s32 ty = py0 / (s32)OCCLUSION_TILE_SIZE; ty * (s32)OCCLUSION_TILE_SIZE < py1; ++ty)
+	{
+		for (s32 tx = px0 / (s32)OCCLUSION_TILE_SIZE; tx * (s32)OCCLUSION_TILE_SIZE < px1; ++tx)
+		{
+			if (buffer->tile_depth[ty * buffer->tiles_x + tx] > sphere_depth) continue;
+
+			s32 y_end = MIN((ty + 1) * (s32)OCCLUSION_TILE_SIZE, py1);
+			s32 x_end = MIN((tx + 1) * (s32)OCCLUSION_TILE_SIZE, px1);
+
+			for (s32 y = MAX(ty * (s32)OCCLUSION_TILE_SIZE, py0); y < y_end; ++y)
+				for (s32 x = MAX(tx * (s32)OCCLUSION_TILE_SIZE, px0); x < x_end; ++x)
+					if (buffer->depth[y * buffer->width + x] <= sphere_depth) return false;
+		}
+	}
+
+	return true;
+}
+
+
+struct OcclusionStats
+{
+	u32 frustum_visible;
+	u32 occluders;
+	u32 occluder_triangles;
+	u32 occluded;
+	u64 triangles_submitted;//Triangles of the instances left visible
+	f64 rasterize_seconds;
+	f64 test_seconds;
+};
+
+// Occlusion culls instances (world space radii, as kept by the instance store). occluder_meshes is indexed by
+// draw_info.vertex_buffer_index. occluded gets 1 for every instance that is inside the frustum but hidden;
+// instances outside the frustum are left to the GPU culler and get 0.
+void occlusion_cull_instances(OcclusionBuffer* buffer, const ShaderGlobals* globals, const OccluderMesh* occluder_meshes, const DrawCallInfo* instances, u32 count, u8* occluded, OcclusionStats* stats, u32 triangle_budget = OCCLUDER_TRIANGLE_BUDGET)
+{
+	OcclusionStats local_stats = {};
+	f64 start = time_in_seconds();
+
+	CullFrustum frustum = make_cull_frustum(globals);
+	begin_occlusion_frame(buffer, globals);
+
+	//The largest instances on screen, by radius over distance, become this frame's occluders.
+	u32 occluders[MAX_OCCLUDERS];
+	f32 occluder_sizes[MAX_OCCLUDERS];
+	u32 occluder_count = 0;
+
+	vec3 camera = Vec3(0.0f);
+	{
+		//Camera position from the inverse of the rigid view transform: -R^T * t.
+		const Mat4x4& view = globals->view;
+		for (u32 i = 0; i < 3; ++i)
+			camera.data[i] = -(view.d[0][i] * view.d[0][3] + view.d[1][i] * view.d[1][3] + view.d[2][i] * view.d[2][3]);
+	}
+
+	for (u32 i = 0; i < count; ++i)
+	{
+		occluded[i] = 0;
+
+		const DrawCallInfo* instance = &instances[i];
+		vec3 centre = instance_sphere_centre(instance);
+		if (!sphere_in_frustum(&frustum, centre, instance->bounding_radius * frustum.bounds_scale)) continue;
+
+		local_stats.frustum_visible++;
+
+		f32 size = instance->bounding_radius / MAX(length(centre - camera), 1e-3f);
+		if (occluder_count == MAX_OCCLUDERS && size <= occluder_sizes[occluder_count - 1]) continue;
+
+		u32 position = MIN(occluder_count, MAX_OCCLUDERS - 1);
+		while (position > 0 && occluder_sizes[position - 1] < size)
+		{
+			occluders[position] = occluders[position - 1];
+			occluder_sizes[position] = occluder_sizes[position - 1];
+			position--;
+		}
+		occluders[position] = i;
+		occluder_sizes[position] = size;
+		occluder_count = MIN(occluder_count + 1, MAX_OCCLUDERS);
+	}
+
+	u32 max_vertex_count = 0;
+	for (u32 i = 0; i < occluder_count; ++i)
+		max_vertex_count = MAX(max_vertex_count, occluder_meshes[instances[occluders[i]].draw_info.vertex_buffer_index].vertex_count);
+
+	f32* screen = new f32[MAX(max_vertex_count, 1u) * 4];
+
+	for (u32 i = 0; i < occluder_count; ++i)
+	{
+		const DrawCallInfo* instance = &instances[occluders[i]];
+		const OccluderMesh* mesh = &occluder_meshes[instance->draw_info.vertex_buffer_index];
+
+		if (buffer->triangles_rasterized + mesh->index_count / 3 > triangle_budget) continue;
+
+		rasterize_occluder(buffer, mesh, &instance->draw_info, screen);
+	}
+
+	delete[] screen;
+
+	build_occlusion_tiles(buffer);
+
+	local_stats.occluders = buffer->occluder_count;
+	local_stats.occluder_triangles = buffer->triangles_rasterized;
+	local_stats.rasterize_seconds = time_in_seconds() - start;
+
+	start = time_in_seconds();
+
+	for (u32 i = 0; i < count; ++i)
+	{
+		const DrawCallInfo* instance = &instances[i];
+		vec3 centre = instance_sphere_centre(instance);
+		if (!sphere_in_frustum(&frustum, centre, instance->bounding_radius * frustum.bounds_scale)) continue;
+
+		occluded[i] = sphere_occluded(buffer, centre, instance->bounding_radius);
+		local_stats.occluded += occluded[i];
+
+		if (!occluded[i]) local_stats.triangles_submitted += instance->triangle_count;
+	}
+
+	local_stats.test_seconds = time_in_seconds() - start;
+
+	if (stats) *stats = local_stats;
+}
+
+// Culls the instances with the simplified occluders and again with the full meshes as occluders; instances only the
+// simplified occluders hide are the ones they wrongly cull. meshes holds the full meshes as OccluderMesh.
+// Returns the mean rasterize plus test time of a frame.
+f64 benchmark_occlusion_culling(const OccluderMesh* meshes, u32 mesh_count, const DrawCallInfo* instances, u32 count, const ShaderGlobals* globals, u32 width, u32 height)
+{
+	OccluderMesh* occluder_meshes = new OccluderMesh[mesh_count];
+	for (u32 i = 0; i < mesh_count; ++i)
+		build_occluder_mesh(&occluder_meshes[i], meshes[i].indices, meshes[i].index_count, meshes[i].positions, meshes[i].vertex_count, sizeof(f32) * 3);
+
+	OcclusionBuffer buffer;
+	init_occlusion_buffer(&buffer, width, height);
+
+	u8* occluded = new u8[count];
+	u8* reference = new u8[count];
+
+	OcclusionStats stats = {};
+	const u32 iterations = 100;
+	f64 rasterize_seconds = 0, test_seconds = 0;
+	for (u32 it = 0; it < iterations; ++it)
+	{
+		occlusion_cull_instances(&buffer, globals, occluder_meshes, instances, count, occluded, &stats);
+		rasterize_seconds += stats.rasterize_seconds;
+		test_seconds += stats.test_seconds;
+	}
+
+	u64 frustum_triangles = 0;
+	CullFrustum frustum = make_cull_frustum(globals);
+	for (u32 i = 0; i < count; ++i)
+		if (sphere_in_frustum(&frustum, instance_sphere_centre(&instances[i]), instances[i].bounding_radius * frustum.bounds_scale))
+			frustum_triangles += instances[i].triangle_count;
+
+	OcclusionStats reference_stats = {};
+	occlusion_cull_instances(&buffer, globals, meshes, instances, count, reference, &reference_stats, ~0u);
+
+	u32 wrongly_culled = 0;
+	for (u32 i = 0; i < count; ++i) wrongly_culled += occluded[i] && !reference[i];
+
+	printf("Occlusion %ux%u, %u instances: %u in frustum, %u occluders (%u triangles), %u occluded\n",
+	       width, height, count, stats.frustum_visible, stats.occluders, stats.occluder_triangles, stats.occluded);
+	printf("  rasterize %.3fms, test %.3fms; triangles submitted %llu -> %llu (%.1f%%)\n",
+	       rasterize_seconds * 1000.0 / iterations, test_seconds * 1000.0 / iterations,
+	       (unsigned long long)frustum_triangles, (unsigned long long)stats.triangles_submitted, frustum_triangles ? 100.0 * stats.triangles_submitted / frustum_triangles : 0.0);
+	printf("  full mesh occluders (%u triangles): %u occluded; %u instances culled only by the simplified occluders\n",
+	       reference_stats.occluder_triangles, reference_stats.occluded, wrongly_culled);
+
+	delete[] occluded;
+	delete[] reference;
+	free_occlusion_buffer(&buffer);
+	for (u32 i = 0; i < mesh_count; ++i) free_occluder_mesh(&occluder_meshes[i]);
+	delete[] occluder_meshes;
+
+	return (rasterize_seconds + test_seconds) / iterations;
+}
@@ -0,0 +1,496 @@
+#pragma once
+
+// Static batching for small meshes. A cube or icosphere instance is a whole draw for a few dozen triangles, so dense
+// clutter is bound by draw count long before triangles. Instances of meshes up to BATCH_MAX_MESH_TRIANGLES are baked
+// instead: their vertices are transformed into world space and merged into one vertex and index chunk per cell of a
+// uniform grid. Each non-empty cell is one draw with identity transform, and its box and bounding sphere stand in
+// for the instances inside it when culling, so the cell size trades draws against culling granularity.
+//
+// Instances are addressed by instance store handle. Adding, moving or removing one only marks the cells it left and
+// entered; rebuild_static_batch re-bakes just those.
+//
+// Baked instances are static: they keep their own rotation but not the time driven spin vertex_shader.hlsl adds.
+//
+// Needs culling.h and occlusion.h in the same translation unit.
+
+
+constexpr u32 BATCH_MAX_MESH_TRIANGLES = 1024;//Bigger meshes keep their own draws, baking them would only cost memory
+constexpr u32 BATCH_NO_CELL = ~0u;
+
+// CPU copy of a mesh to bake from.
+struct BatchSourceMesh
+{
+	const Vertex* vertices;
+	u32 vertex_count;
+	const u32* indices;
+	u32 index_count;
+};
+
+struct BatchCell
+{
+	Vertex* vertices;//World space
+	u32* indices;//Into vertices
+	u32 vertex_count;
+	u32 index_count;
+
+	vec3 bounds_min;
+	vec3 bounds_max;
+	vec3 centre;//Sphere around the box, what the culler tests
+	f32 radius;
+
+	u32 first_instance;//Handle of the first instance in the cell, BATCH_NO_CELL when empty
+	u32 instance_count;
+	u8 dirty;
+};
+
+struct StaticBatch
+{
+	BatchCell* cells;
+	u32 cells_x;
+	u32 cells_y;
+	u32 cells_z;
+	vec3 world_min;
+	f32 cell_size;
+
+	//Per handle
+	DrawInfo* instance_draws;//Placement that gets baked
+	u32* instance_cells;//BATCH_NO_CELL for instances that are not batched
+	u32* next_in_cell;//Cell instance lists are linked through the handles
+
+	u32 instance_capacity;
+	u32 dirty_count;
+};
+
+void init_static_batch(StaticBatch* batch, u32 instance_capacity, vec3 world_min, vec3 world_max, f32 cell_size)
+{
+	*batch = {};
+
+	vec3 extent = world_max - world_min;
+	batch->cells_x = MAX((u32)ceilf(extent.x / cell_size), 1u);
+	batch->cells_y = MAX((u32)ceilf(extent.y / cell_size), 1u);
+	batch->cells_z = MAX((u32)ceilf(extent.z / cell_size), 1u);
+	batch->world_min = world_min;
+	batch->cell_size = cell_size;
+
+	u32 cell_count = batch->cells_x * batch->cells_y * batch->cells_z;
+	batch->cells = new BatchCell[cell_count];
+	for (u32 i = 0; i < cell_count; ++i)
+	{
+		batch->cells[i] = {};
+		batch->cells[i].first_instance = BATCH_NO_CELL;
+	}
+
+	batch->instance_draws = new DrawInfo[instance_capacity];
+	batch->instance_cells = new u32[instance_capacity];
+	batch->next_in_cell = new u32[instance_capacity];
+	batch->instance_capacity = instance_capacity;
+	for (u32 i = 0; i < instance_capacity; ++i) batch->instance_cells[i] = BATCH_NO_CELL;
+}
+
+void free_static_batch(StaticBatch* batch)
+{
+	u32 cell_count = batch->cells_x * batch->cells_y * batch->cells_z;
+	for (u32 i = 0; i < cell_count; ++i)
+	{
+		delete[] batch->cells[i].vertices;
+		delete[] batch->cells[i].indices;
+	}
+
+	delete[] batch->cells;
+	delete[] batch->instance_draws;
+	delete[] batch->instance_cells;
+	delete[] batch->next_in_cell;
+	*batch = {};
+}
+
+inline u32 batch_cell_count(const StaticBatch* batch)
+{
+	return batch->cells_x * batch->cells_y * batch->cells_z;
+}
+
+// Positions outside the world bounds clamp to the border cells, like the instance store's keys.
+u32 batch_cell_index(const StaticBatch* batch, vec3 position)
+{
+	vec3 p = (position - batch->world_min) * (1.0f / batch->cell_size);
+
+	u32 x = (u32)MIN(MAX(p.x, 0.0f), (f32)(batch->cells_x - 1));
+	u32 y = (u32)MIN(MAX(p.y, 0.0f), (f32)(batch->cells_y - 1));
+	u32 z = (u32)MIN(MAX(p.z, 0.0f), (f32)(batch->cells_z - 1));
+
+	return (z * batch->cells_y + y) * batch->cells_x + x;
+}
+
+void mark_batch_cell_dirty(StaticBatch* batch, u32 cell)
+{
+	if (batch->cells[cell].dirty) return;
+
+	batch->cells[cell].dirty = 1;
+	batch->dirty_count++;
+}
+
+void unlink_batched_instance(StaticBatch* batch, u32 handle)
+{
+	u32 cell_index = batch->instance_cells[handle];
+	BatchCell* cell = &batch->cells[cell_index];
+
+	u32* link = &cell->first_instance;
+	while (*link != handle) link = &batch->next_in_cell[*link];
+	*link = batch->next_in_cell[handle];
+
+	cell->instance_count--;
+	batch->instance_cells[handle] = BATCH_NO_CELL;
+	mark_batch_cell_dirty(batch, cell_index);
+}
+
+void link_batched_instance(StaticBatch* batch, u32 handle, u32 cell_index)
+{
+	BatchCell* cell = &batch->cells[cell_index];
+
+	batch->next_in_cell[handle] = cell->first_instance;
+	cell->first_instance = handle;
+	cell->instance_count++;
+	batch->instance_cells[handle] = cell_index;
+	mark_batch_cell_dirty(batch, cell_index);
+}
+
+// Returns false and leaves the instance alone when its mesh is too big to batch.
+bool add_batched_instance(StaticBatch* batch, const BatchSourceMesh* meshes, u32 handle, const DrawInfo* draw_info)
+{
+	assert(handle < batch->instance_capacity && batch->instance_cells[handle] == BATCH_NO_CELL);
+
+	if (meshes[draw_info->vertex_buffer_index].index_count / 3 > BATCH_MAX_MESH_TRIANGLES) return false;
+
+	batch->instance_draws[handle] = *draw_info;
+	link_batched_instance(batch, handle, batch_cell_index(batch, draw_info->position));
+	return true;
+}
+
+// New placement for a batched instance. Its cell is re-baked, and so is the old one if it changed cells.
+void update_batched_instance(StaticBatch* batch, u32 handle, const DrawInfo* draw_info)
+{
+	u32 cell_index = batch->instance_cells[handle];
+	assert(cell_index != BATCH_NO_CELL && draw_info->vertex_buffer_index == batch->instance_draws[handle].vertex_buffer_index);
+
+	batch->instance_draws[handle] = *draw_info;
+
+	u32 new_cell_index = batch_cell_index(batch, draw_info->position);
+	if (new_cell_index == cell_index)
+	{
+		mark_batch_cell_dirty(batch, cell_index);
+		return;
+	}
+
+	unlink_batched_instance(batch, handle);
+	link_batched_instance(batch, handle, new_cell_index);
+}
+
+void remove_batched_instance(StaticBatch* batch, u32 handle)
+{
+	if (batch->instance_cells[handle] == BATCH_NO_CELL) return;
+	unlink_batched_instance(batch, handle);
+}
+
+// Re-bakes one cell from its instance list, in list order.
+void bake_batch_cell(StaticBatch* batch, const BatchSourceMesh* meshes, BatchCell* cell)
+{
+	delete[] cell->vertices;
+	delete[] cell->indices;
+	cell->vertices = 0;
+	cell->indices = 0;
+	cell->vertex_count = 0;
+	cell->index_count = 0;
+	cell->bounds_min = Vec3(FLT_MAX);
+	cell->bounds_max = Vec3(-FLT_MAX);
+	cell->centre = Vec3(0.0f);
+	cell->radius = 0.0f;
+	cell->dirty = 0;
+
+	if (cell->instance_count == 0) return;
+
+	u32 vertex_count = 0, index_count = 0;
+	for (u32 handle = cell->first_instance; handle != BATCH_NO_CELL; handle = batch->next_in_cell[handle])
+	{
+		const BatchSourceMesh* mesh = &meshes[batch->instance_draws[handle].vertex_buffer_index];
+		vertex_count += mesh->vertex_count;
+		index_count += mesh->index_count;
+	}
+
+	cell->vertices = new Vertex[MAX(vertex_count, 1u)];
+	cell->indices = new u32[MAX(index_count, 1u)];
+
+	for (u32 handle = cell->first_instance; handle != BATCH_NO_CELL; handle = batch->next_in_cell[handle])
+	{
+		const DrawInfo* draw_info = &batch->instance_draws[handle];
+		const BatchSourceMesh* mesh = &meshes[draw_info->vertex_buffer_index];
+		vec4 quat = normalize(draw_info->quat);
+
+		u32 base_vertex = cell->vertex_count;
+		for (u32 i = 0; i < mesh->vertex_count; ++i)
+		{
+			const Vertex* source = &mesh->vertices[i];
+			vec3 position = rotate_vec_by_quat(Vec3(source->position[0], source->position[1], source->position[2]), quat) + draw_info->position;
+			vec3 normal = rotate_vec_by_quat(Vec3(source->normal[0], source->normal[1], source->normal[2]), quat);
+
+			Vertex* v = &cell->vertices[cell->vertex_count++];
+			v->position[0] = position.x; v->position[1] = position.y; v->position[2] = position.z;
+			v->normal[0] = normal.x; v->normal[1] = normal.y; v->normal[2] = normal.z;
+
+			cell->bounds_min = Vec3(MIN(cell->bounds_min.x, position.x), MIN(cell->bounds_min.y, position.y), MIN(cell->bounds_min.z, position.z));
+			cell->bounds_max = Vec3(MAX(cell->bounds_max.x, position.x), MAX(cell->bounds_max.y, position.y), MAX(cell->bounds_max.z, position.z));
+		}
+
+		for (u32 i = 0; i < mesh->index_count; ++i) cell->indices[cell->index_count++] = base_vertex + mesh->indices[i];
+	}
+
+	cell->centre = (cell->bounds_min + cell->bounds_max) * 0.5f;
+	cell->radius = length(cell->bounds_max - cell->centre);
+}
+
+// Re-bakes the dirty cells. Returns how many there were.
+u32 rebuild_static_batch(StaticBatch* batch, const BatchSourceMesh* meshes)
+{
+	if (batch->dirty_count == 0) return 0;
+
+	u32 rebuilt = 0;
+	for (u32 i = 0; i < batch_cell_count(batch); ++i)
+	{
+		if (!batch->cells[i].dirty) continue;
+
+		bake_batch_cell(batch, meshes, &batch->cells[i]);
+		rebuilt++;
+	}
+
+	batch->dirty_count = 0;
+	return rebuilt;
+}
+
+// Non-empty cells whose sphere is in the frustum, written to visible_cells. Returns the count, which is the number of
+// batch draws this frame.
+u32 cull_static_batch(const StaticBatch* batch, const CullFrustum* frustum, u32* visible_cells)
+{
+	u32 visible_count = 0;
+
+	for (u32 i = 0; i < batch_cell_count(batch); ++i)
+	{
+		const BatchCell* cell = &batch->cells[i];
+		if (cell->index_count == 0) continue;
+		if (!sphere_in_frustum(frustum, cell->centre, cell->radius * frustum->bounds_scale)) continue;
+
+		visible_cells[visible_count++] = i;
+	}
+
+	return visible_count;
+}
+
+
+// Checks every cell against its instances, transformed again through a rotation matrix rather than the quaternion
+// path bake_batch_cell uses: every batched instance has to be in the cell of its position, its triangles have to be
+// in the cell's chunk in list order with the mesh's connectivity, its vertices within tolerance of the reference and
+// inside the cell's bounds, and no cell may be left dirty. Prints the first mismatch and returns false otherwise.
+bool verify_static_batch(const StaticBatch* batch, const BatchSourceMesh* meshes)
+{
+	if (batch->dirty_count != 0)
+	{
+		printf("Static batch: %u cells still dirty\n", batch->dirty_count);
+		return false;
+	}
+
+	u32 listed = 0;
+	for (u32 c = 0; c < batch_cell_count(batch); ++c)
+	{
+		const BatchCell* cell = &batch->cells[c];
+		u32 vertex_offset = 0, index_offset = 0, instance_count = 0;
+
+		for (u32 handle = cell->first_instance; handle != BATCH_NO_CELL; handle = batch->next_in_cell[handle])
+		{
+			const DrawInfo* draw_info = &batch->instance_draws[handle];
+			const BatchSourceMesh* mesh = &meshes[draw_info->vertex_buffer_index];
+
+			if (batch->instance_cells[handle] != c || batch_cell_index(batch, draw_info->position) != c)
+			{
+				printf("Static batch: instance %u is listed in cell %u but belongs to cell %u\n", handle, c, batch_cell_index(batch, draw_info->position));
+				return false;
+			}
+
+			if (vertex_offset + mesh->vertex_count > cell->vertex_count || index_offset + mesh->index_count > cell->index_count)
+			{
+				printf("Static batch: cell %u is too small for instance %u\n", c, handle);
+				return false;
+			}
+
+			vec4 q = normalize(draw_info->quat);
+			Mat4x4 rotation = {};
+			rotation.row_vecs[0] = {1 - 2 * (q.y * q.y + q.z * q.z), 2 * (q.x * q.y - q.z * q.w), 2 * (q.x * q.z + q.y * q.w), 0};
+			rotation.row_vecs[1] = {2 * (q.x * q.y + q.z * q.w), 1 - 2 * (q.x * q.x + q.z * q.z), 2 * (q.y * q.z - q.x * q.w), 0};
+			rotation.row_vecs[2] = {2 * (q.x * q.z - q.y * q.w), 2 * (q.y * q.z + q.x * q.w), 1 - 2 * (q.x * q.x + q.y * q.y), 0};
+			rotation.row_vecs[3] = {0, 0, 0, 1};
+
+			for (u32 i = 0; i < mesh->vertex_count; ++i)
+			{
+				const f32* p = mesh->vertices[i].position;
+				vec4 expected = mult(rotation, vec4{p[0], p[1], p[2], 1.0f});
+				vec3 expected_position = Vec3(expected.x, expected.y, expected.z) + draw_info->position;
+
+				const Vertex* v = &cell->vertices[vertex_offset + i];
+				vec3 position = Vec3(v->position[0], v->position[1], v->position[2]);
+				f32 tolerance = 1e-4f * MAX(length(expected_position), 1.0f);
+
+				bool inside = position.x >= cell->bounds_min.x && position.y >= cell->bounds_min.y && position.z >= cell->bounds_min.z &&
+				              position.x <= cell->bounds_max.x && position.y <= cell->bounds_max.y && position.z <= cell->bounds_max.z;
+
+				if (length(position - expected_position) > tolerance || !inside || length(position - cell->centre) > cell->radius * (1.0f + 1e-5f))
+				{
+					printf("Static batch: vertex %u of instance %u in cell %u is at %f %f %f, expected %f %f %f inside the cell bounds\n",
+					       i, handle, c, position.x, position.y, position.z, expected_position.x, expected_position.y, expected_position.z);
+					return false;
+				}
+			}
+
+			for (u32 i = 0; i < mesh->index_count; ++i)
+			{
+				if (cell->indices[index_offset + i] != vertex_offset + mesh->indices[i])
+				{
+					printf("Static batch: index %u of instance %u in cell %u is %u, expected %u\n", i, handle, c, cell->indices[index_offset + i], vertex_offset + mesh->indices[i]);
+					return false;
+				}
+			}
+
+			vertex_offset += mesh->vertex_count;
+			index_offset += mesh->index_count;
+			instance_count++;
+		}
+
+		if (vertex_offset != cell->vertex_count || index_offset != cell->index_count || instance_count != cell->instance_count)
+		{
+			printf("Static batch: cell %u holds %u vertices, %u indices and %u instances, expected %u, %u and %u\n",
+			       c, cell->vertex_count, cell->index_count, cell->instance_count, vertex_offset, index_offset, instance_count);
+			return false;
+		}
+
+		listed += instance_count;
+	}
+
+	u32 batched = 0;
+	for (u32 i = 0; i < batch->instance_capacity; ++i) batched += batch->instance_cells[i] != BATCH_NO_CELL;
+
+	if (batched != listed)
+	{
+		printf("Static batch: %u instances are batched but %u are listed in cells\n", batched, listed);
+		return false;
+	}
+
+	return true;
+}
+
+// Scatters instance_count random instances of meshes over the world bounds like draw() does, batches them for each
+// cell size and prints the draws before and after, what coarser culling costs in triangles for the given camera,
+// and the full and incremental bake times. Moves 1% of the instances and removes a few before checking again.
+void benchmark_static_batching(const BatchSourceMesh* meshes, u32 mesh_count, u32 instance_count, vec3 world_min, vec3 world_max,
+                               const f32* cell_sizes, u32 cell_size_count, const ShaderGlobals* globals)
+{
+	DrawInfo* draws = new DrawInfo[instance_count];
+	u32 random = 101;
+	for (u32 i = 0; i < instance_count; ++i)
+	{
+		draws[i] = {};
+		draws[i].position = Vec3(rand_f32_in_range(world_min.x, world_max.x, &random), rand_f32_in_range(world_min.y, world_max.y, &random), rand_f32_in_range(world_min.z, world_max.z, &random));
+		draws[i].quat = normalize(vec4{rand_f32_in_range(-1.0f, 1.0f, &random), rand_f32_in_range(-1.0f, 1.0f, &random), rand_f32_in_range(-1.0f, 1.0f, &random), rand_f32_in_range(-1.0f, 1.0f, &random)});
+		draws[i].vertex_buffer_index = MIN((u32)(rand_f32_normal(&random) * mesh_count), mesh_count - 1);
+	}
+
+	f32* mesh_radii = new f32[mesh_count];
+	for (u32 m = 0; m < mesh_count; ++m)
+	{
+		mesh_radii[m] = 0.0f;
+		for (u32 i = 0; i < meshes[m].vertex_count; ++i)
+		{
+			const f32* p = meshes[m].vertices[i].position;
+			mesh_radii[m] = MAX(mesh_radii[m], length(Vec3(p[0], p[1], p[2])));
+		}
+	}
+
+	//Per instance culling as the reference for what the coarser cells cost.
+	CullFrustum frustum = make_cull_frustum(globals);
+	u32 visible_instances = 0;
+	u64 visible_triangles = 0;
+	u32 small_instances = 0;
+	for (u32 i = 0; i < instance_count; ++i)
+	{
+		const BatchSourceMesh* mesh = &meshes[draws[i].vertex_buffer_index];
+		if (mesh->index_count / 3 > BATCH_MAX_MESH_TRIANGLES) continue;
+
+		small_instances++;
+		if (!sphere_in_frustum(&frustum, draws[i].position, mesh_radii[draws[i].vertex_buffer_index] * frustum.bounds_scale)) continue;
+
+		visible_instances++;
+		visible_triangles += mesh->index_count / 3;
+	}
+
+	printf("Static batching, %u instances, %u of them small: %u visible with %llu triangles when culled one by one\n",
+	       instance_count, small_instances, visible_instances, (unsigned long long)visible_triangles);
+
+	for (u32 s = 0; s < cell_size_count; ++s)
+	{
+		StaticBatch batch;
+		init_static_batch(&batch, instance_count, world_min, world_max, cell_sizes[s]);
+
+		f64 start = time_in_seconds();
+		for (u32 i = 0; i < instance_count; ++i) add_batched_instance(&batch, meshes, i, &draws[i]);
+		rebuild_static_batch(&batch, meshes);
+		f64 full_seconds = time_in_seconds() - start;
+
+		bool passed = verify_static_batch(&batch, meshes);
+
+		u32 chunk_count = 0;
+		u64 vertex_bytes = 0;
+		for (u32 c = 0; c < batch_cell_count(&batch); ++c)
+		{
+			chunk_count += batch.cells[c].index_count != 0;
+			vertex_bytes += batch.cells[c].vertex_count * sizeof(Vertex) + batch.cells[c].index_count * sizeof(u32);
+		}
+
+		u32* visible_cells = new u32[batch_cell_count(&batch)];
+		u32 visible_chunks = cull_static_batch(&batch, &frustum, visible_cells);
+		u64 chunk_triangles = 0;
+		for (u32 i = 0; i < visible_chunks; ++i) chunk_triangles += batch.cells[visible_cells[i]].index_count / 3;
+		delete[] visible_cells;
+
+		//1% of the instances move up to a cell size, some of them into other cells, and a few are removed.
+		u32 moved = MAX(small_instances / 100, 1u);
+		u32 removed = 0;
+		for (u32 i = 0, done = 0; i < instance_count && done < moved; i += 97)
+		{
+			if (batch.instance_cells[i] == BATCH_NO_CELL) continue;
+
+			DrawInfo draw_info = draws[i];
+			draw_info.position = draw_info.position + Vec3(rand_f32_in_range(-1.0f, 1.0f, &random), 0.0f, rand_f32_in_range(-1.0f, 1.0f, &random)) * cell_sizes[s];
+			update_batched_instance(&batch, i, &draw_info);
+			done++;
+		}
+		for (u32 i = 13; i < instance_count && removed < 8; i += 211)
+		{
+			if (batch.instance_cells[i] == BATCH_NO_CELL) continue;
+			remove_batched_instance(&batch, i);
+			removed++;
+		}
+
+		start = time_in_seconds();
+		u32 rebuilt = rebuild_static_batch(&batch, meshes);
+		f64 incremental_seconds = time_in_seconds() - start;
+
+		passed = verify_static_batch(&batch, meshes) && passed;
+
+		printf("  cell %.1f: %u draws -> %u chunks (%.1fx fewer), %.1fMB baked, %s\n",
+		       cell_sizes[s], small_instances, chunk_count, chunk_count ? (f64)small_instances / chunk_count : 0.0,
+		       vertex_bytes / (1024.0 * 1024.0), passed ? "merge verified" : "MERGE FAILED");
+		printf("    visible: %u chunks with %llu triangles (%.2fx the per instance triangles)\n",
+		       visible_chunks, (unsigned long long)chunk_triangles, visible_triangles ? (f64)chunk_triangles / visible_triangles : 0.0);
+		printf("    full bake %.2fms; %u moved, %u removed -> %u of %u cells rebuilt in %.3fms\n",
+		       full_seconds * 1000.0, moved, removed, rebuilt, batch_cell_count(&batch), incremental_seconds * 1000.0);
+
+		free_static_batch(&batch);
+	}
+
+	delete[] draws;
+	delete[] mesh_radii;
+}
@@ -0,0 +1,392 @@
+#pragma once
+
+// Per triangle filter for one instance draw. Instance culling and LOD selection only decide whole meshes, so a visible
+// Apollo statue still sends every back facing, zero area and sub-pixel triangle to the rasterizer. This takes the
+// draw's index range and instance transform and writes a compacted index buffer holding only the triangles that can
+// cover a sample, in their original order so the vertex cache order survives.
+//
+// A triangle is dropped when it is
+// - off screen: all three corners outside the same clip plane, or all in front of the near plane
+// - degenerate: zero area on screen, which includes triangles repeating an index
+// - back facing: the pipeline culls clockwise triangles (FrontCounterClockwise), which have a positive determinant
+//   with screen y pointing down
+// - small: its screen bounding box rounds to the same pixel edge in x or y, so no pixel centre lies inside it
+// Triangles that cross the near plane can not be projected and are always kept.
+//
+// Vertices are transformed once per draw into pixel positions and clip codes, then triangles are tested four at a
+// time with SSE2 and the survivors appended in order. cull_triangles is the scalar reference a compute version
+// should match; cull_triangles_sse has to give exactly the same output and benchmark_triangle_culling checks it.
+//
+// Needs occlusion.h for the instance transform.
+
+#include <emmintrin.h>
+
+
+enum TriangleCull
+{
+	TRIANGLE_VISIBLE,
+	TRIANGLE_OFF_SCREEN,
+	TRIANGLE_DEGENERATE,
+	TRIANGLE_BACK_FACING,
+	TRIANGLE_SMALL,
+
+	TRIANGLE_CULL_COUNT
+};
+
+static char* triangle_cull_names[TRIANGLE_CULL_COUNT] = {"visible", "off screen", "degenerate", "back facing", "small"};
+
+struct TriangleCullStats
+{
+	u32 triangles[TRIANGLE_CULL_COUNT];//Triangles per outcome, TRIANGLE_VISIBLE are the ones written
+};
+
+//Clip codes, one bit per plane the vertex is outside of.
+constexpr u32 CLIP_LEFT = 1;
+constexpr u32 CLIP_RIGHT = 2;
+constexpr u32 CLIP_BOTTOM = 4;
+constexpr u32 CLIP_TOP = 8;
+constexpr u32 CLIP_NEAR = 16;//Reversed Z depth above 1, which includes everything behind the camera
+
+// Projected vertices of one draw, SoA so four triangles' corners load as lanes.
+struct TriangleCullVertices
+{
+	f32* x;//Pixels, only meaningful without CLIP_NEAR
+	f32* y;
+	u32* clip_codes;
+	u32 capacity;
+};
+
+void init_triangle_cull_vertices(TriangleCullVertices* vertices, u32 capacity)
+{
+	capacity = (capacity + 3) & ~3u;
+
+	*vertices = {};
+	vertices->x = new f32[capacity];
+	vertices->y = new f32[capacity];
+	vertices->clip_codes = new u32[capacity];
+	vertices->capacity = capacity;
+}
+
+void free_triangle_cull_vertices(TriangleCullVertices* vertices)
+{
+	delete[] vertices->x;
+	delete[] vertices->y;
+	delete[] vertices->clip_codes;
+	*vertices = {};
+}
+
+// Object space to clip space for an instance, the transform vertex_shader.hlsl applies.
+Mat4x4 triangle_cull_transform(const ShaderGlobals* globals, const DrawInfo* draw_info)
+{
+	Mat4x4 world = instance_world_matrix(draw_info, globals->time);
+	return mult(mult(globals->projection, globals->view), world);
+}
+
+void project_triangle_cull_vertices(TriangleCullVertices* vertices, const Mat4x4* m, const f32* positions, size_t positions_stride, u32 vertex_count, u32 width, u32 height)
+{
+	assert(vertex_count <= vertices->capacity);
+
+	f32 half_width = width * 0.5f;
+	f32 half_height = height * 0.5f;
+	size_t stride_in_floats = positions_stride / sizeof(f32);
+
+	for (u32 i = 0; i < vertex_count; ++i)
+	{
+		const f32* p = positions + i * stride_in_floats;
+
+		f32 cx = m->d[0][0] * p[0] + m->d[0][1] * p[1] + m->d[0][2] * p[2] + m->d[0][3];
+		f32 cy = m->d[1][0] * p[0] + m->d[1][1] * p[1] + m->d[1][2] * p[2] + m->d[1][3];
+		f32 cz = m->d[2][0] * p[0] + m->d[2][1] * p[1] + m->d[2][2] * p[2] + m->d[2][3];
+		f32 cw = m->d[3][0] * p[0] + m->d[3][1] * p[1] + m->d[3][2] * p[2] + m->d[3][3];
+
+		u32 code = 0;
+		if (cx < -cw) code |= CLIP_LEFT;
+		if (cx > cw) code |= CLIP_RIGHT;
+		if (cy < -cw) code |= CLIP_BOTTOM;
+		if (cy > cw) code |= CLIP_TOP;
+		if (cz > cw) code |= CLIP_NEAR;
+		vertices->clip_codes[i] = code;
+
+		f32 inv_w = 1.0f / cw;
+		vertices->x[i] = (cx * inv_w + 1.0f) * half_width;
+		vertices->y[i] = (1.0f - cy * inv_w) * half_height;
+	}
+}
+
+// Same as project_triangle_cull_vertices four vertices at a time, with the operations in the same order so the
+// results are bit identical.
+void project_triangle_cull_vertices_sse(TriangleCullVertices* vertices, const Mat4x4* m, const f32* positions, size_t positions_stride, u32 vertex_count, u32 width, u32 height)
+{
+	assert(vertex_count <= vertices->capacity);
+
+	__m128 row[4][4];
+	for (u32 r = 0; r < 4; ++r)
+		for (u32 c = 0; c < 4; ++c) row[r][c] = _mm_set1_ps(m->d[r][c]);
+
+	__m128 half_width = _mm_set1_ps(width * 0.5f);
+	__m128 half_height = _mm_set1_ps(height * 0.5f);
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 sign = _mm_set1_ps(-0.0f);
+	size_t stride_in_floats = positions_stride / sizeof(f32);
+
+	u32 i = 0;
+	for (; i + 4 <= vertex_count; i += 4)
+	{
+		const f32* p0 = positions + (i + 0) * stride_in_floats;
+		const f32* p1 = positions + (i + 1) * stride_in_floats;
+		const f32* p2 = positions + (i + 2) * stride_in_floats;
+		const f32* p3 = positions + (i + 3) * stride_in_floats;
+		__m128 px = _mm_set_ps(p3[0], p2[0], p1[0], p0[0]);
+		__m128 py = _mm_set_ps(p3[1], p2[1], p1[1], p0[1]);
+		__m128 pz = _mm_set_ps(p3[2], p2[2], p1[2], p0[2]);
+
+		__m128 clip[4];
+		for (u32 r = 0; r < 4; ++r)
+			clip[r] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(row[r][0], px), _mm_mul_ps(row[r][1], py)), _mm_mul_ps(row[r][2], pz)), row[r][3]);
+
+		__m128 cx = clip[0], cy = clip[1], cz = clip[2], cw = clip[3];
+		__m128 negative_w = _mm_xor_ps(cw, sign);
+
+		__m128i code = _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(cx, negative_w)), _mm_set1_epi32(CLIP_LEFT));
+		code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(cx, cw)), _mm_set1_epi32(CLIP_RIGHT)));
+		code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(cy, negative_w)), _mm_set1_epi32(CLIP_BOTTOM)));
+		code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(cy, cw)), _mm_set1_epi32(CLIP_TOP)));
+		code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(cz, cw)), _mm_set1_epi32(CLIP_NEAR)));
+		_mm_storeu_si128((__m128i*)(vertices->clip_codes + i), code);
+
+		__m128 inv_w = _mm_div_ps(one, cw);
+		_mm_storeu_ps(vertices->x + i, _mm_mul_ps(_mm_add_ps(_mm_mul_ps(cx, inv_w), one), half_width));
+		_mm_storeu_ps(vertices->y + i, _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(cy, inv_w)), half_height));
+	}
+
+	if (i < vertex_count)
+	{
+		TriangleCullVertices rest = {vertices->x + i, vertices->y + i, vertices->clip_codes + i, vertices->capacity - i};
+		project_triangle_cull_vertices(&rest, m, positions + i * stride_in_floats, positions_stride, vertex_count - i, width, height);
+	}
+}
+
+// Pixel centres sit at i + 0.5, so a range [min, max] holds one exactly when the two round to different integers.
+// Both ends are clamped to the target first, which keeps far away corners in the integer range; a range entirely
+// beside the target clamps to a single edge and holds no centre either. Rounding is to nearest even, as cvtps_epi32
+// and HLSL's round do.
+inline bool range_misses_pixel_centres(f32 min, f32 max, f32 size)
+{
+	min = MIN(MAX(min, 0.0f), size);
+	max = MIN(MAX(max, 0.0f), size);
+	return _mm_cvtss_si32(_mm_set_ss(min)) == _mm_cvtss_si32(_mm_set_ss(max));
+}
+
+TriangleCull classify_triangle(const TriangleCullVertices* vertices, u32 a, u32 b, u32 c, u32 width, u32 height)
+{
+	u32 code_a = vertices->clip_codes[a];
+	u32 code_b = vertices->clip_codes[b];
+	u32 code_c = vertices->clip_codes[c];
+
+	if (code_a & code_b & code_c) return TRIANGLE_OFF_SCREEN;
+	if ((code_a | code_b | code_c) & CLIP_NEAR) return TRIANGLE_VISIBLE;
+
+	f32 ax = vertices->x[a], ay = vertices->y[a];
+	f32 bx = vertices->x[b], by = vertices->y[b];
+	f32 cx = vertices->x[c], cy = vertices->y[c];
+
+	f32 det = (bx - ax) * (cy - ay) - (by - ay) * (cx - ax);
+	if (det == 0.0f) return TRIANGLE_DEGENERATE;
+	if (det > 0.0f) return TRIANGLE_BACK_FACING;
+
+	f32 min_x = MIN(ax, MIN(bx, cx)), max_x = MAX(ax, MAX(bx, cx));
+	f32 min_y = MIN(ay, MIN(by, cy)), max_y = MAX(ay, MAX(by, cy));
+	if (range_misses_pixel_centres(min_x, max_x, (f32)width) || range_misses_pixel_centres(min_y, max_y, (f32)height)) return TRIANGLE_SMALL;
+
+	return TRIANGLE_VISIBLE;
+}
+
+// Writes the visible triangles of indices to destination, which may be indices itself. Returns the index count written.
+u32 cull_triangles(u32* destination, const u32* indices, u32 index_count, const TriangleCullVertices* vertices, u32 width, u32 height, TriangleCullStats* stats)
+{
+	TriangleCullStats local_stats = {};
+	u32 written = 0;
+
+	for (u32 i = 0; i + 3 <= index_count; i += 3)
+	{
+		u32 a = indices[i + 0], b = indices[i + 1], c = indices[i + 2];
+		TriangleCull result = classify_triangle(vertices, a, b, c, width, height);
+		local_stats.triangles[result]++;
+
+		if (result != TRIANGLE_VISIBLE) continue;
+
+		destination[written + 0] = a;
+		destination[written + 1] = b;
+		destination[written + 2] = c;
+		written += 3;
+	}
+
+	if (stats) *stats = local_stats;
+	return written;
+}
+
+static const u8 lane_count_table[16] = {0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4};
+
+// cull_triangles four triangles at a time: the corners are gathered into lanes, every test becomes a mask and the
+// first test to fail decides a lane's outcome, in the reference's order.
+u32 cull_triangles_sse(u32* destination, const u32* indices, u32 index_count, const TriangleCullVertices* vertices, u32 width, u32 height, TriangleCullStats* stats)
+{
+	TriangleCullStats local_stats = {};
+	u32 written = 0;
+	u32 triangle_count = index_count / 3;
+
+	__m128 zero = _mm_setzero_ps();
+	__m128 target_width = _mm_set1_ps((f32)width);
+	__m128 target_height = _mm_set1_ps((f32)height);
+	__m128i near = _mm_set1_epi32(CLIP_NEAR);
+	__m128i zero_i = _mm_setzero_si128();
+
+	u32 t = 0;
+	for (; t + 4 <= triangle_count; t += 4)
+	{
+		const u32* tri = indices + t * 3;
+
+		__m128i code_a = _mm_set_epi32(vertices->clip_codes[tri[9]], vertices->clip_codes[tri[6]], vertices->clip_codes[tri[3]], vertices->clip_codes[tri[0]]);
+		__m128i code_b = _mm_set_epi32(vertices->clip_codes[tri[10]], vertices->clip_codes[tri[7]], vertices->clip_codes[tri[4]], vertices->clip_codes[tri[1]]);
+		__m128i code_c = _mm_set_epi32(vertices->clip_codes[tri[11]], vertices->clip_codes[tri[8]], vertices->clip_codes[tri[5]], vertices->clip_codes[tri[2]]);
+
+		__m128 ax = _mm_set_ps(vertices->x[tri[9]], vertices->x[tri[6]], vertices->x[tri[3]], vertices->x[tri[0]]);
+		__m128 ay = _mm_set_ps(vertices->y[tri[9]], vertices->y[tri[6]], vertices->y[tri[3]], vertices->y[tri[0]]);
+		__m128 bx = _mm_set_ps(vertices->x[tri[10]], vertices->x[tri[7]], vertices->x[tri[4]], vertices->x[tri[1]]);
+		__m128 by = _mm_set_ps(vertices->y[tri[10]], vertices->y[tri[7]], vertices->y[tri[4]], vertices->y[tri[1]]);
+		__m128 cx = _mm_set_ps(vertices->x[tri[11]], vertices->x[tri[8]], vertices->x[tri[5]], vertices->x[tri[2]]);
+		__m128 cy = _mm_set_ps(vertices->y[tri[11]], vertices->y[tri[8]], vertices->y[tri[5]], vertices->y[tri[2]]);
+
+		u32 off_screen = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(_mm_and_si128(_mm_and_si128(code_a, code_b), code_c), zero_i)));
+		u32 crosses_near = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_or_si128(_mm_or_si128(code_a, code_b), code_c), near), near)));
+
+		__m128 det = _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(bx, ax), _mm_sub_ps(cy, ay)), _mm_mul_ps(_mm_sub_ps(by, ay), _mm_sub_ps(cx, ax)));
+		u32 degenerate = _mm_movemask_ps(_mm_cmpeq_ps(det, zero));
+		u32 back_facing = _mm_movemask_ps(_mm_cmpgt_ps(det, zero));
+
+		__m128 min_x = _mm_min_ps(_mm_max_ps(_mm_min_ps(ax, _mm_min_ps(bx, cx)), zero), target_width);
+		__m128 max_x = _mm_min_ps(_mm_max_ps(_mm_max_ps(ax, _mm_max_ps(bx, cx)), zero), target_width);
+		__m128 min_y = _mm_min_ps(_mm_max_ps(_mm_min_ps(ay, _mm_min_ps(by, cy)), zero), target_height);
+		__m128 max_y = _mm_min_ps(_mm_max_ps(_mm_max_ps(ay, _mm_max_ps(by, cy)), zero), target_height);
+		__m128i same_x = _mm_cmpeq_epi32(_mm_cvtps_epi32(min_x), _mm_cvtps_epi32(max_x));
+		__m128i same_y = _mm_cmpeq_epi32(_mm_cvtps_epi32(min_y), _mm_cvtps_epi32(max_y));
+		u32 small = _mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(same_x, same_y)));
+
+		//Triangles crossing the near plane skip every screen space test; their pixel positions are meaningless.
+		u32 projected = ~(off_screen | crosses_near) & 15;
+		degenerate &= projected;
+		back_facing &= projected & ~degenerate;
+		small &= projected & ~degenerate & ~back_facing;
+		u32 visible = ~(off_screen | degenerate | back_facing | small) & 15;
+
+		local_stats.triangles[TRIANGLE_OFF_SCREEN] += lane_count_table[off_screen];
+		local_stats.triangles[TRIANGLE_DEGENERATE] += lane_count_table[degenerate];
+		local_stats.triangles[TRIANGLE_BACK_FACING] += lane_count_table[back_facing];
+		local_stats.triangles[TRIANGLE_SMALL] += lane_count_table[small];
+		local_stats.triangles[TRIANGLE_VISIBLE] += lane_count_table[visible];
+
+		for (u32 lane = 0; lane < 4; ++lane)
+		{
+			if (!(visible & (1 << lane))) continue;
+
+			destination[written + 0] = tri[lane * 3 + 0];
+			destination[written + 1] = tri[lane * 3 + 1];
+			destination[written + 2] = tri[lane * 3 + 2];
+			written += 3;
+		}
+	}
+
+	if (t < triangle_count)
+	{
+		TriangleCullStats rest_stats;
+		written += cull_triangles(destination + written, indices + t * 3, (triangle_count - t) * 3, vertices, width, height, &rest_stats);
+		for (u32 i = 0; i < TRIANGLE_CULL_COUNT; ++i) local_stats.triangles[i] += rest_stats.triangles[i];
+	}
+
+	if (stats) *stats = local_stats;
+	return written;
+}
+
+// The whole filter for one instance draw: projects the mesh's vertices with the instance transform and writes the
+// visible triangles of indices[first_index, first_index + index_count), a LOD's range of the mesh index buffer, to
+// destination. vertices needs room for vertex_count. Returns the index count written.
+u32 filter_instance_triangles(u32* destination, const u32* indices, u32 first_index, u32 index_count,
+                              const f32* positions, size_t positions_stride, u32 vertex_count,
+                              const DrawInfo* draw_info, const ShaderGlobals* globals, u32 width, u32 height,
+                              TriangleCullVertices* vertices, TriangleCullStats* stats)
+{
+	Mat4x4 m = triangle_cull_transform(globals, draw_info);
+	project_triangle_cull_vertices_sse(vertices, &m, positions, positions_stride, vertex_count, width, height);
+	return cull_triangles_sse(destination, indices + first_index, index_count, vertices, width, height, stats);
+}
+
+
+// Puts the mesh in front of a 70 degree camera at several distances, from filling the screen to a few pixels across,
+// and once half off screen. Every case checks the SSE path against the scalar reference and prints what was culled
+// and how many triangles per second both paths test, including the vertex projection.
+void benchmark_triangle_culling(char* name, const u32* indices, u32 index_count, const f32* positions, u32 vertex_count, size_t positions_stride, u32 width, u32 height)
+{
+	size_t stride_in_floats = positions_stride / sizeof(f32);
+	f32 radius = 0.0f;
+	for (u32 i = 0; i < vertex_count; ++i)
+	{
+		const f32* p = positions + i * stride_in_floats;
+		radius = MAX(radius, length(Vec3(p[0], p[1], p[2])));
+	}
+
+	ShaderGlobals globals = {};
+	globals.projection = perspective_infinite_reversed_z(70.0, 0.01f, (f32)width, (f32)height);
+	globals.view = look_at(Vec3(0.0f, 0.0f, 0.0f), Vec3(0.0f, 0.0f, -1.0f), {0.0f, 1.0f, 0.0f});
+
+	TriangleCullVertices vertices;
+	init_triangle_cull_vertices(&vertices, vertex_count);
+	u32* output = new u32[index_count];
+	u32* reference = new u32[index_count];
+
+	u32 triangle_count = index_count / 3;
+	printf("Triangle culling %s, %u triangles, %u vertices, %ux%u:\n", name, triangle_count, vertex_count, width, height);
+
+	struct Placement { char* label; f32 distance; f32 offset_x; };
+	Placement placements[] = {{"filling", 1.5f, 0.0f}, {"near", 4.0f, 0.0f}, {"mid", 16.0f, 0.0f}, {"far", 64.0f, 0.0f}, {"tiny", 512.0f, 0.0f}, {"half off", 4.0f, 2.8f}};
+
+	for (u32 p = 0; p < sizeof(placements) / sizeof(placements[0]); ++p)
+	{
+		DrawInfo draw_info = {};
+		draw_info.quat = normalize(vec4{0.3f, 0.5f, 0.1f, 0.8f});
+		draw_info.position = Vec3(placements[p].offset_x * radius, 0.0f, -placements[p].distance * radius);
+
+		Mat4x4 m = triangle_cull_transform(&globals, &draw_info);
+
+		TriangleCullStats reference_stats;
+		project_triangle_cull_vertices(&vertices, &m, positions, positions_stride, vertex_count, width, height);
+		u32 reference_count = cull_triangles(reference, indices, index_count, &vertices, width, height, &reference_stats);
+
+		TriangleCullStats stats;
+		u32 count = filter_instance_triangles(output, indices, 0, index_count, positions, positions_stride, vertex_count, &draw_info, &globals, width, height, &vertices, &stats);
+
+		bool matches = count == reference_count && memcmp(output, reference, sizeof(u32) * count) == 0 &&
+		               memcmp(&stats, &reference_stats, sizeof(stats)) == 0;
+
+		u32 iterations = MAX(1000000 / MAX(triangle_count, 1u), 10u);
+		f64 start = time_in_seconds();
+		for (u32 it = 0; it < iterations; ++it)
+		{
+			project_triangle_cull_vertices(&vertices, &m, positions, positions_stride, vertex_count, width, height);
+			cull_triangles(reference, indices, index_count, &vertices, width, height, 0);
+		}
+		f64 scalar_seconds = (time_in_seconds() - start) / iterations;
+
+		start = time_in_seconds();
+		for (u32 it = 0; it < iterations; ++it)
+			filter_instance_triangles(output, indices, 0, index_count, positions, positions_stride, vertex_count, &draw_info, &globals, width, height, &vertices, 0);
+		f64 sse_seconds = (time_in_seconds() - start) / iterations;
+
+		printf("  %-8s %u -> %u triangles (%.1f%%):", placements[p].label, triangle_count, count / 3, triangle_count ? 100.0 * count / 3 / triangle_count : 0.0);
+		for (u32 i = 1; i < TRIANGLE_CULL_COUNT; ++i) printf(" %s %u,", triangle_cull_names[i], stats.triangles[i]);
+		printf(" scalar %.1fM/s, sse %.1fM/s%s\n", triangle_count / scalar_seconds * 1e-6, triangle_count / sse_seconds * 1e-6, matches ? "" : " (DOES NOT MATCH THE REFERENCE)");
+	}
+
+	delete[] output;
+	delete[] reference;
+	free_triangle_cull_vertices(&vertices);
+}
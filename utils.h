@@ -40,3 +40,14 @@ ReadFileResult read_entire_file(char* path) {
 
     return result;
 }
+
+
+// 64-bit seek, plain fseek takes a long which is only 32 bits on windows.
+int seek_file_64(FILE* file, int64_t offset)
+{
+#ifdef _MSC_VER
+    return _fseeki64(file, offset, SEEK_SET);
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+}
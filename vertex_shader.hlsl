@@ -36,6 +36,35 @@ cbuffer GlobalBindings : register(b1, space0)
 };
 
 
+//Instanced draws from cull_compute's instance buckets: instance i of the draw is instance_ids[first_instance + i],
+//its vertex buffer comes from the frame's draw call infos and its transform from instance_matrix_rows instead of
+//draw_info. Zero for the other draws.
+struct InstanceBindings
+{
+	uint first_instance;
+	uint instanced;
+};
+
+cbuffer InstanceRangeBindings : register(b2, space0)
+{
+	InstanceBindings instance_bindings;
+};
+
+//The first 32 bytes of DrawCallInfo, padded to its 80 byte stride.
+struct InstanceDrawCallInfo
+{
+	float4 quat;
+	float3 position;
+	uint vertex_buffer_index;
+	uint4 cold[3];
+};
+
+StructuredBuffer<uint> instance_ids : register(t0, space1);
+StructuredBuffer<InstanceDrawCallInfo> instance_draw_calls : register(t1, space1);
+//Three rows of a 3x4 matrix per draw call info, rotation with the time spin and position, from instance_transform.h.
+StructuredBuffer<float4> instance_matrix_rows : register(t2, space1);
+
+
 float3 rotate_vec_by_quat(float3 v, float4 q)
 {
 	return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
@@ -64,28 +93,43 @@ struct Vertex
 StructuredBuffer<Vertex> VertexBufferTable[] : register(t0, BUFFER_SPACE);
 
 
-VertexOutput main(uint vertex_id : SV_VertexID)
+VertexOutput main(uint vertex_id : SV_VertexID, uint instance_id : SV_InstanceID)
 {
-	Vertex vertex = VertexBufferTable[draw_info.vertex_buffer_index].Load(vertex_id);
+	Vertex vertex;
+	float3 in_pos;
+	float3 normal;
+
+	if (instance_bindings.instanced) {
+		uint instance = instance_ids[instance_bindings.first_instance + instance_id];
+		vertex = VertexBufferTable[instance_draw_calls[instance].vertex_buffer_index].Load(vertex_id);
+
+		float4 row_0 = instance_matrix_rows[instance * 3 + 0];
+		float4 row_1 = instance_matrix_rows[instance * 3 + 1];
+		float4 row_2 = instance_matrix_rows[instance * 3 + 2];
 
-	float3 in_pos = vertex.position;
-	float3 in_colour = vertex.normal;
+		float4 position = float4(vertex.position, 1.0);
+		in_pos = float3(dot(row_0, position), dot(row_1, position), dot(row_2, position));
+		normal = float3(dot(row_0.xyz, vertex.normal), dot(row_1.xyz, vertex.normal), dot(row_2.xyz, vertex.normal));
+	}
+	else {
+		vertex = VertexBufferTable[draw_info.vertex_buffer_index].Load(vertex_id);
 
-	float4 quat = { 0.0, 1.0, 0.0, cos(globals.time / 2) };
-	quat = normalize(quat);
+		float4 quat = { 0.0, 1.0, 0.0, cos(globals.time / 2) };
+		quat = normalize(quat);
 
-	quat = qmul(draw_info.quat, quat);
-	quat = normalize(quat);
+		quat = qmul(draw_info.quat, quat);
+		quat = normalize(quat);
 
-	in_pos = rotate_vec_by_quat(in_pos, quat);
-	in_pos += draw_info.position;
+		in_pos = rotate_vec_by_quat(vertex.position, quat) + draw_info.position;
+		normal = rotate_vec_by_quat(vertex.normal, quat);
+	}
 
 	VertexOutput output;
 
 	output.position = mul( globals.projection, mul(globals.view, float4(in_pos, 1.0)));
 
-	output.colour = in_colour;
-	output.normal = normalize(rotate_vec_by_quat(vertex.normal, quat));
+	output.colour = vertex.normal;
+	output.normal = normalize(normal);
 
 	return output;
 }
\ No newline at end of file